@@ -0,0 +1,109 @@
+#include "AdaptiveQuality.h"
+#include <algorithm>
+
+// weight of a new sample in the moving averages
+static const double Smoothing = 0.2;
+
+NetworkMonitor::NetworkMonitor()
+    : m_latency(0.),
+    m_bytes(0.),
+    m_rate(0.),
+    m_window(-1),
+    m_window_bytes(0),
+    m_congested(false)
+{
+}
+
+void NetworkMonitor::loaded(qint64 now, qint64 latency, qint64 bytes)
+{
+    m_latency += (double(latency) - m_latency) * Smoothing;
+    m_bytes += (double(bytes) - m_bytes) * Smoothing;
+    if (m_window < 0) {
+        // the first tile gives the first estimate
+        m_latency = double(latency);
+        m_bytes = double(bytes);
+        m_rate = double(bytes) * 1000. / double(std::max(latency, qint64(1)));
+        m_window = now;
+        return;
+    }
+    m_window_bytes += bytes;
+    qint64 elapsed = now - m_window;
+    if (elapsed >= Window) {
+        double rate = double(m_window_bytes) * 1000. / double(elapsed);
+        m_rate += (rate - m_rate) * Smoothing;
+        m_window = now;
+        m_window_bytes = 0;
+    }
+}
+
+bool NetworkMonitor::update(int pending)
+{
+    bool congested = m_congested;
+    if (pending == 0) {
+        // The backlog drained. The latency average only moves with new
+        // downloads, so on a slow link it would otherwise never clear.
+        congested = false;
+    } else if (m_window >= 0) {
+        double drain = double(pending) * m_bytes * 1000. / std::max(m_rate, 1.);
+        if (drain > DrainLimit || m_latency > LatencyLimit) {
+            congested = true;
+        } else if (drain < DrainLimit / 4 && m_latency < LatencyLimit / 2) {
+            congested = false;
+        }
+    }
+    bool changed = congested != m_congested;
+    m_congested = congested;
+    return changed;
+}
+
+QualityController::QualityController(int budget)
+    : m_budget(qint64(budget) * 1000000),
+    m_frame(0.),
+    m_over(0),
+    m_under(0),
+    m_slow(false),
+    m_congested(false),
+    m_coarse(false)
+{
+}
+
+bool QualityController::frameRendered(qint64 nsecs, int missing)
+{
+    if (m_budget <= 0) {
+        return false;
+    }
+    Level level = this->level();
+    m_frame += (double(nsecs) - m_frame) * Smoothing;
+    m_over = m_frame > double(m_budget) ? m_over + 1 : 0;
+    m_under = m_frame < double(m_budget) / 2 ? m_under + 1 : 0;
+    if (m_over >= Frames) {
+        m_slow = true;
+    } else if (m_under >= Frames) {
+        m_slow = false;
+    }
+    // coarse tiles are kept until the backlog they were meant to cut
+    // has drained
+    if (m_coarse && !m_congested && missing == 0) {
+        m_coarse = false;
+    }
+    return this->level() != level;
+}
+
+bool QualityController::setCongested(bool congested)
+{
+    if (m_budget <= 0) {
+        return false;
+    }
+    Level level = this->level();
+    m_congested = congested;
+    m_coarse = m_coarse || congested;
+    return this->level() != level;
+}
+
+QualityController::Level QualityController::level() const
+{
+    if (m_coarse) {
+        return Coarse;
+    }
+    return m_slow ? Reduced : Full;
+}
@@ -0,0 +1,80 @@
+#ifndef __ADAPTIVE_QUALITY_H_
+#define __ADAPTIVE_QUALITY_H_
+
+#include <QtGlobal>
+
+// Download throughput and latency estimates of the TileFetcher. Finished
+// downloads feed a moving average of their latency and size, and the bytes
+// finished per second are averaged over Window ms periods. The network is
+// congested when the downloads in flight would take longer than DrainLimit
+// to finish at the measured rate, or when the latency passes LatencyLimit.
+// It is clear again once both are well below their limit, or as soon as
+// no download is left in flight. Times are in 
+// milliseconds on the fetcher clock. This class is NOT thread safe.
+class NetworkMonitor {
+public:
+    static const qint64 Window = 1000;
+    static const qint64 DrainLimit = 2000;
+    static const qint64 LatencyLimit = 1500;
+
+    NetworkMonitor();
+
+    void loaded(qint64 now, qint64 latency, qint64 bytes);
+    // updates the congestion state for 'pending' downloads in flight,
+    // returns true if it changed
+    bool update(int pending);
+
+    bool congested() const {
+        return m_congested;
+    }
+    double bytesPerSecond() const {
+        return m_rate;
+    }
+    double latency() const {
+        return m_latency;
+    }
+
+private:
+    double m_latency;   // ms, moving average
+    double m_bytes;     // tile payload size, moving average
+    double m_rate;      // bytes per second, moving average of the windows
+    qint64 m_window;    // start of the current window, -1 before the first tile
+    qint64 m_window_bytes;
+    bool m_congested;
+};
+
+// Per-renderer quality level. Frames that exceed the frame budget drop to
+// Reduced quality, where the renderer skips the child tile fallbacks and
+// prefetches fewer time frames. A congested network drops to Coarse, where
+// the tiles are requested one zoom level up and drawn scaled, and nothing
+// is prefetched. Each level is restored once its cause is gone: frames well
+// within the budget, and an idle network with no tile missing from view.
+class QualityController {
+public:
+    enum Level { Full, Reduced, Coarse };
+
+    // frames a change must persist before the level follows
+    static const int Frames = 10;
+
+    // 'budget' is the frame budget in ms, 0 disables the controller
+    explicit QualityController(int budget);
+
+    // records a frame and its missing tiles, returns true if the level
+    // changed
+    bool frameRendered(qint64 nsecs, int missing);
+    // returns true if the level changed
+    bool setCongested(bool congested);
+
+    Level level() const;
+
+private:
+    qint64 m_budget;     // ns
+    double m_frame;      // ns, moving average
+    int m_over;          // consecutive frames over the budget
+    int m_under;         // consecutive frames well within the budget
+    bool m_slow;         // frames are over budget
+    bool m_congested;    // the fetcher network is congested
+    bool m_coarse;       // tiles are requested a level up
+};
+
+#endif
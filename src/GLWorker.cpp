@@ -24,6 +24,16 @@ GLWorker::GLWorker(const GLWorker& shared)
     construct(shared.m_surface, shared.m_context);
 }
 
+GLWorker::GLWorker(QSurface* surface, QOpenGLContext* shared)
+    : m_surface(NULL),
+      m_context(NULL),
+      m_thread(NULL), 
+      m_parent(NULL)
+{
+    // initialize using the input surface and an external shared context
+    construct(surface, shared);
+}
+
 GLWorker::~GLWorker()
 {
     // make sure the parent thread is the object owner
@@ -54,6 +64,8 @@ void GLWorker::start()
     m_context->moveToThread(m_thread);
     // move worker object to worker thread
     moveToThread(m_thread);
+    // name the thread after the worker class, e.g. for the tile tracer
+    m_thread->setObjectName(metaObject()->className());
     // start worker thread
     m_thread->start();
 }
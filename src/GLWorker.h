@@ -19,6 +19,8 @@ public:
     GLWorker(QSurface* surface);
     // Constructor that uses OpenGL's shared context feature
     GLWorker(const GLWorker& shared);
+    // Constructor for a context on 'surface' in the share group of 'shared'
+    GLWorker(QSurface* surface, QOpenGLContext* shared);
     ~GLWorker();
 
     // Note: parent must call stop() before deleting. 
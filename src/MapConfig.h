@@ -1,30 +1,132 @@
 #ifndef __MAP_CONFIG_H_
 #define __MAP_CONFIG_H_
 
-#include <QVector2D>
+#include <QPointF>
 #include <QGuiApplication>
+#include <QStringList>
+#include <vector>
+
+// A raster tile layer drawn over the base map, e.g. hillshade or labels.
+// Layers share the base map tile size and are composited in one pass.
+struct MapLayer {
+    QString server;    // map tile server endpoint
+    QString format;    // map tile image format
+    float opacity;     // [0,1]
+    size_t cache_size; // renderer tile cache size in tiles
+};
 
 // Main object used to store all map configuration state
 struct MapConfig {
+    // layers per map tile including the base map
+    enum { MaxLayers = 4 };
+
     QString server;    // map tile server endpoint
     QString format;    // map tile image format
-    QVector2D center;  // lat/lon center of the map
+    QPointF center;    // lon/lat center of the map (double precision)
     int min_zoom;      // minimum map zoom level
     int max_zoom;      // maximum map zoom level
     int zoom_level;    // starting map zoom level
+    double bearing;    // starting map bearing, degrees clockwise from north
     QSize map_size;    // map viewport width/height
     int tile_size;     // map tile pixel size (square)
     size_t cache_size; // tile cache size in tiles
+    size_t ram_cache_size; // decoded tile RAM budget in MB
+    int frame_budget;      // ms per frame before quality is reduced (0 off)
+    QString lite_format;   // lighter base map format fetched while congested
+    QString tile_daemon;   // qtmapviewer-tiled server name, empty to fetch directly
+    size_t disk_cache_size; // tile payload disk cache budget in MB (0 off)
+    bool restore;          // restore the views and tiles of the last session
+    bool keep_bearing;     // --bearing was given, a restored view keeps it
+    int windows;       // number of map windows sharing one tile service
+    QString overlay_file;   // overlay update file to load at startup
+    QString overlay_socket; // local socket name for live overlay updates
+    int cluster_zoom;       // deepest zoom with clustered overlay points (-1 off)
+    bool hidpi;             // draw tiles 1:1 in device pixels on HiDPI screens
+    QString hidpi_suffix;   // tile URL suffix of the double size tiles (e.g. @2x)
+    std::vector<MapLayer> layers; // raster layers stacked over the base map
+    QStringList times;      // timestamps of the {time} tile server URLs
+    int frame_interval;     // ms between time frames during playback
+    int prefetch_frames;    // time frames fetched ahead of the playhead
+    size_t prefetch_budget; // texture budget of the prefetched frames in MB
+    QString export_file;    // headless export job file, see MapExporter
+    int export_workers;     // parallel headless renderers
+    int export_timeout;     // ms an export waits for missing tiles
+    QString trace_record;   // performance trace file to record, see Trace.h
+    QString trace_replay;   // performance trace file to replay headless
+    QString replay_output;  // per-frame timings of a replay (stdout if empty)
+    QString tile_trace;     // tile lifecycle trace to write, see TileTracer
+    bool startup_bench;     // exit after the first full frames, see StartupBench
+
+    // Tile servers with a {time} placeholder serve a tile for each of 
+    // the times, which are played back as an animation
+    static bool timedServer(const QString& server) {
+        return server.contains("{time}");
+    }
+
+    // Mapbox Vector Tile formats are decoded and tessellated
+    // instead of being uploaded as raster images
+    bool vectorTiles() const {
+        return format == "pbf" || format == "mvt";
+    }
 
     void print() const {
         printf("  Server:\t%s\n", qPrintable(server));
-        printf("  Image format:\t%s\n", qPrintable(format));
+        printf("  Image format:\t%s (%s)\n", qPrintable(format), vectorTiles() ? "vector" : "raster");
         printf("  Map Center:\t[%f, %f]\n", center.x(), center.y());
         printf("  Zoom Range:\t[%d, %d]\n", min_zoom, max_zoom);
         printf("  Start zoom:\t%d\n", zoom_level);
+        printf("  Bearing:\t%.1f degrees\n", bearing);
         printf("  Map Size:\t%d x %d\n", map_size.width(), map_size.height());
         printf("  Tile Size:\t%d pixels\n", tile_size);
-        printf("  Cache Size:\t%u tiles\n", cache_size);
+        printf("  Cache Size:\t%u tiles\n", unsigned(cache_size));
+        printf("  RAM Cache:\t%u MB\n", unsigned(ram_cache_size));
+        printf("  Frame Budget:\t%d ms\n", frame_budget);
+        if (!lite_format.isEmpty()) {
+            printf("  Lite Format:\t%s\n", qPrintable(lite_format));
+        }
+        printf("  Windows:\t%d\n", windows);
+        printf("  Tile Daemon:\t%s\n", tile_daemon.isEmpty() ? "off" : qPrintable(tile_daemon));
+        printf("  Disk Cache:\t%u MB\n", unsigned(disk_cache_size));
+        printf("  Restore:\t%s\n", restore ? "on" : "off");
+        if (!overlay_file.isEmpty()) {
+            printf("  Overlay File:\t%s\n", qPrintable(overlay_file));
+        }
+        if (!overlay_socket.isEmpty()) {
+            printf("  Overlay Socket:\t%s\n", qPrintable(overlay_socket));
+        }
+        for (size_t i = 0; i < layers.size(); i++) {
+            printf("  Layer %u:\t%s (%s) opacity %.2f, %u tiles\n", unsigned(i + 1), 
+                qPrintable(layers[i].server), qPrintable(layers[i].format), 
+                layers[i].opacity, unsigned(layers[i].cache_size));
+        }
+        if (!times.isEmpty()) {
+            printf("  Time Frames:\t%d (%s to %s)\n", times.size(), 
+                qPrintable(times.first()), qPrintable(times.last()));
+            printf("  Frame Interval:\t%d ms\n", frame_interval);
+            printf("  Prefetch:\t%d frames, %u MB\n", prefetch_frames, unsigned(prefetch_budget));
+        }
+        printf("  Cluster Zoom:\t%d\n", cluster_zoom);
+        printf("  HiDPI:\t\t%s\n", hidpi ? "on" : "off");
+        if (!hidpi_suffix.isEmpty()) {
+            printf("  HiDPI Suffix:\t%s\n", qPrintable(hidpi_suffix));
+        }
+        if (!export_file.isEmpty()) {
+            printf("  Export File:\t%s\n", qPrintable(export_file));
+            printf("  Export Workers:\t%d\n", export_workers);
+            printf("  Export Timeout:\t%d ms\n", export_timeout);
+        }
+        if (!trace_record.isEmpty()) {
+            printf("  Record Trace:\t%s\n", qPrintable(trace_record));
+        }
+        if (!trace_replay.isEmpty()) {
+            printf("  Replay Trace:\t%s\n", qPrintable(trace_replay));
+        }
+        if (!tile_trace.isEmpty()) {
+            printf("  Tile Trace:\t%s\n", qPrintable(tile_trace));
+        }
+        if (startup_bench) {
+            printf("  Startup Bench:\ton\n");
+        }
     }
 };
 
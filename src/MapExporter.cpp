@@ -0,0 +1,191 @@
+#include "MapExporter.h"
+#include "TileMath.h"
+#include <QFile>
+#include <QRunnable>
+#include <QDebug>
+#include <algorithm>
+#include <cctype>
+
+class MapExporter::WriteTask : public QRunnable
+{
+public:
+    WriteTask(MapExporter* exporter, int id, const QImage& image, const QString& file)
+        : m_exporter(exporter), m_id(id), m_image(image), m_file(file) {}
+
+    void run() {
+        // the format is taken from the file suffix
+        bool ok = !m_image.isNull() && m_image.save(m_file, 0, 90);
+        QMetaObject::invokeMethod(m_exporter, "imageWritten", Qt::QueuedConnection,
+            Q_ARG(int, m_id), Q_ARG(bool, ok));
+    }
+
+private:
+    MapExporter *m_exporter;
+    int m_id;
+    QImage m_image;
+    QString m_file;
+};
+
+MapExporter::MapExporter(const MapConfig& config, TileService& service, QObject *parent)
+    : QObject(parent),
+    m_service(service),
+    m_config(config),
+    m_next(0),
+    m_written(0),
+    m_failed(0)
+{
+    m_config.tile_size = service.tileSize();
+    // exported images are always drawn at full quality
+    m_config.frame_budget = 0;
+}
+
+MapExporter::~MapExporter()
+{
+    // images still being written hold a pointer to the exporter
+    m_writers.waitForDone();
+    for (size_t i = 0; i < m_workers.size(); i++) {
+        m_service.destroyRenderer(m_workers[i].renderer);
+        delete m_workers[i].surface;
+    }
+    m_workers.clear();
+}
+
+bool MapExporter::readFile(const QString& path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        qCritical() << "Unable to open export job file:" << path;
+        return false;
+    }
+    int number = 0;
+    while (!file.atEnd()) {
+        QByteArray line = file.readLine().trimmed();
+        number++;
+        if (line.isEmpty() || line.startsWith('#')) {
+            continue;
+        }
+        // five numbers, the file is the rest of the line and may hold spaces
+        QList<QByteArray> fields;
+        int pos = 0;
+        while (fields.size() < 5 && pos < line.size()) {
+            int end = pos;
+            while (end < line.size() && !isspace((unsigned char)line[end])) {
+                end++;
+            }
+            fields.append(line.mid(pos, end - pos));
+            while (end < line.size() && isspace((unsigned char)line[end])) {
+                end++;
+            }
+            pos = end;
+        }
+        bool ok = fields.size() == 5 && pos < line.size();
+        Job job;
+        if (ok) {
+            bool lon_ok, lat_ok, zoom_ok, width_ok, height_ok;
+            job.center = QPointF(fields[0].toDouble(&lon_ok), fields[1].toDouble(&lat_ok));
+            job.zoom = fields[2].toInt(&zoom_ok);
+            job.size = QSize(fields[3].toInt(&width_ok), fields[4].toInt(&height_ok));
+            job.file = QString::fromUtf8(line.mid(pos));
+            ok = lon_ok && lat_ok && zoom_ok && width_ok && height_ok &&
+                job.zoom >= 0 && job.zoom <= m_config.max_zoom && !job.size.isEmpty();
+        }
+        if (!ok) {
+            qWarning() << "Malformed export job at line" << number << "of" << path;
+            continue;
+        }
+        addJob(job);
+    }
+    return true;
+}
+
+void MapExporter::addJob(const Job& job)
+{
+    m_jobs.push_back(job);
+}
+
+void MapExporter::start()
+{
+    if (m_jobs.empty()) {
+        // queued, so the event loop is running when it arrives
+        QMetaObject::invokeMethod(this, "finished", Qt::QueuedConnection);
+        return;
+    }
+    // No point in more renderers than jobs
+    int count = std::max(1, std::min(m_config.export_workers, int(m_jobs.size())));
+    for (int i = 0; i < count; i++) {
+        Worker worker;
+        worker.surface = new QOffscreenSurface();
+        worker.surface->setFormat(QSurfaceFormat());
+        worker.surface->create();
+        worker.renderer = m_service.createRenderer(m_config, worker.surface);
+        connect(worker.renderer, SIGNAL(imageExported(int, const QImage&, bool)),
+            this, SLOT(imageExported(int, const QImage&, bool)));
+        m_workers.push_back(worker);
+    }
+    for (size_t i = 0; i < m_workers.size(); i++) {
+        dispatch(m_workers[i]);
+    }
+}
+
+void MapExporter::dispatch(Worker& worker)
+{
+    while (worker.queued < QueueDepth && m_next < m_jobs.size()) {
+        const Job& job = m_jobs[m_next];
+        TileGrid<> grid(m_config.tile_size);
+
+        TileRenderer::ExportJob request;
+        request.id = int(m_next);
+        request.timeout = m_config.export_timeout;
+        request.state.setZoom(job.zoom);
+        request.state.setMapSize(job.size);
+        request.state.setBounds(PixelRect(TileMath::lonlatToPixel(grid, job.zoom, job.center), job.size));
+        request.state.setValid();
+        worker.renderer->exportImage(request);
+
+        worker.queued++;
+        m_next++;
+    }
+}
+
+void MapExporter::imageExported(int id, const QImage& image, bool complete)
+{
+    const Job& job = m_jobs[size_t(id)];
+    if (!complete) {
+        qWarning() << "Export timed out with missing tiles:" << job.file;
+    }
+    // encoding is the slowest part, so it runs off the GUI thread
+    m_writers.start(new WriteTask(this, complete ? id : -1 - id, image, job.file));
+
+    for (size_t i = 0; i < m_workers.size(); i++) {
+        if (m_workers[i].renderer == sender()) {
+            m_workers[i].queued--;
+            dispatch(m_workers[i]);
+            break;
+        }
+    }
+}
+
+void MapExporter::imageWritten(int id, bool ok)
+{
+    // incomplete images are written anyway, but counted as failed
+    bool complete = id >= 0;
+    if (!complete) {
+        id = -1 - id;
+    }
+    if (!ok) {
+        qWarning() << "Unable to write exported image:" << m_jobs[size_t(id)].file;
+    }
+    if (!ok || !complete) {
+        m_failed++;
+    }
+    m_written++;
+    if (m_written == m_jobs.size()) {
+        finish();
+    }
+}
+
+void MapExporter::finish()
+{
+    qDebug() << "Exported" << int(m_jobs.size()) - m_failed << "of" << int(m_jobs.size()) << "images";
+    emit finished();
+}
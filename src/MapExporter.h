@@ -0,0 +1,80 @@
+#ifndef __MAP_EXPORTER_H_
+#define __MAP_EXPORTER_H_
+
+#include "TileRenderer.h"
+#include "TileService.h"
+#include "MapConfig.h"
+#include <QObject>
+#include <QOffscreenSurface>
+#include <QThreadPool>
+#include <vector>
+
+// Renders static map images without a window. Jobs are spread over several
+// headless TileRenderers on offscreen surfaces, which share the tiles of
+// one TileService, and the read back images are encoded and written by a
+// thread pool. A job file has one image per line:
+//
+//   <lon> <lat> <zoom> <width> <height> <file>
+//
+// The file is the rest of the line and may contain spaces. The image format
+// follows the file suffix (png, jpg). Lines starting with '#' are ignored. This object lives in the GUI thread.
+class MapExporter : public QObject
+{
+    Q_OBJECT
+public:
+    struct Job {
+        QPointF center; // lon/lat
+        int zoom;
+        QSize size;
+        QString file;
+    };
+
+    MapExporter(const MapConfig& config, TileService& service, QObject *parent = 0);
+    ~MapExporter();
+
+    // reads all jobs in the file, returns false on error
+    bool readFile(const QString& path);
+    void addJob(const Job& job);
+    // starts the export, finished() is emitted once every image is written
+    void start();
+
+    // number of images that timed out with missing tiles or failed to write
+    int failed() const {
+        return m_failed;
+    }
+
+signals:
+    void finished();
+
+private slots:
+    void imageExported(int id, const QImage& image, bool complete);
+    void imageWritten(int id, bool ok);
+
+private:
+    // Thread pool task encoding and writing one image
+    class WriteTask;
+
+    // a worker is a headless renderer and its surface
+    struct Worker {
+        Worker(): surface(NULL), renderer(NULL), queued(0) {}
+        QOffscreenSurface *surface;
+        TileRenderer *renderer;
+        int queued; // jobs queued on the renderer
+    };
+    // renderers hold two jobs, so one renders while the other is read back
+    enum { QueueDepth = 2 };
+
+    void dispatch(Worker& worker);
+    void finish();
+
+    TileService &m_service;
+    MapConfig m_config;
+    std::vector<Job> m_jobs;
+    std::vector<Worker> m_workers;
+    QThreadPool m_writers;
+    size_t m_next;    // next job to dispatch
+    size_t m_written; // images written or failed
+    int m_failed;
+};
+
+#endif
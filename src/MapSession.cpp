@@ -0,0 +1,60 @@
+#include "MapSession.h"
+#include <QSettings>
+#include <QStringList>
+
+MapSession MapSession::load(const QString& server, const QStringList& layers)
+{
+    MapSession session;
+    QSettings settings("qtmapviewer", "qtmapviewer");
+    settings.beginGroup("session");
+    if (settings.value("server").toString() != server || 
+        settings.value("layers").toStringList() != layers) {
+        return session;
+    }
+    session.server = server;
+    session.layers = layers;
+    int views = settings.beginReadArray("views");
+    for (int i = 0; i < views; i++) {
+        settings.setArrayIndex(i);
+        View view;
+        view.center = settings.value("center").toPointF();
+        view.zoom = settings.value("zoom").toInt();
+        view.bearing = settings.value("bearing", 0.).toDouble();
+        // tiles are stored as zoom/x/y/layer/frame
+        QStringList tiles = settings.value("tiles").toStringList();
+        for (int t = 0; t < tiles.size(); t++) {
+            QStringList fields = tiles[t].split('/');
+            if (fields.size() == 5) {
+                view.tiles.push_back(TileIndex(fields[0].toInt(), fields[1].toInt(), 
+                    fields[2].toInt(), fields[3].toInt(), fields[4].toInt()));
+            }
+        }
+        session.views.push_back(view);
+    }
+    settings.endArray();
+    return session;
+}
+
+void MapSession::save() const
+{
+    QSettings settings("qtmapviewer", "qtmapviewer");
+    settings.remove("session");
+    settings.beginGroup("session");
+    settings.setValue("server", server);
+    settings.setValue("layers", layers);
+    settings.beginWriteArray("views", int(views.size()));
+    for (size_t i = 0; i < views.size(); i++) {
+        settings.setArrayIndex(int(i));
+        settings.setValue("center", views[i].center);
+        settings.setValue("zoom", views[i].zoom);
+        settings.setValue("bearing", views[i].bearing);
+        QStringList tiles;
+        for (size_t t = 0; t < views[i].tiles.size(); t++) {
+            const TileIndex& tile = views[i].tiles[t];
+            tiles << QString("%1/%2/%3/%4/%5").arg(tile.zoom()).arg(tile.x()).arg(tile.y())
+                .arg(tile.layer()).arg(tile.frame());
+        }
+        settings.setValue("tiles", tiles);
+    }
+    settings.endArray();
+}
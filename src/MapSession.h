@@ -0,0 +1,33 @@
+#ifndef __MAP_SESSION_H_
+#define __MAP_SESSION_H_
+
+#include "TileTypes.h"
+#include <QPointF>
+#include <QString>
+#include <QStringList>
+#include <vector>
+
+// The view of each map window when the viewer last exited, kept with
+// QSettings. A launch restores the views, and loads the tiles they showed
+// from the disk cache before the windows are exposed, so the first frame
+// is drawn without waiting for the network.
+struct MapSession {
+    struct View {
+        QPointF center;      // lon/lat
+        int zoom;            // logical zoom level
+        double bearing;      // degrees clockwise from north
+        TileIndexList tiles; // tiles in view
+    };
+
+    // the views only apply to the same base map and layer servers, the
+    // tile indices refer to the layers by position
+    QString server;
+    QStringList layers;
+    std::vector<View> views;
+
+    // returns an empty session if none was saved for 'server' and 'layers'
+    static MapSession load(const QString& server, const QStringList& layers);
+    void save() const;
+};
+
+#endif
@@ -1,79 +1,162 @@
 #include "MapViewer.h"
 #include "TileTypes.h"
+#include "TileMath.h"
 #include <QtCore/QCoreApplication>
 #include <QtGui/QOpenGLContext>
 #include <QMouseEvent>
 #include <QWheelEvent>
 #include <iostream>
-#define _USE_MATH_DEFINES
-#include <math.h>
+#include <QtMath>
 
-Q_DECLARE_METATYPE(TileIndex);
-
-MapViewer::MapViewer(const MapConfig& config, QWindow *parent)
+MapViewer::MapViewer(const MapConfig& config, TileService& service, QWindow *parent)
     : QWindow(parent), 
+      m_service(service),
       m_renderer(NULL), 
-      m_fetcher(NULL),
+      m_playback(NULL),
       m_mouse_pressed(false),
+      m_pixel_ratio(1.),
+      m_bearing(0.),
+      m_zoom(config.zoom_level),
       m_config(config)
 {
-    // Must register value types with Qt to use in signal/slots
-    qRegisterMetaType<TileIndex>();
-
     // Use an OpenGL surface and window backing memory, enabling 
     // GPU rendering of the map
     setSurfaceType(QWindow::OpenGLSurface);
+
+    // The service may fetch double size (@2x) tiles, one of which covers
+    // a configured tile of the next zoom level up
+    m_config.tile_size = service.tileSize();
+    m_tile_shift = TileGrid<>(service.tileSize()).shift() - TileGrid<>(config.tile_size).shift();
+    m_zoom_bias = -m_tile_shift;
+    m_zoom = std::max(minZoom(), std::min(m_zoom, maxZoom()));
+
     // Initialize the map center in pixel coordinates
-    m_map_center = latlonToPixel(m_config.zoom_level, config.center);
-    m_render_state.setZoom(m_config.zoom_level);
+    m_map_center = latlonToPixel(renderZoom(), config.center);
+    m_render_state.setZoom(renderZoom());
+    updatePixelRatio();
+    setBearing(config.bearing);
 
     setWidth(config.map_size.width());
     setHeight(config.map_size.height());
 
     // Use a default surface format
     setFormat(QSurfaceFormat());
+
+    // Time dimension tiles play as a loop from the first frame
+    if (config.times.size() > 1) {
+        m_playback = new Playback(config.times.size(), config.frame_interval, this);
+        connect(m_playback, SIGNAL(frameChanged(int)), this, SLOT(setFrame(int)));
+        m_playback->play();
+    }
 }
 
 MapViewer::~MapViewer()
 {
     if (m_renderer) {
-        // must stop the worker thread before destrution
-        m_renderer->stop();
-        delete m_renderer;
+        // the service stops the worker thread before destrution
+        m_service.destroyRenderer(m_renderer);
         m_renderer = NULL;
     }
-    if (m_fetcher) {
-        // must stop the worker thread before destrution
-        m_fetcher->stop();
-        delete m_fetcher;
-        m_fetcher = NULL;
-    }
 }
 
 void MapViewer::initialize()
 {
-    if (!m_renderer && !m_fetcher) {
-        // Here the TileRenderer is constructed first to target the MapViewer Qwindow 
-        // surface, and the TileFetcher is construted to share the same GL context
+    if (!m_renderer) {
+        // Here the TileRenderer is constructed to target the MapViewer QWindow
+        // surface, sharing its GL context group with the service TileFetcher.
         // See the GLWorker constructors for details
-        m_renderer = new TileRenderer(m_config, this);
-        m_fetcher = new TileFetcher(m_config, *m_renderer);
+        m_renderer = m_service.createRenderer(m_config, this);
+
+        // connect the signal to cancel outstanding tile requests for this view
+        connect(this, SIGNAL(cancelRequests()), m_renderer, SIGNAL(cancelRequests()));
+
+        // hand over any overlay data that arrived before the renderer
+        m_renderer->updateOverlay(m_overlay_updates);
+        m_overlay_updates.clear();
+
+        connect(m_renderer, SIGNAL(frameRendered(qint64, int, int)), 
+            this, SLOT(frameRendered(qint64, int, int)));
+    }
+}
+
+void MapViewer::setFrame(int frame)
+{
+    m_render_state.setFrame(frame);
+    if (m_renderer && m_render_state.valid()) {
+        publishState();
+    }
+}
+
+void MapViewer::frameRendered(qint64, int tiles, int missing)
+{
+    if (tiles > 0 && missing == 0) {
+        qDebug() << "First full frame after" << m_service.uptime() << "ms";
+        disconnect(m_renderer, SIGNAL(frameRendered(qint64, int, int)), 
+            this, SLOT(frameRendered(qint64, int, int)));
+        emit firstFullFrame();
+    }
+}
 
-        // connect the renderer tile request signal to the fetcher tile request slot
-        connect(m_renderer, SIGNAL(requestTile(const TileIndex&)), 
-            m_fetcher, SLOT(tileRequest(const TileIndex&)));
-        // connect the tile fetcher response signal to the tile renderer reposnse slot
-        connect(m_fetcher, SIGNAL(responseTile(TileImage*)), 
-            m_renderer, SLOT(tileResponse(TileImage*)));
-        // connect the signal to cancel outstanding tile requests to the fetcher slot
-        connect(this, SIGNAL(cancelRequests()), m_fetcher, SIGNAL(cancelRequests()));
-        // connect the renderer delete tile signal to the tile fetcher slot
-        connect(m_renderer, SIGNAL(deleteTile(TileImage*)), 
-            m_fetcher, SLOT(deleteTile(TileImage*)));
+void MapViewer::setBearing(qreal degrees)
+{
+    m_bearing = std::fmod(degrees, 360.);
+    if (m_bearing < 0.) {
+        m_bearing += 360.;
+    }
+    m_render_state.setBearing(float(m_bearing));
+    if (m_renderer && m_render_state.valid()) {
+        publishState();
+    }
+}
 
-        // start the worker threads for these objects
-        m_renderer->start();
-        m_fetcher->start();
+QPoint MapViewer::mapOffset(const QPointF& offset) const
+{
+    double radians = qDegreesToRadians(m_bearing);
+    double c = std::cos(radians), s = std::sin(radians);
+    return QPoint(qRound(offset.x() * c - offset.y() * s), 
+        qRound(offset.x() * s + offset.y() * c));
+}
+
+MapSession::View MapViewer::sessionView() const
+{
+    MapSession::View view;
+    TileGrid<> grid(m_config.tile_size);
+    view.center = TileMath::pixelToLonlat(grid, renderZoom(), m_map_center);
+    view.zoom = m_zoom;
+    view.bearing = m_bearing;
+    if (!m_render_state.valid()) {
+        return view; // never shown
+    }
+    // the tiles of every layer in view, as TileRenderer::updateVisible()
+    // resolves them
+    QPointF corners[4];
+    m_render_state.viewport(corners);
+    TileSpans spans;
+    TileMath::coverConvex(grid.size(), corners, 4, spans);
+    const int zoom = renderZoom();
+    const int wrap = (1 << zoom) - 1;
+    for (size_t row = 0; row < spans.rows.size(); row++) {
+        int y = spans.y1 + int(row);
+        if (y < 0 || y > wrap) {
+            continue;
+        }
+        for (int x = spans.rows[row].first; x <= spans.rows[row].second; x++) {
+            for (size_t layer = 0; layer <= m_config.layers.size(); layer++) {
+                const QString& server = layer ? m_config.layers[layer - 1].server : m_config.server;
+                int frame = MapConfig::timedServer(server) ? m_render_state.frame() : 0;
+                view.tiles.push_back(TileIndex(zoom, x & wrap, y, int(layer), frame));
+            }
+        }
+    }
+    return view;
+}
+
+void MapViewer::updateOverlay(const OverlayUpdateList& updates)
+{
+    if (m_renderer) {
+        m_renderer->updateOverlay(updates);
+    } else {
+        m_overlay_updates.insert(m_overlay_updates.end(), updates.begin(), updates.end());
     }
 }
 
@@ -90,15 +173,70 @@ bool MapViewer::event(QEvent *event)
 }
 
 void MapViewer::resizeEvent(QResizeEvent *event) {
-    const QSize& size = event->size();
+    updatePixelRatio();
+
+    // The map is rendered in device pixels, compute the map bounds
+    // in pixel space based on the new resize
+    m_render_state.setMapSize(event->size() * m_pixel_ratio);
+    updateBounds();
+    m_render_state.setValid();
+}
 
-    // Compute the map bounds in pixel space based on the new resize
-    QRect bounds(m_map_center.x() - size.width() / 2, 
-                 m_map_center.y() - size.height() / 2, size.width(), size.height());
+bool MapViewer::updatePixelRatio()
+{
+    qreal ratio = devicePixelRatio();
+    // Fractional ratios are rounded to the nearest power of two scale,
+    // the map is drawn slightly smaller or larger rather than resampled
+    int scale_shift = 0;
+    if (m_config.hidpi) {
+        scale_shift = ratio >= 3. ? 2 : (ratio >= 1.5 ? 1 : 0);
+    }
+    int bias = scale_shift - m_tile_shift;
+    bool changed = ratio != m_pixel_ratio;
+    m_pixel_ratio = ratio;
+    m_render_state.setPixelRatio(float(ratio));
+
+    if (bias != m_zoom_bias) {
+        // Keep the logical zoom and the map center location, only the 
+        // zoom level of the tiles drawn changes
+        int from = renderZoom();
+        m_zoom_bias = bias;
+        m_zoom = std::max(minZoom(), std::min(m_zoom, maxZoom()));
+        int to = renderZoom();
+        for (; from < to; from++) {
+            m_map_center = m_map_center.zoomedIn();
+        }
+        for (; from > to; from--) {
+            m_map_center = m_map_center.zoomedOut();
+        }
+        m_render_state.setZoom(to);
+        changed = true;
+    }
+    return changed;
+}
+
+void MapViewer::publishState()
+{
+    if (TraceRecorder *recorder = m_service.recorder()) {
+        recorder->recordState(this, m_render_state);
+    }
+    m_renderer->setState(m_render_state);
+}
 
+void MapViewer::updateBounds()
+{
+    PixelRect bounds(m_map_center, m_render_state.mapSize());
     m_render_state.setBounds(bounds);
-    m_render_state.setMapSize(size);
-    m_render_state.setValid();
+}
+
+int MapViewer::minZoom() const
+{
+    return std::max(m_config.min_zoom, -m_zoom_bias);
+}
+
+int MapViewer::maxZoom() const
+{
+    return std::min(m_config.max_zoom, m_config.max_zoom - m_zoom_bias);
 }
 
 void MapViewer::mousePressEvent(QMouseEvent * event) 
@@ -116,16 +254,13 @@ void MapViewer::mouseMoveEvent(QMouseEvent * event)
        // This is done by computing the pixel offset vector and adding it
        // to the map center coordinate. We then recompute the map bounds in
        // pixel space and update the render state with the new values.
-       QPoint diff = m_mouse_anchor - event->pos();
+       // The drag is on screen, the map below it may be turned
+       QPoint diff = mapOffset(QPointF(m_mouse_anchor - event->pos()) * m_pixel_ratio);
        m_map_center += diff;
        m_mouse_anchor = event->pos();
 
-       const QSize& size = m_render_state.mapSize();
-       QRect bounds(m_map_center.x() - size.width() / 2, 
-                    m_map_center.y() - size.height() / 2, size.width(), size.height());
-
-       m_render_state.setBounds(bounds);
-       m_renderer->setState(m_render_state);
+       updateBounds();
+       publishState();
 
        m_mouse_anchor = event->pos();
    } 
@@ -140,22 +275,25 @@ void MapViewer::mouseReleaseEvent(QMouseEvent * event)
 void MapViewer::mouseDoubleClickEvent(QMouseEvent * event)
 {
     const QSize& size = m_render_state.mapSize();
-    m_map_center += (event->pos() - QPoint(size.width() / 2, size.height() / 2));
+    m_map_center += mapOffset(QPointF(event->pos()) * m_pixel_ratio - 
+        QPointF(size.width() / 2, size.height() / 2));
 
     // Here a left button double click zoom in, a right button zooms out
     if (event->buttons() & Qt::LeftButton) {
         // Zoom in
-        m_render_state.setZoom(std::min(m_render_state.zoom() + 1, m_config.max_zoom));
+        m_zoom = std::min(m_zoom + 1, maxZoom());
+        m_render_state.setZoom(renderZoom());
         if (m_render_state.zoomedIn()) {
             // only scale the map center coordinate if we zoomed in
-            m_map_center = QPoint(m_map_center.x() * 2, m_map_center.y() * 2);
+            m_map_center = m_map_center.zoomedIn();
         }
     } else if (event->buttons() & Qt::RightButton) {
         // Zoom out
-        m_render_state.setZoom(std::max(m_render_state.zoom() - 1, m_config.min_zoom));
+        m_zoom = std::max(m_zoom - 1, minZoom());
+        m_render_state.setZoom(renderZoom());
         if (m_render_state.zoomedOut()) {
             // only scale the map center coordinate if we zoomed out
-            m_map_center = QPoint(m_map_center.x() / 2, m_map_center.y() / 2);
+            m_map_center = m_map_center.zoomedOut();
         }
     }
     // emit a signal to cancel outstanding tile requests since we are moving to a new
@@ -165,11 +303,8 @@ void MapViewer::mouseDoubleClickEvent(QMouseEvent * event)
 
     // A zoom operation changes the map center in pixel coordinates because the 
     // center is defined within the pixel spae of a specific zoom level
-    QRect bounds(m_map_center.x() - size.width() / 2, 
-                 m_map_center.y() - size.height() / 2, size.width(), size.height());
-
-    m_render_state.setBounds(bounds);
-    m_renderer->setState(m_render_state);
+    updateBounds();
+    publishState();
 }
 
 void MapViewer::keyPressEvent(QKeyEvent *event)
@@ -178,6 +313,23 @@ void MapViewer::keyPressEvent(QKeyEvent *event)
     if (event->key() == Qt::Key_Escape) {
         close();
     };
+    // The brackets turn the map in steps, N turns it back north up
+    switch (event->key()) {
+        case Qt::Key_BracketLeft:  setBearing(m_bearing - BearingStep); break;
+        case Qt::Key_BracketRight: setBearing(m_bearing + BearingStep); break;
+        case Qt::Key_N:            setBearing(0.); break;
+        default: break;
+    }
+    // Space pauses or resumes the time frame playback, the arrow keys
+    // step through the frames
+    if (m_playback) {
+        switch (event->key()) {
+            case Qt::Key_Space: m_playback->toggle(); break;
+            case Qt::Key_Left:  m_playback->pause(); m_playback->step(-1); break;
+            case Qt::Key_Right: m_playback->pause(); m_playback->step(1); break;
+            default: break;
+        }
+    }
 }
 
 void MapViewer::exposeEvent(QExposeEvent *event)
@@ -186,29 +338,24 @@ void MapViewer::exposeEvent(QExposeEvent *event)
     if (isExposed()) {
         // Make sure the viewer is initialized when the window is exposed
         initialize();
-        m_renderer->setState(m_render_state);
+        // the window may have moved to a screen with another pixel ratio
+        if (updatePixelRatio()) {
+            m_render_state.setMapSize(size() * m_pixel_ratio);
+            updateBounds();
+        }
+        publishState();
     }
 }
 
 // Converts from a latitude/longitude value to a pixel coordinate for a 
-// given zoom level. See http://en.wikipedia.org/wiki/Mercator_projection
-QPoint MapViewer::latlonToPixel(int zoom, const QVector2D& v) {
-    double tile_size = double(m_config.tile_size);
-    double to_rad = M_PI / 180.0;
-    double z = pow(2.0, zoom);
-    double x = (v.x() + 180.) / 360. * z * tile_size;
-    double y = 0.5 * (1. - log(tan(to_rad * v.y()) + 1.0 / cos(to_rad * v.y())) / M_PI) * z * tile_size;
-    return QPoint(int(x), int(y));
+// given zoom level. See TileMath for the projection.
+PixelPoint MapViewer::latlonToPixel(int zoom, const QPointF& v) {
+    return TileMath::lonlatToPixel(TileGrid<>(m_config.tile_size), zoom, v);
 }
 
 // Converts from a pixel coordinate at a zoom level to a latitude/longitude value
-QVector2D MapViewer::pixelToLatlon(int zoom, const QPoint& v) {
-    double tile_size = double(m_config.tile_size);
-    double to_deg = 180.0 / M_PI;
-    double z = pow(2.0, zoom);
-    double lon = 360. * v.x() / z - 180.;
-    double lat = to_deg * atan(sinh(M_PI - 2. * M_PI * v.y() / z));
-    return QVector2D(lon / tile_size, lat / tile_size);
+QPointF MapViewer::pixelToLatlon(int zoom, const PixelPoint& v) {
+    return TileMath::pixelToLonlat(TileGrid<>(m_config.tile_size), zoom, v);
 }
 
 
@@ -6,22 +6,42 @@
 #include <QDebug>
 #include <QVector2D>
 #include "TileRenderer.h"
-#include "TileFetcher.h"
+#include "TileService.h"
 #include "MapConfig.h"
+#include "MapSession.h"
+#include "Playback.h"
 
 // Main map viewer class. QWindow represents a window in the underlying
 // system, so MapViewer inherits from QWindow and implements map-specific
-// controls like pan/zoom. This class owns the tile fetcher and tile renderer
-// used to display the map on the QWindow surface. The TileFetcher and 
-// TileRenderer operated completely asynchronously, which allows simultaneous
-// texture creation/upload and map rendering.
+// controls like pan/zoom. This class owns the tile renderer used to display
+// the map on the QWindow surface, while tiles come from a TileService that
+// can be shared by several viewers. The TileFetcher and TileRenderer 
+// operated completely asynchronously, which allows simultaneous texture 
+// creation/upload and map rendering.
 class MapViewer : public QWindow
 {
     Q_OBJECT
 public:
-    MapViewer(const MapConfig& config, QWindow *parent = 0);
+    MapViewer(const MapConfig& config, TileService& service, QWindow *parent = 0);
     ~MapViewer();
 
+    // the view and the tiles it shows, for the next session to restore
+    MapSession::View sessionView() const;
+
+public slots:
+    // Applies a batch of overlay layer updates, see OverlayUpdate. Updates
+    // received before the renderer starts are held until it does.
+    void updateOverlay(const OverlayUpdateList& updates);
+    // turns the map so 'degrees' clockwise from north points up
+    void setBearing(qreal degrees);
+
+private slots:
+    // draws the time dimension tiles of 'frame'
+    void setFrame(int frame);
+    // logs the time to the first frame without missing tiles and
+    // emits firstFullFrame()
+    void frameRendered(qint64 nsecs, int tiles, int missing);
+
 protected:
     // QWindow event handlers
     bool event(QEvent *event);
@@ -35,23 +55,53 @@ protected:
 
 signals:
     void cancelRequests();
+    // the first frame without missing tiles was drawn
+    void firstFullFrame();
 
 private:
+    // degrees the map turns per bracket key press
+    enum { BearingStep = 15 };
+
     void initialize();
 
+    // Tiles are drawn 1:1 in device pixels, so a HiDPI window shows the
+    // map one zoom level deeper than its logical zoom for every doubling
+    // of the pixel ratio. Returns true if the pixel ratio changed.
+    bool updatePixelRatio();
+    void updateBounds();
+    // hands the render state to the renderer, and to the trace recorder
+    // if the session is recorded
+    void publishState();
+    int renderZoom() const {
+        return m_zoom + m_zoom_bias;
+    }
+    // logical zoom range keeping the render zoom within the tile range
+    int minZoom() const;
+    int maxZoom() const;
+    // turns a screen space offset in device pixels by the bearing into
+    // a map pixel space offset
+    QPoint mapOffset(const QPointF& offset) const;
+
     // see http://en.wikipedia.org/wiki/Mercator_projection for details
     // on the mercator projection used in most map tiling systems
-    QPoint latlonToPixel(int zoom, const QVector2D& coord);
-    QVector2D pixelToLatlon(int zoom, const QPoint& v);
+    PixelPoint latlonToPixel(int zoom, const QPointF& coord);
+    QPointF pixelToLatlon(int zoom, const PixelPoint& v);
 
+    TileService &m_service;   // fetches map tiles
     TileRenderer *m_renderer; // renders map tiles
-    TileFetcher *m_fetcher;   // fetches map tiles
+    Playback *m_playback;     // time frame playhead, NULL without times
 
     bool m_mouse_pressed;
     QPoint m_mouse_anchor;
     TileRenderer::State m_render_state;
-    QPoint m_map_center;
+    PixelPoint m_map_center; // 64-bit pixel space of the render zoom
+    qreal m_pixel_ratio;     // device pixels per logical pixel
+    qreal m_bearing;         // degrees clockwise from north, [0, 360)
+    int m_zoom;              // logical zoom level
+    int m_zoom_bias;         // render zoom minus logical zoom
+    int m_tile_shift;        // log2 of service tile size / configured tile size
     MapConfig m_config;
+    OverlayUpdateList m_overlay_updates; // held until initialize()
 };
 
 #endif
\ No newline at end of file
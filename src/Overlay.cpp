@@ -0,0 +1,600 @@
+#include "Overlay.h"
+#include "TileMath.h"
+#include <QOpenGLContext>
+#include <QDebug>
+#include <QVector2D>
+#include <QVector4D>
+#include <algorithm>
+#define _USE_MATH_DEFINES
+#include <math.h>
+
+// Point sprite vertex shader. Instance positions are relative to the
+// padded region the instance buffer was built for, and 'origin' moves
+// that region into the viewport, so panning only changes one uniform.
+const static char PointVertexShader[] =
+    "#version 430\n"
+    "layout (location = 0) in vec2 corner;"   // unit sprite quad corner
+    "layout (location = 1) in vec2 position;" // instance pixel position
+    "layout (location = 2) in vec4 color;"    // instance color
+    "layout (location = 3) in float size;"    // instance radius scale
+    "uniform mat4 projection;"
+    "uniform vec2 origin;"  // instance region offset in the viewport
+    "uniform float radius;" // sprite radius in pixels
+    "out vec4 sprite_color;"
+    "out vec2 sprite_coord;"
+    "void main() {"
+        "sprite_color = color;"
+        "sprite_coord = corner;"
+        "gl_Position = projection * vec4(position + origin + corner * radius * size, 0, 1);"
+    "}";
+
+// Point sprite fragment shader, cuts the quad down to a disc
+const static char PointFragmentShader[] =
+    "#version 430\n"
+    "layout(location = 0) out vec4 out_color;"
+    "in vec4 sprite_color;"
+    "in vec2 sprite_coord;"
+    "void main() {"
+        "if (dot(sprite_coord, sprite_coord) > 1.0) discard;"
+        "out_color = sprite_color;"
+    "}";
+
+// Polyline vertex shader. Vertices are world offsets from the layer anchor,
+// scaled to pixels at the current zoom and moved by the anchor position
+// relative to the viewport (computed in double precision on the CPU).
+const static char LineVertexShader[] =
+    "#version 430\n"
+    "layout (location = 0) in vec2 position;" // world offset from the anchor
+    "uniform mat4 projection;"
+    "uniform float scale;" // pixels per world unit
+    "uniform vec2 origin;" // anchor position in the viewport
+    "void main() {"
+        "gl_Position = projection * vec4(position * scale + origin, 0, 1);"
+    "}";
+
+const static char LineFragmentShader[] =
+    "#version 430\n"
+    "layout(location = 0) out vec4 out_color;"
+    "uniform vec4 color;"
+    "void main() {"
+        "out_color = color;"
+    "}";
+
+const float OverlayLayer::PointRadius = 4.f;
+const float OverlayLayer::MaxClusterSize = 5.f;
+
+// Helper to build and link a shader program, logging any errors
+static QGLShaderProgram* createProgram(const char* vertex, const char* fragment, const char* name)
+{
+    QGLShaderProgram *shader = new QGLShaderProgram;
+	if (!shader->addShaderFromSourceCode(QGLShader::Vertex, vertex)) {
+		qWarning() << name << "vertex shader compile error: " << shader->log();
+	}
+	if (!shader->addShaderFromSourceCode(QGLShader::Fragment, fragment)) {
+		qWarning() << name << "fragment shader compile error: " << shader->log();
+	}
+	if (!shader->link()) {
+		qWarning() << name << "shader program link error: " << shader->log();
+	}
+    return shader;
+}
+
+static QVector4D toColor(QRgb rgb)
+{
+    return QVector4D(qRed(rgb) / 255.f, qGreen(rgb) / 255.f, qBlue(rgb) / 255.f, qAlpha(rgb) / 255.f);
+}
+
+OverlayLayer::OverlayLayer(QOpenGLExtraFunctions* gl, PointClusterer* clusterer)
+    : m_gl(gl),
+    m_visible(true),
+    m_clusterer(clusterer),
+    m_point_buffer(QOpenGLBuffer::VertexBuffer),
+    m_points_dirty(false),
+    m_point_zoom(-1),
+    m_point_count(0),
+    m_point_clustered(false),
+    m_point_version(0),
+    m_line_buffer(QOpenGLBuffer::VertexBuffer),
+    m_line_anchored(false),
+    m_line_used(0),
+    m_line_holes(0),
+    m_line_capacity(0),
+    m_line_realloc(false)
+{
+}
+
+OverlayLayer::~OverlayLayer()
+{
+    m_point_buffer.destroy();
+    m_line_buffer.destroy();
+    delete m_clusterer;
+}
+
+// The normalized world square is the tile pixel projection divided by the
+// world pixel size, see TileMath
+QPointF OverlayLayer::toWorld(const QPointF& lonlat)
+{
+    return TileMath::lonlatToWorld(lonlat);
+}
+
+void OverlayLayer::apply(const OverlayUpdate& update)
+{
+    switch (update.type) {
+        case OverlayUpdate::Point:
+            if (!update.coords.empty()) {
+                PointRecord& point = m_points[update.id];
+                point.world = toWorld(update.coords[0]);
+                point.color = update.color;
+                m_point_index.insert(update.id, QRectF(point.world, QSizeF(0., 0.)));
+                m_points_dirty = true;
+                if (m_clusterer) {
+                    m_clusterer->update(update.id, point.world, point.color);
+                }
+            }
+            break;
+        case OverlayUpdate::Polyline:
+        case OverlayUpdate::Append:
+            setLine(update.id, update.coords, update.color, update.type == OverlayUpdate::Append);
+            break;
+        case OverlayUpdate::Remove:
+            if (m_points.remove(update.id)) {
+                m_point_index.remove(update.id);
+                m_points_dirty = true;
+                if (m_clusterer) {
+                    m_clusterer->remove(update.id);
+                }
+            }
+            removeLine(update.id);
+            break;
+        case OverlayUpdate::Clear:
+            m_points.clear();
+            m_point_index.clear();
+            m_points_dirty = true;
+            if (m_clusterer) {
+                m_clusterer->clear();
+            }
+            m_lines.clear();
+            m_line_index.clear();
+            m_line_data.clear();
+            m_line_dirty.clear();
+            m_line_used = 0;
+            m_line_holes = 0;
+            break;
+        case OverlayUpdate::Visible:
+            m_visible = (update.id != 0);
+            break;
+    }
+}
+
+void OverlayLayer::flush()
+{
+    if (m_clusterer) {
+        m_clusterer->flush();
+    }
+}
+
+void OverlayLayer::setLine(qint64 id, const std::vector<QPointF>& lonlat, QRgb color, bool append)
+{
+    if (lonlat.empty()) {
+        return;
+    }
+    if (!m_line_anchored) {
+        // all line vertices are stored relative to the first one seen, which
+        // keeps them small enough for float precision at deep zoom levels
+        m_line_anchor = toWorld(lonlat[0]);
+        m_line_anchored = true;
+    }
+
+    QHash<qint64, LineRecord>::iterator it = m_lines.find(id);
+    bool exists = (it != m_lines.end());
+    if (!exists) {
+        LineRecord line;
+        line.first = 0;
+        line.capacity = 0;
+        it = m_lines.insert(id, line);
+    }
+    LineRecord& line = it.value();
+    line.color = color;
+
+    int from = 0;
+    if (append && exists) {
+        from = int(line.world.size());
+    } else {
+        line.world.clear();
+    }
+    // project the new vertices in one batch
+    size_t first = line.world.size();
+    line.world.resize(first + lonlat.size());
+    TileMath::lonlatToWorld(lonlat.data(), &line.world[first], lonlat.size());
+    int count = int(line.world.size());
+
+    if (count > line.capacity) {
+        // Move the line to a new allocation with room to grow, the old one
+        // becomes a hole that is reclaimed by the next compaction
+        m_line_holes += line.capacity;
+        line.first = m_line_used;
+        line.capacity = std::max(16, count * 2);
+        m_line_used += line.capacity;
+        m_line_data.resize(size_t(m_line_used) * 2);
+        from = 0;
+    }
+    writeLine(line, from);
+
+    // extend or recompute the bounds for the spatial index
+    if (from == 0) {
+        line.bounds = QRectF(line.world[0], QSizeF(0., 0.));
+    }
+    for (int i = from; i < count; i++) {
+        const QPointF& p = line.world[i];
+        line.bounds.setLeft(std::min(line.bounds.left(), p.x()));
+        line.bounds.setRight(std::max(line.bounds.right(), p.x()));
+        line.bounds.setTop(std::min(line.bounds.top(), p.y()));
+        line.bounds.setBottom(std::max(line.bounds.bottom(), p.y()));
+    }
+    m_line_index.insert(id, line.bounds);
+}
+
+void OverlayLayer::removeLine(qint64 id)
+{
+    QHash<qint64, LineRecord>::iterator it = m_lines.find(id);
+    if (it != m_lines.end()) {
+        m_line_holes += it.value().capacity;
+        m_lines.erase(it);
+        m_line_index.remove(id);
+    }
+}
+
+// Copies vertices [from, count) of the line into the CPU buffer copy
+// and records the range for upload on the next draw
+void OverlayLayer::writeLine(const LineRecord& line, int from)
+{
+    int count = int(line.world.size());
+    for (int i = from; i < count; i++) {
+        size_t v = size_t(line.first + i) * 2;
+        m_line_data[v] = float(line.world[i].x() - m_line_anchor.x());
+        m_line_data[v + 1] = float(line.world[i].y() - m_line_anchor.y());
+    }
+    if (from < count) {
+        m_line_dirty.push_back(std::make_pair(line.first + from, count - from));
+    }
+}
+
+// Repacks all lines to the front of the buffer once holes dominate it
+void OverlayLayer::compactLines()
+{
+    m_line_used = 0;
+    m_line_holes = 0;
+    for (QHash<qint64, LineRecord>::iterator it = m_lines.begin(); it != m_lines.end(); ++it) {
+        it.value().first = m_line_used;
+        m_line_used += it.value().capacity;
+    }
+    m_line_data.assign(size_t(m_line_used) * 2, 0.f);
+    for (QHash<qint64, LineRecord>::iterator it = m_lines.begin(); it != m_lines.end(); ++it) {
+        writeLine(it.value(), 0);
+    }
+    m_line_dirty.clear();
+    m_line_realloc = true;
+}
+
+// Line vertices are float offsets from the anchor and the shader adds the
+// anchor position in the viewport, so both must stay small for a stable
+// picture at deep zoom. Once the view is far from the anchor, the anchor
+// moves to the view and all vertices are rewritten.
+void OverlayLayer::reanchorLines(const QPointF& anchor)
+{
+    m_line_anchor = anchor;
+    for (QHash<qint64, LineRecord>::iterator it = m_lines.begin(); it != m_lines.end(); ++it) {
+        writeLine(it.value(), 0);
+    }
+    m_line_dirty.clear();
+    m_line_realloc = true;
+}
+
+void OverlayLayer::uploadLines()
+{
+    if (m_line_holes > 1024 && m_line_holes > m_line_used / 2) {
+        compactLines();
+    }
+    if (!m_line_buffer.isCreated()) {
+        m_line_buffer.create();
+        m_line_buffer.setUsagePattern(QOpenGLBuffer::DynamicDraw);
+    }
+    m_line_buffer.bind();
+    if (m_line_realloc || m_line_used > m_line_capacity) {
+        // grow geometrically so appends don't reallocate every frame. A
+        // compaction or re-anchor sizes the buffer from the vertices in
+        // use, so it shrinks with them.
+        if (m_line_realloc) {
+            m_line_capacity = std::max(16, 2 * m_line_used);
+        } else {
+            m_line_capacity = std::max(m_line_used, m_line_capacity * 2);
+        }
+        m_line_buffer.allocate(int(size_t(m_line_capacity) * 2 * sizeof(float)));
+        if (m_line_used) {
+            m_line_buffer.write(0, m_line_data.data(), int(m_line_data.size() * sizeof(float)));
+        }
+        m_line_realloc = false;
+    } else {
+        for (size_t i = 0; i < m_line_dirty.size(); i++) {
+            m_line_buffer.write(int(m_line_dirty[i].first * 2 * sizeof(float)),
+                &m_line_data[size_t(m_line_dirty[i].first) * 2],
+                int(m_line_dirty[i].second * 2 * sizeof(float)));
+        }
+    }
+    m_line_dirty.clear();
+}
+
+void OverlayLayer::drawLines(const OverlayView& view, QGLShaderProgram* shader)
+{
+    if (m_lines.isEmpty()) {
+        return;
+    }
+    // distance in pixels between the anchor and the view that still 
+    // leaves sub-pixel float precision
+    const double MaxAnchorDistance = 16384.;
+    QPointF anchor(m_line_anchor.x() * view.scale - view.bounds.center().x(),
+        m_line_anchor.y() * view.scale - view.bounds.center().y());
+    if (fabs(anchor.x()) > MaxAnchorDistance || fabs(anchor.y()) > MaxAnchorDistance) {
+        reanchorLines(QPointF(view.bounds.center().x() / view.scale, 
+            view.bounds.center().y() / view.scale));
+    }
+    uploadLines();
+
+    // cull the lines against the view in world space
+    std::vector<qint64>& visible = m_culled;
+    visible.clear();
+    QRectF world(view.bounds.x() / view.scale, view.bounds.y() / view.scale,
+        view.bounds.width() / view.scale, view.bounds.height() / view.scale);
+    m_line_index.query(world, visible);
+    if (visible.empty()) {
+        m_line_buffer.release();
+        return;
+    }
+
+    QVector2D origin(float(m_line_anchor.x() * view.scale - view.bounds.x()),
+        float(m_line_anchor.y() * view.scale - view.bounds.y()));
+    shader->setUniformValue("scale", float(view.scale));
+    shader->setUniformValue("origin", origin);
+    shader->setAttributeBuffer("position", GL_FLOAT, 0, 2);
+    shader->enableAttributeArray("position");
+    for (size_t i = 0; i < visible.size(); i++) {
+        const LineRecord& line = m_lines[visible[i]];
+        shader->setUniformValue("color", toColor(line.color));
+        m_gl->glDrawArrays(GL_LINE_STRIP, line.first, GLsizei(line.world.size()));
+    }
+    shader->disableAttributeArray("position");
+    m_line_buffer.release();
+}
+
+static void setInstance(OverlayLayer::PointInstance& instance, const QPointF& world,
+    const OverlayView& view, const QPointF& origin, float size, QRgb color)
+{
+    instance.x = float(world.x() * view.scale - origin.x());
+    instance.y = float(world.y() * view.scale - origin.y());
+    instance.size = size;
+    instance.rgba[0] = (unsigned char)qRed(color);
+    instance.rgba[1] = (unsigned char)qGreen(color);
+    instance.rgba[2] = (unsigned char)qBlue(color);
+    instance.rgba[3] = (unsigned char)qAlpha(color);
+}
+
+void OverlayLayer::drawPoints(const OverlayView& view, QGLShaderProgram* shader, QOpenGLBuffer& sprite)
+{
+    if (m_points.isEmpty()) {
+        return;
+    }
+    // Up to the cluster zoom the precomputed level for the current zoom is
+    // drawn instead of the raw points, until it is first published
+    PointClusterer::LevelPtr level;
+    quint64 version = 0;
+    if (m_clusterer && view.zoom <= m_clusterer->maxZoom()) {
+        level = m_clusterer->level(view.zoom, version);
+    }
+    bool clustered = !level.isNull();
+
+    // Rebuild the instances when the points changed, the zoom changed or the
+    // view moved outside the padded region the instances were culled for
+    QRectF bounds(view.bounds);
+    bool changed = clustered ? (version != m_point_version) : m_points_dirty;
+    if (changed || clustered != m_point_clustered || view.zoom != m_point_zoom || 
+        !m_point_region.contains(bounds)) {
+        m_point_region = bounds.adjusted(-0.5 * bounds.width(), -0.5 * bounds.height(),
+            0.5 * bounds.width(), 0.5 * bounds.height());
+        double pad = PointRadius * view.pixel_ratio * (clustered ? MaxClusterSize : 1.f);
+        QRectF region = m_point_region.adjusted(-pad, -pad, pad, pad);
+        QRectF world(region.x() / view.scale, region.y() / view.scale,
+            region.width() / view.scale, region.height() / view.scale);
+
+        std::vector<PointInstance>& instances = m_instances;
+        instances.clear();
+        if (clustered) {
+            std::vector<const PointClusterer::Cluster*>& visible = m_culled_clusters;
+            visible.clear();
+            m_clusterer->query(*level, view.zoom, world, visible);
+            instances.resize(visible.size());
+            for (size_t i = 0; i < visible.size(); i++) {
+                // sprite area grows with the log of the cluster size
+                float size = std::min(MaxClusterSize, 1.f + 0.5f * log2f(float(visible[i]->count)));
+                setInstance(instances[i], visible[i]->world, view, m_point_region.topLeft(), 
+                    size, visible[i]->color);
+            }
+        } else {
+            std::vector<qint64>& visible = m_culled;
+            visible.clear();
+            m_point_index.query(world, visible);
+            instances.resize(visible.size());
+            for (size_t i = 0; i < visible.size(); i++) {
+                const PointRecord& point = m_points[visible[i]];
+                setInstance(instances[i], point.world, view, m_point_region.topLeft(), 
+                    1.f, point.color);
+            }
+            m_points_dirty = false;
+        }
+        if (!m_point_buffer.isCreated()) {
+            m_point_buffer.create();
+            m_point_buffer.setUsagePattern(QOpenGLBuffer::DynamicDraw);
+        }
+        m_point_buffer.bind();
+        m_point_buffer.allocate(instances.data(), int(instances.size() * sizeof(PointInstance)));
+        m_point_buffer.release();
+
+        m_point_count = int(instances.size());
+        m_point_zoom = view.zoom;
+        m_point_clustered = clustered;
+        m_point_version = version;
+    }
+    if (!m_point_count) {
+        return;
+    }
+
+    shader->setUniformValue("origin", QVector2D(float(m_point_region.x() - view.bounds.x()),
+        float(m_point_region.y() - view.bounds.y())));
+
+    const int stride = sizeof(PointInstance);
+    sprite.bind();
+    shader->setAttributeBuffer("corner", GL_FLOAT, 0, 2);
+    shader->enableAttributeArray("corner");
+    m_point_buffer.bind();
+    int position = shader->attributeLocation("position");
+    int size = shader->attributeLocation("size");
+    int color = shader->attributeLocation("color");
+    shader->setAttributeBuffer(position, GL_FLOAT, 0, 2, stride);
+    shader->setAttributeBuffer(size, GL_FLOAT, 2 * sizeof(float), 1, stride);
+    shader->setAttributeBuffer(color, GL_UNSIGNED_BYTE, 3 * sizeof(float), 4, stride);
+    shader->enableAttributeArray(position);
+    shader->enableAttributeArray(size);
+    shader->enableAttributeArray(color);
+    m_gl->glVertexAttribDivisor(position, 1);
+    m_gl->glVertexAttribDivisor(size, 1);
+    m_gl->glVertexAttribDivisor(color, 1);
+
+    m_gl->glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, m_point_count);
+
+    // reset the divisors, the attribute state is shared with the tile shaders
+    m_gl->glVertexAttribDivisor(position, 0);
+    m_gl->glVertexAttribDivisor(size, 0);
+    m_gl->glVertexAttribDivisor(color, 0);
+    shader->disableAttributeArray(position);
+    shader->disableAttributeArray(size);
+    shader->disableAttributeArray(color);
+    shader->disableAttributeArray("corner");
+    m_point_buffer.release();
+}
+
+OverlayRenderer::OverlayRenderer(int tile_size, int cluster_zoom, std::function<void ()> redraw)
+    : m_tile_size(tile_size),
+    m_cluster_zoom(cluster_zoom),
+    m_redraw(redraw),
+    m_gl(NULL),
+    m_point_shader(NULL),
+    m_line_shader(NULL),
+    m_sprite(QOpenGLBuffer::VertexBuffer)
+{
+}
+
+OverlayRenderer::~OverlayRenderer()
+{
+    assert(m_layers.empty());
+}
+
+bool OverlayRenderer::update(const OverlayUpdateList& updates)
+{
+    if (updates.empty()) {
+        return false;
+    }
+    m_mutex.lock();
+    m_pending.insert(m_pending.end(), updates.begin(), updates.end());
+    m_mutex.unlock();
+    return true;
+}
+
+void OverlayRenderer::setup()
+{
+    m_gl = QOpenGLContext::currentContext()->extraFunctions();
+    m_point_shader = createProgram(PointVertexShader, PointFragmentShader, "Overlay point");
+    m_line_shader = createProgram(LineVertexShader, LineFragmentShader, "Overlay line");
+
+    const GLfloat quad[8] = {-1.f, -1.f, 1.f, -1.f, -1.f, 1.f, 1.f, 1.f};
+    m_sprite.create();
+    m_sprite.bind();
+    m_sprite.allocate(quad, sizeof(quad));
+    m_sprite.release();
+
+    m_cluster_thread.start();
+}
+
+void OverlayRenderer::shutdown()
+{
+    // stop clustering before the layers and their clusterers go away
+    m_cluster_thread.quit();
+    m_cluster_thread.wait();
+    for (size_t i = 0; i < m_layers.size(); i++) {
+        delete m_layers[i];
+    }
+    m_layers.clear();
+    m_layer_names.clear();
+    m_sprite.destroy();
+    delete m_point_shader;
+    m_point_shader = NULL;
+    delete m_line_shader;
+    m_line_shader = NULL;
+}
+
+void OverlayRenderer::draw(const QRectF& bounds, int zoom, float pixel_ratio, 
+    const QMatrix4x4& projection)
+{
+    // take the pending updates and apply them to the layers
+    OverlayUpdateList& updates = m_updates;
+    updates.clear();
+    m_mutex.lock();
+    updates.swap(m_pending);
+    m_mutex.unlock();
+
+    for (size_t i = 0; i < updates.size(); i++) {
+        std::map<QString, OverlayLayer*>::iterator it = m_layer_names.find(updates[i].layer);
+        if (it == m_layer_names.end()) {
+            PointClusterer *clusterer = NULL;
+            if (m_cluster_zoom >= 0) {
+                clusterer = new PointClusterer(m_tile_size, m_cluster_zoom, m_redraw);
+                clusterer->moveToThread(&m_cluster_thread);
+            }
+            OverlayLayer *layer = new OverlayLayer(m_gl, clusterer);
+            m_layers.push_back(layer);
+            it = m_layer_names.insert(std::make_pair(updates[i].layer, layer)).first;
+        }
+        it->second->apply(updates[i]);
+    }
+    if (!updates.empty()) {
+        // hand this frame's point changes to the cluster worker
+        for (size_t i = 0; i < m_layers.size(); i++) {
+            m_layers[i]->flush();
+        }
+    }
+    if (m_layers.empty()) {
+        return;
+    }
+
+    OverlayView view;
+    view.bounds = bounds;
+    view.zoom = zoom;
+    view.scale = double(m_tile_size) * pow(2.0, zoom);
+    view.pixel_ratio = pixel_ratio;
+    view.projection = projection;
+
+    for (size_t i = 0; i < m_layers.size(); i++) {
+        if (!m_layers[i]->visible()) {
+            continue;
+        }
+        m_line_shader->bind();
+        m_line_shader->setUniformValue("projection", projection);
+        m_layers[i]->drawLines(view, m_line_shader);
+        m_line_shader->release();
+
+        m_point_shader->bind();
+        m_point_shader->setUniformValue("projection", projection);
+        // sprites keep their size in logical pixels
+        m_point_shader->setUniformValue("radius", OverlayLayer::PointRadius * pixel_ratio);
+        m_layers[i]->drawPoints(view, m_point_shader, m_sprite);
+        m_point_shader->release();
+    }
+}
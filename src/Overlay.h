@@ -0,0 +1,184 @@
+#ifndef __OVERLAY_H_
+#define __OVERLAY_H_
+
+#include "QuadTree.h"
+#include "PointClusterer.h"
+#include <QOpenGLBuffer>
+#include <QOpenGLExtraFunctions>
+#include <QGLShaderProgram>
+#include <QMatrix4x4>
+#include <QMutex>
+#include <QHash>
+#include <QRect>
+#include <QRgb>
+#include <QString>
+#include <QThread>
+#include <functional>
+#include <vector>
+#include <map>
+
+// A single change to a named overlay layer. Coordinates are lon/lat pairs
+// stored as QPointF(lon, lat), matching the MapConfig center convention.
+// Layers are created on first use and drawn in creation order.
+struct OverlayUpdate {
+    enum Type {
+        Point,    // insert or move point 'id' to coords[0]
+        Polyline, // insert or replace polyline 'id' with 'coords'
+        Append,   // append 'coords' to polyline 'id'
+        Remove,   // remove the point or polyline 'id'
+        Clear,    // remove everything in the layer
+        Visible   // show (id != 0) or hide (id == 0) the layer
+    };
+
+    OverlayUpdate()
+        : type(Point), id(0), color(qRgb(220, 40, 40)) {}
+    OverlayUpdate(Type type, const QString& layer, qint64 id)
+        : type(type), layer(layer), id(id), color(qRgb(220, 40, 40)) {}
+
+    Type type;
+    QString layer;
+    qint64 id;
+    QRgb color;
+    std::vector<QPointF> coords;
+};
+typedef std::vector<OverlayUpdate> OverlayUpdateList;
+
+// The region of the map being drawn, in the pixel space of 'zoom'. The
+// bounds are doubles, which hold the 64-bit pixel space exactly.
+struct OverlayView {
+    QRectF bounds;    // viewport bounds in pixels
+    int zoom;         // map zoom level
+    double scale;     // pixels per normalized world unit at 'zoom'
+    float pixel_ratio; // device pixels per logical pixel
+    QMatrix4x4 projection;
+};
+
+// One overlay layer holding points and polylines in normalized Web Mercator
+// world coordinates, each indexed by a QuadTree for view culling. Points are
+// drawn as instanced sprites from a buffer of the culled set, which is only
+// rebuilt when the data changes or the view leaves the padded region it was
+// built for. At low zoom levels the points are replaced by the clusters
+// precomputed by the layer's PointClusterer. Polylines live in one vertex
+// buffer that is written once and patched in place as tracks grow. Only
+// used on the TileRenderer thread.
+class OverlayLayer {
+public:
+    // takes ownership of the (optional) clusterer
+    OverlayLayer(QOpenGLExtraFunctions* gl, PointClusterer* clusterer);
+    ~OverlayLayer();
+
+    void apply(const OverlayUpdate& update);
+    // sends the applied point changes on to the clusterer
+    void flush();
+    void drawLines(const OverlayView& view, QGLShaderProgram* shader);
+    void drawPoints(const OverlayView& view, QGLShaderProgram* shader, QOpenGLBuffer& sprite);
+
+    bool visible() const {
+        return m_visible;
+    }
+
+    // Radius of point sprites in pixels
+    static const float PointRadius;
+    // Largest cluster sprite radius as a multiple of PointRadius
+    static const float MaxClusterSize;
+
+    // point sprite instance attributes, RGBA bytes are normalized in GL
+    struct PointInstance {
+        float x, y;
+        float size;
+        unsigned char rgba[4];
+    };
+
+    // converts lon/lat into the normalized world square [0,1]x[0,1]
+    static QPointF toWorld(const QPointF& lonlat);
+
+private:
+    struct PointRecord {
+        QPointF world;
+        QRgb color;
+    };
+    struct LineRecord {
+        std::vector<QPointF> world;
+        QRectF bounds;
+        QRgb color;
+        int first;    // first vertex in the line buffer
+        int capacity; // vertices reserved in the line buffer
+    };
+
+    void setLine(qint64 id, const std::vector<QPointF>& lonlat, QRgb color, bool append);
+    void removeLine(qint64 id);
+    void writeLine(const LineRecord& line, int from);
+    void compactLines();
+    // moves the line anchor to 'anchor' and rewrites every vertex
+    void reanchorLines(const QPointF& anchor);
+    void uploadLines();
+
+    QOpenGLExtraFunctions *m_gl;
+    bool m_visible;
+    PointClusterer *m_clusterer;
+
+    QHash<qint64, PointRecord> m_points;
+    QuadTree<qint64> m_point_index;
+    QOpenGLBuffer m_point_buffer; // culled point instances
+    bool m_points_dirty;
+    QRectF m_point_region;        // padded pixel region of the instances
+    int m_point_zoom;
+    int m_point_count;
+    bool m_point_clustered;       // instances are built from clusters
+    quint64 m_point_version;      // cluster version of the instances
+
+    QHash<qint64, LineRecord> m_lines;
+    QuadTree<qint64> m_line_index;
+    QOpenGLBuffer m_line_buffer;
+    std::vector<float> m_line_data;   // CPU copy of the line buffer
+    std::vector<std::pair<int, int>> m_line_dirty; // vertex ranges to upload
+    QPointF m_line_anchor;  // world origin of the line buffer vertices
+    bool m_line_anchored;
+    int m_line_used;        // vertices allocated, including holes
+    int m_line_holes;       // vertices in released allocations
+    int m_line_capacity;    // vertices allocated in the GPU buffer
+    bool m_line_realloc;
+
+    // scratch lists of the culling, kept to reuse their memory
+    std::vector<qint64> m_culled;
+    std::vector<const PointClusterer::Cluster*> m_culled_clusters;
+    std::vector<PointInstance> m_instances;
+};
+
+// Owns the overlay layers and their shaders. Updates can be queued from any
+// thread and are applied on the next draw() in the TileRenderer thread.
+// Point clustering for all layers runs on one shared worker thread, which
+// calls 'redraw' whenever new clusters are published.
+class OverlayRenderer {
+public:
+    // 'cluster_zoom' is the deepest clustered zoom level, -1 disables it
+    OverlayRenderer(int tile_size, int cluster_zoom, std::function<void ()> redraw);
+    ~OverlayRenderer();
+
+    // thread safe, returns true if a redraw is needed
+    bool update(const OverlayUpdateList& updates);
+
+    // the following are only called from the GL context thread
+    void setup();
+    void shutdown();
+    void draw(const QRectF& bounds, int zoom, float pixel_ratio, const QMatrix4x4& projection);
+
+private:
+    int m_tile_size;
+    int m_cluster_zoom;
+    std::function<void ()> m_redraw;
+    QThread m_cluster_thread;
+    QOpenGLExtraFunctions *m_gl;
+    QGLShaderProgram *m_point_shader;
+    QGLShaderProgram *m_line_shader;
+    QOpenGLBuffer m_sprite; // unit quad shared by all point sprites
+
+    std::vector<OverlayLayer*> m_layers;
+    std::map<QString, OverlayLayer*> m_layer_names;
+
+    QMutex m_mutex; // protects the pending update list
+    OverlayUpdateList m_pending;
+    OverlayUpdateList m_updates; // updates being applied by draw()
+};
+
+#endif
@@ -0,0 +1,137 @@
+#include "OverlaySource.h"
+#include <QFile>
+#include <QDebug>
+#include <cassert>
+
+OverlaySource::OverlaySource(QObject *parent)
+    : QObject(parent),
+    m_server(NULL)
+{
+}
+
+bool OverlaySource::parse(const QByteArray& line, OverlayUpdate& update)
+{
+    QList<QByteArray> fields = line.simplified().split(' ');
+    if (fields.size() < 2 || fields[0].size() != 1) {
+        return false;
+    }
+    update = OverlayUpdate();
+    update.layer = QString::fromUtf8(fields[1]);
+
+    bool ok = true;
+    switch (fields[0][0]) {
+        case 'P': update.type = OverlayUpdate::Point; break;
+        case 'L': update.type = OverlayUpdate::Polyline; break;
+        case 'A': update.type = OverlayUpdate::Append; break;
+        case 'D': update.type = OverlayUpdate::Remove; break;
+        case 'C': update.type = OverlayUpdate::Clear; return true;
+        case 'V': update.type = OverlayUpdate::Visible; break;
+        default: return false;
+    }
+    if (fields.size() < 3) {
+        return false;
+    }
+    update.id = fields[2].toLongLong(&ok);
+    if (!ok) {
+        return false;
+    }
+    if (update.type == OverlayUpdate::Remove || update.type == OverlayUpdate::Visible) {
+        return true;
+    }
+
+    // an optional color either leads the coordinates or trails the point
+    for (int i = 3; i < fields.size(); i++) {
+        if (fields[i].startsWith('#')) {
+            uint rgb = fields[i].mid(1).toUInt(&ok, 16);
+            if (!ok) {
+                return false;
+            }
+            update.color = qRgb(qRed(rgb), qGreen(rgb), qBlue(rgb));
+        } else if (i + 1 < fields.size()) {
+            bool lon_ok, lat_ok;
+            double lon = fields[i].toDouble(&lon_ok);
+            double lat = fields[i + 1].toDouble(&lat_ok);
+            if (!lon_ok || !lat_ok) {
+                return false;
+            }
+            update.coords.push_back(QPointF(lon, lat));
+            i++;
+        } else {
+            return false;
+        }
+    }
+    if (update.type == OverlayUpdate::Point && update.coords.size() != 1) {
+        return false;
+    }
+    return !update.coords.empty();
+}
+
+bool OverlaySource::readFile(const QString& path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        qCritical() << "Unable to open overlay file:" << path;
+        return false;
+    }
+    OverlayUpdateList list;
+    int number = 0;
+    while (!file.atEnd()) {
+        QByteArray line = file.readLine();
+        number++;
+        if (line.trimmed().isEmpty() || line.startsWith('#')) {
+            continue;
+        }
+        OverlayUpdate update;
+        if (parse(line, update)) {
+            list.push_back(update);
+        } else {
+            qWarning() << "Invalid overlay line" << number << "in" << path;
+        }
+    }
+    emit updates(list);
+    return true;
+}
+
+bool OverlaySource::listen(const QString& name)
+{
+    if (!m_server) {
+        m_server = new QLocalServer(this);
+        connect(m_server, SIGNAL(newConnection()), this, SLOT(newConnection()));
+    }
+    // remove a stale socket left behind by a previous crash
+    QLocalServer::removeServer(name);
+    if (!m_server->listen(name)) {
+        qCritical() << "Unable to listen on overlay socket:" << name << m_server->errorString();
+        return false;
+    }
+    return true;
+}
+
+void OverlaySource::newConnection()
+{
+    while (QLocalSocket *socket = m_server->nextPendingConnection()) {
+        connect(socket, SIGNAL(readyRead()), this, SLOT(readSocket()));
+        connect(socket, SIGNAL(disconnected()), socket, SLOT(deleteLater()));
+    }
+}
+
+void OverlaySource::readSocket()
+{
+    QLocalSocket *socket = qobject_cast<QLocalSocket*>(sender());
+    assert(socket);
+
+    // batch every complete line received so far into one update
+    OverlayUpdateList list;
+    while (socket->canReadLine()) {
+        QByteArray line = socket->readLine();
+        OverlayUpdate update;
+        if (parse(line, update)) {
+            list.push_back(update);
+        } else if (!line.trimmed().isEmpty()) {
+            qWarning() << "Invalid overlay line:" << line.trimmed();
+        }
+    }
+    if (!list.empty()) {
+        emit updates(list);
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef __OVERLAY_SOURCE_H_
+#define __OVERLAY_SOURCE_H_
+
+#include "Overlay.h"
+#include <QObject>
+#include <QLocalServer>
+#include <QLocalSocket>
+
+// Feeds overlay updates from a text file or a local socket into the map.
+// Each line is one update, with coordinates given as lon/lat pairs:
+//
+//   P <layer> <id> <lon> <lat> [#rrggbb]       insert or move a point
+//   L <layer> <id> [#rrggbb] <lon> <lat> ...   insert or replace a polyline
+//   A <layer> <id> <lon> <lat> ...             append to a polyline
+//   D <layer> <id>                             remove a point or polyline
+//   C <layer>                                  clear a layer
+//   V <layer> <0|1>                            hide or show a layer
+//
+// All lines received in one read are delivered as a single batch through
+// the updates() signal. This object lives in the GUI thread.
+class OverlaySource : public QObject
+{
+    Q_OBJECT
+public:
+    OverlaySource(QObject *parent = 0);
+
+    // reads and emits all updates in the file, returns false on error
+    bool readFile(const QString& path);
+    // listens for clients on the named local socket
+    bool listen(const QString& name);
+
+    // parses one protocol line, returns false if it is malformed
+    static bool parse(const QByteArray& line, OverlayUpdate& update);
+
+signals:
+    void updates(const OverlayUpdateList& updates);
+
+private slots:
+    void newConnection();
+    void readSocket();
+
+private:
+    QLocalServer *m_server;
+};
+
+#endif
@@ -0,0 +1,47 @@
+#include "Playback.h"
+
+Playback::Playback(int frames, int interval, QObject *parent)
+    : QObject(parent),
+    m_frames(frames),
+    m_frame(0)
+{
+    m_timer.setInterval(interval);
+    // keeps the frame rate steady, coarse timers drift by up to 5%
+    m_timer.setTimerType(Qt::PreciseTimer);
+    connect(&m_timer, SIGNAL(timeout()), this, SLOT(advance()));
+}
+
+void Playback::play()
+{
+    if (m_frames > 1) {
+        m_timer.start();
+    }
+}
+
+void Playback::pause()
+{
+    m_timer.stop();
+}
+
+void Playback::toggle()
+{
+    if (playing()) {
+        pause();
+    } else {
+        play();
+    }
+}
+
+void Playback::step(int delta)
+{
+    if (m_frames < 1) {
+        return;
+    }
+    m_frame = ((m_frame + delta) % m_frames + m_frames) % m_frames;
+    emit frameChanged(m_frame);
+}
+
+void Playback::advance()
+{
+    step(1);
+}
@@ -0,0 +1,44 @@
+#ifndef __PLAYBACK_H_
+#define __PLAYBACK_H_
+
+#include <QObject>
+#include <QTimer>
+
+// Playback controller of the time dimension tiles. It loops through the
+// frames of MapConfig::times at a fixed interval and emits the playhead,
+// which the MapViewer puts into the render state. The renderer prefetches
+// the frames ahead of the playhead, so after the first pass every frame
+// comes from the tile caches.
+class Playback : public QObject
+{
+    Q_OBJECT
+public:
+    Playback(int frames, int interval, QObject *parent = 0);
+
+    int frame() const {
+        return m_frame;
+    }
+    bool playing() const {
+        return m_timer.isActive();
+    }
+
+public slots:
+    void play();
+    void pause();
+    void toggle();
+    // moves the playhead by 'delta' frames, wrapping around
+    void step(int delta);
+
+signals:
+    void frameChanged(int frame);
+
+private slots:
+    void advance();
+
+private:
+    QTimer m_timer;
+    int m_frames;
+    int m_frame;
+};
+
+#endif
@@ -0,0 +1,306 @@
+#include "PointClusterer.h"
+#include <QCoreApplication>
+#include <algorithm>
+#include <cmath>
+
+// Register the process event with Qt
+const QEvent::Type PointClusterer::ProcessRequest::type = (QEvent::Type)QEvent::registerEventType();
+
+PointClusterer::PointClusterer(int tile_size, int max_zoom, std::function<void ()> published)
+    : m_tile_size(tile_size),
+    m_max_zoom(max_zoom),
+    m_published(published),
+    m_outbox_clear(false),
+    m_inbox_clear(false),
+    m_scheduled(false),
+    m_cells(max_zoom + 1),
+    m_levels(max_zoom + 1),
+    m_version(0)
+{
+}
+
+double PointClusterer::cellSize(int zoom) const
+{
+    return double(CellSize) / (double(m_tile_size) * pow(2.0, zoom));
+}
+
+quint64 PointClusterer::cellOf(int zoom, const QPointF& world) const
+{
+    double size = cellSize(zoom);
+    double limit = 1.0 / size - 1.0;
+    double x = std::max(0.0, std::min(limit, floor(world.x() / size)));
+    double y = std::max(0.0, std::min(limit, floor(world.y() / size)));
+    return cellKey(quint32(x), quint32(y));
+}
+
+void PointClusterer::update(qint64 id, const QPointF& world, QRgb color)
+{
+    Delta delta = { id, world, color, false };
+    m_outbox.push_back(delta);
+}
+
+void PointClusterer::remove(qint64 id)
+{
+    Delta delta = { id, QPointF(), 0, true };
+    m_outbox.push_back(delta);
+}
+
+void PointClusterer::clear()
+{
+    // a clear drops everything queued before it
+    m_outbox.clear();
+    m_outbox_clear = true;
+}
+
+void PointClusterer::flush()
+{
+    if (m_outbox.empty() && !m_outbox_clear) {
+        return;
+    }
+    m_inbox_mutex.lock();
+    if (m_outbox_clear) {
+        m_inbox.clear();
+        m_inbox_clear = true;
+    }
+    m_inbox.insert(m_inbox.end(), m_outbox.begin(), m_outbox.end());
+    if (!m_scheduled) {
+        // only one process request is outstanding at a time, later
+        // changes are picked up by that request
+        m_scheduled = true;
+        QCoreApplication::postEvent(this, new PointClusterer::ProcessRequest());
+    }
+    m_inbox_mutex.unlock();
+    m_outbox.clear();
+    m_outbox_clear = false;
+}
+
+PointClusterer::LevelPtr PointClusterer::level(int zoom, quint64& version) const
+{
+    LevelPtr level;
+    m_level_mutex.lock();
+    if (zoom >= 0 && zoom <= m_max_zoom) {
+        level = m_levels[zoom];
+    }
+    version = m_version;
+    m_level_mutex.unlock();
+    return level;
+}
+
+void PointClusterer::query(const Level& level, int zoom, const QRectF& world,
+    std::vector<const Cluster*>& clusters) const
+{
+    // chunks are sorted by row and column, so each visible row of chunks
+    // is one contiguous range found with a binary search. Chunks on the
+    // edge of the view are only partly in it, their clusters are checked.
+    quint64 first = cellOf(zoom, world.topLeft());
+    quint64 last = cellOf(zoom, world.bottomRight());
+    quint32 x1 = quint32(first), y1 = quint32(first >> 32);
+    quint32 x2 = quint32(last), y2 = quint32(last >> 32);
+
+    struct Compare {
+        bool operator()(const ChunkPtr& c, quint64 key) const { return c->key < key; }
+    };
+    Level::const_iterator it = level.begin();
+    for (quint32 row = y1 >> ChunkShift; row <= y2 >> ChunkShift; row++) {
+        it = std::lower_bound(it, level.end(), cellKey(x1 >> ChunkShift, row), Compare());
+        quint64 end = cellKey(x2 >> ChunkShift, row);
+        for (; it != level.end() && (*it)->key <= end; ++it) {
+            const std::vector<Cluster>& chunk = (*it)->clusters;
+            for (size_t i = 0; i < chunk.size(); i++) {
+                quint32 x = quint32(chunk[i].cell), y = quint32(chunk[i].cell >> 32);
+                if (x >= x1 && x <= x2 && y >= y1 && y <= y2) {
+                    clusters.push_back(&chunk[i]);
+                }
+            }
+        }
+    }
+}
+
+void PointClusterer::customEvent(QEvent *event)
+{
+    // Handle custom internal event type to process queued changes
+    if (event->type() == ProcessRequest::type) {
+        process();
+    } else {
+        QObject::customEvent(event);
+    }
+}
+
+void PointClusterer::accumulate(const PointState& point, int sign,
+    std::vector<std::vector<quint64>>& dirty)
+{
+    for (int zoom = 0; zoom <= m_max_zoom; zoom++) {
+        quint64 key = cellOf(zoom, point.world);
+        Cell& cell = m_cells[zoom][key];
+        cell.x += sign * point.world.x();
+        cell.y += sign * point.world.y();
+        cell.count += sign;
+        cell.r += quint64(qint64(sign) * qRed(point.color));
+        cell.g += quint64(qint64(sign) * qGreen(point.color));
+        cell.b += quint64(qint64(sign) * qBlue(point.color));
+        dirty[zoom].push_back(key);
+    }
+}
+
+void PointClusterer::process()
+{
+    std::vector<Delta> deltas;
+    bool clear;
+    m_inbox_mutex.lock();
+    deltas.swap(m_inbox);
+    clear = m_inbox_clear;
+    m_inbox_clear = false;
+    m_scheduled = false;
+    m_inbox_mutex.unlock();
+
+    std::vector<std::vector<quint64>> dirty(m_max_zoom + 1);
+    if (clear) {
+        m_points.clear();
+        for (int zoom = 0; zoom <= m_max_zoom; zoom++) {
+            m_cells[zoom].clear();
+        }
+        // dropping the snapshots forces every level to be republished
+        m_level_mutex.lock();
+        for (int zoom = 0; zoom <= m_max_zoom; zoom++) {
+            m_levels[zoom].reset();
+        }
+        m_level_mutex.unlock();
+    }
+
+    // Each change moves the point out of its old cell and into the new
+    // one on every level; only those cells are marked dirty
+    for (size_t i = 0; i < deltas.size(); i++) {
+        QHash<qint64, PointState>::iterator it = m_points.find(deltas[i].id);
+        if (it != m_points.end()) {
+            accumulate(it.value(), -1, dirty);
+            if (deltas[i].removed) {
+                m_points.erase(it);
+                continue;
+            }
+        } else if (deltas[i].removed) {
+            continue;
+        } else {
+            it = m_points.insert(deltas[i].id, PointState());
+        }
+        it.value().world = deltas[i].world;
+        it.value().color = deltas[i].color;
+        accumulate(it.value(), 1, dirty);
+    }
+    publish(dirty);
+}
+
+// Orders cell keys by chunk, and row major within a chunk
+struct ChunkOrder {
+    bool operator()(quint64 a, quint64 b) const {
+        quint64 chunk_a = PointClusterer::chunkOf(a), chunk_b = PointClusterer::chunkOf(b);
+        return chunk_a < chunk_b || (chunk_a == chunk_b && a < b);
+    }
+};
+
+// Publishes a new snapshot of each level with dirty cells. The snapshots
+// may still be in use by the renderer, so they and their chunks are never
+// modified in place: the chunks with dirty cells are rebuilt, the others
+// are shared with the previous snapshot.
+void PointClusterer::publish(std::vector<std::vector<quint64>>& dirty)
+{
+    bool changed = false;
+    for (int zoom = 0; zoom <= m_max_zoom; zoom++) {
+        std::vector<quint64>& keys = dirty[zoom];
+        if (keys.empty() && m_levels[zoom]) {
+            continue;
+        }
+        std::sort(keys.begin(), keys.end(), ChunkOrder());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+        m_level_mutex.lock();
+        LevelPtr old = m_levels[zoom];
+        m_level_mutex.unlock();
+
+        static const Level empty;
+        const Level& source = old ? *old : empty;
+        Level *level = new Level();
+        level->reserve(source.size() + keys.size());
+        Level::const_iterator it = source.begin();
+        std::vector<quint64>::const_iterator first = keys.begin();
+        while (first != keys.end()) {
+            // the dirty cells of the next chunk
+            quint64 key = chunkOf(*first);
+            std::vector<quint64>::const_iterator last = first;
+            while (last != keys.end() && chunkOf(*last) == key) {
+                ++last;
+            }
+            // share the untouched chunks ahead of it
+            while (it != source.end() && (*it)->key < key) {
+                level->push_back(*it++);
+            }
+            const Chunk *previous = NULL;
+            if (it != source.end() && (*it)->key == key) {
+                previous = (it++)->data(); // replaced below
+            }
+            if (Chunk *chunk = mergeChunk(zoom, key, previous, first, last)) {
+                level->push_back(ChunkPtr(chunk));
+            }
+            first = last;
+        }
+        level->insert(level->end(), it, source.end());
+
+        m_level_mutex.lock();
+        m_levels[zoom] = LevelPtr(level);
+        m_level_mutex.unlock();
+        changed = true;
+    }
+    if (changed) {
+        m_level_mutex.lock();
+        m_version++;
+        m_level_mutex.unlock();
+        // let the renderer know new clusters are available
+        m_published();
+    }
+}
+
+// Merges the dirty cells [first, last) of chunk 'key' into a copy of the
+// clusters of 'source' (NULL for a new chunk). Returns NULL if the chunk
+// has no clusters left.
+PointClusterer::Chunk* PointClusterer::mergeChunk(int zoom, quint64 key, const Chunk* source,
+    std::vector<quint64>::const_iterator first, std::vector<quint64>::const_iterator last)
+{
+    static const std::vector<Cluster> none;
+    const std::vector<Cluster>& clusters = source ? source->clusters : none;
+    Chunk *chunk = new Chunk;
+    chunk->key = key;
+    chunk->clusters.reserve(clusters.size() + size_t(last - first));
+    std::vector<Cluster>::const_iterator it = clusters.begin();
+    std::vector<Cluster>::const_iterator end = clusters.end();
+    for (;; ++first) {
+        // copy the untouched clusters ahead of the next dirty cell
+        while (it != end && (first == last || it->cell < *first)) {
+            chunk->clusters.push_back(*it++);
+        }
+        if (first == last) {
+            break;
+        }
+        if (it != end && it->cell == *first) {
+            ++it; // replaced below
+        }
+        CellMap::iterator cell = m_cells[zoom].find(*first);
+        if (cell == m_cells[zoom].end()) {
+            continue;
+        }
+        const Cell& c = cell.value();
+        if (c.count <= 0) {
+            m_cells[zoom].erase(cell);
+            continue;
+        }
+        Cluster cluster;
+        cluster.cell = *first;
+        cluster.world = QPointF(c.x / c.count, c.y / c.count);
+        cluster.count = c.count;
+        cluster.color = qRgb(int(c.r / c.count), int(c.g / c.count), int(c.b / c.count));
+        chunk->clusters.push_back(cluster);
+    }
+    if (chunk->clusters.empty()) {
+        delete chunk;
+        return NULL;
+    }
+    return chunk;
+}
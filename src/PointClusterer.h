@@ -0,0 +1,142 @@
+#ifndef __POINT_CLUSTERER_H_
+#define __POINT_CLUSTERER_H_
+
+#include <QObject>
+#include <QEvent>
+#include <QMutex>
+#include <QHash>
+#include <QPointF>
+#include <QRectF>
+#include <QRgb>
+#include <QSharedPointer>
+#include <functional>
+#include <vector>
+
+// Hierarchical grid clustering of overlay points, one level per zoom. At
+// zoom z the world is divided into cells of CellSize pixels, and all points
+// in a cell collapse into one cluster at their centroid. Each point update
+// only touches the one cell it leaves and the one it enters per level. The
+// level snapshots are split into chunks of ChunkCells x ChunkCells cells,
+// and a publish copies only the chunks with changed cells, the others are
+// shared with the previous snapshot.
+//
+// The object lives on a worker thread. The renderer queues point changes
+// with update()/remove()/clear() and hands them over with flush(); the
+// worker patches the levels and publishes immutable snapshots that the
+// renderer picks up with level() for the current zoom.
+class PointClusterer : public QObject
+{
+    Q_OBJECT
+public:
+    // cluster cell size in pixels at every zoom level
+    static const int CellSize = 64;
+    // snapshot chunks are blocks of 16 x 16 cells
+    enum { ChunkShift = 4, ChunkCells = 1 << ChunkShift };
+
+    struct Cluster {
+        quint64 cell;  // cell key, see cellKey()
+        QPointF world; // centroid in normalized world coordinates
+        int count;     // number of points in the cluster
+        QRgb color;    // average point color
+    };
+    // clusters of one block of cells, sorted by cell key (row major)
+    struct Chunk {
+        quint64 key;                   // chunk key, see chunkOf()
+        std::vector<Cluster> clusters;
+    };
+    typedef QSharedPointer<const Chunk> ChunkPtr;
+    // chunks of one zoom level that have clusters, sorted by chunk key
+    typedef std::vector<ChunkPtr> Level;
+    typedef QSharedPointer<const Level> LevelPtr;
+
+    PointClusterer(int tile_size, int max_zoom, std::function<void ()> published);
+
+    // the following are only called from the renderer thread
+    void update(qint64 id, const QPointF& world, QRgb color);
+    void remove(qint64 id);
+    void clear();
+    // posts the queued point changes to the worker thread
+    void flush();
+
+    // returns the latest snapshot for 'zoom' (NULL until first published)
+    // and the publish version, which changes whenever any level changes
+    LevelPtr level(int zoom, quint64& version) const;
+    int maxZoom() const {
+        return m_max_zoom;
+    }
+
+    // world units covered by one cell at 'zoom'
+    double cellSize(int zoom) const;
+    static quint64 cellKey(quint32 x, quint32 y) {
+        return (quint64(y) << 32) | x;
+    }
+    // key of the chunk holding 'cell', a cellKey() in chunk units
+    static quint64 chunkOf(quint64 cell) {
+        return cellKey(quint32(cell) >> ChunkShift, quint32(cell >> 32) >> ChunkShift);
+    }
+    // appends the clusters of 'level' whose cell intersects 'world'
+    void query(const Level& level, int zoom, const QRectF& world,
+        std::vector<const Cluster*>& clusters) const;
+
+protected:
+    void customEvent(QEvent *event);
+
+private:
+    // Event posted to the worker thread when new changes are queued
+    class ProcessRequest : public QEvent {
+    public:
+        ProcessRequest(): QEvent(type) {}
+        static const QEvent::Type type;
+    };
+
+    struct Delta {
+        qint64 id;
+        QPointF world;
+        QRgb color;
+        bool removed;
+    };
+    struct PointState {
+        QPointF world;
+        QRgb color;
+    };
+    // running sums used to compute the cluster centroid and color
+    struct Cell {
+        Cell(): x(0.), y(0.), count(0), r(0), g(0), b(0) {}
+        double x, y;
+        int count;
+        quint64 r, g, b;
+    };
+    typedef QHash<quint64, Cell> CellMap;
+
+    void process();
+    void accumulate(const PointState& point, int sign, std::vector<std::vector<quint64>>& dirty);
+    void publish(std::vector<std::vector<quint64>>& dirty);
+    Chunk* mergeChunk(int zoom, quint64 key, const Chunk* source,
+        std::vector<quint64>::const_iterator first, std::vector<quint64>::const_iterator last);
+    quint64 cellOf(int zoom, const QPointF& world) const;
+
+    int m_tile_size;
+    int m_max_zoom;
+    std::function<void ()> m_published;
+
+    // renderer thread state
+    std::vector<Delta> m_outbox;
+    bool m_outbox_clear;
+
+    // handoff between the renderer and the worker thread
+    QMutex m_inbox_mutex;
+    std::vector<Delta> m_inbox;
+    bool m_inbox_clear;
+    bool m_scheduled;
+
+    // worker thread state
+    QHash<qint64, PointState> m_points;
+    std::vector<CellMap> m_cells; // per zoom level
+
+    // published snapshots
+    mutable QMutex m_level_mutex;
+    std::vector<LevelPtr> m_levels;
+    quint64 m_version;
+};
+
+#endif
@@ -0,0 +1,164 @@
+#ifndef __QUAD_TREE_H_
+#define __QUAD_TREE_H_
+
+#include <QRectF>
+#include <map>
+#include <memory>
+#include <vector>
+#include <cassert>
+
+// Loose quadtree spatial index over the normalized Web Mercator world square
+// [0,1]x[0,1]. Nodes line up with the tile pyramid: a node at depth d covers
+// exactly the tile (d, x, y). Items are stored in the deepest node whose
+// square fully contains their bounding box, and leaves split once they hold
+// more than 'capacity' items. Like the tile cache, this class is NOT thread
+// safe and is only accessed from the TileRenderer thread.
+template <typename K>
+class QuadTree {
+    struct Entry {
+        K key;
+        QRectF bounds;
+    };
+    struct Node {
+        Node(const QRectF& square, int depth): square(square), depth(depth) {}
+        bool leaf() const { return !children[0]; }
+
+        QRectF square;
+        int depth;
+        std::unique_ptr<Node> children[4];
+        std::vector<Entry> entries;
+    };
+    typedef std::map<K, Node*> NodeMap;
+
+public:
+    QuadTree(size_t capacity = 32, int max_depth = 24)
+        : m_capacity(capacity),
+        m_max_depth(max_depth),
+        m_root(new Node(QRectF(0., 0., 1., 1.), 0)) {}
+
+    // inserts or moves the item 'key' with the given world bounds
+    void insert(const K& key, const QRectF& bounds) {
+        remove(key);
+        insert(m_root.get(), Entry{key, bounds});
+    }
+
+    // removes the item 'key', returns false if it isn't indexed
+    bool remove(const K& key) {
+        typename NodeMap::iterator it = m_nodes.find(key);
+        if (it == m_nodes.end()) {
+            return false;
+        }
+        std::vector<Entry>& entries = it->second->entries;
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (entries[i].key == key) {
+                entries[i] = entries.back();
+                entries.pop_back();
+                break;
+            }
+        }
+        m_nodes.erase(it);
+        return true;
+    }
+
+    // appends the keys of all items intersecting 'rect' to 'keys'
+    void query(const QRectF& rect, std::vector<K>& keys) const {
+        query(m_root.get(), rect, keys);
+    }
+
+    void clear() {
+        m_root.reset(new Node(QRectF(0., 0., 1., 1.), 0));
+        m_nodes.clear();
+    }
+    size_t size() const {
+        return m_nodes.size();
+    }
+
+private:
+    static bool contains(const QRectF& square, const QRectF& bounds) {
+        // QRectF::contains excludes degenerate (point) rectangles
+        return bounds.left() >= square.left() && bounds.right() <= square.right() &&
+            bounds.top() >= square.top() && bounds.bottom() <= square.bottom();
+    }
+    static bool intersects(const QRectF& a, const QRectF& b) {
+        return a.left() <= b.right() && b.left() <= a.right() &&
+            a.top() <= b.bottom() && b.top() <= a.bottom();
+    }
+
+    // returns the child square containing 'bounds', or -1 if it straddles
+    static int child(const Node* node, const QRectF& bounds) {
+        QPointF c = node->square.center();
+        int cx = bounds.left() >= c.x() ? 1 : (bounds.right() < c.x() ? 0 : -1);
+        int cy = bounds.top() >= c.y() ? 1 : (bounds.bottom() < c.y() ? 0 : -1);
+        return (cx < 0 || cy < 0) ? -1 : cy * 2 + cx;
+    }
+
+    void insert(Node* node, const Entry& entry) {
+        int c;
+        while (!node->leaf() && (c = child(node, entry.bounds)) >= 0) {
+            node = node->children[c].get();
+        }
+        node->entries.push_back(entry);
+        m_nodes[entry.key] = node;
+        if (node->leaf() && node->entries.size() > m_capacity && node->depth < m_max_depth) {
+            split(node);
+        }
+    }
+
+    void split(Node* node) {
+        double half = 0.5 * node->square.width();
+        for (int i = 0; i < 4; i++) {
+            QRectF square(node->square.left() + half * (i % 2),
+                node->square.top() + half * (i / 2), half, half);
+            node->children[i].reset(new Node(square, node->depth + 1));
+        }
+        // push down every entry that fits inside a child square
+        std::vector<Entry> entries;
+        entries.swap(node->entries);
+        for (size_t i = 0; i < entries.size(); i++) {
+            int c = child(node, entries[i].bounds);
+            if (c < 0) {
+                node->entries.push_back(entries[i]);
+            } else {
+                insert(node->children[c].get(), entries[i]);
+            }
+        }
+    }
+
+    void query(const Node* node, const QRectF& rect, std::vector<K>& keys) const {
+        for (size_t i = 0; i < node->entries.size(); i++) {
+            if (intersects(node->entries[i].bounds, rect)) {
+                keys.push_back(node->entries[i].key);
+            }
+        }
+        if (!node->leaf()) {
+            for (int i = 0; i < 4; i++) {
+                const Node* c = node->children[i].get();
+                if (intersects(c->square, rect)) {
+                    if (contains(rect, c->square)) {
+                        collect(c, keys); // fully visible, skip the tests
+                    } else {
+                        query(c, rect, keys);
+                    }
+                }
+            }
+        }
+    }
+
+    void collect(const Node* node, std::vector<K>& keys) const {
+        for (size_t i = 0; i < node->entries.size(); i++) {
+            keys.push_back(node->entries[i].key);
+        }
+        if (!node->leaf()) {
+            for (int i = 0; i < 4; i++) {
+                collect(node->children[i].get(), keys);
+            }
+        }
+    }
+
+    size_t m_capacity;
+    int m_max_depth;
+    std::unique_ptr<Node> m_root;
+    NodeMap m_nodes;
+};
+
+#endif
@@ -0,0 +1,129 @@
+#include "RetryPolicy.h"
+#include <QDateTime>
+#include <QLocale>
+#include <algorithm>
+
+const int RetryPolicy::Threshold;
+const qint64 RetryPolicy::RetryDelay;
+const qint64 RetryPolicy::MaxRetryDelay;
+
+RetryPolicy::RetryPolicy()
+    : m_random(std::random_device()())
+{
+    m_clock.start();
+}
+
+RetryPolicy::Failure RetryPolicy::classify(int status)
+{
+    if (status == 0 || status == 429 || status >= 500) {
+        return HostFailure;
+    }
+    return TileFailure;
+}
+
+qint64 RetryPolicy::retryAfter(const QByteArray& value)
+{
+    if (value.isEmpty()) {
+        return 0;
+    }
+    bool ok = false;
+    qint64 seconds = value.toLongLong(&ok);
+    if (ok) {
+        return std::max(qint64(0), seconds * 1000);
+    }
+    QDateTime date = QLocale::c().toDateTime(QString::fromLatin1(value), 
+        "ddd, dd MMM yyyy hh:mm:ss 'GMT'");
+    if (!date.isValid()) {
+        return 0;
+    }
+    date.setTimeSpec(Qt::UTC);
+    return std::max(qint64(0), QDateTime::currentDateTimeUtc().msecsTo(date));
+}
+
+qint64 RetryPolicy::backoff(int failures)
+{
+    qint64 delay = std::min(RetryDelay << std::min(failures - 1, 16), MaxRetryDelay);
+    // "equal jitter": keep half the delay and randomize the other half,
+    // so tiles and viewers that failed together don't retry together
+    std::uniform_int_distribution<qint64> jitter(0, delay / 2);
+    return delay - delay / 2 + jitter(m_random);
+}
+
+qint64 RetryPolicy::retryAt(const TileIndex& tile, const QString& host) const
+{
+    qint64 time = now();
+    qint64 at = time;
+    std::map<TileIndex, TileState>::const_iterator t = m_tiles.find(tile);
+    if (t != m_tiles.end()) {
+        at = std::max(at, t->second.retry_at);
+    }
+    std::map<QString, HostState>::const_iterator h = m_hosts.find(host);
+    if (h != m_hosts.end() && h->second.tripped) {
+        if (time < h->second.open_until) {
+            at = std::max(at, h->second.open_until);
+        } else if (h->second.probing) {
+            // half open with the probe in flight, check back later
+            at = std::max(at, time + RetryDelay);
+        }
+    }
+    return at;
+}
+
+void RetryPolicy::started(const QString& host)
+{
+    std::map<QString, HostState>::iterator h = m_hosts.find(host);
+    if (h != m_hosts.end() && h->second.tripped && now() >= h->second.open_until) {
+        h->second.probing = true;
+    }
+}
+
+void RetryPolicy::succeeded(const TileIndex& tile, const QString& host)
+{
+    m_tiles.erase(tile);
+    // any response closes the circuit
+    m_hosts.erase(host);
+}
+
+void RetryPolicy::failed(const TileIndex& tile, const QString& host, Failure failure,
+    qint64 retry_after)
+{
+    TileState& state = m_tiles[tile];
+    state.attempts++;
+    state.retry_at = now() + std::max(backoff(state.attempts), retry_after);
+
+    if (failure == PoolExhausted) {
+        // only the tile waits, an open circuit stays open
+        cancelled(host);
+        return;
+    }
+    if (failure == TileFailure) {
+        // the server answered, so the host itself is fine
+        m_hosts.erase(host);
+        return;
+    }
+    HostState& h = m_hosts[host];
+    h.failures++;
+    h.probing = false;
+    if (retry_after > 0 || h.failures >= Threshold || h.tripped) {
+        // Retry-After is honored as is, otherwise the open period grows
+        // with each failure past the threshold (including failed probes)
+        qint64 delay = retry_after > 0 ? retry_after : 
+            backoff(std::max(1, h.failures - Threshold + 1));
+        h.tripped = true;
+        h.open_until = std::max(h.open_until, now() + delay);
+    }
+}
+
+void RetryPolicy::cancelled(const QString& host)
+{
+    std::map<QString, HostState>::iterator h = m_hosts.find(host);
+    if (h != m_hosts.end()) {
+        h->second.probing = false;
+    }
+}
+
+bool RetryPolicy::healthy(const QString& host) const
+{
+    std::map<QString, HostState>::const_iterator h = m_hosts.find(host);
+    return h == m_hosts.end() || !h->second.tripped;
+}
@@ -0,0 +1,88 @@
+#ifndef __RETRY_POLICY_H_
+#define __RETRY_POLICY_H_
+
+#include "TileTypes.h"
+#include <QElapsedTimer>
+#include <QString>
+#include <QByteArray>
+#include <map>
+#include <random>
+
+// Retry bookkeeping for the TileFetcher. Every failed tile gets a jittered
+// exponential backoff before it may be fetched again. Failures that point
+// at the server rather than the tile (throttling, 5xx, connection errors)
+// also count against the host, and after Threshold of them in a row the
+// host circuit opens: no tile is fetched from it until the host backoff
+// (or the server's Retry-After) has passed. The circuit is then half open
+// and lets a single probe request through, which closes it on success or
+// reopens it with a longer delay on failure. Times are in milliseconds on
+// the policy clock. Like the fetcher maps, this class is NOT thread safe.
+class RetryPolicy {
+public:
+    enum Failure {
+        TileFailure,  // the tile itself is bad (404, undecodable data)
+        HostFailure,  // the server is unhealthy or unreachable
+        PoolExhausted // no room for the tile here, says nothing about the server
+    };
+
+    // consecutive host failures that open the circuit
+    static const int Threshold = 5;
+    // backoff after the first failure, doubled for each further failure
+    // up to the maximum, before jitter
+    static const qint64 RetryDelay = 1000;
+    static const qint64 MaxRetryDelay = 300000;
+
+    RetryPolicy();
+
+    // Throttling (429), server errors and requests that never got an HTTP
+    // response ('status' 0) count against the host, anything else (and 
+    // payloads that failed to decode, -1) is the tile
+    static Failure classify(int status);
+    // Retry-After delay in milliseconds of a header 'value', or 0 if the
+    // header is missing. The header holds either seconds or an HTTP date.
+    static qint64 retryAfter(const QByteArray& value);
+
+    qint64 now() const {
+        return m_clock.elapsed();
+    }
+    // returns the earliest time 'tile' may be fetched from 'host', which
+    // is now() if it may be fetched right away
+    qint64 retryAt(const TileIndex& tile, const QString& host) const;
+    // must be called for every request sent after retryAt() allowed it,
+    // so a half open circuit only lets one probe through
+    void started(const QString& host);
+
+    void succeeded(const TileIndex& tile, const QString& host);
+    // 'retry_after' is the server Retry-After delay, or 0 if not given
+    void failed(const TileIndex& tile, const QString& host, Failure failure,
+        qint64 retry_after);
+    // a request was aborted, which says nothing about the host
+    void cancelled(const QString& host);
+
+    // false while the host circuit is open or half open
+    bool healthy(const QString& host) const;
+
+private:
+    struct TileState {
+        TileState(): attempts(0), retry_at(0) {}
+        int attempts;    // consecutive failures
+        qint64 retry_at; // earliest fetch time
+    };
+    struct HostState {
+        HostState(): failures(0), tripped(false), probing(false), open_until(0) {}
+        int failures;      // consecutive host failures
+        bool tripped;      // circuit is open (or half open once open_until passes)
+        bool probing;      // the half open probe request is in flight
+        qint64 open_until; // end of the open period
+    };
+
+    // jittered exponential backoff for the n-th failure
+    qint64 backoff(int failures);
+
+    QElapsedTimer m_clock;
+    std::mt19937 m_random;
+    std::map<TileIndex, TileState> m_tiles;
+    std::map<QString, HostState> m_hosts;
+};
+
+#endif
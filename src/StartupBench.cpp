@@ -0,0 +1,48 @@
+#include "StartupBench.h"
+#include <cstdio>
+
+StartupBench::StartupBench(const QElapsedTimer& process, int windows, QObject *parent)
+    : QObject(parent),
+    m_process(process),
+    m_windows(windows),
+    m_warmed(-1)
+{
+    m_timer.setSingleShot(true);
+    connect(&m_timer, SIGNAL(timeout()), this, SLOT(stop()));
+}
+
+void StartupBench::start()
+{
+    m_timer.start(Timeout);
+}
+
+void StartupBench::warmed()
+{
+    m_warmed = m_process.elapsed();
+}
+
+void StartupBench::firstFullFrame()
+{
+    m_full.push_back(m_process.elapsed());
+    if (int(m_full.size()) == m_windows) {
+        stop();
+    }
+}
+
+void StartupBench::stop()
+{
+    m_timer.stop();
+    if (m_warmed >= 0) {
+        printf("Warm load done after %lld ms\n", m_warmed);
+    }
+    for (size_t i = 0; i < m_full.size(); i++) {
+        printf("Full frame %u after %lld ms\n", unsigned(i + 1), m_full[i]);
+    }
+    if (int(m_full.size()) < m_windows) {
+        printf("%d of %d windows never drew a full frame\n", 
+            m_windows - int(m_full.size()), m_windows);
+    } else {
+        printf("Startup took %lld ms\n", m_full.back());
+    }
+    emit finished();
+}
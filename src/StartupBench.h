@@ -0,0 +1,47 @@
+#ifndef __STARTUP_BENCH_H_
+#define __STARTUP_BENCH_H_
+
+#include <QObject>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <vector>
+
+// Startup benchmark of the real viewer startup path (--startup-bench).
+// The windows are connected to firstFullFrame(), and once every window
+// drew a frame without missing tiles the times since the process started
+// are printed and finished() is emitted. Compare a warm start with a run
+// with --no-restore. This object lives in the GUI thread.
+class StartupBench : public QObject
+{
+    Q_OBJECT
+public:
+    // 'process' was started first thing in main()
+    StartupBench(const QElapsedTimer& process, int windows, QObject *parent = 0);
+
+    // marks the end of the warm load of the last session tiles
+    void warmed();
+    // waits for the windows, which are shown next
+    void start();
+
+signals:
+    void finished();
+
+public slots:
+    // a window drew its first full frame
+    void firstFullFrame();
+
+private slots:
+    void stop();
+
+private:
+    // give up on windows that never get their tiles
+    enum { Timeout = 60000 };
+
+    const QElapsedTimer &m_process;
+    std::vector<qint64> m_full; // ms to each window's first full frame
+    int m_windows;
+    qint64 m_warmed;            // ms to the end of the warm load, -1 if none
+    QTimer m_timer;
+};
+
+#endif
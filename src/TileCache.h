@@ -5,23 +5,29 @@
 #include <map>
 #include <memory>
 #include <functional>
+#include <algorithm>
 #include <cassert>
 #include "TileTypes.h"
 
 // General LRU cache implementation. Note that on insertion, if the key
 // is present this cache will evict the value and overwrite the slot. This 
 // cache is NOT thread safe - it is designed to only be accessed from the 
-// TileRenderer event/context thread, so no need for locks.
+// TileRenderer event/context thread, so no need for locks. With a cost 
+// function the capacity is a budget of summed value costs (e.g. bytes)
+// rather than a number of values.
 template <typename K, typename V> 
 class LRUCache { 
     typedef std::list<K> KeyList;
     typedef std::map<K, std::pair<V, typename KeyList::iterator>> KeyMap;
     typedef std::function<void (V value)> Callback;
+    typedef std::function<size_t (const V& value)> Cost;
 
 public:
-    LRUCache(size_t size, Callback evict)
+    LRUCache(size_t size, Callback evict, Cost cost = Cost())
         : m_size(size), 
-        m_evict(evict) 
+        m_used(0),
+        m_evict(evict),
+        m_cost(cost)
     {
     }
 
@@ -41,34 +47,64 @@ public:
     void insert(const K& key, const V& value) {
         typename KeyMap::iterator ret = m_map.find(key);
         if (ret == m_map.end()) {
-            if (m_list.size() == m_size) {
-                const typename KeyMap::iterator it = m_map.find(m_list.front()); 
-                m_evict(it->second.first);
-                m_map.erase(it);
-                m_list.pop_front(); 
+            // evict the least recently used values until the new one fits
+            size_t cost = costOf(value);
+            while (!m_list.empty() && m_used + cost > m_size) {
+                evictFront();
             }
             typename KeyList::iterator it = m_list.insert(m_list.end(), key);
             m_map.insert(std::make_pair(key, std::make_pair(value, it)));
+            m_used += cost;
         } else {
             // evict existing key/value pairs and overwrite
             m_evict(ret->second.first);
+            m_used -= costOf(ret->second.first);
             ret->second.first = value;
+            m_used += costOf(value);
             // update the LRU poliy tracking
             m_list.splice(m_list.end(), m_list, ret->second.second);
         }
     }
+    // evicts every key/value pair in LRU order
+    void clear() {
+        while (!m_list.empty()) {
+            evictFront();
+        }
+    }
     size_t size() const {
         return m_map.size();
     }
+    // summed cost of the cached values, the same as size() without a
+    // cost function
+    size_t used() const {
+        return m_used;
+    }
+    // raises the capacity to at least 'size', it never shrinks
+    void reserve(size_t size) {
+        m_size = std::max(m_size, size);
+    }
 
 private:
+    size_t costOf(const V& value) const {
+        return m_cost ? m_cost(value) : 1;
+    }
+    void evictFront() {
+        const typename KeyMap::iterator it = m_map.find(m_list.front());
+        m_evict(it->second.first);
+        m_used -= costOf(it->second.first);
+        m_map.erase(it);
+        m_list.pop_front();
+    }
+
     size_t m_size;
+    size_t m_used;
     KeyList m_list;
     KeyMap m_map;
     Callback m_evict;
+    Cost m_cost;
 };
 
-// The tile cache maps tile indices to tile images
-typedef LRUCache<TileIndex, TileImage*> TileCache;
+// The tile cache maps tile indices to tile image handles
+typedef LRUCache<TileIndex, TileHandle> TileCache;
 
 #endif
\ No newline at end of file
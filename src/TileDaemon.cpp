@@ -0,0 +1,297 @@
+#include "TileDaemon.h"
+#include <QCoreApplication>
+#include <QNetworkDiskCache>
+#include <QNetworkRequest>
+#include <QRunnable>
+#include <QDebug>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <new>
+
+const QEvent::Type TileDaemon::DecodedEvent::type = (QEvent::Type)QEvent::registerEventType();
+
+// Worker pool task that decodes a tile payload into RGBA8888 pixels, the
+// layout the viewers upload. The format is detected from the payload.
+class TileDaemon::DecodeTask : public QRunnable {
+public:
+    DecodeTask(TileDaemon* daemon, const QByteArray& url, const QByteArray& data)
+        : m_daemon(daemon), m_url(url), m_data(data) {}
+
+    void run() {
+        QImage image;
+        image.loadFromData(m_data);
+        if (!image.isNull()) {
+            image = image.convertToFormat(QImage::Format_RGBA8888);
+        }
+        QCoreApplication::postEvent(m_daemon, new DecodedEvent(m_url, image));
+    }
+
+private:
+    TileDaemon *m_daemon;
+    QByteArray m_url;
+    QByteArray m_data;
+};
+
+TileDaemon::TileDaemon(const Config& config, QObject *parent)
+    : QObject(parent),
+    m_config(config),
+    m_server(new QLocalServer(this)),
+    m_network(new QNetworkAccessManager(this)),
+    m_next(0)
+{
+    QNetworkDiskCache *cache = new QNetworkDiskCache(this);
+    cache->setCacheDirectory(config.disk_cache);
+    cache->setMaximumCacheSize(config.disk_cache_size);
+    m_network->setCache(cache);
+
+    connect(m_server, SIGNAL(newConnection()), this, SLOT(newConnection()));
+    connect(m_network, SIGNAL(finished(QNetworkReply*)),
+        this, SLOT(loadTile(QNetworkReply*)));
+}
+
+TileDaemon::~TileDaemon()
+{
+    m_decoders.waitForDone();
+}
+
+bool TileDaemon::start()
+{
+    // Another daemon serving the name keeps it, a name left behind by a
+    // daemon that crashed is taken over
+    QLocalSocket probe;
+    probe.connectToServer(m_config.name);
+    if (probe.waitForConnected(500)) {
+        qCritical() << "A tile daemon already serves" << m_config.name;
+        return false;
+    }
+    QLocalServer::removeServer(m_config.name);
+
+    // QSharedMemory sizes are ints, a larger ring is refused rather than
+    // truncated (the estimate is in doubles so it can't overflow itself)
+    double estimate = double(m_config.ring_slots) * 
+        (sizeof(TileProxy::SlotHeader) + 4. * m_config.max_tile_size * m_config.max_tile_size);
+    if (estimate + sizeof(TileProxy::RingHeader) > double(INT_MAX)) {
+        qCritical() << "Tile ring of" << m_config.ring_slots << "slots of" 
+            << m_config.max_tile_size << "pixels exceeds 2 GB, lower --slots or --max-tile-size";
+        return false;
+    }
+    size_t slot_bytes = size_t(m_config.max_tile_size) * size_t(m_config.max_tile_size) * 4;
+    size_t size = TileProxy::Ring::size(m_config.ring_slots, slot_bytes);
+    m_memory.setKey(m_config.name + "-ring");
+    if (!m_memory.create(int(size)) && m_memory.error() == QSharedMemory::AlreadyExists) {
+        // the segment of a crashed daemon goes away with its last detach
+        m_memory.attach();
+        m_memory.detach();
+        m_memory.create(int(size));
+    }
+    if (!m_memory.isAttached()) {
+        qCritical() << "Tile ring shared memory error:" << m_memory.errorString();
+        return false;
+    }
+
+    // Sequences start even, slots are unused until their first write
+    uchar *data = static_cast<uchar*>(m_memory.data());
+    TileProxy::RingHeader *header = reinterpret_cast<TileProxy::RingHeader*>(data);
+    header->magic = TileProxy::Magic;
+    header->version = TileProxy::Version;
+    header->slot_count = quint32(m_config.ring_slots);
+    header->slot_bytes = quint32(slot_bytes);
+    m_ring.attach(data);
+    for (int i = 0; i < m_config.ring_slots; i++) {
+        TileProxy::SlotHeader *slot = new (m_ring.slot(i)) TileProxy::SlotHeader;
+        slot->sequence.store(0);
+        slot->width = slot->height = 0;
+    }
+    m_slot_urls.assign(size_t(m_config.ring_slots), QByteArray());
+
+    if (!m_server->listen(m_config.name)) {
+        qCritical() << "Tile daemon listen error:" << m_server->errorString();
+        return false;
+    }
+    return true;
+}
+
+void TileDaemon::newConnection()
+{
+    while (QLocalSocket *client = m_server->nextPendingConnection()) {
+        connect(client, SIGNAL(readyRead()), this, SLOT(readClient()));
+        connect(client, SIGNAL(disconnected()), this, SLOT(clientGone()));
+        send(client, "HELLO " + m_memory.key().toUtf8());
+    }
+}
+
+void TileDaemon::readClient()
+{
+    QLocalSocket *client = qobject_cast<QLocalSocket*>(sender());
+    while (client->canReadLine()) {
+        QList<QByteArray> fields = client->readLine().trimmed().split(' ');
+        if (fields.size() == 3 && fields[0] == "GET") {
+            get(client, fields[1], fields[2]);
+        } else if (fields.size() == 2 && fields[0] == "CANCEL") {
+            cancel(client, fields[1]);
+        } else {
+            qWarning() << "Tile daemon: invalid request" << fields.join(' ');
+        }
+    }
+}
+
+void TileDaemon::clientGone()
+{
+    // Drop the requests of the viewer, downloads nobody else waits for
+    // are aborted
+    QLocalSocket *client = qobject_cast<QLocalSocket*>(sender());
+    std::vector<QNetworkReply*> aborts;
+    for (std::map<QByteArray, InFlight>::iterator it = m_inflight.begin();
+        it != m_inflight.end(); it++) {
+        std::vector<Request>& requests = it->second.requests;
+        requests.erase(std::remove_if(requests.begin(), requests.end(),
+            [client](const Request& r) { return r.client == client; }), requests.end());
+        if (requests.empty() && it->second.reply) {
+            aborts.push_back(it->second.reply);
+        }
+    }
+    // aborting emits finished(), so only do it once the loop is done
+    for (size_t i = 0; i < aborts.size(); i++) {
+        aborts[i]->abort();
+    }
+    client->deleteLater();
+}
+
+void TileDaemon::get(QLocalSocket* client, const QByteArray& id, const QByteArray& url)
+{
+    // A tile still in the ring is answered right away
+    std::map<QByteArray, Resident>::const_iterator resident = m_resident.find(url);
+    if (resident != m_resident.end()) {
+        send(client, "TILE " + id + " " + QByteArray::number(resident->second.slot) +
+            " " + QByteArray::number(resident->second.sequence));
+        return;
+    }
+    Request request = {client, id};
+    std::pair<std::map<QByteArray, InFlight>::iterator, bool> it =
+        m_inflight.insert(std::make_pair(url, InFlight()));
+    it.first->second.requests.push_back(request);
+    if (!it.second) {
+        return; // already downloading or decoding
+    }
+
+    QNetworkRequest download(QUrl::fromEncoded(url));
+    // many map servers require a valid User-Agent header
+    download.setRawHeader("User-Agent", "qtmapviewer");
+    download.setAttribute(QNetworkRequest::CacheLoadControlAttribute,
+        QNetworkRequest::PreferCache);
+    QNetworkReply *reply = m_network->get(download);
+    reply->setProperty("url", url);
+    it.first->second.reply = reply;
+}
+
+void TileDaemon::cancel(QLocalSocket* client, const QByteArray& id)
+{
+    for (std::map<QByteArray, InFlight>::iterator it = m_inflight.begin();
+        it != m_inflight.end(); it++) {
+        std::vector<Request>& requests = it->second.requests;
+        for (size_t i = 0; i < requests.size(); i++) {
+            if (requests[i].client != client || requests[i].id != id) {
+                continue;
+            }
+            requests.erase(requests.begin() + i);
+            send(client, "CANCELLED " + id);
+            // a decode that lost its requests still fills the ring
+            if (requests.empty() && it->second.reply) {
+                it->second.reply->abort();
+            }
+            return;
+        }
+    }
+    // answered before the cancel arrived, the viewer handles that answer
+}
+
+void TileDaemon::loadTile(QNetworkReply* reply)
+{
+    reply->deleteLater();
+    QByteArray url = reply->property("url").toByteArray();
+    std::map<QByteArray, InFlight>::iterator it = m_inflight.find(url);
+    if (it == m_inflight.end()) {
+        return;
+    }
+    it->second.reply = NULL;
+    if (reply->error() != QNetworkReply::NoError) {
+        if (reply->error() != QNetworkReply::OperationCanceledError) {
+            qWarning() << "Network error for request:" << reply->url() << reply->error();
+        }
+        // the viewers apply their own retry policy to the status
+        int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+        QByteArray retry_after = reply->rawHeader("Retry-After").trimmed();
+        answer(url, "FAIL", " " + QByteArray::number(status) +
+            (retry_after.isEmpty() ? QByteArray() : " " + retry_after));
+        return;
+    }
+    QByteArray payload = reply->readAll();
+    if (!reply->attribute(QNetworkRequest::SourceIsFromCacheAttribute).toBool()) {
+        it->second.bytes = payload.size();
+    }
+    m_decoders.start(new DecodeTask(this, url, payload));
+}
+
+void TileDaemon::customEvent(QEvent *event)
+{
+    if (event->type() == DecodedEvent::type) {
+        DecodedEvent *e = static_cast<DecodedEvent*>(event);
+        int max_size = m_config.max_tile_size;
+        if (e->image.isNull() || e->image.width() > max_size || e->image.height() > max_size) {
+            qWarning() << "Tile decode error for request:" << e->url;
+            // a bad payload fails like a missing tile, not like the host
+            answer(e->url, "FAIL", " 200");
+        } else {
+            store(e->url, e->image);
+        }
+    } else {
+        QObject::customEvent(event);
+    }
+}
+
+void TileDaemon::store(const QByteArray& url, const QImage& image)
+{
+    int slot = m_next;
+    m_next = (m_next + 1) % m_ring.slotCount();
+    if (!m_slot_urls[size_t(slot)].isEmpty()) {
+        m_resident.erase(m_slot_urls[size_t(slot)]);
+    }
+
+    // Seqlock write: viewers reading the slot meanwhile see a changed
+    // sequence and request the tile again
+    TileProxy::SlotHeader *header = m_ring.slot(slot);
+    quint32 sequence = header->sequence.load(std::memory_order_relaxed) + 2;
+    header->sequence.store(sequence - 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    header->width = quint32(image.width());
+    header->height = quint32(image.height());
+    memcpy(m_ring.pixels(slot), image.constBits(), size_t(image.width()) * image.height() * 4);
+    header->sequence.store(sequence, std::memory_order_release);
+
+    m_slot_urls[size_t(slot)] = url;
+    Resident resident = {slot, sequence};
+    m_resident[url] = resident;
+    std::map<QByteArray, InFlight>::const_iterator it = m_inflight.find(url);
+    qint64 bytes = it != m_inflight.end() ? it->second.bytes : 0;
+    answer(url, "TILE", " " + QByteArray::number(slot) + " " + QByteArray::number(sequence) +
+        (bytes > 0 ? " " + QByteArray::number(bytes) : QByteArray()));
+}
+
+void TileDaemon::answer(const QByteArray& url, const QByteArray& verb, const QByteArray& suffix)
+{
+    std::map<QByteArray, InFlight>::iterator it = m_inflight.find(url);
+    if (it == m_inflight.end()) {
+        return;
+    }
+    const std::vector<Request>& requests = it->second.requests;
+    for (size_t i = 0; i < requests.size(); i++) {
+        send(requests[i].client, verb + " " + requests[i].id + suffix);
+    }
+    m_inflight.erase(it);
+}
+
+void TileDaemon::send(QLocalSocket* client, const QByteArray& line)
+{
+    client->write(line + "\n");
+}
@@ -0,0 +1,102 @@
+#ifndef __TILE_DAEMON_H_
+#define __TILE_DAEMON_H_
+
+#include "TileProxy.h"
+#include <QObject>
+#include <QEvent>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QSharedMemory>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QThreadPool>
+#include <map>
+#include <vector>
+
+// Tile proxy daemon shared by the viewer processes of a host (the
+// qtmapviewer-tiled target). Viewers connect on a QLocalServer and request
+// tiles by URL, see TileProxy.h. Each URL is downloaded once through a disk
+// cache and decoded once on a worker pool, whatever the number of viewers
+// waiting for it, and the pixels go into a shared memory ring that every
+// viewer uploads from. Tiles still in the ring are answered right away.
+class TileDaemon : public QObject
+{
+    Q_OBJECT
+public:
+    struct Config {
+        QString name;          // local server name
+        int ring_slots;        // ring slots
+        int max_tile_size;     // largest tile a slot holds, in pixels
+        QString disk_cache;    // disk cache directory
+        qint64 disk_cache_size; // disk cache budget in bytes
+    };
+
+    TileDaemon(const Config& config, QObject *parent = 0);
+    ~TileDaemon();
+
+    // creates the ring and starts listening, returns false if another
+    // daemon already serves the name or the ring can't be created
+    bool start();
+
+protected:
+    void customEvent(QEvent *event);
+
+private slots:
+    void newConnection();
+    void readClient();
+    void clientGone();
+    void loadTile(QNetworkReply* reply);
+
+private:
+    // Event posted back by a decode task, the image is null if the
+    // payload failed to decode
+    class DecodedEvent : public QEvent {
+    public:
+        DecodedEvent(const QByteArray& url, const QImage& image)
+            : QEvent(type), url(url), image(image) {}
+        static const QEvent::Type type;
+
+        QByteArray url;
+        QImage image;
+    };
+    class DecodeTask;
+
+    // a viewer request waiting for a tile
+    struct Request {
+        QLocalSocket *client;
+        QByteArray id;
+    };
+    // a download (or decode, with a NULL reply) and its requests
+    struct InFlight {
+        InFlight(): reply(NULL), bytes(0) {}
+        QNetworkReply *reply;
+        qint64 bytes; // downloaded payload size, 0 for a disk cache hit
+        std::vector<Request> requests;
+    };
+    // the ring slot and sequence a URL was last stored with
+    struct Resident {
+        int slot;
+        quint32 sequence;
+    };
+
+    void get(QLocalSocket* client, const QByteArray& id, const QByteArray& url);
+    void cancel(QLocalSocket* client, const QByteArray& id);
+    // writes a decoded tile into the next ring slot and answers its requests
+    void store(const QByteArray& url, const QImage& image);
+    // answers every request of 'url' with 'line' followed by its suffix
+    void answer(const QByteArray& url, const QByteArray& verb, const QByteArray& suffix);
+    static void send(QLocalSocket* client, const QByteArray& line);
+
+    Config m_config;
+    QLocalServer *m_server;
+    QNetworkAccessManager *m_network;
+    QSharedMemory m_memory;
+    TileProxy::Ring m_ring;
+    std::vector<QByteArray> m_slot_urls;      // URL stored in each slot
+    int m_next;                               // next slot to overwrite
+    std::map<QByteArray, InFlight> m_inflight; // by tile URL
+    std::map<QByteArray, Resident> m_resident; // tiles in the ring
+    QThreadPool m_decoders;
+};
+
+#endif
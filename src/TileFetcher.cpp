@@ -1,44 +1,490 @@
 #include "TileFetcher.h"
+#include "TileTracer.h"
 #include <QtCore/QCoreApplication>
 #include <QtGui/QOpenGLContext>
 #include <iostream>
 #include <QNetworkReply>
+#include <QRunnable>
+#include <QLocalSocket>
+#include <QStandardPaths>
+#include <QElapsedTimer>
+#include <algorithm>
 #include <cassert>
 
-TileFetcher::TileFetcher(const MapConfig& config, const TileRenderer& renderer)
-    : GLWorker(renderer), 
-    m_network(new QNetworkAccessManager(this)),
+// Register the vector tile, partial tile and response events with Qt
+const QEvent::Type TileFetcher::VectorTileEvent::type = (QEvent::Type)QEvent::registerEventType();
+const QEvent::Type TileFetcher::PartialTileEvent::type = (QEvent::Type)QEvent::registerEventType();
+const QEvent::Type TileFetcher::ResponseFlush::type = (QEvent::Type)QEvent::registerEventType();
+
+// Worker pool task that decodes the prefix of a raster payload that is
+// still downloading. Image formats that tolerate truncation (baseline and
+// progressive JPEG) decode to a partial image, others to a null image.
+class TileFetcher::PartialDecodeTask : public QRunnable {
+public:
+    PartialDecodeTask(TileFetcher* fetcher, const TileIndex& index, 
+        const QByteArray& data, const QString& format)
+        : m_fetcher(fetcher), m_index(index), m_data(data), m_format(format) {}
+
+    void run() {
+        QImage image;
+        image.loadFromData(m_data, m_format.toLocal8Bit().data());
+        if (!image.isNull()) {
+            image = image.convertToFormat(QImage::Format_RGBA8888);
+        }
+        QCoreApplication::postEvent(m_fetcher, new PartialTileEvent(m_index, image));
+    }
+
+private:
+    TileFetcher *m_fetcher;
+    TileIndex m_index;
+    QByteArray m_data;
+    QString m_format;
+};
+
+// Worker pool task that decodes and tessellates a vector tile payload
+// off the fetcher thread. The result is posted back to the fetcher as a
+// VectorTileEvent for buffer upload.
+class TileFetcher::VectorDecodeTask : public QRunnable {
+public:
+    VectorDecodeTask(TileFetcher* fetcher, const TileIndex& index, 
+        const QByteArray& data, int tile_size)
+        : m_fetcher(fetcher), m_index(index), 
+        m_data(data), m_tile_size(tile_size) {}
+
+    void run() {
+        TileTracer::begin(TileTracer::Decode, m_index);
+        VectorMesh *mesh = new VectorMesh;
+        VectorTileDecoder decoder(m_tile_size);
+        if (!decoder.decode(m_data, *mesh)) {
+            qCritical() << "Vector tile decode error for tile:" << m_index.string();
+            delete mesh;
+            mesh = NULL;
+        }
+        TileTracer::end(TileTracer::Decode, m_index);
+        QCoreApplication::postEvent(m_fetcher, new VectorTileEvent(m_index, mesh));
+    }
+
+private:
+    TileFetcher *m_fetcher;
+    TileIndex m_index;
+    QByteArray m_data;
+    int m_tile_size;
+};
+
+// Worker pool task that decodes a disk cached tile payload into 'tile',
+// which stays empty if the payload doesn't decode to a tile
+class TileFetcher::WarmDecodeTask : public QRunnable {
+public:
+    WarmDecodeTask(const QByteArray& data, const QString& format, int tile_size, 
+        bool vector, DecodedTile& tile)
+        : m_data(data), m_format(format), m_tile_size(tile_size), 
+        m_vector(vector), m_tile(tile) {}
+
+    void run() {
+        if (m_vector) {
+            VectorMesh *mesh = new VectorMesh;
+            VectorTileDecoder decoder(m_tile_size);
+            if (decoder.decode(m_data, *mesh)) {
+                m_tile.mesh.reset(mesh);
+            } else {
+                delete mesh;
+            }
+            return;
+        }
+        QImage image;
+        image.loadFromData(m_data, m_format.toLocal8Bit().data());
+        if (image.width() == m_tile_size && image.height() == m_tile_size) {
+            m_tile.image = image.convertToFormat(QImage::Format_RGBA8888);
+        }
+    }
+
+private:
+    QByteArray m_data;
+    QString m_format;
+    int m_tile_size;
+    bool m_vector;
+    DecodedTile& m_tile;
+};
+
+// renderer tile cache budget of all the map layers
+static size_t cacheTiles(const MapConfig& config)
+{
+    size_t tiles = config.cache_size;
+    for (size_t i = 0; i < config.layers.size(); i++) {
+        tiles += config.layers[i].cache_size;
+    }
+    return tiles;
+}
+
+TileFetcher::TileFetcher(const MapConfig& config, QSurface* surface, QOpenGLContext* shared,
+    TraceRecorder* recorder, const Trace::File* replay)
+    : GLWorker(surface, shared), 
+    m_network(replay ? new TraceNetwork(*replay, this) : new QNetworkAccessManager(this)),
+    m_disk_cache(NULL),
+    m_replay(replay != NULL),
+    m_lite(false),
+    m_retry_timer(new QTimer(this)),
+    // one slab holds a full tile cache of every layer for every view, which 
+    // covers the steady state; bursts of in-flight responses add a slab
+    m_pool(cacheTiles(config) * size_t(std::max(1, config.windows))),
+    m_decoded(config.ram_cache_size << 20, [](DecodedTile) {}, &TileFetcher::decodedBytes),
+    m_recorder(recorder),
+    m_daemon(NULL),
+    m_daemon_timer(new QTimer(this)),
+    m_daemon_id(0),
+    // recordings and replays need the payloads, so they always download
+    m_daemon_name(recorder || replay ? QString() : config.tile_daemon),
     m_config(config)
 {
+    // a trace holds the payloads of one format per tile
+    if (recorder || replay) {
+        m_config.lite_format.clear();
+    }
+
     // connect the network manager finished signal to the slot 
     // that creates tile images
     connect(m_network, SIGNAL(finished(QNetworkReply*)), 
         this, SLOT(loadTile(QNetworkReply*)));
+
+    m_retry_timer->setSingleShot(true);
+    connect(m_retry_timer, SIGNAL(timeout()), this, SLOT(retryTiles()));
+    m_daemon_timer->setSingleShot(true);
+    connect(m_daemon_timer, SIGNAL(timeout()), this, SLOT(reconnectDaemon()));
+
+    // Downloads are kept on disk for the next session, the tiles then
+    // load without a round trip to the server
+    if (!replay && m_config.disk_cache_size > 0) {
+        m_disk_cache = new QNetworkDiskCache(this);
+        m_disk_cache->setCacheDirectory(
+            QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/tiles");
+        m_disk_cache->setMaximumCacheSize(m_config.disk_cache_size);
+        m_network->setCache(m_disk_cache);
+    }
+}
+
+void TileFetcher::addClient(QObject* client)
+{
+    m_clients.insert(client);
+    if (m_monitor.congested()) {
+        QMetaObject::invokeMethod(client, "networkCongested", Qt::QueuedConnection,
+            Q_ARG(bool, true));
+    }
+}
+
+void TileFetcher::removeClient(QObject* client)
+{
+    m_clients.erase(client);
+
+    // drop the client from every download, aborting the ones nobody
+    // else is waiting for
+    std::vector<QNetworkReply*> aborts;
+    for (TileInFlightMap::iterator it = m_inflight.begin(); it != m_inflight.end(); it++) {
+        std::vector<QObject*>& clients = it->second.clients;
+        clients.erase(std::remove(clients.begin(), clients.end(), client), clients.end());
+        if (clients.empty() && it->second.reply) {
+            aborts.push_back(it->second.reply);
+        }
+        if (clients.empty() && it->second.daemon_id) {
+            cancelDaemon(it->second.daemon_id);
+        }
+    }
+    // release the references held by responses the client will never see
+    TileResponseMap::iterator it = m_responses.find(client);
+    if (it != m_responses.end()) {
+        for (size_t i = 0; i < it->second.size(); i++) {
+            if (!it->second[i].handle.isNull()) {
+                release(it->second[i].handle);
+            }
+        }
+        m_responses.erase(it);
+    }
+    // aborting emits finished(), so only do it once the loops are done
+    for (size_t i = 0; i < aborts.size(); i++) {
+        aborts[i]->abort();
+    }
+}
+
+void TileFetcher::tileRequests(const TileIndexList& tiles)
+{
+    QObject *client = sender();
+    if (m_clients.find(client) == m_clients.end()) {
+        return; // client was removed while the request was queued
+    }
+    for (size_t i = 0; i < tiles.size(); i++) {
+        tileRequest(client, tiles[i]);
+    }
 }
 
-void TileFetcher::tileRequest(const TileIndex& tile)
+void TileFetcher::tileRequest(QObject* client, const TileIndex& tile)
 {
-    // Create the tile URL as the standard <server>/<zoom>/<x>/<y>.<format>
-    QUrl url(m_config.server +
-             QString::number(tile.zoom()) + QString("/") +
-             QString::number(tile.x()) + QString("/") +
-             QString::number(tile.y()) + QString(".") + m_config.format);
+    TileTracer::mark(TileTracer::Queued, tile);
+    // A tile already resident for another client is shared right away
+    TileImageMap::iterator image = m_images.find(tile);
+    if (image != m_images.end()) {
+        m_pool.get(image->second)->m_refs++;
+        respond(client, tile, image->second);
+        return;
+    }
+    // A tile still decoded in RAM only needs an upload. If the pool is
+    // exhausted the tile backs off and waits below like a failed one.
+    DecodedTile decoded;
+    if (m_inflight.find(tile) == m_inflight.end() && m_decoded.query(tile, decoded)) {
+        TileHandle handle = decoded.mesh ? 
+            createTile(tile, *decoded.mesh) : createTile(tile, decoded.image);
+        if (!handle.isNull()) {
+            m_pool.get(handle)->m_refs = 1;
+            m_images[tile] = handle;
+            respond(client, tile, handle);
+            return;
+        }
+        exhausted(tile);
+    }
+    // A tile already in flight just gains another subscriber
+    std::pair<TileInFlightMap::iterator, bool> it = 
+        m_inflight.insert(std::make_pair(tile, InFlight()));
+    std::vector<QObject*>& clients = it.first->second.clients;
+    if (std::find(clients.begin(), clients.end(), client) == clients.end()) {
+        clients.push_back(client);
+    }
+    if (!it.second) {
+        return;
+    }
+
+    // A tile that failed recently, or whose host circuit is open, waits
+    // for its backoff delay. The client stays subscribed so it doesn't
+    // ask again in the meantime.
+    qint64 retry_at = m_retry.retryAt(tile, m_config.host(tile));
+    if (retry_at > m_retry.now()) {
+        it.first->second.parked = true;
+        scheduleRetry(retry_at);
+        return;
+    }
+    fetch(tile, it.first->second);
+}
+
+QUrl TileFetcher::tileUrl(const TileIndex& tile, bool lite) const
+{
+    // Create the tile URL as the standard <server>/<zoom>/<x>/<y><suffix>.<format>
+    // of the tile layer, where the suffix selects double size (e.g. @2x) tiles 
+    // for HiDPI screens. The {time} of time dimension servers is the tile frame.
+    const Source& source = m_config.source(tile);
+    QString server = source.server;
+    if (source.timed) {
+        server.replace("{time}", m_config.times.value(tile.frame()));
+    }
+    return QUrl(server +
+                QString::number(tile.zoom()) + QString("/") +
+                QString::number(tile.x()) + QString("/") +
+                QString::number(tile.y()) + m_config.suffix + 
+                QString(".") + m_config.format(tile, lite));
+}
+
+void TileFetcher::fetch(const TileIndex& tile, InFlight& inflight)
+{
+    inflight.lite = m_lite;
+    QUrl url = tileUrl(tile, inflight.lite);
+    m_retry.started(m_config.host(tile));
+    inflight.parked = false;
+    TileTracer::begin(TileTracer::Network, tile);
+    if (m_daemon && !m_config.vector) {
+        // The tile daemon downloads and decodes the tile for every viewer
+        // process, the answer comes back in readDaemon()
+        inflight.daemon_id = ++m_daemon_id;
+        inflight.started = m_retry.now();
+        m_daemon_requests[inflight.daemon_id] = tile;
+        m_daemon->write("GET " + QByteArray::number(inflight.daemon_id) + " " + 
+            url.toEncoded() + "\n");
+        updateNetwork();
+        return;
+    }
 
     QNetworkRequest request;
     // many map servers require a valid User-Agent header, so we 
     // just use the application name
     request.setRawHeader("User-Agent", "qtmapviewer");
     request.setUrl(url);
+    // the layer and frame aren't part of the URL, trace recordings need them
+    request.setAttribute(QNetworkRequest::User, tile.layer());
+    request.setAttribute(QNetworkRequest::Attribute(QNetworkRequest::User + 1), tile.frame());
 
     QNetworkReply *reply = m_network->get(request);
-    // connect the cancel requet signal to the reply abort slot so
-    // all outstanding requests will terminate if cancelRequests() fires
-    connect(this, SIGNAL(cancelRequests()), reply, SLOT(abort()));
+    if (!m_config.vector) {
+        // raster payloads are decoded progressively as they arrive
+        connect(reply, SIGNAL(readyRead()), this, SLOT(readTile()));
+    }
+    // the start time gives the download latency, for trace recordings and
+    // the network monitor
+    reply->setProperty("started", m_retry.now());
+    inflight.reply = reply;
 
     // track each reply so we can recover the tile index when the 
     // reply completes the image download
     assert(m_replies.find(reply) == m_replies.end());
     m_replies[reply] = tile;
+    updateNetwork();
+}
+
+void TileFetcher::updateNetwork()
+{
+    // tiles the daemon is fetching for us count as downloads too
+    if (!m_monitor.update(int(m_replies.size() + m_daemon_requests.size()))) {
+        return;
+    }
+    bool congested = m_monitor.congested();
+    m_lite = congested && !m_config.lite_format.isEmpty();
+    qWarning() << (congested ? "Tile downloads are falling behind, reducing quality" :
+        "Tile downloads caught up, restoring quality") 
+        << int(m_monitor.bytesPerSecond() / 1024) << "KB/s" 
+        << int(m_monitor.latency()) << "ms";
+    for (std::set<QObject*>::iterator it = m_clients.begin(); it != m_clients.end(); it++) {
+        QMetaObject::invokeMethod(*it, "networkCongested", Qt::QueuedConnection,
+            Q_ARG(bool, congested));
+    }
+}
+
+void TileFetcher::fail(const TileIndex& tile, QNetworkReply* reply)
+{
+    if (reply && reply->error() != QNetworkReply::NoError) {
+        fail(tile, reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt(),
+            reply->rawHeader("Retry-After").trimmed());
+    } else {
+        fail(tile, -1, QByteArray());
+    }
+}
+
+void TileFetcher::fail(const TileIndex& tile, int status, const QByteArray& retry_after_header)
+{
+    RetryPolicy::Failure failure = RetryPolicy::classify(status);
+    qint64 retry_after = RetryPolicy::retryAfter(retry_after_header);
+    const QString& host = m_config.host(tile);
+    bool healthy = m_retry.healthy(host);
+    m_retry.failed(tile, host, failure, retry_after);
+    if (healthy && !m_retry.healthy(host)) {
+        qWarning() << "Tile server" << host 
+            << "is unhealthy, pausing requests";
+    }
+}
+
+void TileFetcher::exhausted(const TileIndex& tile)
+{
+    m_retry.failed(tile, m_config.host(tile), RetryPolicy::PoolExhausted, 0);
+}
+
+void TileFetcher::scheduleRetry(qint64 retry_at)
+{
+    int delay = int(std::max(qint64(0), retry_at - m_retry.now()));
+    if (!m_retry_timer->isActive() || m_retry_timer->remainingTime() > delay) {
+        m_retry_timer->start(delay);
+    }
+}
+
+void TileFetcher::retryTiles()
+{
+    qint64 now = m_retry.now();
+    qint64 next = -1;
+    TileIndexList uploads;
+    TileInFlightMap::iterator it = m_inflight.begin();
+    while (it != m_inflight.end()) {
+        if (!it->second.parked) {
+            it++;
+            continue;
+        }
+        if (it->second.clients.empty()) {
+            // every subscriber cancelled while it was parked
+            m_inflight.erase(it++);
+            continue;
+        }
+        // once a half open circuit lets the probe through, the
+        // following tiles get a later retry time
+        qint64 retry_at = m_retry.retryAt(it->first, m_config.host(it->first));
+        DecodedTile decoded;
+        if (retry_at <= now && m_decoded.query(it->first, decoded)) {
+            uploads.push_back(it->first);
+        } else if (retry_at <= now) {
+            fetch(it->first, it->second);
+        } else if (next < 0 || retry_at < next) {
+            next = retry_at;
+        }
+        it++;
+    }
+    if (next >= 0) {
+        scheduleRetry(next);
+    }
+    // tiles that backed off because the pool was exhausted only need 
+    // their upload retried, completing them may retry tiles meanwhile
+    for (size_t i = 0; i < uploads.size(); i++) {
+        DecodedTile decoded;
+        if (m_inflight.find(uploads[i]) == m_inflight.end() || 
+            !m_decoded.query(uploads[i], decoded)) {
+            continue;
+        }
+        TileHandle handle = decoded.mesh ? 
+            createTile(uploads[i], *decoded.mesh) : createTile(uploads[i], decoded.image);
+        if (handle.isNull()) {
+            // still no room, the tile stays parked with its clients
+            exhausted(uploads[i]);
+            m_inflight[uploads[i]].parked = true;
+            scheduleRetry(m_retry.retryAt(uploads[i], m_config.host(uploads[i])));
+            continue;
+        }
+        complete(uploads[i], handle);
+    }
+}
+
+void TileFetcher::cancelTiles()
+{
+    // Unsubscribe the cancelling client from all of its downloads. It gets
+    // an invalid response for each so its request map is cleared, and 
+    // downloads without any subscribers left are aborted.
+    QObject *client = sender();
+    std::vector<QNetworkReply*> aborts;
+    for (TileInFlightMap::iterator it = m_inflight.begin(); it != m_inflight.end(); it++) {
+        std::vector<QObject*>& clients = it->second.clients;
+        std::vector<QObject*>::iterator c = std::find(clients.begin(), clients.end(), client);
+        if (c == clients.end()) {
+            continue;
+        }
+        clients.erase(c);
+        respond(client, it->first, TileHandle());
+        if (clients.empty() && it->second.reply) {
+            aborts.push_back(it->second.reply);
+        }
+        if (clients.empty() && it->second.daemon_id) {
+            cancelDaemon(it->second.daemon_id);
+        }
+    }
+    // aborting emits finished(), so only do it once the loop is done
+    for (size_t i = 0; i < aborts.size(); i++) {
+        aborts[i]->abort();
+    }
+}
+
+void TileFetcher::cancelTiles(const TileIndexList& tiles)
+{
+    QObject *client = sender();
+    std::vector<QNetworkReply*> aborts;
+    for (size_t i = 0; i < tiles.size(); i++) {
+        TileInFlightMap::iterator it = m_inflight.find(tiles[i]);
+        if (it == m_inflight.end()) {
+            continue; // answered before the cancel arrived
+        }
+        std::vector<QObject*>& clients = it->second.clients;
+        std::vector<QObject*>::iterator c = std::find(clients.begin(), clients.end(), client);
+        if (c == clients.end()) {
+            continue;
+        }
+        clients.erase(c);
+        if (clients.empty() && it->second.reply) {
+            aborts.push_back(it->second.reply);
+        }
+        if (clients.empty() && it->second.daemon_id) {
+            cancelDaemon(it->second.daemon_id);
+        }
+    }
+    // aborting emits finished(), so only do it once the loop is done
+    for (size_t i = 0; i < aborts.size(); i++) {
+        aborts[i]->abort();
+    }
 }
 
 void TileFetcher::loadTile(QNetworkReply* reply)
@@ -52,48 +498,590 @@ void TileFetcher::loadTile(QNetworkReply* reply)
     assert(it != m_replies.end());
     TileIndex index = it->second;
     m_replies.erase(it);
+    TileTracer::end(TileTracer::Network, index);
 
-    TileImage *tile = NULL;
+    TileInFlightMap::iterator inflight = m_inflight.find(index);
+    assert(inflight != m_inflight.end());
+    inflight->second.reply = NULL;
+
+    // the streamed part of the payload was already read by readTile()
+    QByteArray payload = inflight->second.data + reply->readAll();
+    inflight->second.data.clear();
+
+    // record every finished download, a replay needs it even if all of
+    // its subscribers cancelled
+    qint64 latency = m_retry.now() - reply->property("started").toLongLong();
+    if (m_recorder && reply->error() != QNetworkReply::OperationCanceledError) {
+        m_recorder->recordTile(index, int(latency), int(reply->error()), 
+            reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt(), payload);
+    }
+    // cache hits say nothing about the network
+    if (reply->error() == QNetworkReply::NoError &&
+        !reply->attribute(QNetworkRequest::SourceIsFromCacheAttribute).toBool()) {
+        m_monitor.loaded(m_retry.now(), latency, payload.size());
+    }
+    updateNetwork();
+
+    if (inflight->second.clients.empty()) {
+        // every subscriber cancelled, nothing left to do
+        m_retry.cancelled(m_config.host(index));
+        dropPartial(inflight->second);
+        m_inflight.erase(inflight);
+        return;
+    }
+
+    TileHandle tile; // null unless the tile loads
     if (QNetworkReply::NoError != reply->error()) {
-        tile = new TileImage(index);//tile.valid = false;
         if (reply->error() != QNetworkReply::OperationCanceledError) {
             qCritical() << "Network error for request:" 
                 << reply->request().url() << reply->error();
+            fail(index, reply);
+        } else {
+            m_retry.cancelled(m_config.host(index));
         }
+    } else if (m_config.vector) {
+        // Vector tiles are decoded and tessellated on the worker pool, 
+        // the response is sent once the VectorTileEvent comes back
+        m_decoders.start(new VectorDecodeTask(this, index, payload, m_config.tile_size));
+        return;
     } else {
         QImage image;
         // Load the image directly from the reply payload bytes
-        image.loadFromData(reply->readAll(), m_config.format.toLocal8Bit().data());
-        assert(image.width() == m_config.tile_size);
-        assert(image.height() == m_config.tile_size);
+        TileTracer::begin(TileTracer::Decode, index);
+        image.loadFromData(payload, 
+            m_config.format(index, inflight->second.lite).toLocal8Bit().data());
+        TileTracer::end(TileTracer::Decode, index);
+        if (image.isNull()) {
+            qCritical() << "Image decode error for request:" << reply->request().url();
+            fail(index, NULL);
+        } else {
+            assert(image.width() == m_config.tile_size);
+            assert(image.height() == m_config.tile_size);
+            // convert once here, the texture upload and the RAM tier
+            // both use the GL pixel layout
+            DecodedTile decoded;
+            decoded.image = image.convertToFormat(QImage::Format_RGBA8888);
+            // lite tiles are only drawn until the full tile replaces them,
+            // so they stay out of the RAM tier
+            if (!inflight->second.lite) {
+                m_decoded.insert(index, decoded);
+            }
+            TileHandle partial = inflight->second.partial;
+            if (!partial.isNull()) {
+                // the final pixels go into the partial tile the clients
+                // already draw, which takes over its download reference
+                m_pool.get(partial)->update(decoded.image);
+                m_pool.get(partial)->m_refs--;
+                inflight->second.partial = TileHandle();
+                tile = partial;
+            } else {
+                tile = createTile(index, decoded.image);
+            }
+            if (tile.isNull()) {
+                // the pool is exhausted, the tile backs off and is 
+                // uploaded from the RAM tier when it's requested again
+                exhausted(index);
+            } else {
+                m_pool.get(tile)->m_lite = inflight->second.lite;
+            }
+        }
+    }
+    dropPartial(inflight->second);
+    complete(index, tile);
+}
+
+void TileFetcher::readTile()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    TileReplyMap::const_iterator it = m_replies.find(reply);
+    if (it == m_replies.end() || reply->error() != QNetworkReply::NoError) {
+        return;
+    }
+    TileInFlightMap::iterator inflight = m_inflight.find(it->second);
+    assert(inflight != m_inflight.end());
+    inflight->second.data += reply->readAll();
+    decodePartial(it->second, inflight->second);
+}
+
+void TileFetcher::decodePartial(const TileIndex& index, InFlight& inflight)
+{
+    if (inflight.decoding || !inflight.streamable || inflight.clients.empty() ||
+        inflight.data.size() - inflight.decoded < StreamStep) {
+        return;
+    }
+    inflight.decoding = true;
+    inflight.decoded = inflight.data.size();
+    // the task shares the payload bytes, appending detaches our copy
+    m_decoders.start(new PartialDecodeTask(this, index, inflight.data, 
+        m_config.format(index, inflight.lite)));
+}
+
+void TileFetcher::dropPartial(InFlight& inflight)
+{
+    TileHandle partial = inflight.partial;
+    inflight.partial = TileHandle();
+    if (!partial.isNull() && --m_pool.get(partial)->m_refs == 0) {
+        m_pool.release(partial);
+    }
+}
+
+void TileFetcher::partialTile(const TileIndex& index, const QImage& image)
+{
+    // the download may have finished or failed while decoding
+    TileInFlightMap::iterator it = m_inflight.find(index);
+    if (it == m_inflight.end() || !it->second.reply) {
+        return;
+    }
+    InFlight& inflight = it->second;
+    inflight.decoding = false;
+    if (image.isNull() || image.width() != m_config.tile_size || 
+        image.height() != m_config.tile_size) {
+        // the format can't be decoded from a prefix, wait for all of it
+        inflight.streamable = false;
+        return;
+    }
+    if (inflight.partial.isNull()) {
+        inflight.partial = createTile(index, image);
+        if (inflight.partial.isNull()) {
+            return; // pool exhausted
+        }
+        m_pool.get(inflight.partial)->m_refs = 1;
+        m_pool.get(inflight.partial)->m_lite = inflight.lite;
+    } else {
+        m_pool.get(inflight.partial)->update(image);
+    }
+    // every response hands one reference to the client
+    for (size_t i = 0; i < inflight.clients.size(); i++) {
+        m_pool.get(inflight.partial)->m_refs++;
+        respond(inflight.clients[i], index, inflight.partial, true);
+    }
+    decodePartial(index, inflight);
+}
+
+template <typename T>
+TileHandle TileFetcher::createTile(const TileIndex& index, const T& data)
+{
+    // reuses a released pool record and its GL objects when possible
+    TileHandle handle = m_pool.acquire();
+    if (!handle.isNull()) {
+        TileTracer::begin(TileTracer::Upload, index);
+        m_pool.get(handle)->load(index, data);
+        TileTracer::end(TileTracer::Upload, index);
+    }
+    return handle;
+}
+
+void TileFetcher::complete(const TileIndex& index, const TileHandle& tile)
+{
+    TileInFlightMap::iterator it = m_inflight.find(index);
+    assert(it != m_inflight.end());
+    std::vector<QObject*> clients;
+    clients.swap(it->second.clients);
+    m_inflight.erase(it);
+
+    if (clients.empty()) {
+        // cancelled while decoding, clients may still hold partial
+        // responses of the tile
+        if (!tile.isNull() && m_pool.get(tile)->m_refs == 0) {
+            m_pool.release(tile);
+        }
+        return;
+    }
+    bool recovered = false;
+    if (!tile.isNull()) {
+        recovered = !m_retry.healthy(m_config.host(index));
+        m_retry.succeeded(index, m_config.host(index));
+        // one reference for each client the image is handed to, on top
+        // of those held for partial responses
+        m_pool.get(tile)->m_refs += int(clients.size());
+        // lite tiles aren't shared, a later request fetches the full tile
+        if (!m_pool.get(tile)->lite()) {
+            m_images[index] = tile;
+        }
+    }
+    // queue the tile for each TileRenderer
+    for (size_t i = 0; i < clients.size(); i++) {
+        respond(clients[i], index, tile);
+    }
+    if (recovered) {
+        // the probe closed the host circuit, resume the parked tiles now
+        qWarning() << "Tile server" << m_config.host(index) << "recovered";
+        retryTiles();
+    }
+}
 
-        tile = new TileImage(index, image);
-        m_images[index] = tile;
+void TileFetcher::respond(QObject* client, const TileIndex& index, const TileHandle& tile, 
+    bool partial)
+{
+    if (m_responses.empty()) {
+        QCoreApplication::postEvent(this, new TileFetcher::ResponseFlush());
     }
-    // emit the tile to the TileRenderer
-    emit responseTile(tile);
+    m_responses[client].push_back(TileResponse(index, tile, partial));
 }
 
-void TileFetcher::deleteTile(TileImage* tile)
+void TileFetcher::release(const TileHandle& handle)
 {
-    assert(tile);
-    TileImageMap::iterator it = m_images.find(tile->index());
+    TileImage *tile = m_pool.get(handle);
+    if (!tile) {
+        qCritical() << "Stale tile handle released:" << handle.slot() << handle.generation();
+        return;
+    }
+    assert(tile->m_refs > 0);
+    if (--tile->m_refs == 0) {
+        // first remove the tile image from the image map, partial tiles
+        // whose download failed never made it there
+        TileImageMap::iterator it = m_images.find(tile->index());
+        if (it != m_images.end() && handle == it->second) {
+            m_images.erase(it);
+        }
+        m_pool.release(handle);
+    }
+}
 
-    assert(it != m_images.end());
-    assert(tile == it->second);
-    // first remove the tile image from the image map
-    m_images.erase(it);
-    delete tile;
+void TileFetcher::deleteTiles(const TileHandleList& tiles)
+{
+    // each deletion drops one client reference to the image
+    for (size_t i = 0; i < tiles.size(); i++) {
+        assert(!tiles[i].isNull());
+        release(tiles[i]);
+    }
+}
+
+void TileFetcher::warmTiles(const TileIndexList& tiles)
+{
+    if (m_daemon && !m_config.vector) {
+        warmDaemon(tiles);
+        return;
+    }
+    if (!m_disk_cache) {
+        return;
+    }
+    // Read the cached payloads here and decode them all in parallel, each
+    // task fills its own entry of 'decoded'
+    std::vector<DecodedTile> decoded(tiles.size());
+    for (size_t i = 0; i < tiles.size(); i++) {
+        DecodedTile cached;
+        if (m_decoded.query(tiles[i], cached)) {
+            continue;
+        }
+        QIODevice *data = m_disk_cache->data(tileUrl(tiles[i]));
+        if (!data) {
+            continue;
+        }
+        m_decoders.start(new WarmDecodeTask(data->readAll(), m_config.source(tiles[i]).format,
+            m_config.tile_size, m_config.vector, decoded[i]));
+        delete data;
+    }
+    m_decoders.waitForDone();
+
+    int warm = 0;
+    for (size_t i = 0; i < tiles.size(); i++) {
+        if (!decoded[i].image.isNull() || decoded[i].mesh) {
+            m_decoded.insert(tiles[i], decoded[i]);
+            warm++;
+        }
+    }
+    qDebug() << "Loaded" << warm << "of" << tiles.size() << "session tiles from the disk cache";
+}
+
+void TileFetcher::warmDaemon(const TileIndexList& tiles)
+{
+    // Ask for every tile at once and read the answers here, the views
+    // don't request tiles before the warm load, so every answer is ours.
+    // The daemon answers from its ring or disk cache right away, tiles
+    // still downloading after WarmTimeout are cancelled and fetched later.
+    std::map<quint32, TileIndex> requests;
+    for (size_t i = 0; i < tiles.size(); i++) {
+        DecodedTile cached;
+        if (m_decoded.query(tiles[i], cached)) {
+            continue;
+        }
+        quint32 id = ++m_daemon_id;
+        requests[id] = tiles[i];
+        m_daemon->write("GET " + QByteArray::number(id) + " " + 
+            tileUrl(tiles[i]).toEncoded() + "\n");
+    }
+    QElapsedTimer timer;
+    timer.start();
+    int warm = 0;
+    while (!requests.empty() && m_daemon->state() == QLocalSocket::ConnectedState) {
+        if (!m_daemon->canReadLine()) {
+            int left = WarmTimeout - int(timer.elapsed());
+            if (left <= 0 || !m_daemon->waitForReadyRead(left)) {
+                break;
+            }
+            continue;
+        }
+        QList<QByteArray> fields = m_daemon->readLine().trimmed().split(' ');
+        std::map<quint32, TileIndex>::iterator it = 
+            requests.find(fields.size() > 1 ? fields[1].toUInt() : 0);
+        if (it == requests.end()) {
+            continue;
+        }
+        if (fields[0] == "TILE" && fields.size() >= 4) {
+            // copy the pixels out of the ring before the slot is reused
+            int slot = fields[2].toInt();
+            quint32 sequence = fields[3].toUInt();
+            DecodedTile decoded;
+            decoded.image = m_ring.image(slot, sequence).copy();
+            if (m_ring.holds(slot, sequence) && decoded.image.width() == m_config.tile_size &&
+                decoded.image.height() == m_config.tile_size) {
+                m_decoded.insert(it->second, decoded);
+                warm++;
+            }
+        }
+        requests.erase(it);
+    }
+    // the late answers are ignored by readDaemon()
+    for (std::map<quint32, TileIndex>::iterator it = requests.begin(); it != requests.end(); it++) {
+        cancelDaemon(it->first);
+    }
+    qDebug() << "Loaded" << warm << "of" << tiles.size() << "session tiles from the tile daemon";
+}
+
+void TileFetcher::customEvent(QEvent *event)
+{
+    // Handle decoded vector tiles by uploading the mesh buffers
+    if (event->type() == VectorTileEvent::type) {
+        VectorTileEvent *e = static_cast<VectorTileEvent*>(event);
+        TileHandle tile;
+        if (e->mesh) {
+            // the RAM tier takes over the mesh from the event
+            DecodedTile decoded;
+            decoded.mesh.reset(e->mesh);
+            e->mesh = NULL;
+            m_decoded.insert(e->index, decoded);
+            tile = createTile(e->index, *decoded.mesh);
+            if (tile.isNull()) {
+                exhausted(e->index);
+            }
+        } else {
+            fail(e->index, NULL);
+        }
+        complete(e->index, tile);
+    } else if (event->type() == PartialTileEvent::type) {
+        PartialTileEvent *e = static_cast<PartialTileEvent*>(event);
+        partialTile(e->index, e->image);
+    } else if (event->type() == ResponseFlush::type) {
+        // Send every response queued since the flush was posted, one
+        // queued call per client. The uploads of the batch, which may
+        // rewrite textures the renderers already draw (partial tiles and
+        // reused pool records), are flushed first so their contexts see
+        // the new contents.
+        if (!m_responses.empty()) {
+            glFlush();
+        }
+        for (TileResponseMap::iterator it = m_responses.begin(); it != m_responses.end(); it++) {
+            QMetaObject::invokeMethod(it->first, "tileResponses", Qt::QueuedConnection,
+                Q_ARG(TileResponseList, it->second));
+        }
+        m_responses.clear();
+    } else {
+        QObject::customEvent(event);
+    }
+}
+
+void TileFetcher::setup()
+{
+    if (!m_daemon_name.isEmpty()) {
+        connectDaemon();
+    }
+    if (m_replay) {
+        return;
+    }
+    // Resolve the tile hosts and open connections to them in the
+    // background, so the first tile requests don't wait for either
+    std::set<QString> hosts;
+    for (size_t i = 0; i < m_config.sources.size(); i++) {
+        QUrl url(QString(m_config.sources[i].server).replace("{time}", "0"));
+        if (url.host().isEmpty() || !hosts.insert(url.host()).second) {
+            continue;
+        }
+        QHostInfo::lookupHost(url.host(), this, SLOT(hostResolved(QHostInfo)));
+#ifndef QT_NO_SSL
+        if (url.scheme() == "https") {
+            m_network->connectToHostEncrypted(url.host(), quint16(url.port(443)));
+            continue;
+        }
+#endif
+        m_network->connectToHost(url.host(), quint16(url.port(80)));
+    }
+}
+
+void TileFetcher::hostResolved(const QHostInfo& info)
+{
+    if (info.error() != QHostInfo::NoError) {
+        qWarning() << "Tile server host lookup failed:" << info.hostName() 
+            << info.errorString();
+    }
+}
+
+void TileFetcher::connectDaemon()
+{
+    // The daemon greets with the key of its tile ring, without a daemon
+    // (or with one that doesn't answer) tiles are fetched directly
+    QLocalSocket *daemon = new QLocalSocket(this);
+    daemon->connectToServer(m_daemon_name);
+    QList<QByteArray> hello;
+    if (daemon->waitForConnected(DaemonTimeout) && 
+        (daemon->canReadLine() || daemon->waitForReadyRead(DaemonTimeout))) {
+        hello = daemon->readLine().trimmed().split(' ');
+    }
+    if (hello.size() == 2 && hello[0] == "HELLO") {
+        m_ring_memory.setKey(QString::fromUtf8(hello[1]));
+        if (m_ring_memory.attach(QSharedMemory::ReadOnly) && 
+            m_ring.attach(const_cast<void*>(m_ring_memory.constData()))) {
+            m_daemon = daemon;
+            connect(m_daemon, SIGNAL(readyRead()), this, SLOT(readDaemon()));
+            connect(m_daemon, SIGNAL(disconnected()), this, SLOT(daemonGone()));
+            qDebug() << "Fetching raster tiles through the tile daemon" << m_daemon_name;
+            return;
+        }
+        qWarning() << "Tile daemon ring error:" << m_ring_memory.errorString();
+        m_ring_memory.detach();
+    }
+    delete daemon;
+}
+
+void TileFetcher::reconnectDaemon()
+{
+    connectDaemon();
+    if (!m_daemon) {
+        m_daemon_timer->start(DaemonRetry);
+    }
+}
+
+void TileFetcher::cancelDaemon(quint32 id)
+{
+    m_daemon->write("CANCEL " + QByteArray::number(id) + "\n");
+}
+
+void TileFetcher::readDaemon()
+{
+    while (m_daemon && m_daemon->canReadLine()) {
+        QList<QByteArray> fields = m_daemon->readLine().trimmed().split(' ');
+        if (fields.size() < 2) {
+            continue;
+        }
+        std::map<quint32, TileIndex>::iterator it = m_daemon_requests.find(fields[1].toUInt());
+        if (it == m_daemon_requests.end()) {
+            continue;
+        }
+        TileIndex index = it->second;
+        m_daemon_requests.erase(it);
+        TileTracer::end(TileTracer::Network, index);
+        TileInFlightMap::iterator inflight = m_inflight.find(index);
+        assert(inflight != m_inflight.end());
+        inflight->second.daemon_id = 0;
+        // only answers that took a download say something about the 
+        // network, their GET to TILE round trip is the latency
+        if (fields[0] == "TILE" && fields.size() == 5) {
+            m_monitor.loaded(m_retry.now(), m_retry.now() - inflight->second.started, 
+                fields[4].toLongLong());
+        }
+        updateNetwork();
+
+        if (inflight->second.clients.empty()) {
+            // every subscriber cancelled, nothing left to do
+            m_retry.cancelled(m_config.host(index));
+            m_inflight.erase(inflight);
+        } else if (fields[0] == "CANCELLED") {
+            // a client subscribed again after the cancel went out, so the
+            // tile is requested again
+            m_retry.cancelled(m_config.host(index));
+            fetch(index, inflight->second);
+        } else if (fields[0] == "TILE" && fields.size() >= 4) {
+            daemonTile(index, fields[2].toInt(), fields[3].toUInt());
+        } else {
+            fail(index, fields.size() > 2 ? fields[2].toInt() : 0, 
+                fields.size() > 3 ? fields[3] : QByteArray());
+            complete(index, TileHandle());
+        }
+    }
+}
+
+void TileFetcher::daemonTile(const TileIndex& index, int slot, quint32 sequence)
+{
+    // The texture is uploaded straight from the shared ring. The daemon 
+    // may overwrite the slot meanwhile, then the tile is requested again.
+    QImage image = m_ring.image(slot, sequence);
+    TileHandle tile;
+    if (!image.isNull()) {
+        tile = createTile(index, image);
+    }
+    if (!m_ring.holds(slot, sequence)) {
+        if (!tile.isNull()) {
+            m_pool.release(tile);
+        }
+        TileInFlightMap::iterator inflight = m_inflight.find(index);
+        m_retry.cancelled(m_config.host(index));
+        fetch(index, inflight->second);
+        return;
+    }
+    if (image.isNull()) {
+        fail(index, -1, QByteArray());
+    } else if (tile.isNull()) {
+        exhausted(index);
+    } else {
+        m_pool.get(tile)->m_lite = m_inflight[index].lite;
+    }
+    complete(index, tile);
+}
+
+void TileFetcher::daemonGone()
+{
+    // Fall back to direct downloads, the tiles the daemon still owed are
+    // fetched again
+    qWarning() << "Tile daemon" << m_daemon_name << "disconnected, fetching tiles directly";
+    m_daemon->deleteLater();
+    m_daemon = NULL;
+    m_ring.detach();
+    m_ring_memory.detach();
+    std::map<quint32, TileIndex> requests;
+    requests.swap(m_daemon_requests);
+    for (std::map<quint32, TileIndex>::iterator it = requests.begin(); it != requests.end(); it++) {
+        TileInFlightMap::iterator inflight = m_inflight.find(it->second);
+        assert(inflight != m_inflight.end());
+        inflight->second.daemon_id = 0;
+        TileTracer::end(TileTracer::Network, it->second);
+        m_retry.cancelled(m_config.host(it->second));
+        if (inflight->second.clients.empty()) {
+            m_inflight.erase(inflight);
+        } else {
+            fetch(it->second, inflight->second);
+        }
+    }
+    // a restarted daemon is used again once it answers
+    m_daemon_timer->start(DaemonRetry);
 }
 
 void TileFetcher::shutdown()
 {
-    // Clean up all tile images in the shutdown callback. 
-    for (TileImageMap::iterator it = m_images.begin(); 
-        it != m_images.end(); it++) {
-        assert(it->second);
-        delete it->second;
+    // Wait for decode tasks so none post events past this point
+    m_decoders.waitForDone();
+    m_retry_timer->stop();
+    m_daemon_timer->stop();
+    if (m_daemon) {
+        disconnect(m_daemon, NULL, this, NULL);
+        m_daemon->abort();
+        m_daemon = NULL;
+        m_ring.detach();
+        m_ring_memory.detach();
     }
+
+    // Clean up all tile images in the shutdown callback, the pool
+    // destroys the GL objects of every record on this thread
     m_images.clear();
+    m_pool.clear();
+    m_decoded.clear();
+}
+
+size_t TileFetcher::decodedBytes(const DecodedTile& tile)
+{
+    if (tile.mesh) {
+        return tile.mesh->vertices.size() * sizeof(float) + 
+            tile.mesh->indices.size() * sizeof(unsigned int);
+    }
+    return size_t(tile.image.bytesPerLine()) * size_t(tile.image.height());
 }
 
@@ -4,52 +4,311 @@
 #include "TileRenderer.h"
 #include "TileTypes.h"
 #include "MapConfig.h"
+#include "RetryPolicy.h"
+#include "AdaptiveQuality.h"
+#include "TilePool.h"
+#include "TileCache.h"
+#include "Trace.h"
+#include "TileProxy.h"
 #include <QNetworkAccessManager>
+#include <QNetworkDiskCache>
+#include <QHostInfo>
+#include <QThreadPool>
+#include <QTimer>
+#include <QSharedMemory>
+#include <QLocalSocket>
+#include <set>
+#include <memory>
 
 // This class manages fetching tile data from a remote server. It also
 // owns all TileImage objects created by converting tile image data into
 // OpenGL textures suitable for rendering in the TileRenderer. All 
 // communiation between this class and a TileRenderer happens via signal/slot
 // connections.
+//
+// One fetcher serves any number of renderer clients (see TileService). The
+// requesting client is taken from QObject::sender(), every tile index has
+// at most one download in flight that all interested clients subscribe to,
+// and resident tile images are shared between clients by reference count.
+// Tile images live in a TilePool and are passed around as TileHandles.
+// Failed tiles are negatively cached: the first failure is reported to the
+// clients, and later requests are parked until the RetryPolicy allows the
+// tile (and its host) to be fetched again, so a missing tile or an
+// overloaded server isn't hit again every frame. Decoded tiles are also
+// kept in system RAM within a byte budget, so a tile that dropped out of
+// every renderer cache comes back with an upload instead of a download
+// and decode. Raster tiles are decoded progressively while they download:
+// whenever enough new bytes arrived, the payload so far is decoded on the
+// worker pool and, if the image format allows it (e.g. JPEG), uploaded and
+// sent to the clients as a partial tile.
+//
+// When a qtmapviewer-tiled daemon runs on the host (see TileDaemon), raster
+// tiles are fetched through it instead: the daemon downloads and decodes 
+// each tile once for every viewer process and the fetcher uploads the 
+// pixels straight from its shared memory ring. If the daemon goes away the
+// fetcher downloads directly again, and tries to reconnect every few
+// seconds so a restarted daemon is picked up.
+//
+// Direct downloads go through a disk cache, which also warms the RAM tier
+// at startup with the tiles of the last session (see MapSession). With a
+// daemon the session tiles are asked from the daemon instead. The tile
+// hosts are resolved and connected asynchronously when the fetcher starts.
+//
+// The fetcher watches its download throughput and latency (NetworkMonitor).
+// When the downloads fall behind the clients are told, so they request
+// coarser tiles, and base map tiles are fetched in the lighter format if
+// one is configured, until the backlog drains. Lite tiles are neither 
+// shared nor kept in the RAM tier, the renderers request them again in
+// full once the network is clear.
 class TileFetcher : public GLWorker
 {
     Q_OBJECT
 public:
-    TileFetcher(const MapConfig& config, const TileRenderer& renderer);
+    // The fetcher context is created on 'surface' in the share group
+    // of 'shared', so its textures are usable by every renderer. Downloads
+    // are recorded to 'recorder' and served from 'replay' if given.
+    TileFetcher(const MapConfig& config, QSurface* surface, QOpenGLContext* shared,
+        TraceRecorder* recorder = NULL, const Trace::File* replay = NULL);
+
+    // pool the renderers resolve their tile handles with
+    const TilePool& pool() const {
+        return m_pool;
+    }
 
 public slots:
-    void tileRequest(const TileIndex& tile);
+    // registers or unregisters a renderer, which must provide a 
+    // tileResponses(const TileResponseList&) and a networkCongested(bool)
+    // slot
+    void addClient(QObject* client);
+    void removeClient(QObject* client);
+
+    void tileRequests(const TileIndexList& tiles);
+    void cancelTiles();
+    // unsubscribes the client from 'tiles' without a response, the 
+    // client already dropped its requests for them
+    void cancelTiles(const TileIndexList& tiles);
     void loadTile(QNetworkReply* reply);
-    void deleteTile(TileImage* tile);
+    void readTile();
+    void deleteTiles(const TileHandleList& tiles);
+    // decodes the disk cached payloads of 'tiles' into the RAM tier, or
+    // copies them from the tile daemon, returns once they are in
+    void warmTiles(const TileIndexList& tiles);
 
-signals:
-    void responseTile(TileImage* tile);
-    void cancelRequests();
+private slots:
+    // fetches the parked tiles whose backoff delay has passed
+    void retryTiles();
+    // handles the answers of the tile daemon
+    void readDaemon();
+    void daemonGone();
+    // tries to connect to a (restarted) tile daemon again
+    void reconnectDaemon();
+    void hostResolved(const QHostInfo& info);
 
 protected:
+    void customEvent(QEvent *event);
+    void setup();
     void shutdown();
 
 private:
-    struct Config {
-        Config(const MapConfig& config)
-        : server(config.server),
-        format(config.format),
-        tile_size(config.tile_size) {}
+    // Event posted back to the fetcher by a vector tile decode task once
+    // the tile mesh is tessellated, so the buffers get created on the
+    // fetcher GL context thread. The event owns the mesh.
+    class VectorTileEvent : public QEvent {
+    public:
+        VectorTileEvent(const TileIndex& index, VectorMesh* mesh)
+            : QEvent(type), index(index), mesh(mesh) {}
+        ~VectorTileEvent() { delete mesh; }
+        static const QEvent::Type type;
+
+        TileIndex index;
+        VectorMesh *mesh; // NULL if the tile failed to decode
+    };
+    // Thread pool task that decodes vector tiles (see TileFetcher.cpp)
+    class VectorDecodeTask;
+
+    // Event posted back by a partial decode task with the image decoded
+    // from a tile payload prefix, a null image if it couldn't be decoded
+    class PartialTileEvent : public QEvent {
+    public:
+        PartialTileEvent(const TileIndex& index, const QImage& image)
+            : QEvent(type), index(index), image(image) {}
+        static const QEvent::Type type;
+
+        TileIndex index;
+        QImage image;
+    };
+    // Thread pool task that decodes a partial raster payload
+    class PartialDecodeTask;
+    // Thread pool task that decodes a disk cached payload at startup
+    class WarmDecodeTask;
+    // new bytes that trigger another partial decode
+    enum { StreamStep = 16 * 1024 };
+    // ms to wait for the tile daemon to connect and greet
+    enum { DaemonTimeout = 200 };
+    // ms between attempts to reconnect to a tile daemon that went away
+    enum { DaemonRetry = 5000 };
+    // ms the startup waits for the session tiles from the tile daemon
+    enum { WarmTimeout = 2000 };
+
+    // Event posted to the fetcher itself when the first response of a
+    // batch is queued. Every reply handled before the event is delivered
+    // goes out to each client in one tileResponses() batch.
+    class ResponseFlush : public QEvent {
+    public:
+        ResponseFlush(): QEvent(type) {}
+        static const QEvent::Type type;
+    };
+
+    // A download in flight (or being decoded, with a NULL reply) and
+    // the clients waiting for it. Parked entries are waiting out the
+    // backoff of an earlier failure before the download starts.
+    //
+    // A streaming download collects its payload in 'data'. Once a partial
+    // decode succeeds the tile image is in 'partial', which holds one
+    // reference for the download besides those sent to the clients.
+    struct InFlight {
+        InFlight(): reply(NULL), daemon_id(0), started(0), parked(false), decoded(0), 
+            decoding(false), streamable(true), lite(false) {}
+        QNetworkReply *reply;
+        quint32 daemon_id;  // request id if the tile daemon fetches the tile
+        qint64 started;     // time the daemon request went out
+        bool parked;
+        std::vector<QObject*> clients;
+        QByteArray data;    // payload received so far
+        TileHandle partial; // partially decoded tile image
+        int decoded;        // payload bytes at the last partial decode
+        bool decoding;      // a partial decode task is running
+        bool streamable;    // partial payloads of this tile can be decoded
+        bool lite;          // fetched in the lite format
+    };
+
+    // Decoded tile data in the RAM tier, one of the two is set
+    struct DecodedTile {
+        QImage image;                     // raster tiles, as RGBA8888
+        std::shared_ptr<VectorMesh> mesh; // vector tiles
+    };
+    typedef LRUCache<TileIndex, DecodedTile> DecodedCache;
+    static size_t decodedBytes(const DecodedTile& tile);
+
+    void tileRequest(QObject* client, const TileIndex& tile);
+    QUrl tileUrl(const TileIndex& tile, bool lite = false) const;
+    // updates the congestion state, and tells the clients if it changed
+    void updateNetwork();
+    void fetch(const TileIndex& tile, InFlight& inflight);
+    // records a failed load with the retry policy, 'reply' is NULL
+    // for payloads that failed to decode
+    void fail(const TileIndex& tile, QNetworkReply* reply);
+    // records a failed load with the HTTP 'status' of the response (0 if 
+    // there was none, -1 if the payload failed to decode)
+    void fail(const TileIndex& tile, int status, const QByteArray& retry_after_header);
+    // backs off a tile that didn't fit in the exhausted tile pool
+    void exhausted(const TileIndex& tile);
+    void scheduleRetry(qint64 retry_at);
+    // loads 'data' into a pool record, returns a null handle if the
+    // pool is exhausted
+    template <typename T>
+    TileHandle createTile(const TileIndex& index, const T& data);
+    // hands a finished tile image (or a null handle if the tile 
+    // failed) to all the subscribed clients
+    void complete(const TileIndex& index, const TileHandle& tile);
+    void respond(QObject* client, const TileIndex& index, const TileHandle& tile, 
+        bool partial = false);
+    // starts a partial decode if enough new bytes arrived
+    void decodePartial(const TileIndex& index, InFlight& inflight);
+    // drops the download reference of a partially decoded tile
+    void dropPartial(InFlight& inflight);
+    // uploads a partially decoded tile and sends it to the clients
+    void partialTile(const TileIndex& index, const QImage& image);
+    void release(const TileHandle& tile);
+    // connects to the tile daemon if one runs
+    void connectDaemon();
+    void cancelDaemon(quint32 id);
+    // warmTiles() through the tile daemon, which has the disk cache of 
+    // the raster tiles
+    void warmDaemon(const TileIndexList& tiles);
+    // uploads a tile from the daemon ring and sends it to the clients
+    void daemonTile(const TileIndex& index, int slot, quint32 sequence);
+
+    // Tile server of one map layer
+    struct Source {
+        Source(const QString& server, const QString& format)
+        : server(server),
+        format(format),
+        host(QUrl(QString(server).replace("{time}", "0")).host()),
+        timed(MapConfig::timedServer(server)) {}
 
         QString server;
         QString format;
+        QString host;
+        bool timed; // the server URL has a {time} placeholder
+    };
+
+    struct Config {
+        Config(const MapConfig& config)
+        : disk_cache_size(qint64(config.disk_cache_size) << 20),
+        lite_format(config.vectorTiles() ? QString() : config.lite_format),
+        times(config.times),
+        suffix(config.hidpi_suffix),
+        tile_size(config.tile_size),
+        vector(config.vectorTiles()) {
+            sources.push_back(Source(config.server, config.format));
+            for (size_t i = 0; i < config.layers.size(); i++) {
+                sources.push_back(Source(config.layers[i].server, config.layers[i].format));
+            }
+        }
+
+        const Source& source(const TileIndex& index) const {
+            return sources[index.layer()];
+        }
+        // image format of a download, 'lite' for the base map only
+        const QString& format(const TileIndex& index, bool lite) const {
+            return lite && index.layer() == 0 ? lite_format : source(index).format;
+        }
+        // each layer host has its own circuit breaker
+        const QString& host(const TileIndex& index) const {
+            return source(index).host;
+        }
+
+        qint64 disk_cache_size;      // bytes, 0 without a disk cache
+        QString lite_format;         // base map format while congested
+        std::vector<Source> sources; // base map first, then MapConfig::layers
+        QStringList times;           // timestamps of the tile frames
+        QString suffix;
         int tile_size;
+        bool vector; // the base map is a vector tile layer, there are no others
     };
 
     typedef std::map<QNetworkReply*, TileIndex> TileReplyMap;
-    typedef std::map<TileIndex, TileImage*> TileImageMap;
+    typedef std::map<TileIndex, TileHandle> TileImageMap;
+    typedef std::map<TileIndex, InFlight> TileInFlightMap;
+    typedef std::map<QObject*, TileResponseList> TileResponseMap;
 
     // Qt network layer abstraction
     QNetworkAccessManager *m_network;
+    QNetworkDiskCache *m_disk_cache; // NULL if disabled or replaying
+    bool m_replay;                   // downloads are served from a trace
 
-    TileReplyMap m_replies; // tracks network replies
-    TileImageMap m_images;  // tracks allocated tile images
-    Config m_config;        // store internal config state      
+    TileReplyMap m_replies;    // tracks network replies
+    TileImageMap m_images;     // tracks allocated tile images
+    TileInFlightMap m_inflight; // downloads and their subscribers
+    std::set<QObject*> m_clients; // registered renderers
+    QThreadPool m_decoders;    // vector tile decode workers
+    TileResponseMap m_responses; // responses waiting for the next flush
+    RetryPolicy m_retry;       // negative cache and host circuit breaker
+    NetworkMonitor m_monitor;  // download throughput and congestion
+    bool m_lite;               // base map tiles are fetched in the lite format
+    QTimer *m_retry_timer;     // fires when the next parked tile is due
+    TilePool m_pool;           // tile image records
+    DecodedCache m_decoded;    // decoded tiles in system RAM
+    TraceRecorder *m_recorder; // records downloads if set
+    QLocalSocket *m_daemon;    // tile daemon connection, NULL without one
+    QTimer *m_daemon_timer;    // fires when the daemon is tried again
+    QSharedMemory m_ring_memory; // tile daemon ring
+    TileProxy::Ring m_ring;
+    quint32 m_daemon_id;       // last tile daemon request id
+    std::map<quint32, TileIndex> m_daemon_requests; // by request id
+    QString m_daemon_name;     // tile daemon server name, empty if disabled
+    Config m_config;           // store internal config state      
 }; 
 
 #endif
@@ -0,0 +1,154 @@
+#include "TileMath.h"
+#include <algorithm>
+#include <climits>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TILE_MATH_SSE2
+#include <emmintrin.h>
+#endif
+#define _USE_MATH_DEFINES
+#include <math.h>
+
+const double TileMath::MaxLatitude = 85.0511287798066;
+const int TileMath::MaxZoom;
+
+// The usual y = (1 - ln(tan(lat) + sec(lat)) / pi) / 2 is rewritten with
+// ln(tan(lat) + sec(lat)) = atanh(sin(lat)) = ln((1 + s) / (1 - s)) / 2, 
+// which needs one sine and one logarithm instead of tan, cos and log
+static inline double mercatorY(double sin_lat)
+{
+    return 0.5 - log((1. + sin_lat) / (1. - sin_lat)) * (0.25 / M_PI);
+}
+
+QPointF TileMath::lonlatToWorld(const QPointF& lonlat)
+{
+    double lat = std::max(-MaxLatitude, std::min(MaxLatitude, lonlat.y()));
+    return QPointF((lonlat.x() + 180.) * (1. / 360.), 
+        mercatorY(sin(lat * (M_PI / 180.))));
+}
+
+// The inverse lat = atan(sinh(t)) is the Gudermannian of t, which is also
+// 2 atan(exp(t)) - pi/2
+static inline double mercatorLat(double t)
+{
+    return (360. / M_PI) * atan(exp(t)) - 90.;
+}
+
+QPointF TileMath::worldToLonlat(const QPointF& world)
+{
+    return QPointF(world.x() * 360. - 180., mercatorLat(M_PI - 2. * M_PI * world.y()));
+}
+
+void TileMath::lonlatToWorld(const QPointF* lonlat, QPointF* world, size_t count)
+{
+    size_t i = 0;
+#ifdef TILE_MATH_SSE2
+    static_assert(sizeof(QPointF) == 2 * sizeof(double), "QPointF must be two doubles");
+    // QPointF is a pair of doubles, so each point is one SSE2 register:
+    // the longitude lane is scaled directly and the clamped latitude lane
+    // goes through the shared sine/log core
+    const __m128d lo = _mm_set_pd(-MaxLatitude, -1e300);
+    const __m128d hi = _mm_set_pd(MaxLatitude, 1e300);
+    const __m128d scale = _mm_set_pd(M_PI / 180., 1. / 360.);
+    const __m128d bias = _mm_set_pd(0., 180. / 360.);
+    for (; i + 2 <= count; i += 2) {
+        __m128d a = _mm_loadu_pd(reinterpret_cast<const double*>(&lonlat[i]));
+        __m128d b = _mm_loadu_pd(reinterpret_cast<const double*>(&lonlat[i + 1]));
+        a = _mm_add_pd(_mm_mul_pd(_mm_min_pd(_mm_max_pd(a, lo), hi), scale), bias);
+        b = _mm_add_pd(_mm_mul_pd(_mm_min_pd(_mm_max_pd(b, lo), hi), scale), bias);
+        // gather the two latitudes (in radians) into one register
+        __m128d lat = _mm_unpackhi_pd(a, b);
+        double s[2];
+        _mm_storeu_pd(s, lat);
+        s[0] = sin(s[0]);
+        s[1] = sin(s[1]);
+        // ln((1 + s) / (1 - s)) for both lanes, the division runs 2-wide
+        __m128d sv = _mm_loadu_pd(s);
+        __m128d one = _mm_set1_pd(1.);
+        __m128d ratio = _mm_div_pd(_mm_add_pd(one, sv), _mm_sub_pd(one, sv));
+        _mm_storeu_pd(s, ratio);
+        s[0] = log(s[0]);
+        s[1] = log(s[1]);
+        __m128d y = _mm_sub_pd(_mm_set1_pd(0.5), 
+            _mm_mul_pd(_mm_loadu_pd(s), _mm_set1_pd(0.25 / M_PI)));
+        _mm_storeu_pd(reinterpret_cast<double*>(&world[i]), _mm_unpacklo_pd(a, y));
+        _mm_storeu_pd(reinterpret_cast<double*>(&world[i + 1]), _mm_shuffle_pd(b, y, 2));
+    }
+#endif
+    for (; i < count; i++) {
+        world[i] = lonlatToWorld(lonlat[i]);
+    }
+}
+
+void TileMath::worldToLonlat(const QPointF* world, QPointF* lonlat, size_t count)
+{
+    size_t i = 0;
+#ifdef TILE_MATH_SSE2
+    // the longitude lane is x * 360 - 180, the latitude lane is the
+    // Mercator argument pi - 2 pi y, which goes through exp/atan
+    const __m128d scale = _mm_set_pd(-2. * M_PI, 360.);
+    const __m128d bias = _mm_set_pd(M_PI, -180.);
+    for (; i + 2 <= count; i += 2) {
+        __m128d a = _mm_loadu_pd(reinterpret_cast<const double*>(&world[i]));
+        __m128d b = _mm_loadu_pd(reinterpret_cast<const double*>(&world[i + 1]));
+        a = _mm_add_pd(_mm_mul_pd(a, scale), bias);
+        b = _mm_add_pd(_mm_mul_pd(b, scale), bias);
+        double t[2];
+        _mm_storeu_pd(t, _mm_unpackhi_pd(a, b));
+        t[0] = atan(exp(t[0]));
+        t[1] = atan(exp(t[1]));
+        __m128d lat = _mm_sub_pd(_mm_mul_pd(_mm_loadu_pd(t), _mm_set1_pd(360. / M_PI)), 
+            _mm_set1_pd(90.));
+        _mm_storeu_pd(reinterpret_cast<double*>(&lonlat[i]), _mm_unpacklo_pd(a, lat));
+        _mm_storeu_pd(reinterpret_cast<double*>(&lonlat[i + 1]), _mm_shuffle_pd(b, lat, 2));
+    }
+#endif
+    for (; i < count; i++) {
+        lonlat[i] = worldToLonlat(world[i]);
+    }
+}
+
+void TileMath::coverConvex(int tile_size, const QPointF* polygon, int count, TileSpans& spans)
+{
+    const double size = double(tile_size);
+    // the bottom edge of the polygon belongs to the tile row above it, 
+    // like the exclusive right/bottom of a QRectF
+    double top = polygon[0].y(), bottom = polygon[0].y();
+    for (int i = 1; i < count; i++) {
+        top = std::min(top, polygon[i].y());
+        bottom = std::max(bottom, polygon[i].y());
+    }
+    int y1 = int(std::floor(top / size));
+    int y2 = std::max(y1, int(std::ceil(bottom / size)) - 1);
+    spans.y1 = y1;
+    spans.rows.assign(size_t(y2 - y1 + 1), std::make_pair(INT_MAX, INT_MIN));
+
+    for (int i = 0; i < count; i++) {
+        const QPointF& a = polygon[i];
+        const QPointF& b = polygon[(i + 1) % count];
+        double lo = std::min(a.y(), b.y()), hi = std::max(a.y(), b.y());
+        int first = std::max(y1, int(std::floor(lo / size)));
+        int last = std::min(y2, std::max(first, int(std::ceil(hi / size)) - 1));
+        for (int row = first; row <= last; row++) {
+            // the part of the edge within the row
+            double x0, x1;
+            if (hi == lo) {
+                x0 = a.x();
+                x1 = b.x();
+            } else {
+                double from = std::max(lo, row * size), to = std::min(hi, (row + 1) * size);
+                double slope = (b.x() - a.x()) / (b.y() - a.y());
+                x0 = a.x() + (from - a.y()) * slope;
+                x1 = a.x() + (to - a.y()) * slope;
+            }
+            std::pair<int, int>& span = spans.rows[size_t(row - y1)];
+            span.first = std::min(span.first, int(std::floor(std::min(x0, x1) / size)));
+            span.second = std::max(span.second, int(std::ceil(std::max(x0, x1) / size)) - 1);
+        }
+    }
+    // a row whose overlap is a vertical sliver still holds its column
+    for (size_t i = 0; i < spans.rows.size(); i++) {
+        if (spans.rows[i].first != INT_MAX && spans.rows[i].second < spans.rows[i].first) {
+            spans.rows[i].second = spans.rows[i].first;
+        }
+    }
+}
@@ -0,0 +1,173 @@
+#ifndef __TILE_MATH_H_
+#define __TILE_MATH_H_
+
+#include <QtGlobal>
+#include <QPoint>
+#include <QPointF>
+#include <QRectF>
+#include <QSize>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+#include <utility>
+
+// Tile grid math for square power-of-two tiles. TileGrid<256> and 
+// TileGrid<512> fold the tile size into shifts and masks at compile time,
+// TileGrid<> handles any other power-of-two size with the shift stored at
+// run time. Hot paths are written once as templates over the grid type and
+// switch on the configured tile size to pick the specialization.
+//
+// Pixel coordinates are 64-bit (see PixelPoint) and follow the floor 
+// convention, so the tile and the offset within the tile are also correct
+// for negative (wrapped) pixels.
+template <int TileSize = 0>
+class TileGrid {
+    static_assert(TileSize > 0 && (TileSize & (TileSize - 1)) == 0, 
+        "tile size must be a power of two");
+public:
+    static constexpr int log2(int n) {
+        return n <= 1 ? 0 : 1 + log2(n >> 1);
+    }
+
+    constexpr int size() const { return TileSize; }
+    constexpr int shift() const { return log2(TileSize); }
+    constexpr int mask() const { return TileSize - 1; }
+
+    // tile column/row containing 'pixel'
+    constexpr int tile(qint64 pixel) const { return int(pixel >> shift()); }
+    // offset of 'pixel' inside its tile
+    constexpr int offset(qint64 pixel) const { return int(pixel & mask()); }
+    // world size in pixels at 'zoom'
+    double worldSize(int zoom) const { return std::ldexp(1.0, shift() + zoom); }
+};
+
+// Run time power-of-two tile size
+template <>
+class TileGrid<0> {
+public:
+    explicit TileGrid(int tile_size)
+        : m_size(tile_size), 
+        m_shift(TileGrid<1>::log2(tile_size)) {}
+
+    int size() const { return m_size; }
+    int shift() const { return m_shift; }
+    int mask() const { return m_size - 1; }
+
+    int tile(qint64 pixel) const { return int(pixel >> m_shift); }
+    int offset(qint64 pixel) const { return int(pixel & (m_size - 1)); }
+    double worldSize(int zoom) const { return std::ldexp(1.0, m_shift + zoom); }
+
+private:
+    int m_size;
+    int m_shift;
+};
+
+// A point in the pixel space of one zoom level. The pixel space overflows
+// int at deep zoom levels (512 px tiles at zoom 22 span 2^31 pixels), so 
+// coordinates are 64-bit. Only offsets from the viewport origin are ever
+// handed to the GPU, which keeps them small at any zoom.
+class PixelPoint {
+public:
+    PixelPoint(): m_x(0), m_y(0) {}
+    PixelPoint(qint64 x, qint64 y): m_x(x), m_y(y) {}
+
+    qint64 x() const { return m_x; }
+    qint64 y() const { return m_y; }
+
+    PixelPoint& operator+=(const QPoint& offset) {
+        m_x += offset.x();
+        m_y += offset.y();
+        return *this;
+    }
+    // the same location one zoom level in or out
+    PixelPoint zoomedIn() const { return PixelPoint(m_x * 2, m_y * 2); }
+    PixelPoint zoomedOut() const { return PixelPoint(m_x >> 1, m_y >> 1); }
+
+private:
+    qint64 m_x, m_y;
+};
+
+// A viewport in 64-bit pixel space, right/bottom are inclusive like QRect
+class PixelRect {
+public:
+    PixelRect(): m_left(0), m_top(0) {}
+    // the viewport of 'size' pixels centered on 'center'
+    PixelRect(const PixelPoint& center, const QSize& size)
+        : m_left(center.x() - size.width() / 2),
+        m_top(center.y() - size.height() / 2),
+        m_size(size) {}
+
+    qint64 left() const { return m_left; }
+    qint64 top() const { return m_top; }
+    qint64 right() const { return m_left + m_size.width() - 1; }
+    qint64 bottom() const { return m_top + m_size.height() - 1; }
+    const QSize& size() const { return m_size; }
+
+    // doubles hold 2^53 exactly, which covers every supported zoom
+    QRectF toRectF() const {
+        return QRectF(double(m_left), double(m_top), m_size.width(), m_size.height());
+    }
+
+private:
+    qint64 m_left, m_top;
+    QSize m_size;
+};
+
+// Tiles covered by a convex polygon, as a span of tile columns per row
+struct TileSpans {
+    TileSpans(): y1(0) {}
+    int y1; // tile row of the first span
+    std::vector<std::pair<int, int> > rows; // first and last column, empty if first > last
+
+    bool operator==(const TileSpans& other) const {
+        return y1 == other.y1 && rows == other.rows;
+    }
+    bool operator!=(const TileSpans& other) const {
+        return !(*this == other);
+    }
+};
+
+// Web Mercator projection between lon/lat, stored as QPointF(lon, lat) like
+// the MapConfig center, and the normalized world square [0,1]x[0,1] that 
+// pixel space and the overlay layers are scaled from.
+// See http://en.wikipedia.org/wiki/Mercator_projection
+class TileMath {
+public:
+    // latitude limit of the square Web Mercator world
+    static const double MaxLatitude;
+    // deepest zoom level, which keeps tile indices within int
+    static const int MaxZoom = 30;
+
+    static bool validTileSize(int tile_size) {
+        return tile_size > 0 && (tile_size & (tile_size - 1)) == 0;
+    }
+
+    static QPointF lonlatToWorld(const QPointF& lonlat);
+    static QPointF worldToLonlat(const QPointF& world);
+    // Batch conversions of 'count' points. With SSE2 the arithmetic runs
+    // on two points at a time, the sine/log (and exp/atan) stay scalar 
+    // calls per point. The output may alias the input.
+    static void lonlatToWorld(const QPointF* lonlat, QPointF* world, size_t count);
+    static void worldToLonlat(const QPointF* world, QPointF* lonlat, size_t count);
+
+    template <typename Grid>
+    static PixelPoint lonlatToPixel(const Grid& grid, int zoom, const QPointF& lonlat) {
+        QPointF pixel = lonlatToWorld(lonlat) * grid.worldSize(zoom);
+        return PixelPoint(qint64(std::floor(pixel.x())), qint64(std::floor(pixel.y())));
+    }
+    template <typename Grid>
+    static QPointF pixelToLonlat(const Grid& grid, int zoom, const PixelPoint& pixel) {
+        double size = grid.worldSize(zoom);
+        return worldToLonlat(QPointF(double(pixel.x()) / size, double(pixel.y()) / size));
+    }
+
+    // Scan converts the convex 'polygon' of 'count' pixel space points into
+    // the tiles it overlaps. Each edge is clipped to the tile rows it passes
+    // and widens their spans, so a tile is in a span whenever the polygon
+    // overlaps it, however thin the overlap (edges that only touch a tile
+    // don't count). An axis aligned rectangle covers the same tiles as the
+    // grid of its PixelRect.
+    static void coverConvex(int tile_size, const QPointF* polygon, int count, TileSpans& spans);
+};
+
+#endif
@@ -0,0 +1,99 @@
+#include "TilePool.h"
+#include <QDebug>
+#include <algorithm>
+#include <cassert>
+
+const int TilePool::MaxSlabs;
+
+// generation after 'generation', skipping the null handle generation 0
+static quint32 nextGeneration(quint32 generation)
+{
+    return (generation + 1) ? (generation + 1) : 1;
+}
+
+TilePool::TilePool(size_t slab_size)
+    : m_slab_size(std::max(slab_size, size_t(1))),
+    m_slab_count(0),
+    m_used(0)
+{
+    for (int i = 0; i < MaxSlabs; i++) {
+        m_slabs[i].store(NULL);
+    }
+}
+
+TilePool::~TilePool()
+{
+    assert(m_used == 0);
+}
+
+TileHandle TilePool::acquire()
+{
+    if (m_free.empty()) {
+        if (m_slab_count == MaxSlabs) {
+            qCritical() << "Tile pool exhausted at" << capacity() << "tiles";
+            return TileHandle();
+        }
+        // add a slab, its slots are handed out in ascending order
+        m_slab_owners[m_slab_count].reset(new Record[m_slab_size]);
+        m_slabs[m_slab_count].store(m_slab_owners[m_slab_count].get(), 
+            std::memory_order_release);
+        quint32 first = quint32(m_slab_count * m_slab_size);
+        m_slab_count++;
+        for (size_t i = m_slab_size; i > 0; i--) {
+            m_free.push_back(first + quint32(i - 1));
+        }
+    }
+    quint32 slot = m_free.back();
+    m_free.pop_back();
+    m_used++;
+    Record& record = m_slabs[slot / m_slab_size].load(std::memory_order_relaxed)[slot % m_slab_size];
+    return TileHandle(slot, record.generation.load(std::memory_order_relaxed));
+}
+
+void TilePool::release(const TileHandle& handle)
+{
+    Record *slab = m_slabs[handle.slot() / m_slab_size].load(std::memory_order_relaxed);
+    assert(slab);
+    Record& record = slab[handle.slot() % m_slab_size];
+    assert(record.generation.load(std::memory_order_relaxed) == handle.generation());
+    record.image.reset();
+    record.generation.store(nextGeneration(handle.generation()), std::memory_order_release);
+    m_free.push_back(handle.slot());
+    m_used--;
+}
+
+TileImage* TilePool::get(const TileHandle& handle) const
+{
+    if (handle.isNull() || handle.slot() / m_slab_size >= size_t(MaxSlabs)) {
+        return NULL;
+    }
+    Record *slab = m_slabs[handle.slot() / m_slab_size].load(std::memory_order_acquire);
+    if (!slab) {
+        return NULL;
+    }
+    Record& record = slab[handle.slot() % m_slab_size];
+    if (record.generation.load(std::memory_order_acquire) != handle.generation()) {
+        return NULL;
+    }
+    return &record.image;
+}
+
+void TilePool::clear()
+{
+    for (int i = 0; i < m_slab_count; i++) {
+        Record *slab = m_slab_owners[i].get();
+        for (size_t j = 0; j < m_slab_size; j++) {
+            if (slab[j].image.valid()) {
+                // invalidate outstanding handles too
+                slab[j].generation.store(nextGeneration(slab[j].generation.load()));
+                m_used--;
+            }
+            slab[j].image.destroy();
+        }
+    }
+    // the emptied slabs stay around for a restart
+    m_free.clear();
+    for (size_t i = m_slab_count * m_slab_size; i > 0; i--) {
+        m_free.push_back(quint32(i - 1));
+    }
+}
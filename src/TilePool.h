@@ -0,0 +1,59 @@
+#ifndef __TILE_POOL_H_
+#define __TILE_POOL_H_
+
+#include "TileTypes.h"
+#include <atomic>
+#include <memory>
+#include <vector>
+
+// Slab allocator for TileImage records, addressed by generation counted
+// TileHandles. Records are allocated in slabs of 'slab_size', which the 
+// fetcher sizes from the tile cache budget, so in steady state every tile
+// reuses a released record (and its GL objects) and nothing is allocated.
+// A new slab is only added if all records are in use, up to MaxSlabs. 
+// Slabs never move once allocated.
+//
+// acquire() and release() are only called from the TileFetcher thread.
+// get() may be called from any thread holding a reference to the handle,
+// which is how the renderers resolve the handles in their tile caches.
+class TilePool {
+public:
+    static const int MaxSlabs = 32;
+
+    TilePool(size_t slab_size);
+    ~TilePool();
+
+    // returns an empty record, or a null handle if the pool is exhausted
+    TileHandle acquire();
+    // resets the record and invalidates every handle to it
+    void release(const TileHandle& handle);
+    // returns the record for 'handle', or NULL if the handle is stale
+    TileImage* get(const TileHandle& handle) const;
+    // destroys the GL objects of every record, on the GL context thread
+    void clear();
+
+    // records in use and allocated
+    size_t used() const {
+        return m_used;
+    }
+    size_t capacity() const {
+        return m_slab_size * m_slab_count;
+    }
+
+private:
+    struct Record {
+        Record(): generation(1) {}
+        TileImage image;
+        std::atomic<quint32> generation; // never 0, see TileHandle::isNull()
+    };
+
+    size_t m_slab_size;
+    int m_slab_count;
+    std::unique_ptr<Record[]> m_slab_owners[MaxSlabs];
+    // read without locks by get(), published when a slab is added
+    std::atomic<Record*> m_slabs[MaxSlabs];
+    std::vector<quint32> m_free; // free record slots
+    size_t m_used;
+};
+
+#endif
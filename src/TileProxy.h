@@ -0,0 +1,118 @@
+#ifndef __TILE_PROXY_H_
+#define __TILE_PROXY_H_
+
+#include <QtGlobal>
+#include <QImage>
+#include <atomic>
+
+// Protocol between the viewers and the qtmapviewer-tiled daemon (see
+// TileDaemon), which fetches, disk caches and decodes raster tiles once
+// for every viewer process on a host.
+//
+// Requests and answers are text lines on a QLocalSocket:
+//
+//   daemon: HELLO <shared memory key>
+//   viewer: GET <id> <tile URL>
+//   viewer: CANCEL <id>
+//   daemon: TILE <id> <slot> <sequence> [<payload bytes>]
+//   daemon: FAIL <id> <HTTP status, 0 without a response> [<Retry-After>]
+//   daemon: CANCELLED <id>
+//
+// Every GET gets exactly one answer. A TILE answer that took a download
+// carries the payload size, so the viewers can measure the network; tiles
+// from the ring or the disk cache have none. Decoded tiles are RGBA8888 pixels in a
+// shared memory ring the daemon overwrites round robin. A slot sequence is
+// odd while the daemon writes the slot, so a viewer uploads straight from
+// the ring and then checks the slot still holds the answered sequence; if
+// not, the tile was overwritten during the upload and is requested again.
+namespace TileProxy {
+    // QLocalServer name of the daemon
+    const char DefaultName[] = "qtmapviewer-tiled";
+    const quint32 Magic = 0x514d5452; // "QMTR"
+    const quint32 Version = 1;
+
+    // The ring is a RingHeader followed by 'slot_count' slots, each a
+    // SlotHeader followed by 'slot_bytes' of pixels
+    struct RingHeader {
+        quint32 magic;
+        quint32 version;
+        quint32 slot_count;
+        quint32 slot_bytes;
+    };
+    struct SlotHeader {
+        std::atomic<quint32> sequence; // odd while the slot is written
+        quint32 width;
+        quint32 height;
+        quint32 reserved;
+    };
+    // the atomics are shared between processes, so they must not be
+    // implemented with a process local lock
+    static_assert(ATOMIC_INT_LOCK_FREE == 2, "slot sequences must be lock free");
+
+    // View of an attached ring, the memory belongs to a QSharedMemory
+    class Ring {
+    public:
+        Ring(): m_data(NULL) {}
+
+        // returns false if 'data' isn't a ring of this protocol version
+        bool attach(void* data) {
+            const RingHeader *header = static_cast<const RingHeader*>(data);
+            m_data = data && header->magic == Magic && header->version == Version ?
+                static_cast<uchar*>(data) : NULL;
+            return m_data != NULL;
+        }
+        void detach() {
+            m_data = NULL;
+        }
+        bool valid() const {
+            return m_data != NULL;
+        }
+        int slotCount() const {
+            return int(header()->slot_count);
+        }
+        size_t slotBytes() const {
+            return header()->slot_bytes;
+        }
+        static size_t size(int slot_count, size_t slot_bytes) {
+            return sizeof(RingHeader) + size_t(slot_count) * (sizeof(SlotHeader) + slot_bytes);
+        }
+
+        SlotHeader* slot(int index) const {
+            return reinterpret_cast<SlotHeader*>(m_data + sizeof(RingHeader) +
+                size_t(index) * (sizeof(SlotHeader) + slotBytes()));
+        }
+        uchar* pixels(int index) const {
+            return reinterpret_cast<uchar*>(slot(index) + 1);
+        }
+        // true if 'index' is a slot that holds 'sequence'
+        bool holds(int index, quint32 sequence) const {
+            if (index < 0 || index >= slotCount()) {
+                return false;
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return slot(index)->sequence.load(std::memory_order_acquire) == sequence;
+        }
+        // Image over the pixels of a slot without a copy, a null image if
+        // the slot no longer holds 'sequence'. Check holds() again once
+        // the pixels are consumed.
+        QImage image(int index, quint32 sequence) const {
+            if (!holds(index, sequence)) {
+                return QImage();
+            }
+            const SlotHeader *header = slot(index);
+            if (size_t(header->width) * header->height * 4 > slotBytes()) {
+                return QImage();
+            }
+            return QImage(pixels(index), int(header->width), int(header->height),
+                QImage::Format_RGBA8888);
+        }
+
+    private:
+        const RingHeader* header() const {
+            return reinterpret_cast<const RingHeader*>(m_data);
+        }
+        uchar *m_data;
+    };
+}
+
+#endif
@@ -2,48 +2,142 @@
 #include <QtCore/QCoreApplication>
 #include <QtGui/QOpenGLContext>
 #include <QMatrix4x4>
+#include <QTimer>
+#include <QPolygonF>
 #include <iostream>
+#include <cstring>
+#include <climits>
+#include <algorithm>
+#include "TileMath.h"
+#include "TileTracer.h"
 
-// Simple vertex shader used to position map tiles on the render target
+// Per-frame uniform block shared by the raster and vector shaders. It is
+// written once per frame into a uniform buffer, see FrameBlock.
+#define TILE_FRAME_BLOCK \
+    "layout (std140, binding = 0) uniform Frame {" \
+        "mat4 projection;" \
+        "vec4 size;"        /* tile size in pixels in xy */ \
+        "vec4 palette[8];"  /* vector style colors */ \
+        "vec4 opacity;"     /* map layer opacities, base map in x */ \
+        "vec4 background;"  /* color under the map layers */ \
+    "};"
+
+// CPU side of the std140 Frame uniform block
+struct FrameBlock {
+    enum { PaletteSize = 8 };
+    GLfloat projection[16];
+    GLfloat size[4];
+    GLfloat palette[PaletteSize * 4];
+    GLfloat opacity[4];
+    GLfloat background[4];
+};
+static_assert(MapConfig::MaxLayers <= 4, "the Frame block opacity must hold every layer");
+static_assert(VectorTileDecoder::StyleCount <= FrameBlock::PaletteSize, 
+    "the Frame block palette must hold every vector style");
+
+// Simple vertex shader used to position map tiles on the render target.
+// The quad is the unit square, so texture coordinates come straight from it.
 const static char VertexShader[] =
     "#version 430\n"
-	"layout (location = 0) in vec2 tile;" // tile geometry
-	"uniform mat4 projection;" 
-    "uniform vec2 scale;"      // tile geometry scale
-	"uniform vec2 offset;"     // tile geometry offset
-    "uniform vec2 tex_scale;"  // tile texture scale
-    "uniform vec2 tex_offset;" // tile texture offset
-    "uniform vec2 size;"       // tile size in pixels
+    "layout (location = 0) in vec2 tile;" // unit quad corner
+    TILE_FRAME_BLOCK
+    "uniform vec4 geometry;" // tile geometry scale xy, offset zw
+    "uniform vec4 region;"   // tile texture subregion scale xy, offset zw
     "out vec2 texcoord;"
+    "out vec2 unit;"
     "void main() {"
-        // scale the tile coord to be in the texture [0,1] range
-        "texcoord = tile / size;"
         // scale and offset the texcoord to match the texture subregion
-        "texcoord = tex_scale * texcoord + tex_offset;"
-        // sacle and offset the tile position to match the map location
-        "gl_Position = projection * vec4(scale * tile + offset, 0, 1);"
+        "texcoord = region.xy * tile + region.zw;"
+        "unit = tile;"
+        // scale and offset the tile position to match the map location
+        "gl_Position = projection * vec4(geometry.xy * tile * size.xy + geometry.zw, 0, 1);"
     "}";
 
-// Simple fragment shader used to fetch tile image texture data
+// Fragment shader that fetches the tile image texture data and blends the
+// map layers over it, so a tile with layers is still a single draw. Bit 0
+// of 'present' is the base tile on unit 0, bit i+1 is layer i on unit i+1.
 const static char FragmentShader[] =
     "#version 430\n"
     "layout(location = 0) out vec4 out_color;"
-	"uniform sampler2D tile;"
-	"in vec2 texcoord;" // texture coordinate from vertex shader
-	"void main() {"
-        "out_color = texture(tile, texcoord);"
-	"}";
+    TILE_FRAME_BLOCK
+    "uniform sampler2D tile;"
+    "uniform sampler2D layers[3];"
+    "uniform vec4 layer_regions[3];" // layer subregion scale xy, offset zw
+    "uniform int present;"
+    "in vec2 texcoord;" // texture coordinate from vertex shader
+    "in vec2 unit;"     // position in the tile quad
+    "void main() {"
+        "vec3 color = background.rgb;"
+        "if ((present & 1) != 0) {"
+            "vec4 base = texture(tile, texcoord);"
+            "color = mix(color, base.rgb, base.a * opacity.x);"
+        "}"
+        "for (int i = 0; i < 3; i++) {"
+            "if ((present & (2 << i)) != 0) {"
+                "vec4 layer = texture(layers[i], layer_regions[i].xy * unit + layer_regions[i].zw);"
+                "color = mix(color, layer.rgb, layer.a * opacity[i + 1]);"
+            "}"
+        "}"
+        "out_color = vec4(color, 1);"
+    "}";
+
+// Vertex shader for vector tiles. The region uniform selects the same 
+// subregion as for raster tiles, so a parent tile mesh is scaled up and 
+// shifted instead of sampled, and then clipped to the tile quad with clip
+// distances, which follow the quad when the map is turned.
+const static char VectorVertexShader[] =
+    "#version 430\n"
+    "layout (location = 0) in vec2 position;" // tile pixel space vertex
+    "layout (location = 1) in float style;"   // style palette index
+    TILE_FRAME_BLOCK
+    "uniform vec4 geometry;" // tile geometry scale xy, offset zw
+    "uniform vec4 region;"   // tile subregion scale xy, offset zw
+    "out vec4 color;"
+    "void main() {"
+        // map the subregion of the tile onto the full tile quad
+        "vec2 tile = (position / size.xy - region.zw) / region.xy * size.xy;"
+        "color = palette[int(style)];"
+        "gl_ClipDistance[0] = tile.x;"
+        "gl_ClipDistance[1] = size.x - tile.x;"
+        "gl_ClipDistance[2] = tile.y;"
+        "gl_ClipDistance[3] = size.y - tile.y;"
+        "gl_Position = projection * vec4(geometry.xy * tile + geometry.zw, 0, 1);"
+    "}";
+
+// Fragment shader for vector tiles, just outputs the style color
+const static char VectorFragmentShader[] =
+    "#version 430\n"
+    "layout(location = 0) out vec4 out_color;"
+    "in vec4 color;"
+    "void main() {"
+        "out_color = color;"
+    "}";
 
 // Register the render event with Qt
 const QEvent::Type TileRenderer::RenderRequest::type = (QEvent::Type)QEvent::registerEventType();
+const QEvent::Type TileRenderer::ExportRequest::type = (QEvent::Type)QEvent::registerEventType();
 
-TileRenderer::TileRenderer(const MapConfig& config, QSurface* surface)
-    : GLWorker(surface), 
+TileRenderer::TileRenderer(const MapConfig& config, const TilePool& pool, 
+    QSurface* surface, QOpenGLContext* shared)
+    : GLWorker(surface, shared), 
     m_config(config),
-    m_shader(NULL),
-    m_render_requests(0),
-    m_cache(m_config.cache_size, std::bind(&TileRenderer::tileEvicted, this, std::placeholders::_1))
+    m_pool(pool),
+    m_quad_buffer(QOpenGLBuffer::VertexBuffer),
+    m_frame_buffer(0),
+    m_overlays(config.tile_size, config.cluster_zoom, std::bind(&TileRenderer::requestRender, this)),
+    m_quality(config.frame_budget),
+    m_congested(false),
+    m_render_pending(false),
+    m_headless(surface->surfaceClass() == QSurface::Offscreen),
+    m_fbo(NULL),
+    m_poll_pending(false)
 {
+    // every layer has its own budget, so a dense layer can't push
+    // the base map out of the cache
+    for (int i = 0; i < m_config.layers(); i++) {
+        m_caches.push_back(TileCache(m_config.cache_sizes[i], 
+            std::bind(&TileRenderer::tileEvicted, this, std::placeholders::_1)));
+    }
 }
 
 void TileRenderer::render() 
@@ -55,6 +149,8 @@ void TileRenderer::render()
     if (!state.valid()) { 
         return; 
     }
+    QElapsedTimer timer;
+    timer.start();
 
     // makeCurrent is required even though render() is only ever called by the 
     // thread that owns the GL context. This is a quirk of the implementation 
@@ -62,7 +158,17 @@ void TileRenderer::render()
     context()->makeCurrent(surface());
     const QSize& size = state.mapSize();
 
-    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, context()->defaultFramebufferObject());
+    GLuint target = context()->defaultFramebufferObject();
+    if (m_headless) {
+        // offscreen surfaces have no usable default framebuffer
+        if (!m_fbo || m_fbo->size() != size) {
+            delete m_fbo;
+            m_fbo = new QOpenGLFramebufferObject(size, 
+                QOpenGLFramebufferObject::CombinedDepthStencil);
+        }
+        target = m_fbo->handle();
+    }
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target);
     glClearColor(0.85f,0.85f,0.85f,1);
     glViewport(0, 0, size.width(), size.height());
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
@@ -71,239 +177,1067 @@ void TileRenderer::render()
     projection.setToIdentity();
     // Perform all draw calls with a 2D orthographic projection in raster space
     projection.ortho(QRect(0, 0, size.width(), size.height()));
+    // The map turns against the bearing about the viewport center
+    if (state.bearing() != 0.f) {
+        projection.translate(size.width() / 2.f, size.height() / 2.f);
+        projection.rotate(-state.bearing(), 0.f, 0.f, 1.f);
+        projection.translate(-size.width() / 2.f, -size.height() / 2.f);
+    }
  
-    // Safe to use static vectors because only the GL context thread enters
-    static std::vector<TileDrawable> tiles;
-    static std::vector<TileIndex> requests;
-    tiles.clear();
-    requests.clear();
+    // update the visible map tiles, which also queues the requests for
+    // the tiles that went missing
+    m_new_requests.clear();
+    m_cancelled.clear();
+    QVector2D translation;
+    updateVisible(state, translation);
+    const std::vector<TileDrawable>& tiles = m_visible.tiles;
+    const std::vector<TileIndex>& missing = m_visible.missing;
+
+    // The caches hold at least three screens of tiles (this zoom level and
+    // the fallbacks above and below), so they grow with HiDPI surfaces 
+    int columns = size.width() / m_config.tile_size + 2;
+    int rows = size.height() / m_config.tile_size + 2;
+    // Timed layers also hold the frames ahead of the playhead
+    for (size_t i = 0; i < m_caches.size(); i++) {
+        m_caches[i].reserve(size_t(3 * columns * rows) + 
+            (m_config.timed[i] ? m_visible.prefetched : 0));
+    }
+
+    if (!m_cancelled.empty()) {
+        emit cancelTiles(m_cancelled);
+    }
+    if (!m_new_requests.empty()) {
+        emit requestTiles(m_new_requests);
+    }
+
+    // the tile offsets are relative to the visible grid origin
+    QMatrix4x4 tile_projection = projection;
+    tile_projection.translate(translation.x(), translation.y());
+    uploadFrame(tile_projection);
+    if (m_config.vector) {
+        drawVector(tiles);
+    } else {
+        drawRaster(tiles);
+    }
+    // overlay layers are drawn on top of the map tiles, over the bounding
+    // box of the viewport so a turned map doesn't cull them at the corners
+    QPointF corners[4];
+    state.viewport(corners);
+    QRectF extent = QPolygonF(QVector<QPointF>() << corners[0] << corners[1] 
+        << corners[2] << corners[3]).boundingRect();
+    QMatrix4x4 overlay_projection = projection;
+    overlay_projection.translate(float(extent.left() - state.bounds().left()), 
+        float(extent.top() - state.bounds().top()));
+    m_overlays.draw(extent, state.zoom(), state.pixelRatio(), overlay_projection);
+
+    if (m_headless) {
+        if (!m_jobs.empty()) {
+            exportFrame(missing);
+        } else {
+            // without a swap the frame time would only cover the
+            // submission of the draw calls
+            glFinish();
+        }
+    }
+    // the frame budget leaves out the swap, which waits for the vsync
+    qint64 work = timer.nsecsElapsed();
+    if (!m_headless) {
+        // Manual swap buffers is necessary for QWindow surfaces
+        context()->swapBuffers(surface());
+    }
+    emit frameRendered(timer.nsecsElapsed(), int(tiles.size()), int(missing.size()));
+    if (m_quality.frameRendered(work, int(missing.size()))) {
+        qualityChanged();
+    }
+}
+
+void TileRenderer::exportFrame(const std::vector<TileIndex>& missing)
+{
+    const ExportJob& job = m_jobs.front();
+    // The frame is done once every missing tile has failed, until then
+    // each tile response renders it again
+    bool complete = true;
+    for (size_t i = 0; i < missing.size() && complete; i++) {
+        complete = m_failed.count(missing[i]) > 0;
+    }
+    if (!complete && m_export_clock.elapsed() < job.timeout) {
+        return;
+    }
+
+    // Copy the frame into a free pixel pack buffer, if both are in flight
+    // wait for them, which only happens when jobs finish faster than the
+    // copies
+    Readback *readback = NULL;
+    while (!readback) {
+        for (int i = 0; i < ReadbackCount && !readback; i++) {
+            if (!m_readbacks[i].fence) {
+                readback = &m_readbacks[i];
+            }
+        }
+        if (!readback) {
+            finishReadbacks(true);
+        }
+    }
+    const QSize& size = job.state.mapSize();
+    int bytes = size.width() * size.height() * 4;
+    if (!readback->buffer.isCreated()) {
+        readback->buffer.create();
+        readback->buffer.setUsagePattern(QOpenGLBuffer::StreamRead);
+    }
+    readback->buffer.bind();
+    if (readback->buffer.size() < bytes) {
+        readback->buffer.allocate(bytes);
+    }
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, m_fbo->handle());
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(0, 0, size.width(), size.height(), GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    readback->buffer.release();
+    readback->fence = context()->extraFunctions()->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    readback->size = size;
+    readback->id = job.id;
+    readback->complete = complete;
+    glFlush();
+
+    // the next job renders while the copy is in flight
+    m_jobs.pop_front();
+    startExport();
+    if (!m_poll_pending) {
+        m_poll_pending = true;
+        QTimer::singleShot(1, this, SLOT(pollReadbacks()));
+    }
+}
+
+bool TileRenderer::finishReadbacks(bool wait)
+{
+    QOpenGLExtraFunctions *gl = context()->extraFunctions();
+    bool pending = false;
+    for (int i = 0; i < ReadbackCount; i++) {
+        Readback& readback = m_readbacks[i];
+        if (!readback.fence) {
+            continue;
+        }
+        GLuint64 timeout = wait ? GLuint64(1000000000) : GLuint64(0); // ns
+        GLenum status = gl->glClientWaitSync(readback.fence, GL_SYNC_FLUSH_COMMANDS_BIT, timeout);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+            pending = true;
+            continue;
+        }
+        gl->glDeleteSync(readback.fence);
+        readback.fence = 0;
+
+        int width = readback.size.width(), height = readback.size.height();
+        QImage image;
+        readback.buffer.bind();
+        const uchar *data = static_cast<const uchar*>(
+            readback.buffer.mapRange(0, width * height * 4, QOpenGLBuffer::RangeRead));
+        if (data) {
+            // GL rows start at the bottom, mirrored() also copies the pixels
+            // out of the mapped buffer
+            image = QImage(data, width, height, QImage::Format_RGBA8888).mirrored();
+            readback.buffer.unmap();
+        }
+        readback.buffer.release();
+        emit imageExported(readback.id, image, readback.complete);
+    }
+    return pending;
+}
+
+void TileRenderer::pollReadbacks()
+{
+    context()->makeCurrent(surface());
+    m_poll_pending = finishReadbacks(false);
+    if (m_poll_pending) {
+        QTimer::singleShot(1, this, SLOT(pollReadbacks()));
+    }
+}
+
+void TileRenderer::startExport()
+{
+    if (m_jobs.empty()) {
+        // stop drawing once the queue runs dry, tiles that arrive late 
+        // would render the last job again
+        m_state.publish(State());
+        return;
+    }
+    const ExportJob& job = m_jobs.front();
+    m_failed.clear();
+    m_export_clock.start();
+    // render once more when the job times out, in case tiles are still
+    // missing and no response arrives in time
+    QTimer::singleShot(job.timeout, this, SLOT(exportTimeout()));
+    m_state.publish(job.state);
+    requestRender();
+}
+
+void TileRenderer::exportTimeout()
+{
+    // stale timeouts of earlier jobs just render the current job again
+    requestRender();
+}
 
-    getTiles(state, tiles, requests); // get the visible map tiles!
+void TileRenderer::uploadFrame(const QMatrix4x4& projection)
+{
+    // Only the projection changes between frames, the tile size and the
+    // palette are written in setup()
+    QOpenGLExtraFunctions *gl = context()->extraFunctions();
+    gl->glBindBuffer(GL_UNIFORM_BUFFER, m_frame_buffer);
+    gl->glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(GLfloat) * 16, projection.constData());
+    gl->glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    gl->glBindBufferBase(GL_UNIFORM_BUFFER, 0, m_frame_buffer);
+}
 
-    // Loop over the tile request list (missing from the cache) and 
-    // update the request map. If the request index isn't already in the map
-    // (which means there is an outstanding request for this tile), emit a
-    // tile request for the index.
-    for (size_t i = 0; i < requests.size(); i++) {
-        std::pair<TileRequestMap::iterator, bool> it = 
-            m_requests.insert(std::make_pair(requests[i], true));
-        if (it.second) {
-            emit requestTile(requests[i]);
+void TileRenderer::setTileUniforms(const TileProgram& program, const TileDrawable& tile, 
+    DrawState& state)
+{
+    // Redundant state filter, most tiles share the unit scale and the
+    // full texture region, so usually only the offset changes
+    QVector4D geometry(tile.scale, tile.offset.x(), tile.offset.y());
+    if (geometry != state.geometry) {
+        glUniform4f(program.geometry, geometry.x(), geometry.y(), geometry.z(), geometry.w());
+        state.geometry = geometry;
+    }
+    QVector4D region(tile.tex_scale, tile.tex_offset.x(), tile.tex_offset.y());
+    if (region != state.region) {
+        glUniform4f(program.region, region.x(), region.y(), region.z(), region.w());
+        state.region = region;
+    }
+    if (program.present < 0) {
+        return; // vector program
+    }
+    int present = tile.image ? 1 : 0;
+    bool regions = false;
+    for (int i = 0; i < RasterLayers; i++) {
+        if (tile.layers[i]) {
+            present |= 2 << i;
+            regions = regions || tile.layer_regions[i] != state.layer_regions[i];
         }
     }
+    if (present != state.present) {
+        glUniform1i(program.present, present);
+        state.present = present;
+    }
+    if (regions) {
+        for (int i = 0; i < RasterLayers; i++) {
+            state.layer_regions[i] = tile.layer_regions[i];
+        }
+        glUniform4fv(program.layer_regions, RasterLayers, 
+            reinterpret_cast<const GLfloat*>(state.layer_regions));
+    }
+}
 
+void TileRenderer::drawRaster(const std::vector<TileDrawable>& tiles)
+{
     // This is render code in all its trivial glory :)
-    float tile_size = float(m_config.tile_size);
-    GLfloat tile_quad[8] = {0.f, 0.f, 0.f, tile_size, tile_size, 0.f, tile_size, tile_size};
-    m_shader->bind();
-	m_shader->setAttributeArray("tile", GL_FLOAT, tile_quad, 2);
-	m_shader->enableAttributeArray("tile");
-    m_shader->setUniformValue("size", QVector2D(tile_size, tile_size));
-    m_shader->setUniformValue("projection", projection);
+    m_raster.program->bind();
+    m_quad.bind();
 
     // Render each tile in the visible list. Note that some TileDrawables 
     // point to TileImage objects at a zoom level above or below the 
-    // current zoom. For these the scale/offset parameters ensure the raster
+    // current zoom. For these the geometry/region uniforms ensure the raster
     // is properly sized and maps the correct (sub)region of the tile texture.
+    // The base tile and its map layers are bound to units 0..MaxLayers-1 and
+    // blended in the fragment shader. Neighbouring tiles mostly share their 
+    // fallback textures, so few units actually change between draws.
+    DrawState state;
     for (size_t i = 0; i < tiles.size(); i++) {
-        tiles[i].image->texture().bind(0);
-        m_shader->setUniformValue("scale", tiles[i].scale);
-        m_shader->setUniformValue("offset", tiles[i].offset);
-        m_shader->setUniformValue("tex_scale", tiles[i].tex_scale);
-        m_shader->setUniformValue("tex_offset", tiles[i].tex_offset);
+        const TileDrawable& tile = tiles[i];
+        for (int unit = 0; unit < m_config.layers(); unit++) {
+            TileImage *image = unit ? tile.layers[unit - 1] : tile.image;
+            GLuint texture = image ? image->texture().textureId() : 0;
+            if (texture && texture != state.textures[unit]) {
+                glActiveTexture(GL_TEXTURE0 + unit);
+                glBindTexture(GL_TEXTURE_2D, texture);
+                state.textures[unit] = texture;
+            }
+        }
+        setTileUniforms(m_raster, tile, state);
         glDrawArrays(GL_TRIANGLE_STRIP, 0, 4); 
-        tiles[i].image->texture().release();
     }
-    m_shader->release();
+    for (int unit = m_config.layers() - 1; unit >= 0; unit--) {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+    m_quad.release();
+    m_raster.program->release();
+}
+
+void TileRenderer::drawVector(const std::vector<TileDrawable>& tiles)
+{
+    m_vector.program->bind();
+    m_vector_vao.bind();
+
+    // Vector geometry extends past the tile edges (and past the subregion
+    // for parent tiles), so each tile is clipped to its quad
+    DrawState state;
+    for (GLenum plane = GL_CLIP_DISTANCE0; plane <= GL_CLIP_DISTANCE3; plane++) {
+        glEnable(plane);
+    }
+    for (size_t i = 0; i < tiles.size(); i++) {
+        TileImage *image = tiles[i].image;
+        if (!image->count()) {
+            continue; // nothing drawable in this tile
+        }
+        setTileUniforms(m_vector, tiles[i], state);
 
-    // Manual swap buffers is necessary for QWindow surfaces
-    context()->swapBuffers(surface());
+        // the attribute locations are fixed in the shader layout
+        image->vertices().bind();
+        image->indices().bind();
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, VectorMesh::Stride * sizeof(float), 0);
+        glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, VectorMesh::Stride * sizeof(float), 
+            reinterpret_cast<const void*>(2 * sizeof(float)));
+        glDrawElements(GL_TRIANGLES, image->count(), GL_UNSIGNED_INT, 0);
+    }
+    for (GLenum plane = GL_CLIP_DISTANCE0; plane <= GL_CLIP_DISTANCE3; plane++) {
+        glDisable(plane);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    m_vector_vao.release();
+    m_vector.program->release();
 }
 
 void TileRenderer::setState(const State& state) {
-    m_mutex.lock();
-    m_state = state;
-    if (m_render_requests == 0) {
-        m_render_requests++;
-        // post a render request corresponding to this state update
+    // publish without blocking and post a render request for it
+    m_state.publish(state);
+    requestRender();
+}
+
+void TileRenderer::updateOverlay(const OverlayUpdateList& updates) {
+    if (m_overlays.update(updates)) {
+        requestRender();
+    }
+}
+
+void TileRenderer::exportImage(const ExportJob& job) {
+    QCoreApplication::postEvent(this, new TileRenderer::ExportRequest(job));
+}
+
+void TileRenderer::requestRender() {
+    if (!m_render_pending.exchange(true)) {
         QCoreApplication::postEvent(this, new TileRenderer::RenderRequest());
     }
-    m_mutex.unlock();
 }
 
 TileRenderer::State TileRenderer::getState() {
-    State state;
-    m_mutex.lock();
-    state = m_state;
-    if (m_render_requests > 0) {
-        m_render_requests--;
-        // If there are outstanding render requests (possibly due to map tile
-        // updates) post another render request to the event queue.
-        if (m_render_requests > 0) {
-            QCoreApplication::postEvent(this, new TileRenderer::RenderRequest());
-        }
+    return m_state.read();
+}
+
+bool TileRenderer::queryTile(const TileIndex& index, TileImage*& image) {
+    TileHandle handle;
+    if (!m_caches[index.layer()].query(index, handle)) {
+        return false;
+    }
+    // the cache holds a reference, so the handle can only be stale if
+    // the fetcher released a tile too early
+    image = m_pool.get(handle);
+    if (!image) {
+        qCritical() << "Stale tile handle for tile:" << index.string();
+        return false;
     }
-    m_mutex.unlock();
-    return state;
+    return true;
 }
 
-void TileRenderer::tileEvicted(TileImage* tile) {
-    // emit a request for the TileFetcher to delete the tile image
-    emit deleteTile(tile);
+void TileRenderer::tileEvicted(const TileHandle& tile) {
+    // queue the tile image for deletion by the TileFetcher, the batch is
+    // emitted once the current response batch is inserted. The cells
+    // drawing the tile must drop it before the next frame.
+    TileImage *image = m_pool.get(tile);
+    if (image) {
+        TileTracer::mark(TileTracer::Evicted, image->index());
+        invalidateTile(image->index());
+        m_partial.erase(image->index());
+        m_undrawn.erase(image->index());
+    }
+    m_evicted.push_back(tile);
+}
+
+// This method keeps the visible tile grid up to date for the given state. The
+// grid persists between frames: a pan only resolves the cells that entered
+// the view, and a tile response or eviction only the cells that can draw the
+// tile. Resolving a cell queries the tile cache for its index. If the tile is
+// in the cache, it goes into a TileDrawable object to be rendered. If not, 
+// the cell falls back to cached tiles above or below it in the image pyramid
+// and its index is requested from the TileFetcher. The drawable list is only
+// rebuilt when a cell changed, its offsets are relative to the grid origin 
+// and 'translation' moves the origin to the viewport. The map layers of a 
+// cell are resolved the same way and attached to its drawables.
+void TileRenderer::updateVisible(const State& state, QVector2D& translation)
+{
+    // use the shift/mask specializations for the common tile sizes
+    switch (m_config.tile_size) {
+        case 256: updateVisible(TileGrid<256>(), state, translation); break;
+        case 512: updateVisible(TileGrid<512>(), state, translation); break;
+        default: updateVisible(TileGrid<>(m_config.tile_size), state, translation); break;
+    }
 }
 
-// This method generates a list of visible map tiles for the given state. It simply
-// computes what tiles are inside the current pixel space bounds and queries the tile
-// cache for each index. If the tile is in the cache, it goes into a TileDrawable object
-// to be immidediately rendered. If not, the index goes into the the 'requests' vector
-// to be requested from the TileFetcher.
-void TileRenderer::getTiles(const State& state, std::vector<TileDrawable>& tiles, 
-        std::vector<TileIndex>& requests)
+template <typename Grid>
+void TileRenderer::updateVisible(const Grid& grid, const State& state, QVector2D& translation)
 {
-    int size = m_config.tile_size;
-    int pixels = int(pow(2.0, state.zoom())); // note we assume a 32bit limit here
-
-    int x1, y1, x2, y2;
-    // get the four corners of the pixel space map bounds
-    state.bounds().getCoords(&x1, &y1, &x2, &y2);
-
-    // computes offsets relative to an orthographic projection starting at 0,0
-    // The modulo operator simply gives the portion of the top left tile that
-    // is out of view in the current map viewport
-    int xoffset = -(x1 % size);
-    int yoffset = -(y1 % size);
-
-    // This logic implements longitudinal wrapping
-    int x1_shift = ((x1 < 0)?1:0);
-    int x2_shift = ((x2 < 0)?1:0);
-    int x_shift = ((x1 < 0)?size:0);
-
-    x1 /= size; x2 /= size; y1 /= size; y2 /= size;
-    x1 -= x1_shift;
-    x2 -= x2_shift;
-    xoffset -= x_shift;
-  
-    // rasterize the quad of visible map tiles in x and y
-    int yy = 0;
-    for (int y = y1; y <= y2; y++) {
-        int xx = 0;
-        for (int x = x1; x <= x2; x++) {
-            int xwrap = x;
-            // More nasty logic for logitudinal wrapping. There is probably
-            // a much clearner way to do this, but whatever...
-            if (xwrap < 0) {
-                while (xwrap < 0) { xwrap += pixels; }
-            } else if (xwrap >= pixels) {
-                xwrap %= pixels;
+    const int size = grid.size();
+    VisibleGrid& visible = m_visible;
+
+    // Scan convert the viewport, which the bearing turns about its center,
+    // into the tiles it overlaps. Without a bearing these are the tiles of
+    // the map bounds, with one the corners of their bounding box are left 
+    // out rather than fetched and drawn.
+    QPointF corners[4];
+    state.viewport(corners);
+    TileSpans spans;
+    TileMath::coverConvex(size, corners, 4, spans);
+    int x1 = INT_MAX, x2 = INT_MIN;
+    for (size_t i = 0; i < spans.rows.size(); i++) {
+        if (spans.rows[i].first <= spans.rows[i].second) {
+            x1 = std::min(x1, spans.rows[i].first);
+            x2 = std::max(x2, spans.rows[i].second);
+        }
+    }
+    if (x1 > x2) {
+        x1 = x2 = 0; // an empty viewport still has one cell
+    }
+    int y1 = spans.y1;
+    int columns = x2 - x1 + 1, rows = int(spans.rows.size());
+
+    // The translation moves the grid origin to the top left of the map 
+    // bounds, so it stays within a few screens. Only these small offsets
+    // reach the GPU, the 64-bit pixel position of the viewport never does.
+    const PixelRect& bounds = state.bounds();
+    translation = QVector2D(float((qint64(x1) << grid.shift()) - bounds.left()), 
+        float((qint64(y1) << grid.shift()) - bounds.top()));
+
+    // A new zoom level, or a new fallback direction, invalidates every cell
+    if (state.zoom() != visible.zoom || state.zoomedOut() != visible.zoomed_out) {
+        visible.zoom = state.zoom();
+        visible.zoomed_out = state.zoomedOut();
+        for (size_t i = 0; i < visible.cells.size(); i++) {
+            dropCell(visible.cells[i]);
+        }
+        visible.cells.clear();
+        visible.columns = visible.rows = 0;
+        visible.spans = TileSpans();
+    }
+    // A new time frame resolves every cell again, until then the cells
+    // keep drawing the previous frame
+    if (state.frame() != visible.frame) {
+        visible.shown_frame = visible.frame;
+        visible.frame = state.frame();
+        for (size_t i = 0; i < visible.cells.size(); i++) {
+            visible.cells[i].dirty = true;
+        }
+        visible.dirty = true;
+    }
+    // Shift the grid to the visible range, keeping the resolved cells that
+    // stay in view
+    if (x1 != visible.x1 || y1 != visible.y1 || 
+        columns != visible.columns || rows != visible.rows) {
+        std::vector<VisibleCell> cells(size_t(columns * rows));
+        for (int y = 0; y < visible.rows; y++) {
+            int cy = y + visible.y1 - y1;
+            if (cy < 0 || cy >= rows) {
+                continue;
             }
-            if (y >= 0 && y < pixels) {
-                TileIndex index(state.zoom(), xwrap, y);
-                TileImage* image;
-                // query the cache for the current tile index
-                if (m_cache.query(index, image)) {
-                    // tile is in the cache, so use the TileImage directly
-                    TileDrawable tile;
-                    tile.offset = QVector2D(xoffset + xx * size, yoffset + yy * size);
-                    tile.image = image;
-                    tiles.push_back(tile);
-                } else {
-                    // Tile is not in the cache, so try to reuse tiles from above and below
-                    // in the image pyramid
-                    if (state.zoomedIn()) {
-                        // If we zoomed in, query for the parent tile and configure the
-                        // drawable to use the correct subregion of its texture
-                        TileIndex index(state.zoom() - 1, x/2, y/2);
-                        TileImage* image;
-                        if (m_cache.query(index, image)) {
-                            TileDrawable tile;
-                            tile.offset = QVector2D(xoffset + xx * size, yoffset + yy * size);
-                            tile.image = image;
-                            tile.tex_scale = QVector2D(0.5f, 0.5f);
-                            tile.tex_offset = QVector2D(0.5f * (x%2), 0.5f * (y%2));
-                            tiles.push_back(tile);
-                        }
-                    } else if (state.zoomedOut()) {
-                        // If we zoomed out, query for the 4 child tiles and modify the
-                        // drawable scale/offset to render them at the proper size/location
-                        TileIndex index_tl(state.zoom() + 1, xwrap * 2,     y * 2);
-                        TileIndex index_tr(state.zoom() + 1, xwrap * 2 + 1, y * 2);
-                        TileIndex index_br(state.zoom() + 1, xwrap * 2 + 1, y * 2 + 1);
-                        TileIndex index_bl(state.zoom() + 1, xwrap * 2,     y * 2 + 1);
-                        TileImage* image;
-                        TileDrawable tile; // used for all four children
-                        tile.scale = QVector2D(0.5f,0.5f); // 1/4th the size
-
-                        if (m_cache.query(index_tl, image)) {
-                            tile.offset = QVector2D(xoffset + xx * size, yoffset + yy * size);
-                            tile.image = image;
-                            tiles.push_back(tile);
-                        }
-                        if (m_cache.query(index_tr, image)) {
-                            tile.offset = QVector2D(xoffset + xx * size + size / 2, yoffset + yy * size);
-                            tile.image = image;
-                            tiles.push_back(tile);
-                        }
-                        if (m_cache.query(index_br, image)) {
-                            tile.offset = QVector2D(xoffset + xx * size + size / 2, yoffset + yy * size + size / 2);
-                            tile.image = image;
-                            tiles.push_back(tile);
-                        }
-                        if (m_cache.query(index_bl, image)) {
-                            tile.offset = QVector2D(xoffset + xx * size, yoffset + yy * size + size / 2);
-                            tile.image = image;
-                            tiles.push_back(tile);
+            for (int x = 0; x < visible.columns; x++) {
+                int cx = x + visible.x1 - x1;
+                if (cx >= 0 && cx < columns) {
+                    std::swap(cells[size_t(cy * columns + cx)], 
+                        visible.cells[size_t(y * visible.columns + x)]);
+                }
+            }
+        }
+        visible.cells.swap(cells);
+        // the cells that weren't moved over went out of view
+        for (size_t i = 0; i < cells.size(); i++) {
+            dropCell(cells[i]);
+        }
+        visible.x1 = x1;
+        visible.y1 = y1;
+        visible.columns = columns;
+        visible.rows = rows;
+        visible.changed = true;
+    }
+
+    // Cells that left the viewport are emptied, and those that entered it
+    // are resolved with the dirty ones
+    if (spans != visible.spans) {
+        visible.spans.y1 = spans.y1;
+        visible.spans.rows.swap(spans.rows);
+        visible.changed = true;
+    }
+    if (visible.changed || visible.dirty) {
+        for (int y = 0; y < rows; y++) {
+            const std::pair<int, int>& span = visible.spans.rows[size_t(y)];
+            for (int x = 0; x < columns; x++) {
+                VisibleCell& cell = visible.cells[size_t(y * columns + x)];
+                bool covered = x1 + x >= span.first && x1 + x <= span.second;
+                if (!covered) {
+                    if (cell.covered) {
+                        dropCell(cell);
+                        cell.tiles.clear();
+                        cell.covered = false;
+                        visible.changed = true;
+                    }
+                    cell.dirty = true;
+                    continue;
+                }
+                cell.covered = true;
+                if (cell.dirty) {
+                    resolveCell(size, x1 + x, y1 + y, cell);
+                    visible.changed = true;
+                }
+            }
+        }
+        visible.dirty = false;
+    }
+    if (!visible.changed) {
+        return;
+    }
+
+    // Rebuild the drawable and missing lists. Touching the drawn tiles
+    // keeps tiles in view at the young end of the LRU cache.
+    visible.tiles.clear();
+    visible.missing.clear();
+    TileHandle handle;
+    for (int y = 0; y < rows; y++) {
+        for (int x = 0; x < columns; x++) {
+            const VisibleCell& cell = visible.cells[size_t(y * columns + x)];
+            QVector2D origin(float(x * size), float(y * size));
+            for (size_t i = 0; i < cell.tiles.size(); i++) {
+                TileDrawable tile = cell.tiles[i];
+                tile.offset += origin;
+                visible.tiles.push_back(tile);
+                for (int layer = 0; layer < m_config.layers(); layer++) {
+                    TileImage *image = layer ? tile.layers[layer - 1] : tile.image;
+                    if (image) {
+                        m_caches[layer].query(image->index(), handle);
+                        if (!m_undrawn.empty() && m_undrawn.erase(image->index())) {
+                            TileTracer::mark(TileTracer::Drawn, image->index());
                         }
                     }
-                    requests.push_back(index);
                 }
             }
-            xx++;
-        } // x tile index
-        yy++;
-    } // y tile index
+            visible.missing.insert(visible.missing.end(), 
+                cell.missing.begin(), cell.missing.end());
+        }
+    }
+    if (!m_dropped.empty()) {
+        cancelDropped();
+    }
+    if (m_config.prefetch_frames > 0) {
+        visible.prefetched = prefetchFrames();
+    }
+    visible.changed = false;
+}
+
+size_t TileRenderer::prefetchFrames()
+{
+    // The tiles of the next frames in view are requested like visible 
+    // tiles, nearest frame first, but they don't count as missing. They
+    // stay in the caches, which grow by the prefetch budget, while the 
+    // expired frames behind the playhead age out of the LRU order and 
+    // their tile pool records are reused. There are fewer frames ahead 
+    // at Reduced quality and none at Coarse.
+    const VisibleGrid& visible = m_visible;
+    const int pixels = 1 << visible.zoom;
+    int frames = m_config.prefetch_frames;
+    if (m_quality.level() != QualityController::Full) {
+        frames = m_quality.level() == QualityController::Reduced ? frames / 2 : 0;
+    }
+    size_t tiles = 0;
+    TileImage* image;
+    for (int frame = 1; frame <= frames && frame < m_config.frames; frame++) {
+        for (int y = 0; y < visible.rows; y++) {
+            int ty = visible.y1 + y;
+            if (ty < 0 || ty >= pixels) {
+                continue;
+            }
+            for (int x = 0; x < visible.columns; x++) {
+                if (!visible.cells[size_t(y * visible.columns + x)].covered) {
+                    continue;
+                }
+                for (int layer = 0; layer < m_config.layers(); layer++) {
+                    if (!m_config.timed[layer]) {
+                        continue;
+                    }
+                    if (tiles == m_config.prefetch_tiles) {
+                        return tiles;
+                    }
+                    tiles++;
+                    // querying a cached tile keeps it young in the cache
+                    TileIndex index = tileIndex(visible.zoom, (visible.x1 + x) & (pixels - 1), 
+                        ty, layer, frame);
+                    if (!queryTile(index, image) && 
+                        m_requests.insert(std::make_pair(index, true)).second) {
+                        m_new_requests.push_back(index);
+                        TileTracer::mark(TileTracer::Requested, index);
+                    }
+                }
+            }
+        }
+    }
+    return tiles;
+}
+
+TileIndex TileRenderer::tileIndex(int zoom, int x, int y, int layer, int frame_offset) const
+{
+    if (!m_config.timed[layer] || m_config.frames == 0) {
+        return TileIndex(zoom, x, y, layer);
+    }
+    int frame = (m_visible.frame + frame_offset) % m_config.frames;
+    return TileIndex(zoom, x, y, layer, frame < 0 ? frame + m_config.frames : frame);
+}
+
+bool TileRenderer::queryPreviousFrame(const TileIndex& index, TileImage*& image)
+{
+    // the shown frame, not the one before in time, which is a different
+    // frame when the playback steps backwards or jumps
+    int frame = m_visible.shown_frame;
+    if (!m_config.timed[index.layer()] || frame == index.frame()) {
+        return false;
+    }
+    return queryTile(TileIndex(index.zoom(), index.x(), index.y(), index.layer(), frame), image);
+}
+
+void TileRenderer::resolveCell(int size, int x, int y, VisibleCell& cell)
+{
+    const int pixels = 1 << m_visible.zoom; // tiles per row/column
+    const int wrap = pixels - 1;            // mask for longitudinal wrapping
+    const int zoom = m_visible.zoom;
+    cell.tiles.clear();
+    cell.missing.clear();
+    cell.dirty = false;
+    if (y < 0 || y >= pixels) {
+        return; // outside of the world
+    }
+    // longitudinal wrapping, the mask also wraps negative tiles
+    int xwrap = x & wrap;
+    cell.index = tileIndex(zoom, xwrap, y, 0);
+    TileImage* image;
+    // query the cache for the current tile index
+    if (queryTile(cell.index, image)) {
+        // tile is in the cache, so use the TileImage directly
+        TileDrawable tile;
+        tile.image = image;
+        cell.tiles.push_back(tile);
+        // A partial tile is still downloading, keep it requested. After 
+        // a failed or cancelled download this requests it again. A lite
+        // tile is requested again in full once the network is clear.
+        if (m_partial.count(cell.index) || (image->lite() && !m_congested &&
+            m_quality.level() != QualityController::Coarse)) {
+            requestTile(cell.index, cell);
+        }
+    } else {
+        resolveFallback(size, xwrap, y, cell);
+        requestVisible(cell.index, cell);
+    }
+    if (m_config.layers() > 1) {
+        resolveLayers(size, xwrap, y, cell);
+    }
+}
+
+void TileRenderer::requestTile(const TileIndex& index, VisibleCell& cell)
+{
+    // Request the tile unless there is already an outstanding request for
+    // it, new requests go to the fetcher in one batch at the end of the frame
+    cell.missing.push_back(index);
+    if (m_requests.insert(std::make_pair(index, true)).second) {
+        m_new_requests.push_back(index);
+        TileTracer::mark(TileTracer::Requested, index);
+    }
+}
+
+void TileRenderer::dropCell(VisibleCell& cell)
+{
+    m_dropped.insert(m_dropped.end(), cell.missing.begin(), cell.missing.end());
+    cell.missing.clear();
+}
+
+void TileRenderer::cancelDropped()
+{
+    // Tiles still missing from a cell in view, e.g. a parent requested
+    // for several cells at Coarse quality, stay requested
+    std::set<TileIndex> missing(m_visible.missing.begin(), m_visible.missing.end());
+    for (size_t i = 0; i < m_dropped.size(); i++) {
+        const TileIndex& index = m_dropped[i];
+        if (!missing.count(index) && m_requests.erase(index)) {
+            m_cancelled.push_back(index);
+        }
+    }
+    m_dropped.clear();
+}
+
+void TileRenderer::requestVisible(const TileIndex& index, VisibleCell& cell)
+{
+    // At Coarse quality the parent is fetched instead, the fallback draws 
+    // its subregion. Nothing is missing once the parent is cached.
+    if (m_quality.level() == QualityController::Coarse && index.zoom() > 0) {
+        TileIndex parent(index.zoom() - 1, index.x() >> 1, index.y() >> 1, 
+            index.layer(), index.frame());
+        TileImage *image;
+        if (!queryTile(parent, image)) {
+            requestTile(parent, cell);
+        }
+        return;
+    }
+    requestTile(index, cell);
+}
+
+void TileRenderer::resolveLayers(int size, int xwrap, int y, VisibleCell& cell)
+{
+    // Each layer uses its own tile or else the subregion of its nearest
+    // cached ancestor. Regions are in the texture space of the whole cell.
+    const int zoom = m_visible.zoom;
+    TileImage *images[RasterLayers];
+    QVector4D regions[RasterLayers];
+    bool found = false;
+    for (int layer = 1; layer < m_config.layers(); layer++) {
+        TileImage*& image = images[layer - 1];
+        image = NULL;
+        TileIndex index = tileIndex(zoom, xwrap, y, layer);
+        bool cached = queryTile(index, image);
+        if (cached || queryPreviousFrame(index, image)) {
+            regions[layer - 1] = QVector4D(1.f, 1.f, 0.f, 0.f);
+        } else {
+            for (int level = 1; level <= zoom; level++) {
+                TileIndex parent = tileIndex(zoom - level, xwrap >> level, y >> level, layer);
+                if (queryTile(parent, image)) {
+                    int mask = (1 << level) - 1;
+                    float scale = 1.f / float(1 << level);
+                    regions[layer - 1] = QVector4D(scale, scale, 
+                        scale * (xwrap & mask), scale * (y & mask));
+                    break;
+                }
+            }
+        }
+        if (!cached) {
+            requestVisible(index, cell);
+        } else if (m_partial.count(index)) {
+            requestTile(index, cell);
+        }
+        found = found || image;
+    }
+    for (int layer = m_config.layers(); layer <= RasterLayers; layer++) {
+        images[layer - 1] = NULL;
+    }
+    if (!found) {
+        return;
+    }
+
+    // The layers are drawn with the base drawables, so the parts of the
+    // cell without a base tile get drawables with just the layers
+    if (cell.tiles.empty()) {
+        cell.tiles.push_back(TileDrawable());
+    } else if (cell.tiles[0].scale.x() < 1.f) {
+        int children = 0;
+        for (size_t i = 0; i < cell.tiles.size(); i++) {
+            children |= 1 << ((cell.tiles[i].offset.x() > 0.f ? 1 : 0) + 
+                (cell.tiles[i].offset.y() > 0.f ? 2 : 0));
+        }
+        for (int child = 0; child < 4; child++) {
+            if (!(children & (1 << child))) {
+                TileDrawable tile;
+                tile.scale = QVector2D(0.5f, 0.5f);
+                tile.offset = QVector2D((child & 1) * size / 2, (child >> 1) * size / 2);
+                cell.tiles.push_back(tile);
+            }
+        }
+    }
+    // map each cell region onto the quad of the drawable
+    for (size_t i = 0; i < cell.tiles.size(); i++) {
+        TileDrawable& tile = cell.tiles[i];
+        QVector2D origin = tile.offset / float(size);
+        for (int l = 0; l < RasterLayers; l++) {
+            tile.layers[l] = images[l];
+            if (images[l]) {
+                const QVector4D& region = regions[l];
+                tile.layer_regions[l] = QVector4D(
+                    region.x() * tile.scale.x(), region.y() * tile.scale.y(),
+                    region.x() * origin.x() + region.z(), region.y() * origin.y() + region.w());
+            }
+        }
+    }
 }
 
-void TileRenderer::tileResponse(TileImage* tile)
+void TileRenderer::resolveFallback(int size, int xwrap, int y, VisibleCell& cell)
 {
-    m_requests.erase(tile->index());
+    const int zoom = m_visible.zoom;
+    TileImage* image;
+    // A timed tile keeps showing the frame shown before while it loads
+    if (queryPreviousFrame(cell.index, image)) {
+        TileDrawable tile;
+        tile.image = image;
+        cell.tiles.push_back(tile);
+        return;
+    }
+    // Tile is not in the cache, so try to reuse tiles from above and below
+    // in the image pyramid. Below Full quality the children are skipped, 
+    // the ancestor is a single draw.
+    if (m_visible.zoomed_out && m_quality.level() == QualityController::Full) {
+        // If we zoomed out, query for the 4 child tiles and modify the
+        // drawable scale/offset to render them at the proper size/location
+        TileDrawable tile; // used for all four children
+        tile.scale = QVector2D(0.5f,0.5f); // 1/4th the size
+        for (int child = 0; child < 4; child++) {
+            int cx = child & 1, cy = child >> 1;
+            if (queryTile(tileIndex(zoom + 1, xwrap * 2 + cx, y * 2 + cy, 0), image)) {
+                tile.offset = QVector2D(cx * size / 2, cy * size / 2);
+                tile.image = image;
+                cell.tiles.push_back(tile);
+            }
+        }
+    }
+    if (cell.tiles.empty()) {
+        // Otherwise query for the nearest cached ancestor and configure the
+        // drawable to use the correct subregion of its texture. This also
+        // keeps the map filled while a tile waits out a fetch backoff or
+        // the tile server is unhealthy.
+        for (int level = 1; level <= zoom; level++) {
+            TileIndex parent = tileIndex(zoom - level, xwrap >> level, y >> level, 0);
+            if (queryTile(parent, image)) {
+                int mask = (1 << level) - 1;
+                float scale = 1.f / float(1 << level);
+                TileDrawable tile;
+                tile.image = image;
+                tile.tex_scale = QVector2D(scale, scale);
+                tile.tex_offset = QVector2D(scale * (xwrap & mask), scale * (y & mask));
+                cell.tiles.push_back(tile);
+                break;
+            }
+        }
+    }
+}
 
-    if (tile->valid()) {
-        m_cache.insert(tile->index(), tile);
-        m_mutex.lock();
-        if (!m_render_requests) {
-            m_render_requests++;
-            QCoreApplication::postEvent(this, new TileRenderer::RenderRequest());
+void TileRenderer::invalidateTile(const TileIndex& index)
+{
+    // Mark the cells that can draw 'index': the cells it covers at the grid
+    // zoom or above, or its parent cell when children fill in after a zoom
+    // out. Cells are matched on their wrapped tile column.
+    VisibleGrid& visible = m_visible;
+    if (visible.cells.empty()) {
+        return;
+    }
+    // tiles of the other time frames, like the prefetched ones, aren't
+    // drawn by any cell. The cells still loading the visible frame draw
+    // the shown frame as a stand-in, so its evictions must reach them.
+    if (m_config.timed[index.layer()] && index.frame() != visible.frame &&
+        index.frame() != visible.shown_frame) {
+        return;
+    }
+    int lo_x, hi_x, lo_y, hi_y;
+    if (index.zoom() <= visible.zoom) {
+        int d = visible.zoom - index.zoom();
+        lo_x = index.x() << d;
+        hi_x = ((index.x() + 1) << d) - 1;
+        lo_y = index.y() << d;
+        hi_y = ((index.y() + 1) << d) - 1;
+    } else if (index.zoom() == visible.zoom + 1 && visible.zoomed_out) {
+        lo_x = hi_x = index.x() >> 1;
+        lo_y = hi_y = index.y() >> 1;
+    } else {
+        return;
+    }
+    const int wrap = (1 << visible.zoom) - 1;
+    for (int y = std::max(lo_y - visible.y1, 0); 
+        y <= std::min(hi_y - visible.y1, visible.rows - 1); y++) {
+        for (int x = 0; x < visible.columns; x++) {
+            int xwrap = (visible.x1 + x) & wrap;
+            if (xwrap >= lo_x && xwrap <= hi_x) {
+                visible.cells[size_t(y * visible.columns + x)].dirty = true;
+                visible.dirty = true;
+            }
         }
-        m_mutex.unlock();
     }
 }
 
+void TileRenderer::networkCongested(bool congested)
+{
+    m_congested = congested;
+    // without a level change the cells are still resolved again, so 
+    // the lite tiles in view are requested in full
+    if (m_quality.setCongested(congested) || !congested) {
+        qualityChanged();
+    }
+}
+
+void TileRenderer::qualityChanged()
+{
+    for (size_t i = 0; i < m_visible.cells.size(); i++) {
+        m_visible.cells[i].dirty = true;
+    }
+    m_visible.dirty = true;
+    requestRender();
+}
+
+void TileRenderer::tileResponses(const TileResponseList& tiles)
+{
+    bool inserted = false;
+    for (size_t i = 0; i < tiles.size(); i++) {
+        const TileResponse& tile = tiles[i];
+        // a partial tile is drawn, but the request stays outstanding 
+        // until the final response
+        if (!tile.partial) {
+            m_requests.erase(tile.index);
+        }
+
+        TileTracer::mark(TileTracer::Delivered, tile.index);
+        // failed or cancelled tiles come back with a null handle
+        if (!tile.handle.isNull()) {
+            if (TileTracer::enabled()) {
+                m_undrawn.insert(tile.index);
+            }
+            // inserting a handle again evicts the previous reference
+            m_caches[tile.index.layer()].insert(tile.index, tile.handle);
+            if (tile.partial) {
+                m_partial.insert(tile.index);
+            } else {
+                m_partial.erase(tile.index);
+            }
+            inserted = true;
+        } else if (m_headless) {
+            m_failed.insert(tile.index);
+        }
+        // a failed tile is requested again when its cell is resolved
+        invalidateTile(tile.index);
+    }
+    if (!m_evicted.empty()) {
+        emit deleteTiles(m_evicted);
+        m_evicted.clear();
+    }
+    // a failed tile can also complete an export job
+    if (inserted || (m_headless && !tiles.empty())) {
+        requestRender();
+    }
+}
+
+// Compiles and links a tile shader program and resolves its per-tile 
+// uniform locations, so the draw loops never look up a name. The linked
+// program binary is cached on disk by Qt (glProgramBinary), so after the 
+// first run the renderers start without compiling; compile errors are 
+// then reported by the link.
+static void buildProgram(const char* name, const char* vertex, const char* fragment,
+    QOpenGLShaderProgram*& program, int& geometry, int& region)
+{
+    program = new QOpenGLShaderProgram;
+    if (!program->addCacheableShaderFromSourceCode(QOpenGLShader::Vertex, vertex)) {
+        qWarning() << name << "vertex shader compile error: " << program->log();
+    }
+    if (!program->addCacheableShaderFromSourceCode(QOpenGLShader::Fragment, fragment)) {
+        qWarning() << name << "fragment shader compile error: " << program->log();
+    }
+    if (!program->link()) {
+        qWarning() << name << "shader program link error: " << program->log();
+    }
+    geometry = program->uniformLocation("geometry");
+    region = program->uniformLocation("region");
+}
+
 void TileRenderer::setup()
 {
-    m_shader = new QGLShaderProgram;
-	if (!m_shader->addShaderFromSourceCode(QGLShader::Vertex, std::string(VertexShader).c_str())) {
-		qWarning() << "Vertex shader compile error: " << m_shader->log();
-	}
-	if (!m_shader->addShaderFromSourceCode(QGLShader::Fragment, std::string(FragmentShader).c_str())) {
-		qWarning() << "Fragment shader compile error: " << m_shader->log();
-	}
-	if (!m_shader->link()) {
-		qWarning() << "Shader program link error: " << m_shader->log();
-	}
+    buildProgram("Raster", VertexShader, FragmentShader, 
+        m_raster.program, m_raster.geometry, m_raster.region);
+    m_raster.present = m_raster.program->uniformLocation("present");
+    m_raster.layer_regions = m_raster.program->uniformLocation("layer_regions");
+    m_raster.program->bind();
+    m_raster.program->setUniformValue("tile", 0); // texture unit 0
+    // map layer i samples texture unit i+1
+    static const GLint units[RasterLayers] = {1, 2, 3};
+    glUniform1iv(m_raster.program->uniformLocation("layers"), RasterLayers, units);
+    m_raster.program->release();
+    buildProgram("Vector", VectorVertexShader, VectorFragmentShader, 
+        m_vector.program, m_vector.geometry, m_vector.region);
+
+    // The unit quad lives in a static buffer captured by the quad VAO
+    static const GLfloat quad[8] = {0.f, 0.f, 0.f, 1.f, 1.f, 0.f, 1.f, 1.f};
+    m_quad.create();
+    m_quad.bind();
+    m_quad_buffer.create();
+    m_quad_buffer.bind();
+    m_quad_buffer.allocate(quad, sizeof(quad));
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
+    m_quad.release();
+    m_quad_buffer.release();
+    // the vector VAO keeps both attributes enabled, the pointers change
+    // with every tile mesh
+    m_vector_vao.create();
+    m_vector_vao.bind();
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    m_vector_vao.release();
+
+    // The frame uniform buffer, everything but the projection is constant
+    FrameBlock frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.size[0] = frame.size[1] = float(m_config.tile_size);
+    memcpy(frame.palette, VectorTileDecoder::palette(), 
+        sizeof(GLfloat) * 4 * VectorTileDecoder::StyleCount);
+    for (int i = 0; i < m_config.layers(); i++) {
+        frame.opacity[i] = m_config.opacity[i];
+    }
+    // the clear color, which shows through transparent tiles
+    frame.background[0] = frame.background[1] = frame.background[2] = 0.85f;
+    frame.background[3] = 1.f;
+    QOpenGLExtraFunctions *gl = context()->extraFunctions();
+    gl->glGenBuffers(1, &m_frame_buffer);
+    gl->glBindBuffer(GL_UNIFORM_BUFFER, m_frame_buffer);
+    gl->glBufferData(GL_UNIFORM_BUFFER, sizeof(frame), &frame, GL_DYNAMIC_DRAW);
+    gl->glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+    m_overlays.setup();
 }
 
 void TileRenderer::shutdown()
 {
-    m_shader->removeAllShaders();
-    delete m_shader;
-    m_shader = NULL;
+    // The event loop is done, but tileResponses() calls the fetcher
+    // queued before it dropped this renderer may still be pending. Their
+    // handles hold references, so they go into the caches and are 
+    // released with them.
+    QCoreApplication::sendPostedEvents(this, QEvent::MetaCall);
+    // hand every cached tile back to the fetcher, which may outlive
+    // this renderer when it is shared with other views
+    for (size_t i = 0; i < m_caches.size(); i++) {
+        m_caches[i].clear();
+    }
+    if (!m_evicted.empty()) {
+        emit deleteTiles(m_evicted);
+        m_evicted.clear();
+    }
+
+    // drop the export frames still in flight
+    for (int i = 0; i < ReadbackCount; i++) {
+        if (m_readbacks[i].fence) {
+            context()->extraFunctions()->glDeleteSync(m_readbacks[i].fence);
+            m_readbacks[i].fence = 0;
+        }
+        m_readbacks[i].buffer.destroy();
+    }
+    delete m_fbo;
+    m_fbo = NULL;
+
+    m_overlays.shutdown();
+    delete m_raster.program;
+    m_raster = TileProgram();
+    delete m_vector.program;
+    m_vector = TileProgram();
+    m_quad.destroy();
+    m_quad_buffer.destroy();
+    m_vector_vao.destroy();
+    glDeleteBuffers(1, &m_frame_buffer);
+    m_frame_buffer = 0;
 }
 
 void TileRenderer::customEvent(QEvent *event) 
 {
     // Handle custom internal event type to trigger a render call
     if (event->type() == RenderRequest::type) {
+        // Clear the pending flag before reading the state, so any state
+        // published from here on posts a new request
+        m_render_pending.store(false);
         render();
+    } else if (event->type() == ExportRequest::type) {
+        m_jobs.push_back(static_cast<ExportRequest*>(event)->job);
+        if (m_jobs.size() == 1) {
+            startExport();
+        }
     } else {
         QObject::event(event);
     }     
@@ -4,13 +4,30 @@
 #include "GLWorker.h"
 #include "TileTypes.h"
 #include "TileCache.h"
+#include "TilePool.h"
 #include "MapConfig.h"
+#include "Overlay.h"
+#include "TripleBuffer.h"
+#include "TileMath.h"
+#include "AdaptiveQuality.h"
 #include <QOpenGLTexture>
+#include <QOpenGLFramebufferObject>
+#include <QOpenGLExtraFunctions>
+#include <QElapsedTimer>
 #include <QVector2D>
-#include <QGLShaderProgram>
-#include <QMutex>
+#include <QMatrix4x4>
+#include <QOpenGLShaderProgram>
+#include <QOpenGLVertexArrayObject>
+#include <QOpenGLBuffer>
+#include <QVector4D>
+#include <QtMath>
+#include <atomic>
+#include <deque>
+#include <set>
 
-// This class implements a basic map tile rendering engine.
+// This class implements a basic map tile rendering engine. A renderer
+// created on a QOffscreenSurface runs headless: it draws into a framebuffer
+// object instead of swapping buffers, and reads back the export jobs.
 class TileRenderer : public GLWorker
 {
     Q_OBJECT
@@ -20,11 +37,12 @@ public:
     // setState() to update the renderer. 
     class State {
     public:
-        State(): m_valid(false), m_last_zoom(-1) {}
+        State(): m_valid(false), m_last_zoom(-1), m_pixel_ratio(1.f), m_frame(0), 
+            m_bearing(0.f) {}
         void setValid() {
             m_valid = true;
         }
-        void setBounds(const QRect& bounds) {
+        void setBounds(const PixelRect& bounds) {
             m_map_bounds = bounds;
         }
         void setZoom(int zoom) {
@@ -35,13 +53,26 @@ public:
             }
             m_zoom = zoom;
         }
+        // map size in device pixels
         void setMapSize(const QSize& size) {
             m_map_size = size;
         }
+        void setPixelRatio(float ratio) {
+            m_pixel_ratio = ratio;
+        }
+        // time frame drawn by the time dimension layers
+        void setFrame(int frame) {
+            m_frame = frame;
+        }
+        // degrees clockwise from north of the screen up direction, the
+        // map turns the other way about the viewport center
+        void setBearing(float bearing) {
+            m_bearing = bearing;
+        }
         bool valid() const {
             return m_valid;
         }
-        const QRect& bounds() const {
+        const PixelRect& bounds() const {
             return m_map_bounds;
         }
         int zoom() const {
@@ -56,25 +87,85 @@ public:
         const QSize& mapSize() const {
             return m_map_size;
         }
+        float pixelRatio() const {
+            return m_pixel_ratio;
+        }
+        int frame() const {
+            return m_frame;
+        }
+        float bearing() const {
+            return m_bearing;
+        }
+        // corners of the viewport in pixel space, which are the map bounds
+        // turned by the bearing about their center
+        void viewport(QPointF* corners) const {
+            QRectF rect = m_map_bounds.toRectF();
+            QPointF center = rect.center();
+            double radians = qDegreesToRadians(double(m_bearing));
+            double c = std::cos(radians), s = std::sin(radians);
+            QPointF points[4] = {rect.topLeft(), rect.topRight(), 
+                rect.bottomRight(), rect.bottomLeft()};
+            for (int i = 0; i < 4; i++) {
+                QPointF d = points[i] - center;
+                corners[i] = center + QPointF(d.x() * c - d.y() * s, d.x() * s + d.y() * c);
+            }
+        }
     private:
         bool m_valid;
-        QRect m_map_bounds;
+        PixelRect m_map_bounds;
         int m_zoom;
         int m_last_zoom;
         QSize m_map_size;
+        float m_pixel_ratio;
+        int m_frame;
+        float m_bearing;
     };
 
-    TileRenderer(const MapConfig& config, QSurface* surface);
+    // A headless export of one map image. The frame is read back once
+    // every tile in view is loaded or failed, or once the timeout passes.
+    struct ExportJob {
+        ExportJob(): id(-1), timeout(0) {}
+        int id;
+        State state;
+        int timeout; // ms to wait for missing tiles
+    };
+
+    // 'shared' is an optional context whose share group the renderer
+    // joins, so it can draw textures created by a shared TileFetcher.
+    // Tile handles are resolved in the fetcher 'pool'.
+    TileRenderer(const MapConfig& config, const TilePool& pool, QSurface* surface, 
+        QOpenGLContext* shared = NULL);
 
     void setState(const State& state);
+    // Queues overlay layer updates for the next frame, safe to call
+    // from any thread
+    void updateOverlay(const OverlayUpdateList& updates);
+    // Queues an export job on a headless renderer, safe to call from 
+    // any thread. Jobs are rendered in order, see imageExported().
+    void exportImage(const ExportJob& job);
 
 public slots:
-    void tileResponse(TileImage* tile);
+    void tileResponses(const TileResponseList& tiles);
+    // the fetcher reports when its downloads fall behind, see 
+    // QualityController
+    void networkCongested(bool congested);
 
 signals:
-    void requestTile(const TileIndex& tile);
-    void deleteTile(TileImage* tile);
+    void requestTiles(const TileIndexList& tiles);
+    void deleteTiles(const TileHandleList& tiles);
     void cancelRequests();
+    // cancels the requests of tiles that went out of view
+    void cancelTiles(const TileIndexList& tiles);
+    // emitted for each export job, 'complete' is false if the job timed 
+    // out with tiles missing. The image is null if the read back failed.
+    void imageExported(int id, const QImage& image, bool complete);
+    // emitted after each frame with its render time, the number of tiles
+    // drawn and the number of visible tiles that were missing
+    void frameRendered(qint64 nsecs, int tiles, int missing);
+
+private slots:
+    void exportTimeout();
+    void pollReadbacks();
 
 protected:
     void customEvent(QEvent *event);
@@ -90,49 +181,238 @@ private:
         static const QEvent::Type type;
     };
 
+    // Event carrying an export job to a headless renderer
+    class ExportRequest : public QEvent {
+    public:
+        ExportRequest(const ExportJob& job): QEvent(type), job(job) {}
+        static const QEvent::Type type;
+
+        ExportJob job;
+    };
+
+    // Pixel pack buffer an exported frame is copied into. The copy runs
+    // asynchronously, the buffer is mapped once the fence signals.
+    struct Readback {
+        Readback(): buffer(QOpenGLBuffer::PixelPackBuffer), fence(0), id(-1), complete(false) {}
+        QOpenGLBuffer buffer;
+        GLsync fence; // set while the copy is in flight
+        QSize size;
+        int id;
+        bool complete;
+    };
+    enum { ReadbackCount = 2 };
+
     struct Config {
         Config(const MapConfig& config)
         : tile_size(config.tile_size),
-        cache_size(config.cache_size) {}
+        vector(config.vectorTiles()),
+        frames(config.times.size()),
+        frame_budget(config.frame_budget),
+        prefetch_frames(config.times.size() > 1 ? config.prefetch_frames : 0),
+        prefetch_tiles((config.prefetch_budget << 20) / 
+            (size_t(config.tile_size) * size_t(config.tile_size) * 4)) {
+            cache_sizes.push_back(config.cache_size);
+            opacity.push_back(1.f);
+            timed.push_back(MapConfig::timedServer(config.server));
+            for (size_t i = 0; i < config.layers.size(); i++) {
+                cache_sizes.push_back(config.layers[i].cache_size);
+                opacity.push_back(config.layers[i].opacity);
+                timed.push_back(MapConfig::timedServer(config.layers[i].server));
+            }
+        }
+        // number of map layers including the base map
+        int layers() const {
+            return int(cache_sizes.size());
+        }
 
         int tile_size;
-        size_t cache_size;
+        std::vector<size_t> cache_sizes; // tile cache size of each layer
+        std::vector<float> opacity;      // opacity of each layer
+        std::vector<bool> timed;         // the layer has time frames
+        bool vector;
+        int frames;           // time frames, see MapConfig::times
+        int frame_budget;     // ms, see QualityController
+        int prefetch_frames;  // frames fetched ahead of the playhead
+        size_t prefetch_tiles; // tiles the prefetch budget holds
     };
 
     State getState();
+    // posts a render request unless one is already outstanding, safe
+    // to call from any thread
+    void requestRender();
+
+    // raster layers composited over the base map tile, not to be 
+    // confused with the overlay layers (see OverlayLayer)
+    enum { RasterLayers = MapConfig::MaxLayers - 1 };
 
     // Helper struct that contains a valid tile image along with
-    // geometry and texture scale/offset values for rendering
+    // geometry and texture scale/offset values for rendering. With map 
+    // layers it also carries the layer images composited over it, each
+    // with its texture subregion (scale xy, offset zw) of the quad. The 
+    // base image is NULL where only layers are cached.
     struct TileDrawable {
         TileDrawable()
             // Default to unit scale and zero offset
             : scale(1.f, 1.f),
               offset(0.f, 0.f),
               tex_scale(1.f, 1.f),
-              tex_offset(0.f, 0.f) {}
+              tex_offset(0.f, 0.f),
+              image(NULL) {
+            for (int i = 0; i < RasterLayers; i++) {
+                layers[i] = NULL;
+            }
+        }
 
         QVector2D scale, offset;
         QVector2D tex_scale, tex_offset;
         TileImage *image;
+        TileImage *layers[RasterLayers];
+        QVector4D layer_regions[RasterLayers];
     };
     typedef std::map<TileIndex, bool> TileRequestMap;
 
+    // A cell of the visible tile grid and the drawables resolved for it,
+    // with offsets relative to the cell
+    struct VisibleCell {
+        VisibleCell(): dirty(true), covered(false) {}
+        std::vector<TileDrawable> tiles;
+        TileIndex index; // wrapped tile index of the cell
+        std::vector<TileIndex> missing; // the cell's own tiles that aren't cached
+        bool dirty;      // must be resolved again
+        bool covered;    // the viewport overlaps the cell, it is empty if not
+    };
+    // The visible tile range kept between frames, see updateVisible(). The
+    // grid spans the bounding box of the viewport, but only the cells the
+    // (rotated) viewport overlaps are resolved, requested and drawn.
+    struct VisibleGrid {
+        VisibleGrid(): zoom(-1), frame(0), shown_frame(0), zoomed_out(false), x1(0), y1(0), 
+            columns(0), rows(0), dirty(false), changed(false), prefetched(0) {}
+        int zoom;
+        int frame;         // time frame of the timed layers
+        int shown_frame;   // time frame shown before 'frame'
+        bool zoomed_out;
+        int x1, y1;        // unwrapped tile of the top left cell
+        int columns, rows;
+        TileSpans spans;   // tiles the viewport overlaps
+        std::vector<VisibleCell> cells; // row major
+        bool dirty;        // some cells are dirty
+        bool changed;      // the drawable list needs a rebuild
+        std::vector<TileDrawable> tiles;  // offsets relative to the grid origin
+        std::vector<TileIndex> missing;   // visible tiles not cached
+        size_t prefetched; // tiles of the frames ahead, see prefetchFrames()
+    };
+
+    // Tile shader program with its per-tile uniform locations, which
+    // are resolved once in setup()
+    struct TileProgram {
+        TileProgram(): program(NULL), geometry(-1), region(-1), present(-1), layer_regions(-1) {}
+        QOpenGLShaderProgram *program;
+        int geometry; // vec4 geometry scale xy, offset zw
+        int region;   // vec4 texture subregion scale xy, offset zw
+        int present;  // bit mask of the bound layer textures (raster only)
+        int layer_regions; // vec4 array of the layer subregions (raster only)
+    };
+    // Last values set while drawing a tile list, so unchanged state
+    // isn't sent again for the next tile
+    struct DrawState {
+        DrawState(): geometry(-1.f, -1.f, -1.f, -1.f), region(-1.f, -1.f, -1.f, -1.f), present(-1) {
+            for (int i = 0; i < MapConfig::MaxLayers; i++) {
+                textures[i] = 0;
+            }
+        }
+        QVector4D geometry;
+        QVector4D region;
+        int present;
+        QVector4D layer_regions[RasterLayers];
+        GLuint textures[MapConfig::MaxLayers]; // per texture unit
+    };
+
     void render();
-    void tileEvicted(TileImage* tile);
-    // this method generates a list of visible map tiles for the given state
-    void getTiles(const State& state, std::vector<TileDrawable>& tiles, 
-        std::vector<TileIndex>& requests);
+    // writes the per-frame uniform block
+    void uploadFrame(const QMatrix4x4& projection);
+    // draw the visible tiles as textured quads or tessellated vector meshes
+    void drawRaster(const std::vector<TileDrawable>& tiles);
+    void drawVector(const std::vector<TileDrawable>& tiles);
+    void setTileUniforms(const TileProgram& program, const TileDrawable& tile, 
+        DrawState& state);
+    // starts the job at the front of the export queue
+    void startExport();
+    // reads back the frame if the current export job is done
+    void exportFrame(const std::vector<TileIndex>& missing);
+    // emits the finished readbacks, 'wait' blocks until all are done.
+    // Returns true if readbacks are still in flight.
+    bool finishReadbacks(bool wait);
+    void tileEvicted(const TileHandle& tile);
+    // returns true and sets 'image' if the tile is in the cache
+    bool queryTile(const TileIndex& index, TileImage*& image);
+    // this method updates the visible map tiles for the given state
+    void updateVisible(const State& state, QVector2D& translation);
+    template <typename Grid>
+    void updateVisible(const Grid& grid, const State& state, QVector2D& translation);
+    // fills 'cell' for the unwrapped tile x,y of the visible zoom
+    void resolveCell(int size, int x, int y, VisibleCell& cell);
+    // fills 'cell' with cached tiles from above or below its missing tile
+    void resolveFallback(int size, int xwrap, int y, VisibleCell& cell);
+    // composites the map layers of 'cell' into its drawables
+    void resolveLayers(int size, int xwrap, int y, VisibleCell& cell);
+    // marks 'index' missing in 'cell' and requests it if needed
+    void requestTile(const TileIndex& index, VisibleCell& cell);
+    // queues the requests of a cell that left the view for cancelling
+    void dropCell(VisibleCell& cell);
+    // cancels the dropped requests no cell in view is missing any more
+    void cancelDropped();
+    // requests a visible tile that isn't cached, which is its parent
+    // at Coarse quality
+    void requestVisible(const TileIndex& index, VisibleCell& cell);
+    // resolves every visible cell again after a quality change
+    void qualityChanged();
+    // index of a visible tile, in the visible frame for timed layers
+    TileIndex tileIndex(int zoom, int x, int y, int layer, int frame_offset = 0) const;
+    // queries a timed tile in the time frame shown before, which stands
+    // in for the tile while it loads
+    bool queryPreviousFrame(const TileIndex& index, TileImage*& image);
+    // requests the visible tiles of the frames ahead of the playhead, 
+    // returns the number of tiles kept for them
+    size_t prefetchFrames();
+    // marks the visible cells that may draw 'index' dirty
+    void invalidateTile(const TileIndex& index);
 
     Config m_config;
-    State m_state;
+    const TilePool& m_pool;
+    // Latest render state published by the MapViewer thread
+    TripleBuffer<State> m_state;
 
-    TileCache m_cache;
+    std::vector<TileCache> m_caches; // one per map layer
     TileRequestMap m_requests;
-    QGLShaderProgram *m_shader;
+    TileIndexList m_new_requests; // requests emitted at the end of a frame
+    TileIndexList m_dropped;      // requests of the cells that left the view
+    TileIndexList m_cancelled;    // cancels emitted at the end of a frame
+    VisibleGrid m_visible;
+    std::set<TileIndex> m_partial; // cached tiles that are still downloading
+    std::set<TileIndex> m_undrawn; // delivered tiles not drawn yet, while tracing
+    TileHandleList m_evicted;     // evictions emitted at the end of a batch
+    TileProgram m_raster;
+    TileProgram m_vector;
+    QOpenGLVertexArrayObject m_quad;       // unit quad of the raster tiles
+    QOpenGLBuffer m_quad_buffer;
+    QOpenGLVertexArrayObject m_vector_vao; // vector tile attribute state
+    GLuint m_frame_buffer;                 // Frame uniform block buffer
+    OverlayRenderer m_overlays;
+    QualityController m_quality;
+    bool m_congested;      // the fetcher reports a congested network
+
+    // Set while a RenderRequest is posted and not yet handled, so that
+    // exactly one render event is outstanding at any time
+    std::atomic<bool> m_render_pending;
 
-    // Used for protecting the render state
-    QMutex m_mutex;
-    size_t m_render_requests;
+    // Headless export state, see ExportJob
+    bool m_headless;
+    std::deque<ExportJob> m_jobs;
+    std::set<TileIndex> m_failed;    // tiles that failed for the current job
+    QElapsedTimer m_export_clock;
+    QOpenGLFramebufferObject *m_fbo;
+    Readback m_readbacks[ReadbackCount];
+    bool m_poll_pending;
 };
 
 #endif
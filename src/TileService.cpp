@@ -0,0 +1,116 @@
+#include "TileService.h"
+#include <QGuiApplication>
+#include <QScreen>
+#include <cassert>
+
+TileService::TileService(const MapConfig& config, const Trace::File* replay)
+    : m_surface(NULL),
+    m_share(NULL),
+    m_fetcher(NULL),
+    m_recorder(NULL),
+    m_tile_size(config.tile_size)
+{
+    m_uptime.start();
+
+    // Must register value types with Qt to use in signal/slots
+    qRegisterMetaType<TileIndex>();
+    qRegisterMetaType<TileIndexList>();
+    qRegisterMetaType<TileHandleList>();
+    qRegisterMetaType<TileResponseList>();
+
+    m_surface = new QOffscreenSurface();
+    m_surface->setFormat(QSurfaceFormat());
+    m_surface->create();
+
+    // The share root is only used to create the other contexts, so it
+    // is never current on any thread when a new renderer joins the group
+    m_share = new QOpenGLContext();
+    m_share->setFormat(m_surface->format());
+    m_share->create();
+
+    // Fetch the double size variant of every tile if the server has one
+    // and the primary screen is HiDPI. Viewers on a standard screen then
+    // draw these tiles one zoom level up, see MapViewer::updatePixelRatio().
+    MapConfig fetch = config;
+    QScreen *screen = QGuiApplication::primaryScreen();
+    qreal ratio = screen ? screen->devicePixelRatio() : 1.;
+    if (config.hidpi && !config.hidpi_suffix.isEmpty() && ratio >= 1.5) {
+        fetch.tile_size *= 2;
+    } else {
+        fetch.hidpi_suffix.clear();
+    }
+    m_tile_size = fetch.tile_size;
+
+    if (!config.trace_record.isEmpty()) {
+        m_recorder = new TraceRecorder();
+        if (!m_recorder->open(config.trace_record, m_tile_size)) {
+            delete m_recorder;
+            m_recorder = NULL;
+        }
+    }
+
+    m_fetcher = new TileFetcher(fetch, m_surface, m_share, m_recorder, replay);
+    m_fetcher->start();
+}
+
+TileService::~TileService()
+{
+    // must stop the worker thread before destrution
+    m_fetcher->stop();
+    delete m_fetcher;
+    m_fetcher = NULL;
+    delete m_recorder;
+    m_recorder = NULL;
+    delete m_share;
+    m_share = NULL;
+    delete m_surface;
+    m_surface = NULL;
+}
+
+void TileService::warmTiles(const TileIndexList& tiles)
+{
+    if (!tiles.empty()) {
+        QMetaObject::invokeMethod(m_fetcher, "warmTiles", Qt::BlockingQueuedConnection,
+            Q_ARG(TileIndexList, tiles));
+    }
+}
+
+TileRenderer* TileService::createRenderer(const MapConfig& config, QSurface* surface)
+{
+    TileRenderer *renderer = new TileRenderer(config, m_fetcher->pool(), surface, m_share);
+
+    // register the renderer with the fetcher ahead of its first request,
+    // the fetcher event queue delivers these in order
+    QMetaObject::invokeMethod(m_fetcher, "addClient", Qt::QueuedConnection,
+        Q_ARG(QObject*, renderer));
+
+    // connect the renderer tile request signal to the fetcher tile request slot.
+    // Responses are sent straight to the renderer tileResponses() slot.
+    connect(renderer, SIGNAL(requestTiles(const TileIndexList&)), 
+        m_fetcher, SLOT(tileRequests(const TileIndexList&)));
+    // connect the renderer cancel signal to the fetcher slot
+    connect(renderer, SIGNAL(cancelRequests()), m_fetcher, SLOT(cancelTiles()));
+    connect(renderer, SIGNAL(cancelTiles(const TileIndexList&)), 
+        m_fetcher, SLOT(cancelTiles(const TileIndexList&)));
+    // connect the renderer delete tile signal to the tile fetcher slot
+    connect(renderer, SIGNAL(deleteTiles(const TileHandleList&)), 
+        m_fetcher, SLOT(deleteTiles(const TileHandleList&)));
+
+    // start the worker thread for the renderer
+    renderer->start();
+    return renderer;
+}
+
+void TileService::destroyRenderer(TileRenderer* renderer)
+{
+    assert(renderer);
+    // Wait for the fetcher to drop the renderer, after this it never
+    // sends another response to it
+    QMetaObject::invokeMethod(m_fetcher, "removeClient", Qt::BlockingQueuedConnection,
+        Q_ARG(QObject*, renderer));
+    // must stop the worker thread before destrution, the renderer shutdown
+    // takes the responses still queued to it and releases them with its
+    // cached tiles back to the fetcher
+    renderer->stop();
+    delete renderer;
+}
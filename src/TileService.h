@@ -0,0 +1,63 @@
+#ifndef __TILE_SERVICE_H_
+#define __TILE_SERVICE_H_
+
+#include "TileFetcher.h"
+#include "TileRenderer.h"
+#include "MapConfig.h"
+#include "Trace.h"
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
+#include <QElapsedTimer>
+
+// Shared tile pipeline for any number of map views. The service owns one
+// TileFetcher (network, decode and texture upload) running on an offscreen
+// surface, plus a share group root context that is never made current.
+// Every renderer context joins that share group, so a tile is downloaded,
+// decoded and uploaded once no matter how many views display it. Must be
+// created and destroyed on the GUI thread, and must outlive its renderers.
+// With MapConfig::trace_record set the service records a trace of the
+// session, and a service given a 'replay' trace never touches the network.
+class TileService : public QObject
+{
+    Q_OBJECT
+public:
+    TileService(const MapConfig& config, const Trace::File* replay = NULL);
+    ~TileService();
+
+    // Size of the fetched tiles, which is twice the configured size when
+    // the service fetches @2x tiles for a HiDPI screen
+    int tileSize() const {
+        return m_tile_size;
+    }
+
+    // The trace recorder the views record their states to, NULL if the
+    // session isn't recorded
+    TraceRecorder* recorder() {
+        return m_recorder;
+    }
+
+    // ms since the service was created, which is early in the startup
+    qint64 uptime() const {
+        return m_uptime.elapsed();
+    }
+
+    // Loads 'tiles' from the disk cache or the tile daemon into the 
+    // decoded RAM tier, blocking until they are in. Called at startup
+    // before the views request their first tiles, see MapSession.
+    void warmTiles(const TileIndexList& tiles);
+
+    // Creates, connects and starts a renderer targeting 'surface'
+    TileRenderer* createRenderer(const MapConfig& config, QSurface* surface);
+    // Detaches, stops and deletes a renderer from createRenderer()
+    void destroyRenderer(TileRenderer* renderer);
+
+private:
+    QOffscreenSurface *m_surface; // fetcher surface
+    QOpenGLContext *m_share;      // share group root
+    TileFetcher *m_fetcher;
+    TraceRecorder *m_recorder;
+    int m_tile_size;
+    QElapsedTimer m_uptime;
+};
+
+#endif
@@ -0,0 +1,158 @@
+#include "TileTracer.h"
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QThread>
+#include <QFile>
+#include <QTextStream>
+#include <QDebug>
+#include <memory>
+#include <vector>
+
+std::atomic<bool> TileTracer::s_enabled(false);
+
+namespace {
+    struct Event {
+        qint64 time; // ns since start()
+        TileIndex index;
+        char stage;
+        char phase;
+    };
+
+    // Events of one thread. Only the owning thread appends, it publishes
+    // each event by a release store of the count, so write() reads the 
+    // published prefix without a lock.
+    struct Buffer {
+        Buffer(const QString& key, const QString& thread, int tid)
+            : key(key), thread(thread), tid(tid), events(new Event[TileTracer::Capacity]),
+            count(0), dropped(0) {}
+        QString key;    // object name of the thread, may be empty
+        QString thread;
+        int tid;
+        std::unique_ptr<Event[]> events;
+        std::atomic<size_t> count;
+        std::atomic<size_t> dropped;
+    };
+
+    const char *stageNames[] = {
+        "requested", "queued", "network", "decode", "upload", "delivered", "drawn", "evicted"
+    };
+
+    QElapsedTimer clock;
+    // the buffers live until the process exits, write() may run while
+    // threads still record
+    QMutex buffers_mutex;
+    std::vector<Buffer*> buffers;
+    // buffers of exited threads, waiting for a new thread of the same name
+    std::vector<Buffer*> free_buffers;
+
+    // Hands the buffer back when its thread exits. Pool threads expire and
+    // are recreated, reusing their buffers keeps a long session at one
+    // buffer and one track per live thread.
+    struct ThreadBuffer {
+        ThreadBuffer() : buffer(NULL) {}
+        ~ThreadBuffer() {
+            if (buffer) {
+                QMutexLocker lock(&buffers_mutex);
+                free_buffers.push_back(buffer);
+            }
+        }
+        Buffer *buffer;
+    };
+    thread_local ThreadBuffer thread_buffer;
+
+    // registers the buffer of the calling thread on its first event
+    Buffer* threadBuffer()
+    {
+        if (!thread_buffer.buffer) {
+            QMutexLocker lock(&buffers_mutex);
+            QString key = QThread::currentThread()->objectName();
+            for (size_t i = 0; i < free_buffers.size(); i++) {
+                if (free_buffers[i]->key == key) {
+                    // the events continue on the track of the old thread
+                    thread_buffer.buffer = free_buffers[i];
+                    free_buffers.erase(free_buffers.begin() + i);
+                    return thread_buffer.buffer;
+                }
+            }
+            int tid = int(buffers.size()) + 1;
+            QString name = key;
+            if (name.isEmpty()) {
+                name = QString("thread %1").arg(tid);
+            }
+            thread_buffer.buffer = new Buffer(key, name, tid);
+            buffers.push_back(thread_buffer.buffer);
+        }
+        return thread_buffer.buffer;
+    }
+}
+
+void TileTracer::start()
+{
+    clock.start();
+    s_enabled.store(true);
+}
+
+void TileTracer::record(Stage stage, Phase phase, const TileIndex& index)
+{
+    Buffer *buffer = threadBuffer();
+    size_t count = buffer->count.load(std::memory_order_relaxed);
+    if (count == Capacity) {
+        buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    Event& event = buffer->events[count];
+    event.time = clock.nsecsElapsed();
+    event.index = index;
+    event.stage = char(stage);
+    event.phase = char(phase);
+    buffer->count.store(count + 1, std::memory_order_release);
+}
+
+bool TileTracer::write(const QString& path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text)) {
+        qCritical() << "Unable to create tile trace:" << path;
+        return false;
+    }
+    std::vector<Buffer*> threads;
+    {
+        QMutexLocker lock(&buffers_mutex);
+        threads = buffers;
+    }
+
+    QTextStream out(&file);
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    bool first = true;
+    size_t events = 0, dropped = 0;
+    for (size_t t = 0; t < threads.size(); t++) {
+        const Buffer *buffer = threads[t];
+        // thread names label the tracks in the viewer
+        out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+            << buffer->tid << ",\"args\":{\"name\":\"" << buffer->thread << "\"}}";
+        first = false;
+        size_t count = buffer->count.load(std::memory_order_acquire);
+        for (size_t i = 0; i < count; i++) {
+            const Event& event = buffer->events[i];
+            const TileIndex& index = event.index;
+            QString id = QString("%1/%2/%3/%4/%5").arg(index.zoom()).arg(index.x())
+                .arg(index.y()).arg(index.layer()).arg(index.frame());
+            // microseconds with ns precision
+            out << ",\n{\"name\":\"" << stageNames[int(event.stage)] 
+                << "\",\"cat\":\"tile\",\"ph\":\"" << event.phase
+                << "\",\"id\":\"" << id << "\",\"ts\":" 
+                << QString::number(double(event.time) / 1000., 'f', 3)
+                << ",\"pid\":1,\"tid\":" << buffer->tid << "}";
+        }
+        events += count;
+        dropped += buffer->dropped.load(std::memory_order_relaxed);
+    }
+    out << "\n]}\n";
+    out.flush();
+    printf("Wrote %u tile trace events to %s", unsigned(events), qPrintable(path));
+    if (dropped) {
+        printf(", %u dropped", unsigned(dropped));
+    }
+    printf("\n");
+    return file.error() == QFile::NoError;
+}
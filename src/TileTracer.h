@@ -0,0 +1,76 @@
+#ifndef __TILE_TRACER_H_
+#define __TILE_TRACER_H_
+
+#include "TileTypes.h"
+#include <QString>
+#include <atomic>
+
+// Opt-in lifecycle tracer of individual tiles (--tile-trace). Each stage a
+// tile goes through is recorded with the thread it ran on:
+//
+//   requested  renderer asks the fetcher for the tile
+//   queued     fetcher takes the request
+//   network    download (or tile daemon request), begin and end
+//   decode     image decode or vector tessellation, begin and end
+//   upload     texture or buffer upload, begin and end
+//   delivered  renderer receives the tile
+//   drawn      first frame drawing the tile after its delivery
+//   evicted    renderer cache drops the tile
+//
+// write() exports the events as Chrome trace-event JSON, which Perfetto
+// and chrome://tracing open. Each tile is an async track (its index is the 
+// event id), so the critical path of a slow tile shows across the GUI, 
+// renderer, fetcher and decode threads.
+//
+// Every thread appends to its own fixed size buffer, recording takes no
+// lock and events past the buffer capacity are dropped and counted. The
+// buffer of an exited thread is reused by the next thread of its name, so
+// expiring pool threads don't add buffers. The recording calls are cheap
+// no-ops unless start() was called.
+class TileTracer
+{
+public:
+    enum Stage {
+        Requested, Queued, Network, Decode, Upload, Delivered, Drawn, Evicted
+    };
+    // Chrome trace-event phases of async events
+    enum Phase {
+        Begin = 'b',
+        End = 'e',
+        Instant = 'n'
+    };
+    // events each thread buffer holds
+    enum { Capacity = 1 << 18 };
+
+    // enables recording, the event times are relative to this call
+    static void start();
+    static bool enabled() {
+        return s_enabled.load(std::memory_order_relaxed);
+    }
+    // writes the events recorded so far as trace-event JSON, safe while
+    // other threads still record
+    static bool write(const QString& path);
+
+    static void begin(Stage stage, const TileIndex& index) {
+        if (enabled()) {
+            record(stage, Begin, index);
+        }
+    }
+    static void end(Stage stage, const TileIndex& index) {
+        if (enabled()) {
+            record(stage, End, index);
+        }
+    }
+    static void mark(Stage stage, const TileIndex& index) {
+        if (enabled()) {
+            record(stage, Instant, index);
+        }
+    }
+
+private:
+    static void record(Stage stage, Phase phase, const TileIndex& index);
+
+    static std::atomic<bool> s_enabled;
+};
+
+#endif
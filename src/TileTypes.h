@@ -2,22 +2,32 @@
 #define __TILE_TYPES_H_
 
 #include <QOpenGLTexture>
+#include <QOpenGLBuffer>
+#include <QImage>
 #include <QThread>
+#include <QMetaType>
 #include <iostream>
 #include <tuple>
+#include <vector>
 #include <cassert>
+#include "VectorTile.h"
 
-// defines a tile by x,y coordinate and a zoom level
+// defines a tile by x,y coordinate and a zoom level, plus the map layer
+// (0 is the base map, see MapConfig::layers) and the frame of time 
+// dimension tiles (an index into MapConfig::times, 0 for static tiles)
 // the std::tuple allows ease key generation for 
 // insert/query of the tile cache
-class TileIndex : public std::tuple<int, int, int> {
+class TileIndex : public std::tuple<int, int, int, int, int> {
 public:
-    TileIndex(): tuple(-1, -1, -1) {}
-    TileIndex(int zoom, int x, int y): tuple(zoom, x, y) {}
+    TileIndex(): tuple(-1, -1, -1, 0, 0) {}
+    TileIndex(int zoom, int x, int y, int layer = 0, int frame = 0)
+        : tuple(zoom, x, y, layer, frame) {}
 
     int zoom() const { return std::get<0>(*this); }
     int x() const {    return std::get<1>(*this); }
     int y() const {    return std::get<2>(*this); }
+    int layer() const { return std::get<3>(*this); }
+    int frame() const { return std::get<4>(*this); }
 
     // Format the tile index into a string for printing
     QString string() const {
@@ -27,55 +37,201 @@ public:
              QString::number(x()) + 
              QString(",") +
              QString::number(y()) +
+             (layer() ? QString(",L") + QString::number(layer()) : QString()) +
+             (frame() ? QString(",T") + QString::number(frame()) : QString()) +
              QString("]");
     }
 };
 
-// This class represents a tile image in the OpenGL context. 
-// The constructor takes a QImage and creates a QOpenGLTexture
-// to hold the map tile image data. Object of this type can only 
-// be created/destroyed by the TileFetcher, making it safe to pass
-// around pointers that can be stored in the renderer's tile cache.
+// This class represents a tile image in the OpenGL context. Raster tiles
+// hold the map tile image data in a QOpenGLTexture, vector tiles hold their
+// tessellated VectorMesh in vertex/index buffers. Objects of this type are 
+// records of the TilePool and can only be loaded/released by the 
+// TileFetcher. The GL objects are kept when a record is released, so the
+// next tile loaded into it reuses them instead of allocating new ones. An 
+// image can be shared by several renderers, the fetcher counts the references.
 class TileImage {
 public:
     QOpenGLTexture& texture() {
         return *m_texture;
     }
+    QOpenGLBuffer& vertices() {
+        return m_vertices;
+    }
+    QOpenGLBuffer& indices() {
+        return m_indices;
+    }
+    // number of triangle indices in a vector tile
+    int count() const {
+        return m_count;
+    }
     bool valid() const {
-        return (m_texture != NULL);
+        return m_kind != Empty;
+    }
+    bool vector() const {
+        return m_kind == Vector;
     }
     const TileIndex& index() const {
         return m_index;
     }
+    // fetched in the lite format while the network was congested, the
+    // tile is requested again once it clears
+    bool lite() const {
+        return m_lite;
+    }
 private:
     friend class TileFetcher;
+    friend class TilePool;
 
-    TileImage(const TileIndex& index)
-        : m_index(index), 
-        m_owner(QThread::currentThread()),
-        m_texture(NULL) {}
+    enum Kind {
+        Empty,
+        Raster,
+        Vector
+    };
 
-    // Constructs a TileImage from the QImage, storing the current
-    // QThread to make sure it makes on destruction
-    TileImage(const TileIndex& index, const QImage& image)
-        : m_index(index), 
-        m_owner(QThread::currentThread()),
-        m_texture(new QOpenGLTexture(image, QOpenGLTexture::DontGenerateMipMaps))
-    {
-        m_texture->setMinMagFilters(QOpenGLTexture::Nearest, QOpenGLTexture::Nearest);
-    }
+    TileImage()
+        : m_kind(Empty),
+        m_owner(NULL),
+        m_refs(0),
+        m_lite(false),
+        m_texture(NULL),
+        m_vertices(QOpenGLBuffer::VertexBuffer),
+        m_indices(QOpenGLBuffer::IndexBuffer),
+        m_count(0) {}
 
     ~TileImage() {
-        assert(m_owner == QThread::currentThread());
-        if (valid()) {
+        // the GL objects must be destroyed on the owner thread first
+        assert(m_texture == NULL);
+    }
+
+    // Uploads the QImage into the texture, which is only reallocated 
+    // if the image size changed
+    void load(const TileIndex& index, const QImage& image) {
+        assert(m_kind == Empty);
+        m_owner = QThread::currentThread();
+        if (m_texture && (m_texture->width() != image.width() ||
+            m_texture->height() != image.height())) {
             delete m_texture;
             m_texture = NULL;
         }
+        if (!m_texture) {
+            m_texture = new QOpenGLTexture(QOpenGLTexture::Target2D);
+            m_texture->setFormat(QOpenGLTexture::RGBA8_UNorm);
+            m_texture->setSize(image.width(), image.height());
+            m_texture->setMinMagFilters(QOpenGLTexture::Nearest, QOpenGLTexture::Nearest);
+            m_texture->allocateStorage(QOpenGLTexture::RGBA, QOpenGLTexture::UInt8);
+        }
+        QImage rgba = image.convertToFormat(QImage::Format_RGBA8888);
+        m_texture->setData(QOpenGLTexture::RGBA, QOpenGLTexture::UInt8, rgba.constBits());
+        m_index = index;
+        m_kind = Raster;
+    }
+
+    // Replaces the pixels of a loaded raster tile with an image of the
+    // same size, keeping the texture storage
+    void update(const QImage& image) {
+        assert(m_kind == Raster);
+        assert(m_texture->width() == image.width() && m_texture->height() == image.height());
+        QImage rgba = image.convertToFormat(QImage::Format_RGBA8888);
+        m_texture->setData(QOpenGLTexture::RGBA, QOpenGLTexture::UInt8, rgba.constBits());
+    }
+
+    // Uploads the tessellated mesh into the vertex and index buffers,
+    // which are created on first use
+    void load(const TileIndex& index, const VectorMesh& mesh) {
+        assert(m_kind == Empty);
+        m_owner = QThread::currentThread();
+        if (!m_vertices.isCreated()) {
+            m_vertices.create();
+            m_indices.create();
+        }
+        m_vertices.bind();
+        m_vertices.allocate(mesh.vertices.data(), int(mesh.vertices.size() * sizeof(float)));
+        m_vertices.release();
+        m_indices.bind();
+        m_indices.allocate(mesh.indices.data(), int(mesh.indices.size() * sizeof(unsigned int)));
+        m_indices.release();
+        m_count = int(mesh.indices.size());
+        m_index = index;
+        m_kind = Vector;
+    }
+
+    // Marks the record unused, keeping the GL objects for reuse
+    void reset() {
+        m_index = TileIndex();
+        m_kind = Empty;
+        m_refs = 0;
+        m_lite = false;
+        m_count = 0;
+    }
+
+    // Destroys the GL objects
+    void destroy() {
+        assert(m_owner == NULL || m_owner == QThread::currentThread());
+        reset();
+        delete m_texture;
+        m_texture = NULL;
+        m_vertices.destroy();
+        m_indices.destroy();
     }
 
     TileIndex m_index;         // tile index for the image
-    QThread *m_owner;          // thread that creates the image
+    Kind m_kind;               // type of the loaded tile
+    QThread *m_owner;          // thread that creates the GL objects
+    int m_refs;                // renderers holding the image
+    bool m_lite;               // decoded from a lite format payload
     QOpenGLTexture *m_texture; // OpenGL texture for the image data
+    QOpenGLBuffer m_vertices;  // vector tile vertex buffer
+    QOpenGLBuffer m_indices;   // vector tile triangle index buffer
+    int m_count;               // vector tile index count
 };
 
+// Handle to a TileImage record in the TilePool. The generation changes
+// every time the record is released, so a stale handle resolves to NULL
+// instead of to whatever tile reuses the record. A null handle refers to
+// no tile at all, which is how failed tile responses are sent.
+class TileHandle {
+public:
+    TileHandle(): m_slot(0), m_generation(0) {}
+    TileHandle(quint32 slot, quint32 generation)
+        : m_slot(slot), m_generation(generation) {}
+
+    quint32 slot() const { return m_slot; }
+    quint32 generation() const { return m_generation; }
+    bool isNull() const { return m_generation == 0; }
+
+    bool operator==(const TileHandle& other) const {
+        return m_slot == other.m_slot && m_generation == other.m_generation;
+    }
+private:
+    quint32 m_slot;
+    quint32 m_generation;
+};
+
+// A tile response to a renderer, with a null handle if the tile failed
+// or the request was cancelled. A partial response carries a tile that is
+// still downloading, decoded from the bytes received so far. The final
+// response for the tile follows with the same handle.
+struct TileResponse {
+    TileResponse(): partial(false) {}
+    TileResponse(const TileIndex& index, const TileHandle& handle, bool partial = false)
+        : index(index), handle(handle), partial(partial) {}
+
+    TileIndex index;
+    TileHandle handle;
+    bool partial;
+};
+
+// Tile messages are batched so that a whole frame of requests, responses
+// or deletions crosses between the renderer and fetcher threads in a single
+// queued signal instead of one per tile
+typedef std::vector<TileIndex> TileIndexList;
+typedef std::vector<TileHandle> TileHandleList;
+typedef std::vector<TileResponse> TileResponseList;
+
+Q_DECLARE_METATYPE(TileIndex);
+Q_DECLARE_METATYPE(TileIndexList);
+Q_DECLARE_METATYPE(TileHandleList);
+Q_DECLARE_METATYPE(TileResponseList);
+
 #endif
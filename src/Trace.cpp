@@ -0,0 +1,222 @@
+#include "Trace.h"
+#include <QTimer>
+#include <QDebug>
+#include <algorithm>
+#include <cstring>
+
+bool Trace::File::read(const QString& path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qCritical() << "Unable to open trace file:" << path;
+        return false;
+    }
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    quint32 magic = 0, version = 0;
+    qint32 size = 0;
+    stream >> magic >> version >> size;
+    if (magic != Magic || version != Version || size <= 0) {
+        qCritical() << "Not a version" << Version << "trace file:" << path;
+        return false;
+    }
+    tile_size = size;
+    states.clear();
+    tiles.clear();
+    while (!stream.atEnd()) {
+        quint8 type = 0;
+        qint64 time = 0;
+        stream >> type >> time;
+        if (type == StateRecord) {
+            State record;
+            qint32 view, zoom, width, height, frame;
+            qint64 left, top;
+            float ratio, bearing;
+            stream >> view >> zoom >> left >> top >> width >> height >> ratio >> frame >> bearing;
+            QSize size(width, height);
+            // the center recovers the recorded left/top, see PixelRect
+            PixelPoint center(left + width / 2, top + height / 2);
+            record.time = time;
+            record.view = view;
+            record.state.setZoom(zoom);
+            record.state.setMapSize(size);
+            record.state.setPixelRatio(ratio);
+            record.state.setFrame(frame);
+            record.state.setBearing(bearing);
+            record.state.setBounds(PixelRect(center, size));
+            record.state.setValid();
+            states.push_back(record);
+        } else if (type == TileRecord) {
+            Tile record;
+            qint32 zoom, x, y, layer, frame, latency, error, status;
+            stream >> zoom >> x >> y >> layer >> frame >> latency >> error >> status >> record.payload;
+            record.time = time;
+            record.index = TileIndex(zoom, x, y, layer, frame);
+            record.latency = latency;
+            record.error = error;
+            record.status = status;
+            tiles[record.index].push_back(record);
+        } else {
+            break;
+        }
+        if (stream.status() != QDataStream::Ok) {
+            break;
+        }
+    }
+    if (stream.status() != QDataStream::Ok) {
+        // a recording cut short by a crash is still useful up to there
+        qWarning() << "Trace file is truncated:" << path;
+    }
+    return true;
+}
+
+TraceRecorder::TraceRecorder()
+{
+}
+
+bool TraceRecorder::open(const QString& path, int tile_size)
+{
+    QMutexLocker lock(&m_mutex);
+    m_file.setFileName(path);
+    if (!m_file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qCritical() << "Unable to create trace file:" << path;
+        return false;
+    }
+    m_stream.setDevice(&m_file);
+    m_stream.setVersion(QDataStream::Qt_5_0);
+    m_stream << Trace::Magic << Trace::Version << qint32(tile_size);
+    m_clock.start();
+    return true;
+}
+
+void TraceRecorder::recordState(const void* view, const TileRenderer::State& state)
+{
+    QMutexLocker lock(&m_mutex);
+    if (!m_file.isOpen()) {
+        return;
+    }
+    std::map<const void*, int>::iterator it = 
+        m_views.insert(std::make_pair(view, int(m_views.size()))).first;
+    const PixelRect& bounds = state.bounds();
+    m_stream << quint8(Trace::StateRecord) << qint64(m_clock.elapsed()) 
+        << qint32(it->second) << qint32(state.zoom()) 
+        << qint64(bounds.left()) << qint64(bounds.top())
+        << qint32(bounds.size().width()) << qint32(bounds.size().height())
+        << state.pixelRatio() << qint32(state.frame()) << state.bearing();
+}
+
+void TraceRecorder::recordTile(const TileIndex& index, int latency, int error, int status, 
+    const QByteArray& payload)
+{
+    QMutexLocker lock(&m_mutex);
+    if (!m_file.isOpen()) {
+        return;
+    }
+    m_stream << quint8(Trace::TileRecord) << qint64(m_clock.elapsed())
+        << qint32(index.zoom()) << qint32(index.x()) << qint32(index.y())
+        << qint32(index.layer()) << qint32(index.frame())
+        << qint32(latency) << qint32(error) << qint32(status) << payload;
+}
+
+TraceNetwork::TraceNetwork(const Trace::File& trace, QObject *parent)
+    : QNetworkAccessManager(parent),
+    m_tiles(trace.tiles)
+{
+}
+
+QNetworkReply* TraceNetwork::createRequest(Operation op, const QNetworkRequest& request, 
+    QIODevice *data)
+{
+    Q_UNUSED(op);
+    Q_UNUSED(data);
+    // Recover the tile index from the <zoom>/<x>/<y><suffix>.<format> URL,
+    // the fetcher passes the layer and the frame as request user attributes
+    QStringList path = request.url().path().split('/', QString::SkipEmptyParts);
+    Trace::Tile tile;
+    tile.latency = 0;
+    tile.error = QNetworkReply::ContentNotFoundError;
+    tile.status = 404;
+    if (path.size() >= 3) {
+        QString y = path[path.size() - 1];
+        int digits = 0;
+        while (digits < y.size() && y[digits].isDigit()) {
+            digits++;
+        }
+        TileIndex index(path[path.size() - 3].toInt(), path[path.size() - 2].toInt(), 
+            y.left(digits).toInt(), request.attribute(QNetworkRequest::User).toInt(),
+            request.attribute(QNetworkRequest::Attribute(QNetworkRequest::User + 1)).toInt());
+        std::map<TileIndex, std::deque<Trace::Tile>>::iterator it = m_tiles.find(index);
+        if (it != m_tiles.end()) {
+            tile = it->second.front();
+            if (it->second.size() > 1) {
+                it->second.pop_front();
+            }
+        }
+    }
+    return new TraceReply(request, tile, this);
+}
+
+TraceReply::TraceReply(const QNetworkRequest& request, const Trace::Tile& tile, QObject *parent)
+    : QNetworkReply(parent),
+    m_payload(tile.payload),
+    m_offset(0),
+    m_error(tile.error),
+    m_done(false)
+{
+    setRequest(request);
+    setUrl(request.url());
+    setOperation(QNetworkAccessManager::GetOperation);
+    if (tile.status) {
+        setAttribute(QNetworkRequest::HttpStatusCodeAttribute, tile.status);
+    }
+    open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+    QTimer::singleShot(std::max(0, tile.latency), this, SLOT(deliver()));
+}
+
+void TraceReply::deliver()
+{
+    if (m_done) {
+        return;
+    }
+    m_done = true;
+    if (m_error != QNetworkReply::NoError) {
+        setError(QNetworkReply::NetworkError(m_error), QString("Recorded error"));
+        emit error(QNetworkReply::NetworkError(m_error));
+    } else {
+        setHeader(QNetworkRequest::ContentLengthHeader, m_payload.size());
+        emit readyRead();
+    }
+    setFinished(true);
+    emit finished();
+}
+
+void TraceReply::abort()
+{
+    if (m_done) {
+        return;
+    }
+    m_done = true;
+    m_payload.clear();
+    setError(QNetworkReply::OperationCanceledError, QString("Operation canceled"));
+    emit error(QNetworkReply::OperationCanceledError);
+    setFinished(true);
+    emit finished();
+}
+
+qint64 TraceReply::bytesAvailable() const
+{
+    // the payload only becomes readable once the latency passed
+    qint64 available = m_done ? m_payload.size() - m_offset : 0;
+    return available + QIODevice::bytesAvailable();
+}
+
+qint64 TraceReply::readData(char *data, qint64 size)
+{
+    if (!m_done || m_offset >= m_payload.size()) {
+        return m_done ? -1 : 0;
+    }
+    qint64 count = std::min(size, m_payload.size() - m_offset);
+    memcpy(data, m_payload.constData() + m_offset, size_t(count));
+    m_offset += count;
+    return count;
+}
@@ -0,0 +1,130 @@
+#ifndef __TRACE_H_
+#define __TRACE_H_
+
+#include "TileRenderer.h"
+#include "TileTypes.h"
+#include <QFile>
+#include <QDataStream>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <deque>
+#include <map>
+
+// Performance traces of a map session. A trace records the render states
+// every view publishes and the latency, result and payload of every tile
+// download, each stamped with the time since recording started. Replaying
+// it (see TraceReplay) publishes the same states to a headless renderer 
+// while TraceNetwork serves the recorded downloads, so stalls seen in the
+// field can be reproduced and timed. States capture the effect of all the
+// input events, so the events themselves are not recorded.
+//
+// The file is a QDataStream of a header followed by records:
+//
+//   header: "QMVT" magic, quint32 version, qint32 tile size
+//   state:  quint8 1, qint64 time, qint32 view, qint32 zoom, 
+//           qint64 left, qint64 top, qint32 width, qint32 height, float ratio,
+//           qint32 frame, float bearing
+//   tile:   quint8 2, qint64 time, qint32 zoom, qint32 x, qint32 y, 
+//           qint32 layer, qint32 frame, qint32 latency, qint32 error, qint32 status, QByteArray payload
+//
+// Times and latencies are in milliseconds.
+namespace Trace {
+    const quint32 Magic = 0x514d5654; // "QMVT"
+    const quint32 Version = 4;
+
+    enum RecordType {
+        StateRecord = 1,
+        TileRecord = 2
+    };
+
+    struct State {
+        qint64 time;
+        int view;
+        TileRenderer::State state;
+    };
+
+    struct Tile {
+        qint64 time;
+        TileIndex index;
+        int latency;
+        int error;  // QNetworkReply::NetworkError
+        int status; // HTTP status code, 0 if none
+        QByteArray payload;
+    };
+
+    // All records of a trace file, the states in time order and the 
+    // downloads of each tile in the order they finished
+    struct File {
+        File(): tile_size(0) {}
+        int tile_size; // of the recording service, see TileService::tileSize()
+        std::vector<State> states;
+        std::map<TileIndex, std::deque<Tile>> tiles;
+
+        bool read(const QString& path);
+    };
+}
+
+// Writes a trace file while the application runs. Safe to call from any
+// thread, the views record from the GUI thread and the fetcher from its own.
+class TraceRecorder
+{
+public:
+    TraceRecorder();
+
+    bool open(const QString& path, int tile_size);
+    void recordState(const void* view, const TileRenderer::State& state);
+    void recordTile(const TileIndex& index, int latency, int error, int status, 
+        const QByteArray& payload);
+
+private:
+    QMutex m_mutex;
+    QFile m_file;
+    QDataStream m_stream;
+    QElapsedTimer m_clock;
+    std::map<const void*, int> m_views; // small ids for the view pointers
+};
+
+// Network access manager answering tile requests from a trace instead of
+// the network. Each download of a tile is served with its recorded latency,
+// result and payload, the last one repeats once they run out, and tiles
+// missing from the trace fail right away with a 404.
+class TraceNetwork : public QNetworkAccessManager
+{
+    Q_OBJECT
+public:
+    TraceNetwork(const Trace::File& trace, QObject *parent = 0);
+
+protected:
+    QNetworkReply* createRequest(Operation op, const QNetworkRequest& request, 
+        QIODevice *data = 0);
+
+private:
+    std::map<TileIndex, std::deque<Trace::Tile>> m_tiles;
+};
+
+// Reply of the TraceNetwork, finishes once the recorded latency passes
+class TraceReply : public QNetworkReply
+{
+    Q_OBJECT
+public:
+    TraceReply(const QNetworkRequest& request, const Trace::Tile& tile, QObject *parent);
+
+    void abort();
+    qint64 bytesAvailable() const;
+
+protected:
+    qint64 readData(char *data, qint64 size);
+
+private slots:
+    void deliver();
+
+private:
+    QByteArray m_payload;
+    qint64 m_offset;
+    int m_error;
+    bool m_done;
+};
+
+#endif
@@ -0,0 +1,125 @@
+#include "TraceReplay.h"
+#include <QDebug>
+#include <algorithm>
+#include <cstdio>
+
+TraceReplay::TraceReplay(const MapConfig& config, TileService& service, 
+    const Trace::File& trace, QObject *parent)
+    : QObject(parent),
+    m_service(service),
+    m_config(config),
+    m_trace(trace),
+    m_next(0)
+{
+    m_config.tile_size = service.tileSize();
+    m_timer.setSingleShot(true);
+    connect(&m_timer, SIGNAL(timeout()), this, SLOT(publishStates()));
+}
+
+TraceReplay::~TraceReplay()
+{
+    for (size_t i = 0; i < m_views.size(); i++) {
+        m_service.destroyRenderer(m_views[i].renderer);
+        delete m_views[i].surface;
+    }
+    m_views.clear();
+}
+
+bool TraceReplay::start(const QString& output)
+{
+    if (output.isEmpty()) {
+        m_file.open(stdout, QIODevice::WriteOnly);
+    } else {
+        m_file.setFileName(output);
+        if (!m_file.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text)) {
+            qCritical() << "Unable to create replay output:" << output;
+            return false;
+        }
+    }
+    m_output.setDevice(&m_file);
+
+    int views = 0;
+    for (size_t i = 0; i < m_trace.states.size(); i++) {
+        views = std::max(views, m_trace.states[i].view + 1);
+    }
+    for (int i = 0; i < views; i++) {
+        View view;
+        view.surface = new QOffscreenSurface();
+        view.surface->setFormat(QSurfaceFormat());
+        view.surface->create();
+        view.renderer = m_service.createRenderer(m_config, view.surface);
+        connect(view.renderer, SIGNAL(frameRendered(qint64, int, int)),
+            this, SLOT(frameRendered(qint64, int, int)));
+        m_views.push_back(view);
+    }
+    m_clock.start();
+    publishStates();
+    return true;
+}
+
+void TraceReplay::publishStates()
+{
+    // publish every state that is due, then sleep until the next one
+    qint64 now = m_clock.elapsed();
+    while (m_next < m_trace.states.size() && m_trace.states[m_next].time <= now) {
+        const Trace::State& state = m_trace.states[m_next];
+        View& view = m_views[size_t(state.view)];
+        if (view.first_state < 0) {
+            view.first_state = now;
+        }
+        view.renderer->setState(state.state);
+        m_next++;
+    }
+    if (m_next < m_trace.states.size()) {
+        m_timer.start(int(m_trace.states[m_next].time - now));
+    } else {
+        QTimer::singleShot(DrainTime, this, SLOT(stop()));
+    }
+}
+
+void TraceReplay::frameRendered(qint64 nsecs, int tiles, int missing)
+{
+    int view = 0;
+    for (size_t i = 0; i < m_views.size(); i++) {
+        if (m_views[i].renderer == sender()) {
+            view = int(i);
+        }
+    }
+    View& v = m_views[size_t(view)];
+    if (v.first_full < 0 && v.first_state >= 0 && tiles > 0 && missing == 0) {
+        v.first_full = m_clock.elapsed();
+    }
+    m_frames.push_back(nsecs);
+    m_output << m_clock.elapsed() << ' ' << view << ' ' << nsecs / 1000 << ' '
+        << tiles << ' ' << missing << '\n';
+}
+
+void TraceReplay::stop()
+{
+    m_output.flush();
+    if (!m_frames.empty()) {
+        std::vector<qint64> sorted(m_frames);
+        std::sort(sorted.begin(), sorted.end());
+        qint64 total = 0;
+        for (size_t i = 0; i < sorted.size(); i++) {
+            total += sorted[i];
+        }
+        printf("Replayed %u frames: mean %.3f ms, p50 %.3f ms, p95 %.3f ms, max %.3f ms\n",
+            unsigned(sorted.size()), 
+            double(total) / double(sorted.size()) * 1e-6,
+            double(sorted[sorted.size() / 2]) * 1e-6,
+            double(sorted[sorted.size() * 95 / 100]) * 1e-6,
+            double(sorted.back()) * 1e-6);
+    } else {
+        printf("Replayed no frames\n");
+    }
+    for (size_t i = 0; i < m_views.size(); i++) {
+        if (m_views[i].first_full >= 0) {
+            printf("View %u first full frame after %lld ms\n", unsigned(i),
+                m_views[i].first_full - m_views[i].first_state);
+        } else {
+            printf("View %u never drew a full frame\n", unsigned(i));
+        }
+    }
+    emit finished();
+}
@@ -0,0 +1,68 @@
+#ifndef __TRACE_REPLAY_H_
+#define __TRACE_REPLAY_H_
+
+#include "Trace.h"
+#include "TileService.h"
+#include "MapConfig.h"
+#include <QObject>
+#include <QOffscreenSurface>
+#include <QElapsedTimer>
+#include <QTextStream>
+#include <QFile>
+#include <QTimer>
+#include <vector>
+
+// Replays a recorded trace without a window. Each recorded view gets a
+// headless renderer on an offscreen surface, the recorded states are
+// published to it on the recorded schedule, and the service serves the
+// recorded downloads (see TraceNetwork). Every frame is written out as a
+// line of "<time ms> <view> <frame us> <tiles> <missing>", and a summary
+// is printed once the trace ends, with the frame time distribution and the
+// time each view took from its first state to its first full frame. A 
+// replay has no warm start and simulates the network, so it doesn't show
+// startup times, see StartupBench. This object lives in the GUI thread.
+class TraceReplay : public QObject
+{
+    Q_OBJECT
+public:
+    // 'service' must be created with the same 'trace' 
+    TraceReplay(const MapConfig& config, TileService& service, const Trace::File& trace, 
+        QObject *parent = 0);
+    ~TraceReplay();
+
+    // starts the replay, frame lines go to 'output' or to stdout if it 
+    // is empty. finished() is emitted after the last state.
+    bool start(const QString& output);
+
+signals:
+    void finished();
+
+private slots:
+    void publishStates();
+    void frameRendered(qint64 nsecs, int tiles, int missing);
+    void stop();
+
+private:
+    struct View {
+        View(): surface(NULL), renderer(NULL), first_state(-1), first_full(-1) {}
+        QOffscreenSurface *surface;
+        TileRenderer *renderer;
+        qint64 first_state; // replay ms of the first state, -1 before it
+        qint64 first_full;  // replay ms of the first frame without missing tiles
+    };
+    // time left after the last state for the tiles it requested
+    enum { DrainTime = 2000 };
+
+    TileService &m_service;
+    MapConfig m_config;
+    const Trace::File &m_trace;
+    std::vector<View> m_views;
+    size_t m_next;         // next state to publish
+    QElapsedTimer m_clock;
+    QTimer m_timer;
+    QFile m_file;
+    QTextStream m_output;
+    std::vector<qint64> m_frames; // frame times in ns
+};
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef __TRIPLE_BUFFER_H_
+#define __TRIPLE_BUFFER_H_
+
+#include <atomic>
+
+// Lock-free single producer/single consumer triple buffer. The writer fills
+// its private back buffer and swaps it with the shared middle slot, the
+// reader swaps the middle slot with its private front buffer whenever a
+// fresh value was published. Neither side ever blocks, the reader always
+// gets the newest complete value, and intermediate values are dropped.
+template <typename T>
+class TripleBuffer {
+public:
+    TripleBuffer()
+        : m_back(0),
+        m_middle(1),
+        m_front(2) {}
+
+    // Writer thread only: publishes 'value' as the newest value
+    void publish(const T& value) {
+        m_buffers[m_back] = value;
+        // release our writes and take over the previous middle buffer
+        int old = m_middle.exchange(m_back | Fresh, std::memory_order_acq_rel);
+        m_back = old & Index;
+    }
+
+    // Reader thread only: returns the newest published value
+    const T& read() {
+        if (m_middle.load(std::memory_order_relaxed) & Fresh) {
+            int old = m_middle.exchange(m_front, std::memory_order_acq_rel);
+            m_front = old & Index;
+        }
+        return m_buffers[m_front];
+    }
+
+private:
+    enum { Index = 0x3, Fresh = 0x4 };
+
+    T m_buffers[3];
+    int m_back;               // owned by the writer
+    std::atomic<int> m_middle; // shared slot index plus the Fresh flag
+    int m_front;              // owned by the reader
+};
+
+#endif
@@ -0,0 +1,476 @@
+#include "VectorTile.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+namespace {
+
+// Minimal protobuf wire format reader, just enough for the vector tile
+// schema. All reads are bounds checked and flag an error instead of
+// reading past the end of the payload.
+class PbfReader {
+public:
+    enum WireType { Varint = 0, Fixed64 = 1, Bytes = 2, Fixed32 = 5 };
+
+    PbfReader(const char* data, const char* end)
+        : m_data(reinterpret_cast<const uint8_t*>(data)),
+        m_end(reinterpret_cast<const uint8_t*>(end)),
+        m_field(0), m_wire(0), m_error(false) {}
+
+    // advances to the next field, returns false at the end of the message
+    bool next() {
+        if (m_error || m_data >= m_end) {
+            return false;
+        }
+        uint64_t key = varint();
+        m_field = int(key >> 3);
+        m_wire = int(key & 0x7);
+        return !m_error;
+    }
+    int field() const { return m_field; }
+    int wire() const { return m_wire; }
+    bool error() const { return m_error; }
+
+    uint64_t varint() {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (m_data >= m_end) {
+                break;
+            }
+            uint8_t byte = *m_data++;
+            value |= uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return value;
+            }
+        }
+        m_error = true;
+        return 0;
+    }
+
+    // returns a length delimited field as a [begin, end) byte range
+    bool bytes(const char*& begin, const char*& end) {
+        uint64_t size = varint();
+        if (m_error || size > uint64_t(m_end - m_data)) {
+            m_error = true;
+            return false;
+        }
+        begin = reinterpret_cast<const char*>(m_data);
+        end = begin + size;
+        m_data += size;
+        return true;
+    }
+
+    // reads a packed repeated uint32 field
+    bool packed(std::vector<unsigned int>& values) {
+        const char *begin, *end;
+        if (!bytes(begin, end)) {
+            return false;
+        }
+        PbfReader reader(begin, end);
+        while (reader.m_data < reader.m_end && !reader.m_error) {
+            values.push_back((unsigned int)reader.varint());
+        }
+        m_error = reader.m_error;
+        return !m_error;
+    }
+
+    void skip() {
+        const char *begin, *end;
+        switch (m_wire) {
+            case Varint: varint(); break;
+            case Fixed64: advance(8); break;
+            case Bytes: bytes(begin, end); break;
+            case Fixed32: advance(4); break;
+            default: m_error = true; break;
+        }
+    }
+
+private:
+    void advance(size_t count) {
+        if (count > size_t(m_end - m_data)) {
+            m_error = true;
+        } else {
+            m_data += count;
+        }
+    }
+
+    const uint8_t *m_data, *m_end;
+    int m_field, m_wire;
+    bool m_error;
+};
+
+// vector tile geometry command identifiers
+enum GeometryCommand { MoveTo = 1, LineTo = 2, ClosePath = 7 };
+// vector tile feature geometry types
+enum GeometryType { Unknown = 0, PointType = 1, LineType = 2, PolygonType = 3 };
+
+inline int zigzag(unsigned int value) {
+    return int(value >> 1) ^ -int(value & 1);
+}
+
+} // namespace
+
+VectorTileDecoder::VectorTileDecoder(int tile_size)
+    : m_tile_size(tile_size)
+{
+}
+
+const float* VectorTileDecoder::palette()
+{
+    static const float colors[StyleCount * 4] = {
+        0.60f, 0.60f, 0.60f, 1.f, // Default
+        0.67f, 0.83f, 0.87f, 1.f, // Water
+        0.78f, 0.89f, 0.73f, 1.f, // Park
+        0.91f, 0.90f, 0.85f, 1.f, // Landuse
+        0.84f, 0.81f, 0.78f, 1.f, // Building
+        1.00f, 1.00f, 1.00f, 1.f, // Road
+        0.62f, 0.52f, 0.68f, 1.f, // Boundary
+        0.55f, 0.72f, 0.85f, 1.f  // Waterway
+    };
+    return colors;
+}
+
+// The layer names follow the common OpenMapTiles/Mapbox Streets schemas.
+// Anything unrecognized is drawn in the default style.
+VectorTileDecoder::Style VectorTileDecoder::layerFillStyle(const QString& name)
+{
+    if (name == "water" || name == "ocean") return Water;
+    if (name == "park" || name == "landcover") return Park;
+    if (name == "landuse") return Landuse;
+    if (name == "building") return Building;
+    return Default;
+}
+
+VectorTileDecoder::Style VectorTileDecoder::layerLineStyle(const QString& name)
+{
+    if (name == "transportation" || name == "road") return Road;
+    if (name == "boundary" || name == "admin") return Boundary;
+    if (name == "waterway") return Waterway;
+    return Default;
+}
+
+float VectorTileDecoder::lineWidth(Style style)
+{
+    switch (style) {
+        case Road: return 2.f;
+        case Waterway: return 1.5f;
+        default: return 1.f;
+    }
+}
+
+// Signed ring area using the shoelace formula. In the y-down tile space
+// exterior rings are clockwise and come out positive, holes negative.
+float VectorTileDecoder::area(const Ring& ring)
+{
+    float sum = 0.f;
+    for (size_t i = 0, j = ring.size() - 1; i < ring.size(); j = i++) {
+        sum += (ring[j].x - ring[i].x) * (ring[j].y + ring[i].y);
+    }
+    return 0.5f * sum;
+}
+
+bool VectorTileDecoder::decode(const QByteArray& data, VectorMesh& mesh) const
+{
+    mesh.vertices.clear();
+    mesh.indices.clear();
+
+    // Tile message: repeated Layer layers = 3
+    PbfReader tile(data.constData(), data.constData() + data.size());
+    while (tile.next()) {
+        if (tile.field() == 3 && tile.wire() == PbfReader::Bytes) {
+            const char *begin, *end;
+            if (!tile.bytes(begin, end) || !decodeLayer(begin, end, mesh)) {
+                return false;
+            }
+        } else {
+            tile.skip();
+        }
+    }
+    return !tile.error();
+}
+
+bool VectorTileDecoder::decodeLayer(const char* data, const char* end, VectorMesh& mesh) const
+{
+    // Layer message: name = 1, repeated features = 2, extent = 5. The
+    // extent can appear after the features, so features are decoded in
+    // a second pass once the whole layer header is known.
+    QString name;
+    unsigned int extent = 4096;
+    std::vector<std::pair<const char*, const char*>> features;
+
+    PbfReader layer(data, end);
+    while (layer.next()) {
+        const char *begin, *stop;
+        if (layer.field() == 1 && layer.wire() == PbfReader::Bytes) {
+            if (layer.bytes(begin, stop)) {
+                name = QString::fromUtf8(begin, int(stop - begin));
+            }
+        } else if (layer.field() == 2 && layer.wire() == PbfReader::Bytes) {
+            if (layer.bytes(begin, stop)) {
+                features.push_back(std::make_pair(begin, stop));
+            }
+        } else if (layer.field() == 5 && layer.wire() == PbfReader::Varint) {
+            extent = (unsigned int)layer.varint();
+        } else {
+            layer.skip();
+        }
+    }
+    if (layer.error() || extent == 0) {
+        return false;
+    }
+
+    float scale = float(m_tile_size) / float(extent);
+    Style fill = layerFillStyle(name);
+    Style line = layerLineStyle(name);
+    for (size_t i = 0; i < features.size(); i++) {
+        if (!decodeFeature(features[i].first, features[i].second, scale, fill, line, mesh)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool VectorTileDecoder::decodeFeature(const char* data, const char* end, float scale,
+    Style fill, Style line, VectorMesh& mesh) const
+{
+    // Feature message: type = 3, packed geometry = 4
+    int type = Unknown;
+    std::vector<unsigned int> geometry;
+
+    PbfReader feature(data, end);
+    while (feature.next()) {
+        if (feature.field() == 3 && feature.wire() == PbfReader::Varint) {
+            type = int(feature.varint());
+        } else if (feature.field() == 4 && feature.wire() == PbfReader::Bytes) {
+            feature.packed(geometry);
+        } else {
+            feature.skip();
+        }
+    }
+    if (feature.error()) {
+        return false;
+    }
+
+    std::vector<Ring> rings;
+    if (type == PolygonType) {
+        decodeGeometry(geometry, scale, rings);
+        // Rings are grouped into polygons: each exterior ring starts a new
+        // polygon and the interior rings that follow are its holes
+        std::vector<Ring> polygon;
+        for (size_t i = 0; i < rings.size(); i++) {
+            float a = area(rings[i]);
+            if (a > 0.f) {
+                tessellatePolygon(polygon, fill, mesh);
+                polygon.clear();
+                polygon.push_back(rings[i]);
+            } else if (a < 0.f && !polygon.empty()) {
+                polygon.push_back(rings[i]);
+            }
+        }
+        tessellatePolygon(polygon, fill, mesh);
+    } else if (type == LineType) {
+        decodeGeometry(geometry, scale, rings);
+        for (size_t i = 0; i < rings.size(); i++) {
+            tessellateLine(rings[i], line, mesh);
+        }
+    }
+    return true;
+}
+
+void VectorTileDecoder::decodeGeometry(const std::vector<unsigned int>& geometry,
+    float scale, std::vector<Ring>& rings) const
+{
+    // The geometry is a stream of commands with a repeat count, and the
+    // coordinates are zigzag encoded deltas from the cursor position
+    int x = 0, y = 0;
+    size_t i = 0;
+    while (i < geometry.size()) {
+        unsigned int command = geometry[i] & 0x7;
+        unsigned int count = geometry[i] >> 3;
+        i++;
+        if (command == MoveTo || command == LineTo) {
+            for (unsigned int c = 0; c < count; c++) {
+                if (i + 1 >= geometry.size()) {
+                    return; // truncated coordinate pair
+                }
+                x += zigzag(geometry[i]);
+                y += zigzag(geometry[i + 1]);
+                i += 2;
+                if (command == MoveTo) {
+                    rings.push_back(Ring());
+                }
+                if (!rings.empty()) {
+                    rings.back().push_back(Point(x * scale, y * scale));
+                }
+            }
+        } else if (command != ClosePath) {
+            return; // malformed command stream
+        }
+    }
+}
+
+void VectorTileDecoder::tessellateLine(const Ring& line, Style style, VectorMesh& mesh) const
+{
+    // Each segment is extruded into a quad of the style line width. Joins
+    // are left open, which is invisible at the widths used here.
+    float half = 0.5f * lineWidth(style);
+    for (size_t i = 1; i < line.size(); i++) {
+        const Point& a = line[i - 1];
+        const Point& b = line[i];
+        float dx = b.x - a.x, dy = b.y - a.y;
+        float length = std::sqrt(dx * dx + dy * dy);
+        if (length <= 0.f) {
+            continue;
+        }
+        float nx = -dy / length * half, ny = dx / length * half;
+
+        unsigned int base = (unsigned int)(mesh.vertices.size() / VectorMesh::Stride);
+        const float quad[12] = {
+            a.x + nx, a.y + ny, float(style),
+            a.x - nx, a.y - ny, float(style),
+            b.x + nx, b.y + ny, float(style),
+            b.x - nx, b.y - ny, float(style)
+        };
+        mesh.vertices.insert(mesh.vertices.end(), quad, quad + 12);
+        const unsigned int index[6] = { base, base + 1, base + 2, base + 2, base + 1, base + 3 };
+        mesh.indices.insert(mesh.indices.end(), index, index + 6);
+    }
+}
+
+namespace {
+
+inline float cross(float ax, float ay, float bx, float by, float cx, float cy) {
+    return (bx - ax) * (cy - ay) - (by - ay) * (cx - ax);
+}
+
+inline bool segmentsIntersect(float ax, float ay, float bx, float by,
+    float cx, float cy, float dx, float dy) {
+    float d1 = cross(cx, cy, dx, dy, ax, ay);
+    float d2 = cross(cx, cy, dx, dy, bx, by);
+    float d3 = cross(ax, ay, bx, by, cx, cy);
+    float d4 = cross(ax, ay, bx, by, dx, dy);
+    return ((d1 > 0.f) != (d2 > 0.f)) && ((d3 > 0.f) != (d4 > 0.f)) &&
+        d1 != 0.f && d2 != 0.f && d3 != 0.f && d4 != 0.f;
+}
+
+} // namespace
+
+// Tessellates a polygon (exterior ring followed by holes) with ear clipping.
+// Holes are first merged into the exterior ring by bridging each hole's
+// rightmost vertex to a visible exterior vertex, producing one simple ring.
+void VectorTileDecoder::tessellatePolygon(std::vector<Ring>& rings, Style style, VectorMesh& mesh) const
+{
+    if (rings.empty()) {
+        return;
+    }
+    Ring outer = rings[0];
+    // vector tile rings repeat the first point on close in some encoders
+    if (outer.size() > 1 && outer.front().x == outer.back().x && outer.front().y == outer.back().y) {
+        outer.pop_back();
+    }
+    if (outer.size() < 3) {
+        return;
+    }
+
+    // merge holes from right to left so earlier bridges don't block later ones
+    std::vector<std::pair<float, size_t>> holes;
+    for (size_t h = 1; h < rings.size(); h++) {
+        if (rings[h].size() < 3) {
+            continue;
+        }
+        float max_x = rings[h][0].x;
+        for (size_t i = 1; i < rings[h].size(); i++) {
+            max_x = std::max(max_x, rings[h][i].x);
+        }
+        holes.push_back(std::make_pair(max_x, h));
+    }
+    std::sort(holes.rbegin(), holes.rend());
+
+    for (size_t h = 0; h < holes.size(); h++) {
+        const Ring& hole = rings[holes[h].second];
+        size_t m = 0;
+        for (size_t i = 1; i < hole.size(); i++) {
+            if (hole[i].x > hole[m].x) m = i;
+        }
+        // pick the closest exterior vertex whose bridge crosses no edge
+        size_t bridge = outer.size();
+        float best = 0.f;
+        for (size_t i = 0; i < outer.size(); i++) {
+            float dx = outer[i].x - hole[m].x, dy = outer[i].y - hole[m].y;
+            float dist = dx * dx + dy * dy;
+            if (bridge != outer.size() && dist >= best) {
+                continue;
+            }
+            bool visible = true;
+            for (size_t j = 0, k = outer.size() - 1; j < outer.size() && visible; k = j++) {
+                visible = !segmentsIntersect(hole[m].x, hole[m].y, outer[i].x, outer[i].y,
+                    outer[k].x, outer[k].y, outer[j].x, outer[j].y);
+            }
+            if (visible) {
+                bridge = i;
+                best = dist;
+            }
+        }
+        if (bridge == outer.size()) {
+            continue; // no bridge found, drop the hole
+        }
+        Ring merged(outer.begin(), outer.begin() + bridge + 1);
+        for (size_t i = 0; i <= hole.size(); i++) {
+            merged.push_back(hole[(m + i) % hole.size()]);
+        }
+        merged.insert(merged.end(), outer.begin() + bridge, outer.end());
+        outer.swap(merged);
+    }
+
+    unsigned int base = (unsigned int)(mesh.vertices.size() / VectorMesh::Stride);
+    for (size_t i = 0; i < outer.size(); i++) {
+        mesh.vertices.push_back(outer[i].x);
+        mesh.vertices.push_back(outer[i].y);
+        mesh.vertices.push_back(float(style));
+    }
+
+    // ear clipping over a linked index list
+    std::vector<size_t> ring(outer.size());
+    for (size_t i = 0; i < ring.size(); i++) {
+        ring[i] = i;
+    }
+    float orientation = area(outer) > 0.f ? 1.f : -1.f;
+    size_t i = 0, stalled = 0;
+    while (ring.size() > 3 && stalled < ring.size()) {
+        size_t n = ring.size();
+        const Point& a = outer[ring[(i + n - 1) % n]];
+        const Point& b = outer[ring[i % n]];
+        const Point& c = outer[ring[(i + 1) % n]];
+        // a convex vertex turns the same way as the ring winding
+        bool ear = orientation * cross(a.x, a.y, b.x, b.y, c.x, c.y) > 0.f;
+        for (size_t j = 0; j < n && ear; j++) {
+            const Point& p = outer[ring[j]];
+            if ((p.x == a.x && p.y == a.y) || (p.x == b.x && p.y == b.y) || (p.x == c.x && p.y == c.y)) {
+                continue;
+            }
+            float d1 = cross(a.x, a.y, b.x, b.y, p.x, p.y);
+            float d2 = cross(b.x, b.y, c.x, c.y, p.x, p.y);
+            float d3 = cross(c.x, c.y, a.x, a.y, p.x, p.y);
+            bool negative = (d1 < 0.f) || (d2 < 0.f) || (d3 < 0.f);
+            bool positive = (d1 > 0.f) || (d2 > 0.f) || (d3 > 0.f);
+            ear = negative && positive;
+        }
+        if (ear) {
+            mesh.indices.push_back(base + (unsigned int)ring[(i + n - 1) % n]);
+            mesh.indices.push_back(base + (unsigned int)ring[i % n]);
+            mesh.indices.push_back(base + (unsigned int)ring[(i + 1) % n]);
+            ring.erase(ring.begin() + (i % n));
+            stalled = 0;
+        } else {
+            i++;
+            stalled++;
+        }
+        i %= ring.size();
+    }
+    // emit the final triangle, or fan out a degenerate remainder
+    for (size_t j = 1; j + 1 < ring.size(); j++) {
+        mesh.indices.push_back(base + (unsigned int)ring[0]);
+        mesh.indices.push_back(base + (unsigned int)ring[j]);
+        mesh.indices.push_back(base + (unsigned int)ring[j + 1]);
+    }
+}
@@ -0,0 +1,76 @@
+#ifndef __VECTOR_TILE_H_
+#define __VECTOR_TILE_H_
+
+#include <QByteArray>
+#include <QString>
+#include <vector>
+
+// Tessellated vector tile geometry ready for upload into OpenGL buffers.
+// Vertices are interleaved (x, y, style) triples in tile pixel space, where
+// [0, tile_size] covers the tile and 'style' indexes the shader palette.
+// Indices describe a GL_TRIANGLES list covering all polygons and lines.
+struct VectorMesh {
+    static const int Stride = 3; // floats per vertex
+
+    std::vector<float> vertices;
+    std::vector<unsigned int> indices;
+
+    bool empty() const {
+        return indices.empty();
+    }
+};
+
+// Decodes Mapbox Vector Tile (MVT) protobuf payloads and tessellates the
+// polygon and line features into a VectorMesh. Point features are ignored.
+// Decoding has no GL dependency, so it is safe to run on any worker thread.
+// See https://github.com/mapbox/vector-tile-spec for the format details.
+class VectorTileDecoder {
+public:
+    // Fixed feature styles, indexed by the per-vertex style value
+    enum Style {
+        Default = 0,
+        Water,
+        Park,
+        Landuse,
+        Building,
+        Road,
+        Boundary,
+        Waterway,
+        StyleCount
+    };
+
+    VectorTileDecoder(int tile_size);
+
+    // returns false if 'data' is not a well formed vector tile
+    bool decode(const QByteArray& data, VectorMesh& mesh) const;
+
+    // RGBA colors for each style, StyleCount * 4 floats
+    static const float* palette();
+
+private:
+    struct Point {
+        Point(): x(0.f), y(0.f) {}
+        Point(float x, float y): x(x), y(y) {}
+        float x, y;
+    };
+    typedef std::vector<Point> Ring;
+
+    bool decodeLayer(const char* data, const char* end, VectorMesh& mesh) const;
+    bool decodeFeature(const char* data, const char* end, float scale,
+        Style fill, Style line, VectorMesh& mesh) const;
+    void decodeGeometry(const std::vector<unsigned int>& geometry,
+        float scale, std::vector<Ring>& rings) const;
+
+    // polygon and line tessellation into the mesh triangle list
+    void tessellatePolygon(std::vector<Ring>& rings, Style style, VectorMesh& mesh) const;
+    void tessellateLine(const Ring& line, Style style, VectorMesh& mesh) const;
+
+    static Style layerFillStyle(const QString& name);
+    static Style layerLineStyle(const QString& name);
+    static float lineWidth(Style style);
+    static float area(const Ring& ring);
+
+    int m_tile_size;
+};
+
+#endif
@@ -2,10 +2,22 @@
 // ngoodnight@gmail.com
 
 #include "MapViewer.h"
+#include "MapExporter.h"
+#include "TraceReplay.h"
+#include "StartupBench.h"
 #include "MapConfig.h"
+#include "MapSession.h"
+#include "OverlaySource.h"
+#include "TileMath.h"
+#include "TileProxy.h"
+#include "TileTracer.h"
 #include <QtGui/QGuiApplication>
 #include <QCommandLineParser>
-#include <QHostInfo>
+#include <QElapsedTimer>
+#include <QUrl>
+#include <QThread>
+#include <algorithm>
+#include <vector>
 
 // Parse the command line a use options to override the MapConfig defaults
 bool parseCommandLine(MapConfig& config, QString& error)
@@ -33,6 +45,11 @@ bool parseCommandLine(MapConfig& config, QString& error)
             QCoreApplication::translate("main", "zoom"));
     parser.addOption(max_zoom);
 
+    QCommandLineOption bearing(QStringList() << "bearing",
+            QCoreApplication::translate("main", "Map bearing in degrees clockwise from north (e.g. 45)"),
+            QCoreApplication::translate("main", "degrees"));
+    parser.addOption(bearing);
+
     QCommandLineOption tile_size(QStringList() << "t" << "tile-size",
             QCoreApplication::translate("main", "Map tile size in pixels (e.g. 256)"),
             QCoreApplication::translate("main", "size"));
@@ -43,6 +60,132 @@ bool parseCommandLine(MapConfig& config, QString& error)
             QCoreApplication::translate("main", "cache"));
     parser.addOption(cache_size);
 
+    QCommandLineOption ram_cache(QStringList() << "ram-cache",
+            QCoreApplication::translate("main", "Decoded tile RAM cache size in MB (e.g. 256)"),
+            QCoreApplication::translate("main", "MB"));
+    parser.addOption(ram_cache);
+
+    QCommandLineOption frame_budget(QStringList() << "frame-budget",
+            QCoreApplication::translate("main", "Frame time in ms before map quality is reduced (0 disables)"),
+            QCoreApplication::translate("main", "ms"));
+    parser.addOption(frame_budget);
+
+    QCommandLineOption lite_format(QStringList() << "lite-format",
+            QCoreApplication::translate("main", "Lighter base map image format fetched on a congested network (e.g. jpg)"),
+            QCoreApplication::translate("main", "format"));
+    parser.addOption(lite_format);
+
+    QCommandLineOption tiled(QStringList() << "tiled",
+            QCoreApplication::translate("main", "Server name of the qtmapviewer-tiled daemon to fetch raster tiles through"),
+            QCoreApplication::translate("main", "name"));
+    parser.addOption(tiled);
+
+    QCommandLineOption no_tiled(QStringList() << "no-tiled",
+            QCoreApplication::translate("main", "Always fetch tiles directly, even if a tile daemon runs"));
+    parser.addOption(no_tiled);
+
+    QCommandLineOption disk_cache(QStringList() << "disk-cache",
+            QCoreApplication::translate("main", "Tile disk cache size in MB (0 disables)"),
+            QCoreApplication::translate("main", "MB"));
+    parser.addOption(disk_cache);
+
+    QCommandLineOption no_restore(QStringList() << "no-restore",
+            QCoreApplication::translate("main", "Start at the default view instead of the last session"));
+    parser.addOption(no_restore);
+
+    QCommandLineOption overlay_file(QStringList() << "overlay-file",
+            QCoreApplication::translate("main", "Overlay update file to load at startup"),
+            QCoreApplication::translate("main", "file"));
+    parser.addOption(overlay_file);
+
+    QCommandLineOption overlay_socket(QStringList() << "overlay-socket",
+            QCoreApplication::translate("main", "Local socket name for live overlay updates"),
+            QCoreApplication::translate("main", "name"));
+    parser.addOption(overlay_socket);
+
+    QCommandLineOption windows(QStringList() << "w" << "windows",
+            QCoreApplication::translate("main", "Number of map windows sharing the tile service"),
+            QCoreApplication::translate("main", "count"));
+    parser.addOption(windows);
+
+    QCommandLineOption hidpi_suffix(QStringList() << "hidpi-suffix",
+            QCoreApplication::translate("main", "Tile URL suffix for double size tiles on HiDPI screens (e.g. @2x)"),
+            QCoreApplication::translate("main", "suffix"));
+    parser.addOption(hidpi_suffix);
+
+    QCommandLineOption no_hidpi(QStringList() << "no-hidpi",
+            QCoreApplication::translate("main", "Ignore the screen device pixel ratio"));
+    parser.addOption(no_hidpi);
+
+    QCommandLineOption export_file(QStringList() << "export",
+            QCoreApplication::translate("main", "Render the images of a job file without a window and exit"),
+            QCoreApplication::translate("main", "file"));
+    parser.addOption(export_file);
+
+    QCommandLineOption export_workers(QStringList() << "export-workers",
+            QCoreApplication::translate("main", "Number of parallel export renderers"),
+            QCoreApplication::translate("main", "count"));
+    parser.addOption(export_workers);
+
+    QCommandLineOption export_timeout(QStringList() << "export-timeout",
+            QCoreApplication::translate("main", "Milliseconds an export waits for missing tiles"),
+            QCoreApplication::translate("main", "ms"));
+    parser.addOption(export_timeout);
+
+    QCommandLineOption record(QStringList() << "record",
+            QCoreApplication::translate("main", "Record a performance trace of the session"),
+            QCoreApplication::translate("main", "file"));
+    parser.addOption(record);
+
+    QCommandLineOption replay(QStringList() << "replay",
+            QCoreApplication::translate("main", "Replay a performance trace without a window and exit"),
+            QCoreApplication::translate("main", "file"));
+    parser.addOption(replay);
+
+    QCommandLineOption replay_output(QStringList() << "replay-output",
+            QCoreApplication::translate("main", "File for the per-frame timings of a replay"),
+            QCoreApplication::translate("main", "file"));
+    parser.addOption(replay_output);
+
+    QCommandLineOption tile_trace(QStringList() << "tile-trace",
+            QCoreApplication::translate("main", "Write the lifecycle of every tile as a Chrome trace (Perfetto) JSON file"),
+            QCoreApplication::translate("main", "file"));
+    parser.addOption(tile_trace);
+
+    QCommandLineOption startup_bench(QStringList() << "startup-bench",
+            QCoreApplication::translate("main", "Print the time to the first full frame of every window and exit"));
+    parser.addOption(startup_bench);
+
+    QCommandLineOption layer(QStringList() << "layer",
+            QCoreApplication::translate("main", "Raster layer over the base map, repeat for more layers"),
+            QCoreApplication::translate("main", "URL[,format[,opacity[,cache]]]"));
+    parser.addOption(layer);
+
+    QCommandLineOption times(QStringList() << "times",
+            QCoreApplication::translate("main", "Comma separated timestamps substituted for {time} in tile server URLs"),
+            QCoreApplication::translate("main", "times"));
+    parser.addOption(times);
+
+    QCommandLineOption frame_interval(QStringList() << "frame-interval",
+            QCoreApplication::translate("main", "Time frame playback interval in ms (e.g. 500)"),
+            QCoreApplication::translate("main", "ms"));
+    parser.addOption(frame_interval);
+
+    QCommandLineOption prefetch_frames(QStringList() << "prefetch-frames",
+            QCoreApplication::translate("main", "Time frames fetched ahead of the playhead (e.g. 4)"),
+            QCoreApplication::translate("main", "frames"));
+    parser.addOption(prefetch_frames);
+
+    QCommandLineOption prefetch_budget(QStringList() << "prefetch-budget",
+            QCoreApplication::translate("main", "Texture budget of the prefetched time frames in MB (e.g. 64)"),
+            QCoreApplication::translate("main", "MB"));
+    parser.addOption(prefetch_budget);
+
+    QCommandLineOption cluster_zoom(QStringList() << "cluster-zoom",
+            QCoreApplication::translate("main", "Deepest zoom level with clustered overlay points (-1 disables)"),
+            QCoreApplication::translate("main", "zoom"));
+    parser.addOption(cluster_zoom);
+
     if (!parser.parse(QGuiApplication::arguments())) {
         error = parser.errorText();
         return true;
@@ -54,9 +197,11 @@ bool parseCommandLine(MapConfig& config, QString& error)
     }
 
     if (parser.isSet(server)) {
+        // the host is resolved by the fetcher, a lookup here would block
+        // the startup on DNS
         QString s = parser.value(server);
-        QHostInfo info = QHostInfo::fromName(s);
-        if (info.error() == QHostInfo::NoError) {
+        QUrl url(QString(s).replace("{time}", "0"));
+        if (url.isValid() && !url.host().isEmpty()) {
             config.server = s;
         } else {
             qDebug() << "Invalid map tile server URL: " << s;
@@ -71,21 +216,147 @@ bool parseCommandLine(MapConfig& config, QString& error)
     }
     if (parser.isSet(max_zoom)) {
         QVariant range(parser.value(max_zoom));
-        config.max_zoom = range.toInt();
+        config.max_zoom = std::min(range.toInt(), int(TileMath::MaxZoom));
     }
     if (parser.isSet(tile_size)) {
         QVariant range(parser.value(tile_size));
-        config.tile_size = range.toInt();
+        int size = range.toInt();
+        if (TileMath::validTileSize(size)) {
+            config.tile_size = size;
+        } else {
+            qDebug() << "Invalid map tile size, must be a power of two: " << size;
+        }
     }
     if (parser.isSet(cache_size)) {
         QVariant range(parser.value(cache_size));
         config.cache_size = size_t(range.toInt());
     }
+    if (parser.isSet(ram_cache)) {
+        QVariant range(parser.value(ram_cache));
+        config.ram_cache_size = size_t(std::max(0, range.toInt()));
+    }
+    if (parser.isSet(bearing)) {
+        QVariant range(parser.value(bearing));
+        config.bearing = range.toDouble();
+        config.keep_bearing = true;
+    }
+    if (parser.isSet(frame_budget)) {
+        QVariant range(parser.value(frame_budget));
+        config.frame_budget = std::max(0, range.toInt());
+    }
+    if (parser.isSet(lite_format)) {
+        config.lite_format = parser.value(lite_format);
+    }
+    if (parser.isSet(tiled)) {
+        config.tile_daemon = parser.value(tiled);
+    }
+    if (parser.isSet(no_tiled)) {
+        config.tile_daemon.clear();
+    }
+    if (parser.isSet(disk_cache)) {
+        QVariant range(parser.value(disk_cache));
+        config.disk_cache_size = size_t(std::max(0, range.toInt()));
+    }
+    if (parser.isSet(no_restore)) {
+        config.restore = false;
+    }
+    if (parser.isSet(windows)) {
+        QVariant range(parser.value(windows));
+        config.windows = range.toInt();
+    }
+    if (parser.isSet(cluster_zoom)) {
+        QVariant range(parser.value(cluster_zoom));
+        config.cluster_zoom = range.toInt();
+    }
+    if (parser.isSet(hidpi_suffix)) {
+        config.hidpi_suffix = parser.value(hidpi_suffix);
+    }
+    if (parser.isSet(no_hidpi)) {
+        config.hidpi = false;
+    }
+    if (parser.isSet(export_file)) {
+        config.export_file = parser.value(export_file);
+    }
+    if (parser.isSet(export_workers)) {
+        QVariant range(parser.value(export_workers));
+        config.export_workers = std::max(1, range.toInt());
+    }
+    if (parser.isSet(export_timeout)) {
+        QVariant range(parser.value(export_timeout));
+        config.export_timeout = std::max(0, range.toInt());
+    }
+    if (parser.isSet(record)) {
+        config.trace_record = parser.value(record);
+    }
+    if (parser.isSet(replay)) {
+        config.trace_replay = parser.value(replay);
+    }
+    if (parser.isSet(replay_output)) {
+        config.replay_output = parser.value(replay_output);
+    }
+    if (parser.isSet(tile_trace)) {
+        config.tile_trace = parser.value(tile_trace);
+    }
+    if (parser.isSet(startup_bench)) {
+        config.startup_bench = true;
+    }
+    // layers default to the base map format and cache size
+    QStringList layers = parser.values(layer);
+    for (int i = 0; i < layers.size(); i++) {
+        QStringList fields = layers[i].split(',');
+        MapLayer source;
+        source.server = fields[0];
+        source.format = fields.size() > 1 ? fields[1] : config.format;
+        source.opacity = fields.size() > 2 ? qBound(0.f, fields[2].toFloat(), 1.f) : 1.f;
+        source.cache_size = fields.size() > 3 ? size_t(fields[3].toInt()) : config.cache_size;
+        config.layers.push_back(source);
+    }
+    if (config.layers.size() >= size_t(MapConfig::MaxLayers)) {
+        qDebug() << "Too many map layers, keeping the first" << MapConfig::MaxLayers - 1;
+        config.layers.resize(MapConfig::MaxLayers - 1);
+    }
+    if (!config.layers.empty() && config.vectorTiles()) {
+        qDebug() << "Map layers need a raster base map, ignoring them";
+        config.layers.clear();
+    }
+    if (parser.isSet(times)) {
+        config.times = parser.value(times).split(',', QString::SkipEmptyParts);
+    }
+    if (parser.isSet(frame_interval)) {
+        QVariant range(parser.value(frame_interval));
+        config.frame_interval = std::max(10, range.toInt());
+    }
+    if (parser.isSet(prefetch_frames)) {
+        QVariant range(parser.value(prefetch_frames));
+        config.prefetch_frames = std::max(0, range.toInt());
+    }
+    if (parser.isSet(prefetch_budget)) {
+        QVariant range(parser.value(prefetch_budget));
+        config.prefetch_budget = size_t(std::max(0, range.toInt()));
+    }
+    // a {time} server without times would only ever get 404s
+    bool timed = MapConfig::timedServer(config.server);
+    for (size_t i = 0; i < config.layers.size(); i++) {
+        timed = timed || MapConfig::timedServer(config.layers[i].server);
+    }
+    if (timed && config.times.isEmpty()) {
+        error = "Tile server URLs with {time} need --times";
+        return true;
+    }
+    if (parser.isSet(overlay_file)) {
+        config.overlay_file = parser.value(overlay_file);
+    }
+    if (parser.isSet(overlay_socket)) {
+        config.overlay_socket = parser.value(overlay_socket);
+    }
     return false;
 }
 
 int main(int argc, char **argv)
 {
+    // startup benchmark clock, see StartupBench
+    QElapsedTimer process;
+    process.start();
     QGuiApplication app(argc, argv);
     QGuiApplication::setApplicationName("qtmapviewer");
 
@@ -97,13 +368,29 @@ int main(int argc, char **argv)
     config.server = "http://a.tile.openstreetmap.org/";
     config.format = QString("png");
     // San Francisco, CA :)
-    config.center = QVector2D(-122.20877392578124f, 37.65175620758778f);
+    config.center = QPointF(-122.20877392578124, 37.65175620758778);
     config.min_zoom = 0;
     config.max_zoom = 19; // max for most servers
     config.zoom_level = 10;
+    config.bearing = 0.; // north up
     config.map_size = QSize(1080, 720);
     config.tile_size = 256; // square tiles
     config.cache_size = 256u; // 512 tile cache
+    config.ram_cache_size = 256u; // about 1000 decoded 256 pixel tiles
+    config.frame_budget = 16; // 60 fps
+    config.tile_daemon = TileProxy::DefaultName; // used if it runs
+    config.disk_cache_size = 512u;
+    config.restore = true;
+    config.keep_bearing = false;
+    config.cluster_zoom = 14; // draw raw overlay points past zoom 14
+    config.windows = 1;
+    config.hidpi = true;
+    config.frame_interval = 500;
+    config.prefetch_frames = 4;
+    config.prefetch_budget = 64u; // 256 tiles of 256 KB, 8-10 frames at 1080x720
+    config.export_workers = 4;
+    config.export_timeout = 10000;
+    config.startup_bench = false;
 
     QString error;
     if (parseCommandLine(config, error)) {
@@ -114,9 +401,134 @@ int main(int argc, char **argv)
         config.print();
     }
 
-    MapViewer viewer(config);
-    viewer.setTitle("qtmapviewer");
-    viewer.show();
+    if (!config.tile_trace.isEmpty()) {
+        QThread::currentThread()->setObjectName("GUI");
+        TileTracer::start();
+    }
+
+    if (!config.trace_replay.isEmpty()) {
+        // Headless replay, the recorded states are in the pixel space of
+        // the recorded tile size and the network is simulated
+        Trace::File trace;
+        if (!trace.read(config.trace_replay)) {
+            return -1;
+        }
+        config.hidpi = false;
+        config.tile_size = trace.tile_size;
+        config.trace_record.clear();
+        TileService service(config, &trace);
+        TraceReplay replay(config, service, trace);
+        QObject::connect(&replay, SIGNAL(finished()), &app, SLOT(quit()));
+        if (!replay.start(config.replay_output)) {
+            return -1;
+        }
+        int result = app.exec();
+        if (!config.tile_trace.isEmpty()) {
+            TileTracer::write(config.tile_trace);
+        }
+        return result;
+    }
+
+    if (!config.export_file.isEmpty()) {
+        // Headless batch export, the images are rendered 1:1 with the 
+        // configured tile size whatever the screen is
+        config.hidpi = false;
+        TileService service(config);
+        MapExporter exporter(config, service);
+        if (!exporter.readFile(config.export_file)) {
+            return -1;
+        }
+        QObject::connect(&exporter, SIGNAL(finished()), &app, SLOT(quit()));
+        exporter.start();
+        app.exec();
+        if (!config.tile_trace.isEmpty()) {
+            TileTracer::write(config.tile_trace);
+        }
+        return exporter.failed() ? 1 : 0;
+    }
+
+    // One tile service feeds every map window
+    TileService service(config);
+    StartupBench bench(process, std::max(1, config.windows));
+
+    // Warm start: the windows open where the last session left them, and
+    // the tiles they showed are loaded from the disk cache (or the tile
+    // daemon) into the RAM tier before the windows are exposed
+    MapSession session;
+    if (config.restore) {
+        QStringList layers;
+        for (size_t i = 0; i < config.layers.size(); i++) {
+            layers << config.layers[i].server;
+        }
+        session = MapSession::load(config.server, layers);
+        // the time frames may have changed since, and a hand edited 
+        // session mustn't index past the layers
+        TileIndexList tiles;
+        for (size_t i = 0; i < session.views.size(); i++) {
+            const TileIndexList& view = session.views[i].tiles;
+            for (size_t t = 0; t < view.size(); t++) {
+                if (view[t].layer() >= 0 && size_t(view[t].layer()) <= config.layers.size() &&
+                    view[t].frame() >= 0 && view[t].frame() < std::max(1, config.times.size())) {
+                    tiles.push_back(view[t]);
+                }
+            }
+        }
+        service.warmTiles(tiles);
+        bench.warmed();
+    }
+
+    std::vector<MapViewer*> viewers;
+    for (int i = 0; i < std::max(1, config.windows); i++) {
+        MapConfig view = config;
+        if (size_t(i) < session.views.size()) {
+            view.center = session.views[i].center;
+            view.zoom_level = qBound(config.min_zoom, session.views[i].zoom, config.max_zoom);
+            if (!config.keep_bearing) {
+                view.bearing = session.views[i].bearing;
+            }
+        }
+        viewers.push_back(new MapViewer(view, service));
+        viewers.back()->setTitle("qtmapviewer");
+    }
 
-    return app.exec();
+    // Feed overlay layers from a file and/or a local socket
+    OverlaySource overlays;
+    for (size_t i = 0; i < viewers.size(); i++) {
+        QObject::connect(&overlays, SIGNAL(updates(const OverlayUpdateList&)),
+            viewers[i], SLOT(updateOverlay(const OverlayUpdateList&)));
+    }
+    if (!config.overlay_file.isEmpty()) {
+        overlays.readFile(config.overlay_file);
+    }
+    if (!config.overlay_socket.isEmpty()) {
+        overlays.listen(config.overlay_socket);
+    }
+
+    if (config.startup_bench) {
+        for (size_t i = 0; i < viewers.size(); i++) {
+            QObject::connect(viewers[i], SIGNAL(firstFullFrame()), &bench, SLOT(firstFullFrame()));
+        }
+        QObject::connect(&bench, SIGNAL(finished()), &app, SLOT(quit()));
+        bench.start();
+    }
+    for (size_t i = 0; i < viewers.size(); i++) {
+        viewers[i]->show();
+    }
+
+    int result = app.exec();
+    // the viewers must release their renderers before the service stops
+    MapSession last;
+    last.server = config.server;
+    for (size_t i = 0; i < config.layers.size(); i++) {
+        last.layers << config.layers[i].server;
+    }
+    for (size_t i = 0; i < viewers.size(); i++) {
+        last.views.push_back(viewers[i]->sessionView());
+        delete viewers[i];
+    }
+    last.save();
+    if (!config.tile_trace.isEmpty()) {
+        TileTracer::write(config.tile_trace);
+    }
+    return result;
 }
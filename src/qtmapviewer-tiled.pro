@@ -0,0 +1,18 @@
+QT       += core
+QT       += gui
+QT       += network
+
+TARGET = qtmapviewer-tiled
+CONFIG   += console
+CONFIG   += c++11
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+SOURCES += \
+    tiled.cpp \
+    TileDaemon.cpp
+
+HEADERS += \
+    TileDaemon.h \
+    TileProxy.h
@@ -12,16 +12,51 @@ TEMPLATE = app
 
 SOURCES += \
     main.cpp \
+    AdaptiveQuality.cpp \
     GLWorker.cpp \
+    MapExporter.cpp \
+    MapSession.cpp \
     MapViewer.cpp \
+    Overlay.cpp \
+    OverlaySource.cpp \
+    Playback.cpp \
+    PointClusterer.cpp \
+    RetryPolicy.cpp \
+    StartupBench.cpp \
     TileFetcher.cpp \
-    TileRenderer.cpp
+    TileMath.cpp \
+    TilePool.cpp \
+    TileRenderer.cpp \
+    TileService.cpp \
+    TileTracer.cpp \
+    Trace.cpp \
+    TraceReplay.cpp \
+    VectorTile.cpp
 
 HEADERS += \
+    AdaptiveQuality.h \
     GLWorker.h \
+    MapExporter.h \
+    MapSession.h \
     MapViewer.h \
+    Overlay.h \
+    OverlaySource.h \
+    Playback.h \
+    PointClusterer.h \
+    RetryPolicy.h \
+    QuadTree.h \
+    StartupBench.h \
     TileCache.h \
     TileFetcher.h \
+    TileMath.h \
+    TileProxy.h \
+    TilePool.h \
     TileRenderer.h \
+    TileService.h \
+    TileTracer.h \
     TileTypes.h \
+    Trace.h \
+    TraceReplay.h \
+    TripleBuffer.h \
+    VectorTile.h \
     MapConfig.h
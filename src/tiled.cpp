@@ -0,0 +1,94 @@
+// Tile proxy daemon shared by the qtmapviewer processes of a host, see
+// TileDaemon and TileProxy.h
+
+#include "TileDaemon.h"
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QStandardPaths>
+#include <QDebug>
+#include <algorithm>
+
+// Parse the command line and use options to override the daemon defaults
+bool parseCommandLine(TileDaemon::Config& config, QString& error)
+{
+    QCommandLineParser parser;
+    const QCommandLineOption helpOption = parser.addHelpOption();
+
+    QCommandLineOption name(QStringList() << "name",
+            QCoreApplication::translate("main", "Local server name the viewers connect to"),
+            QCoreApplication::translate("main", "name"));
+    parser.addOption(name);
+
+    QCommandLineOption ring_slots(QStringList() << "slots",
+            QCoreApplication::translate("main", "Decoded tiles kept in the shared memory ring (e.g. 256)"),
+            QCoreApplication::translate("main", "tiles"));
+    parser.addOption(ring_slots);
+
+    QCommandLineOption max_tile_size(QStringList() << "max-tile-size",
+            QCoreApplication::translate("main", "Largest tile size in pixels a ring slot holds (e.g. 512)"),
+            QCoreApplication::translate("main", "pixels"));
+    parser.addOption(max_tile_size);
+
+    QCommandLineOption disk_cache(QStringList() << "disk-cache",
+            QCoreApplication::translate("main", "Tile disk cache directory"),
+            QCoreApplication::translate("main", "directory"));
+    parser.addOption(disk_cache);
+
+    QCommandLineOption disk_cache_size(QStringList() << "disk-cache-size",
+            QCoreApplication::translate("main", "Tile disk cache size in MB (e.g. 1024)"),
+            QCoreApplication::translate("main", "MB"));
+    parser.addOption(disk_cache_size);
+
+    if (!parser.parse(QCoreApplication::arguments())) {
+        error = parser.errorText();
+        return true;
+    }
+    if (parser.isSet(helpOption)) {
+        parser.showHelp();
+        return false;
+    }
+    if (parser.isSet(name)) {
+        config.name = parser.value(name);
+    }
+    if (parser.isSet(ring_slots)) {
+        config.ring_slots = std::max(1, parser.value(ring_slots).toInt());
+    }
+    if (parser.isSet(max_tile_size)) {
+        config.max_tile_size = std::max(1, parser.value(max_tile_size).toInt());
+    }
+    if (parser.isSet(disk_cache)) {
+        config.disk_cache = parser.value(disk_cache);
+    }
+    if (parser.isSet(disk_cache_size)) {
+        config.disk_cache_size = qint64(std::max(0, parser.value(disk_cache_size).toInt())) << 20;
+    }
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("qtmapviewer-tiled");
+
+    TileDaemon::Config config;
+    config.name = TileProxy::DefaultName;
+    config.ring_slots = 256;         // 256 MB with 512 pixel slots
+    config.max_tile_size = 512; // @2x tiles
+    config.disk_cache = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    config.disk_cache_size = qint64(1024) << 20;
+
+    QString error;
+    if (parseCommandLine(config, error)) {
+        qDebug(qPrintable(error));
+        return -1;
+    }
+    printf("  Name:\t\t%s\n", qPrintable(config.name));
+    printf("  Ring:\t\t%d slots of %d pixels\n", config.ring_slots, config.max_tile_size);
+    printf("  Disk Cache:\t%s (%lld MB)\n", qPrintable(config.disk_cache), config.disk_cache_size >> 20);
+
+    TileDaemon daemon(config);
+    if (!daemon.start()) {
+        return -1;
+    }
+    return app.exec();
+}
@@ -0,0 +1,21 @@
+QT       += core
+QT       += gui
+QT       += network
+QT       += testlib
+
+TARGET = tst_retrypolicy
+CONFIG   += console
+CONFIG   += c++11
+CONFIG   += testcase
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+INCLUDEPATH += ../../src
+
+SOURCES += \
+    tst_retrypolicy.cpp \
+    ../../src/RetryPolicy.cpp
+
+HEADERS += \
+    ../../src/RetryPolicy.h
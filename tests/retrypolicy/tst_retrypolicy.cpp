@@ -0,0 +1,300 @@
+#include "RetryPolicy.h"
+#include <QtTest>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QNetworkProxy>
+#include <deque>
+
+// Local HTTP stand-in for a tile server. Each request takes the next
+// scripted fault, an error status with an optional Retry-After header, and
+// requests past the script get a 200 with a small body. While dropping,
+// every connection is closed without a response instead; Qt reconnects a
+// few times before the reply fails, so those aren't scripted per request.
+class FaultServer : public QObject
+{
+    Q_OBJECT
+public:
+    struct Fault {
+        int status;
+        QByteArray retry_after;  // Retry-After header, none if empty
+    };
+
+    FaultServer() : m_requests(0), m_dropping(false) {
+        connect(&m_server, SIGNAL(newConnection()), this, SLOT(newConnection()));
+        m_server.listen(QHostAddress::LocalHost);
+    }
+
+    QUrl url(const TileIndex& tile) const {
+        return QUrl(QString("http://127.0.0.1:%1/%2/%3/%4.png").arg(m_server.serverPort())
+            .arg(tile.zoom()).arg(tile.x()).arg(tile.y()));
+    }
+    void push(int status, const QByteArray& retry_after = QByteArray()) {
+        Fault fault = {status, retry_after};
+        m_faults.push_back(fault);
+    }
+    void setDropping(bool dropping) {
+        m_dropping = dropping;
+    }
+    int requests() const {
+        return m_requests;
+    }
+
+private slots:
+    void newConnection() {
+        while (QTcpSocket *socket = m_server.nextPendingConnection()) {
+            connect(socket, SIGNAL(readyRead()), this, SLOT(readRequest()));
+            connect(socket, SIGNAL(disconnected()), socket, SLOT(deleteLater()));
+        }
+    }
+
+    void readRequest() {
+        QTcpSocket *socket = qobject_cast<QTcpSocket*>(sender());
+        m_buffers[socket] += socket->readAll();
+        if (!m_buffers[socket].contains("\r\n\r\n")) {
+            return; // headers not complete yet
+        }
+        m_buffers.remove(socket);
+        if (m_dropping) {
+            socket->abort();
+            return;
+        }
+        m_requests++;
+        Fault fault = {200, QByteArray()};
+        if (!m_faults.empty()) {
+            fault = m_faults.front();
+            m_faults.pop_front();
+        }
+        QByteArray body = fault.status == 200 ? QByteArray("tile") : QByteArray();
+        QByteArray response = "HTTP/1.1 " + QByteArray::number(fault.status) + " Fault\r\n" +
+            "Content-Length: " + QByteArray::number(body.size()) + "\r\n" +
+            "Connection: close\r\n";
+        if (!fault.retry_after.isEmpty()) {
+            response += "Retry-After: " + fault.retry_after + "\r\n";
+        }
+        socket->write(response + "\r\n" + body);
+        socket->disconnectFromHost();
+    }
+
+private:
+    QTcpServer m_server;
+    std::deque<Fault> m_faults;
+    QMap<QTcpSocket*, QByteArray> m_buffers;
+    int m_requests;
+    bool m_dropping;
+};
+
+// Drives a RetryPolicy the way the TileFetcher does, with downloads from
+// the FaultServer
+class TestRetryPolicy : public QObject
+{
+    Q_OBJECT
+private:
+    // fetches 'tile' and records the result, returns false if it failed
+    bool load(RetryPolicy& policy, const TileIndex& tile) {
+        policy.started(m_host);
+        QNetworkRequest request(m_server->url(tile));
+        QNetworkReply *reply = m_network.get(request);
+        QSignalSpy finished(reply, SIGNAL(finished()));
+        if (!reply->isFinished()) {
+            finished.wait(5000);
+        }
+        bool ok = reply->error() == QNetworkReply::NoError;
+        if (ok) {
+            policy.succeeded(tile, m_host);
+        } else {
+            int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+            policy.failed(tile, m_host, RetryPolicy::classify(status),
+                RetryPolicy::retryAfter(reply->rawHeader("Retry-After").trimmed()));
+        }
+        reply->deleteLater();
+        return ok;
+    }
+    // ms until 'tile' may be fetched
+    qint64 delay(const RetryPolicy& policy, const TileIndex& tile) const {
+        return policy.retryAt(tile, m_host) - policy.now();
+    }
+    // waits until the open circuit lets 'tile' through
+    bool waitOpen(const RetryPolicy& policy, const TileIndex& tile) const {
+        QElapsedTimer timer;
+        timer.start();
+        while (delay(policy, tile) > 0) {
+            if (timer.elapsed() > 5000) {
+                return false;
+            }
+            QTest::qWait(int(delay(policy, tile)));
+        }
+        return true;
+    }
+
+    FaultServer *m_server;
+    QNetworkAccessManager m_network;
+    QString m_host;
+
+private slots:
+    void init() {
+        m_server = new FaultServer;
+        m_host = "127.0.0.1";
+        m_network.setProxy(QNetworkProxy::NoProxy);
+    }
+    void cleanup() {
+        delete m_server;
+        m_server = NULL;
+    }
+
+    void classify_data() {
+        QTest::addColumn<int>("status");
+        QTest::addColumn<bool>("host");
+        QTest::newRow("no response") << 0 << true;
+        QTest::newRow("throttled") << 429 << true;
+        QTest::newRow("server error") << 500 << true;
+        QTest::newRow("unavailable") << 503 << true;
+        QTest::newRow("missing") << 404 << false;
+        QTest::newRow("undecodable") << -1 << false;
+    }
+    void classify() {
+        QFETCH(int, status);
+        QFETCH(bool, host);
+        QCOMPARE(RetryPolicy::classify(status) == RetryPolicy::HostFailure, host);
+    }
+
+    void retryAfter() {
+        QCOMPARE(RetryPolicy::retryAfter(QByteArray()), qint64(0));
+        QCOMPARE(RetryPolicy::retryAfter("7"), qint64(7000));
+        QCOMPARE(RetryPolicy::retryAfter("soon"), qint64(0));
+        QDateTime date = QDateTime::currentDateTimeUtc().addSecs(30);
+        QByteArray header = QLocale::c().toString(date, "ddd, dd MMM yyyy hh:mm:ss 'GMT'").toLatin1();
+        qint64 ms = RetryPolicy::retryAfter(header);
+        QVERIFY2(ms > 28000 && ms <= 30000, QByteArray::number(ms));
+        // a date in the past means right away
+        date = QDateTime::currentDateTimeUtc().addSecs(-30);
+        header = QLocale::c().toString(date, "ddd, dd MMM yyyy hh:mm:ss 'GMT'").toLatin1();
+        QCOMPARE(RetryPolicy::retryAfter(header), qint64(0));
+    }
+
+    // A missing tile backs off exponentially with equal jitter, without
+    // touching the host circuit
+    void tileBackoff() {
+        RetryPolicy policy;
+        TileIndex tile(3, 1, 2);
+        m_server->push(404);
+        m_server->push(404);
+        QVERIFY(!load(policy, tile));
+        qint64 first = delay(policy, tile);
+        QVERIFY2(first >= RetryPolicy::RetryDelay / 2 - 50 && first <= RetryPolicy::RetryDelay,
+            QByteArray::number(first));
+        QVERIFY(!load(policy, tile));
+        qint64 second = delay(policy, tile);
+        QVERIFY2(second >= RetryPolicy::RetryDelay - 50 && second <= 2 * RetryPolicy::RetryDelay,
+            QByteArray::number(second));
+        QVERIFY(policy.healthy(m_host));
+        QCOMPARE(delay(policy, TileIndex(3, 0, 0)), qint64(0));
+        QCOMPARE(m_server->requests(), 2);
+    }
+
+    // Dropped connections open the circuit after Threshold in a row,
+    // then no tile of the host is fetched
+    void circuitOpens() {
+        RetryPolicy policy;
+        TileIndex other(5, 9, 9);
+        m_server->setDropping(true);
+        for (int i = 0; i < RetryPolicy::Threshold; i++) {
+            QVERIFY(policy.healthy(m_host));
+            QCOMPARE(delay(policy, other), qint64(0));
+            QVERIFY(!load(policy, TileIndex(5, i, 0)));
+        }
+        QVERIFY(!policy.healthy(m_host));
+        qint64 wait = delay(policy, other);
+        QVERIFY2(wait >= RetryPolicy::RetryDelay / 2 - 50 && wait <= RetryPolicy::RetryDelay,
+            QByteArray::number(wait));
+
+        // the server is back, the probe closes the circuit
+        m_server->setDropping(false);
+        QVERIFY(waitOpen(policy, other));
+        QVERIFY(load(policy, other));
+        QVERIFY(policy.healthy(m_host));
+        QCOMPARE(m_server->requests(), 1);
+    }
+
+    // Throttling with Retry-After opens the circuit right away for the
+    // given time
+    void retryAfterOpens() {
+        RetryPolicy policy;
+        TileIndex other(4, 2, 2);
+        m_server->push(429, "2");
+        QVERIFY(!load(policy, TileIndex(4, 1, 1)));
+        QVERIFY(!policy.healthy(m_host));
+        qint64 wait = delay(policy, other);
+        QVERIFY2(wait > 1900 && wait <= 2000, QByteArray::number(wait));
+        QVERIFY(waitOpen(policy, other));
+        QVERIFY(policy.now() >= 1900);
+    }
+
+    // Once the open period passes the half open circuit lets one probe
+    // through, and a successful probe closes it
+    void halfOpenProbe() {
+        RetryPolicy policy;
+        TileIndex probe(6, 1, 1), other(6, 2, 2);
+        m_server->push(503, "1");
+        QVERIFY(!load(policy, TileIndex(6, 0, 0)));
+        QVERIFY(waitOpen(policy, probe));
+        QVERIFY(!policy.healthy(m_host));
+
+        // while the probe is in flight the other tiles wait
+        policy.started(m_host);
+        QVERIFY(delay(policy, other) > 0);
+        policy.cancelled(m_host);
+        QCOMPARE(delay(policy, other), qint64(0));
+
+        QVERIFY(load(policy, probe));
+        QVERIFY(policy.healthy(m_host));
+        QCOMPARE(delay(policy, other), qint64(0));
+        QCOMPARE(delay(policy, probe), qint64(0));
+    }
+
+    // An exhausted tile pool only backs off the tile, an open circuit
+    // stays open
+    void poolExhausted() {
+        RetryPolicy policy;
+        TileIndex tile(8, 1, 1), other(8, 2, 2);
+        m_server->push(503, "2");
+        QVERIFY(!load(policy, TileIndex(8, 0, 0)));
+        QVERIFY(!policy.healthy(m_host));
+        policy.failed(tile, m_host, RetryPolicy::PoolExhausted, 0);
+        QVERIFY(!policy.healthy(m_host));
+        qint64 wait = delay(policy, other);
+        QVERIFY2(wait > 1900 && wait <= 2000, QByteArray::number(wait));
+
+        // on a healthy host only the tile waits
+        RetryPolicy healthy;
+        healthy.failed(tile, m_host, RetryPolicy::PoolExhausted, 0);
+        QVERIFY(healthy.healthy(m_host));
+        QVERIFY(delay(healthy, tile) > 0);
+        QCOMPARE(delay(healthy, other), qint64(0));
+    }
+
+    // A failed probe opens the circuit again, and the host recovers once
+    // a later probe succeeds
+    void failedProbeReopens() {
+        RetryPolicy policy;
+        TileIndex probe(7, 1, 1), other(7, 2, 2);
+        m_server->push(503, "1");
+        m_server->push(503);
+        QVERIFY(!load(policy, TileIndex(7, 0, 0)));
+        QVERIFY(waitOpen(policy, other));
+
+        QVERIFY(!load(policy, probe));
+        QVERIFY(!policy.healthy(m_host));
+        qint64 wait = delay(policy, other);
+        QVERIFY2(wait > 0 && wait <= RetryPolicy::RetryDelay, QByteArray::number(wait));
+
+        QVERIFY(waitOpen(policy, other));
+        QVERIFY(load(policy, other));
+        QVERIFY(policy.healthy(m_host));
+        QCOMPARE(m_server->requests(), 3);
+    }
+};
+
+QTEST_GUILESS_MAIN(TestRetryPolicy)
+#include "tst_retrypolicy.moc"
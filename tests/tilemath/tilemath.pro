@@ -0,0 +1,20 @@
+QT       += core
+QT       -= gui
+QT       += testlib
+
+TARGET = tst_tilemath
+CONFIG   += console
+CONFIG   += c++11
+CONFIG   += testcase
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+INCLUDEPATH += ../../src
+
+SOURCES += \
+    tst_tilemath.cpp \
+    ../../src/TileMath.cpp
+
+HEADERS += \
+    ../../src/TileMath.h
@@ -0,0 +1,259 @@
+#include "TileMath.h"
+#include <QtTest>
+#include <random>
+#define _USE_MATH_DEFINES
+#include <math.h>
+
+// The tile grid and Web Mercator math used to be inline in the renderer and
+// the viewer. These are those formulas, as references for TileMath.
+namespace Reference {
+    // TileRenderer::getTiles(): the tile column of a pixel, with the
+    // shift for negative pixels
+    int tile(int pixel, int size) {
+        return pixel / size - (pixel < 0 ? 1 : 0);
+    }
+    // TileRenderer::getTiles(): longitudinal wrapping of a tile column
+    int wrap(int x, int pixels) {
+        if (x < 0) {
+            while (x < 0) { x += pixels; }
+        } else if (x >= pixels) {
+            x %= pixels;
+        }
+        return x;
+    }
+    // MapViewer::latlonToPixel(), before rounding to int
+    QPointF latlonToPixel(int zoom, int tile_size, const QPointF& lonlat) {
+        double to_rad = M_PI / 180.0;
+        double z = pow(2.0, zoom);
+        double x = (lonlat.x() + 180.) / 360. * z * tile_size;
+        double y = 0.5 * (1. - log(tan(to_rad * lonlat.y()) + 1.0 / cos(to_rad * lonlat.y())) / M_PI) *
+            z * tile_size;
+        return QPointF(x, y);
+    }
+    // MapViewer::pixelToLatlon(), with the tile size in the world scale
+    // (the original divided the result by it instead)
+    QPointF pixelToLatlon(int zoom, int tile_size, const QPointF& pixel) {
+        double to_deg = 180.0 / M_PI;
+        double z = pow(2.0, zoom) * tile_size;
+        double lon = 360. * pixel.x() / z - 180.;
+        double lat = to_deg * atan(sinh(M_PI - 2. * M_PI * pixel.y() / z));
+        return QPointF(lon, lat);
+    }
+}
+
+// points spread over the world within the Mercator latitude limit
+static std::vector<QPointF> lonlats(size_t count)
+{
+    std::mt19937 random(35);
+    std::uniform_real_distribution<double> lon(-180., 180.);
+    std::uniform_real_distribution<double> lat(-TileMath::MaxLatitude, TileMath::MaxLatitude);
+    std::vector<QPointF> points(count);
+    for (size_t i = 0; i < count; i++) {
+        points[i] = QPointF(lon(random), lat(random));
+    }
+    return points;
+}
+
+class TestTileMath : public QObject
+{
+    Q_OBJECT
+private:
+    template <typename Grid>
+    void compareGrid(const Grid& grid) {
+        const int size = grid.size();
+        QCOMPARE(1 << grid.shift(), size);
+        for (int pixel = -4 * size - 3; pixel <= 4 * size + 3; pixel++) {
+            int tile = grid.tile(pixel);
+            // the reference is a tile off on the negative multiples of
+            // the tile size, which is the bug the floor shift fixed
+            if (pixel >= 0 || pixel % size != 0) {
+                QCOMPARE(tile, Reference::tile(pixel, size));
+            }
+            QCOMPARE(qint64(tile) * size + grid.offset(pixel), qint64(pixel));
+            QVERIFY(grid.offset(pixel) >= 0 && grid.offset(pixel) < size);
+        }
+        // 64-bit pixels past the int range of deep zoom levels
+        qint64 deep = qint64(1) << 40;
+        QCOMPARE(grid.tile(deep + size), int((deep >> grid.shift()) + 1));
+        QCOMPARE(grid.offset(deep + 7), 7);
+    }
+
+private slots:
+    void grids() {
+        compareGrid(TileGrid<256>());
+        compareGrid(TileGrid<512>());
+        compareGrid(TileGrid<>(128));
+        compareGrid(TileGrid<>(1024));
+    }
+
+    void wrap() {
+        for (int zoom = 0; zoom <= 4; zoom++) {
+            int pixels = 1 << zoom;
+            for (int x = -3 * pixels; x < 3 * pixels; x++) {
+                QCOMPARE(x & (pixels - 1), Reference::wrap(x, pixels));
+            }
+        }
+    }
+
+    void lonlatToPixel_data() {
+        QTest::addColumn<int>("tile_size");
+        QTest::newRow("256") << 256;
+        QTest::newRow("512") << 512;
+        QTest::newRow("128") << 128;
+    }
+    void lonlatToPixel() {
+        QFETCH(int, tile_size);
+        std::vector<QPointF> points = lonlats(2000);
+        for (int zoom = 0; zoom <= 20; zoom += 5) {
+            for (size_t i = 0; i < points.size(); i++) {
+                QPointF reference = Reference::latlonToPixel(zoom, tile_size, points[i]);
+                PixelPoint pixel = tile_size == 256 ?
+                    TileMath::lonlatToPixel(TileGrid<256>(), zoom, points[i]) : tile_size == 512 ?
+                    TileMath::lonlatToPixel(TileGrid<512>(), zoom, points[i]) :
+                    TileMath::lonlatToPixel(TileGrid<>(tile_size), zoom, points[i]);
+                // floor of the same value, up to rounding at a pixel edge
+                QVERIFY(qAbs(double(pixel.x()) - std::floor(reference.x())) <= 1.);
+                QVERIFY(qAbs(double(pixel.y()) - std::floor(reference.y())) <= 1.);
+                QPointF world = TileMath::lonlatToWorld(points[i]);
+                double scale = std::ldexp(double(tile_size), zoom);
+                QVERIFY(qAbs(world.x() * scale - reference.x()) < 1e-6);
+                QVERIFY(qAbs(world.y() * scale - reference.y()) < 1e-6);
+            }
+        }
+    }
+
+    void pixelToLonlat() {
+        std::vector<QPointF> points = lonlats(2000);
+        for (size_t i = 0; i < points.size(); i++) {
+            PixelPoint pixel = TileMath::lonlatToPixel(TileGrid<256>(), 12, points[i]);
+            QPointF lonlat = TileMath::pixelToLonlat(TileGrid<256>(), 12, pixel);
+            QPointF reference = Reference::pixelToLatlon(12, 256,
+                QPointF(double(pixel.x()), double(pixel.y())));
+            QVERIFY(qAbs(lonlat.x() - reference.x()) < 1e-9);
+            QVERIFY(qAbs(lonlat.y() - reference.y()) < 1e-9);
+            // a pixel at zoom 12 is well under 0.001 degrees
+            QVERIFY(qAbs(lonlat.x() - points[i].x()) < 1e-3);
+            QVERIFY(qAbs(lonlat.y() - points[i].y()) < 1e-3);
+        }
+    }
+
+    void clampsLatitude() {
+        QCOMPARE(TileMath::lonlatToWorld(QPointF(0., 90.)).y(),
+            TileMath::lonlatToWorld(QPointF(0., TileMath::MaxLatitude)).y());
+        QVERIFY(qAbs(TileMath::lonlatToWorld(QPointF(0., TileMath::MaxLatitude)).y()) < 1e-9);
+        QVERIFY(qAbs(TileMath::lonlatToWorld(QPointF(0., -TileMath::MaxLatitude)).y() - 1.) < 1e-9);
+    }
+
+    // The batch conversions match the scalar ones for odd counts (the
+    // scalar tail), clamped latitudes and in place conversion
+    void batches() {
+        std::vector<QPointF> points = lonlats(1001);
+        points[3] = QPointF(10., 89.);
+        points[4] = QPointF(-10., -89.);
+        std::vector<QPointF> world(points.size()), back(points.size());
+        TileMath::lonlatToWorld(points.data(), world.data(), points.size());
+        TileMath::worldToLonlat(world.data(), back.data(), world.size());
+        for (size_t i = 0; i < points.size(); i++) {
+            QPointF w = TileMath::lonlatToWorld(points[i]);
+            QVERIFY(qAbs(world[i].x() - w.x()) < 1e-15 && qAbs(world[i].y() - w.y()) < 1e-15);
+            QPointF l = TileMath::worldToLonlat(world[i]);
+            QVERIFY(qAbs(back[i].x() - l.x()) < 1e-12 && qAbs(back[i].y() - l.y()) < 1e-12);
+            double lat = qBound(-TileMath::MaxLatitude, points[i].y(), TileMath::MaxLatitude);
+            QVERIFY(qAbs(back[i].x() - points[i].x()) < 1e-9);
+            QVERIFY(qAbs(back[i].y() - lat) < 1e-9);
+        }
+        std::vector<QPointF> aliased = points;
+        TileMath::lonlatToWorld(aliased.data(), aliased.data(), aliased.size());
+        for (size_t i = 0; i < points.size(); i++) {
+            QCOMPARE(aliased[i], world[i]);
+        }
+    }
+
+    // Microbenchmarks against the references, run with -tickcounter or
+    // the default walltime
+    void benchmarkTiles_data() {
+        QTest::addColumn<bool>("reference");
+        QTest::newRow("reference") << true;
+        QTest::newRow("TileGrid<256>") << false;
+    }
+    void benchmarkTiles() {
+        QFETCH(bool, reference);
+        TileGrid<256> grid;
+        const int pixels = 1 << 10;
+        int sum = 0;
+        QBENCHMARK {
+            for (int pixel = -100000; pixel < 100000; pixel += 7) {
+                if (reference) {
+                    sum += Reference::wrap(Reference::tile(pixel, 256) + pixels, pixels);
+                } else {
+                    sum += (grid.tile(pixel) + pixels) & (pixels - 1);
+                }
+            }
+        }
+        QVERIFY(sum != 0);
+    }
+
+    void benchmarkLonlatToPixel_data() {
+        QTest::addColumn<int>("method");
+        QTest::newRow("reference") << 0;
+        QTest::newRow("scalar") << 1;
+        QTest::newRow("batch") << 2;
+    }
+    void benchmarkLonlatToPixel() {
+        QFETCH(int, method);
+        std::vector<QPointF> points = lonlats(4096);
+        std::vector<QPointF> out(points.size());
+        const double scale = std::ldexp(256., 14);
+        QBENCHMARK {
+            if (method == 0) {
+                for (size_t i = 0; i < points.size(); i++) {
+                    out[i] = Reference::latlonToPixel(14, 256, points[i]);
+                }
+            } else if (method == 1) {
+                for (size_t i = 0; i < points.size(); i++) {
+                    out[i] = TileMath::lonlatToWorld(points[i]) * scale;
+                }
+            } else {
+                TileMath::lonlatToWorld(points.data(), out.data(), points.size());
+                for (size_t i = 0; i < out.size(); i++) {
+                    out[i] *= scale;
+                }
+            }
+        }
+        QVERIFY(out.back().x() > 0.);
+    }
+
+    void benchmarkPixelToLonlat_data() {
+        benchmarkLonlatToPixel_data();
+    }
+    void benchmarkPixelToLonlat() {
+        QFETCH(int, method);
+        std::vector<QPointF> points = lonlats(4096);
+        const double scale = std::ldexp(256., 14);
+        std::vector<QPointF> pixels(points.size()), world(points.size()), out(points.size());
+        TileMath::lonlatToWorld(points.data(), world.data(), points.size());
+        for (size_t i = 0; i < world.size(); i++) {
+            pixels[i] = world[i] * scale;
+        }
+        QBENCHMARK {
+            if (method == 0) {
+                for (size_t i = 0; i < pixels.size(); i++) {
+                    out[i] = Reference::pixelToLatlon(14, 256, pixels[i]);
+                }
+            } else if (method == 1) {
+                for (size_t i = 0; i < pixels.size(); i++) {
+                    out[i] = TileMath::worldToLonlat(pixels[i] / scale);
+                }
+            } else {
+                for (size_t i = 0; i < pixels.size(); i++) {
+                    out[i] = pixels[i] / scale;
+                }
+                TileMath::worldToLonlat(out.data(), out.data(), out.size());
+            }
+        }
+        QVERIFY(qAbs(out.back().y()) <= 90.);
+    }
+};
+
+QTEST_GUILESS_MAIN(TestTileMath)
+#include "tst_tilemath.moc"